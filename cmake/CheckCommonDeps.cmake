@@ -34,6 +34,7 @@ function(check_common_deps)
     check_include_file(sys/ndir.h     HAVE_SYS_NDIR_H)
     check_include_file(sys/fs_types.h HAVE_SYS_FS_TYPES_H)
     check_include_file(sys/fstyp.h    HAVE_SYS_FSTYP_H)
+    check_include_file(sys/inotify.h  HAVE_SYS_INOTIFY_H)
     check_include_file(sys/ioctl.h    HAVE_SYS_IOCTL_H)
     check_include_file(sys/isa_defs.h HAVE_SYS_ISA_DEFS_H)
     check_include_file(sys/mntent.h   HAVE_SYS_MNTENT_H)
@@ -149,6 +150,8 @@ int main(void) {
     check_function_exists(closefrom        HAVE_CLOSEFROM)
     check_function_exists(pwritev          HAVE_PWRITEV)
     check_function_exists(fdatasync        HAVE_FDATASYNC)
+    check_function_exists(sendmmsg         HAVE_SENDMMSG)
+    check_function_exists(fallocate        HAVE_FALLOCATE)
 
     check_symbol_exists(F_CLOSEM "fcntl.h" HAVE_FCNTL_CLOSEM)
 
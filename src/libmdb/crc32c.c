@@ -32,6 +32,24 @@
  */
 #include "crc32c.h"
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HAVE_SSE42
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define CRC32C_HAVE_ARM64
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
 /*
  * This is the CRC-32C table
  * Generated with:
@@ -113,12 +131,110 @@ static const uint32_t crc32c_table[256] = {
  * crc using table.
  */
 
-uint32_t crc32c(unsigned char const *data, unsigned long length)
+uint32_t crc32c_sw(uint32_t crc, unsigned char const *data, unsigned long length)
 {
-	uint32_t crc = ~0;
-
 	while (length--)
 		crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 
 	return crc;
 }
+
+/*
+ * The crc32c instructions compute the same reflected crc as the table,
+ * eight bytes at a time once the buffer is aligned.
+ */
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, unsigned char const *data, unsigned long length)
+{
+	while ((length > 0) && (((uintptr_t)data & 7) != 0)) {
+		crc = _mm_crc32_u8(crc, *data++);
+		length--;
+	}
+
+	uint64_t crc64 = crc;
+	while (length >= 8) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		crc64 = _mm_crc32_u64(crc64, value);
+		data += 8;
+		length -= 8;
+	}
+	crc = (uint32_t)crc64;
+
+	while (length--)
+		crc = _mm_crc32_u8(crc, *data++);
+
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_HAVE_ARM64
+__attribute__((target("+crc")))
+static uint32_t crc32c_arm64(uint32_t crc, unsigned char const *data, unsigned long length)
+{
+	while ((length > 0) && (((uintptr_t)data & 7) != 0)) {
+		crc = __crc32cb(crc, *data++);
+		length--;
+	}
+
+	while (length >= 8) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		crc = __crc32cd(crc, value);
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = __crc32cb(crc, *data++);
+
+	return crc;
+}
+#endif
+
+typedef uint32_t (*crc32c_func_t)(uint32_t, unsigned char const *, unsigned long);
+
+static _Atomic(crc32c_func_t) crc32c_func;
+
+static crc32c_func_t crc32c_probe(void)
+{
+#ifdef CRC32C_HAVE_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42;
+#endif
+#ifdef CRC32C_HAVE_ARM64
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return crc32c_arm64;
+#endif
+	return crc32c_sw;
+}
+
+uint32_t crc32c_update(uint32_t crc, unsigned char const *data, unsigned long length)
+{
+	crc32c_func_t func = atomic_load_explicit(&crc32c_func, memory_order_relaxed);
+	if (func == NULL) {
+		func = crc32c_probe();
+		atomic_store_explicit(&crc32c_func, func, memory_order_relaxed);
+	}
+
+	return func(crc, data, length);
+}
+
+const char *crc32c_impl_name(void)
+{
+	crc32c_update(CRC32C_INIT, NULL, 0);
+	crc32c_func_t func = atomic_load_explicit(&crc32c_func, memory_order_relaxed);
+#ifdef CRC32C_HAVE_SSE42
+	if (func == crc32c_sse42)
+		return "sse4.2";
+#endif
+#ifdef CRC32C_HAVE_ARM64
+	if (func == crc32c_arm64)
+		return "armv8-crc";
+#endif
+	(void)func;
+	return "table";
+}
@@ -5,40 +5,20 @@
 
 #include <inttypes.h>
 
-uint32_t crc32c(unsigned char const *, unsigned long);
+#define CRC32C_INIT (~(uint32_t)0)
 
-#if 0
-extern bool crc32c_arm64_available;
-extern bool crc32c_intel_available;
+/* Extend crc, that starts as CRC32C_INIT, with length bytes of data.  The
+ * result is not inverted.  The crc32c instructions of the cpu are used when
+ * available (SSE4.2 or ARMv8 CRC), otherwise crc32c_sw. */
+uint32_t crc32c_update(uint32_t crc, unsigned char const *data, unsigned long length);
 
-#ifdef ARCH_HAVE_CRC_CRYPTO
-extern uint32_t crc32c_arm64(unsigned char const *, unsigned long);
-extern void crc32c_arm64_probe(void);
-#else
-#define crc32c_arm64 crc32c_sw
-static inline void crc32c_arm64_probe(void)
-{
-}
-#endif /* ARCH_HAVE_CRC_CRYPTO */
+/* Table driven crc32c. */
+uint32_t crc32c_sw(uint32_t crc, unsigned char const *data, unsigned long length);
 
-#ifdef ARCH_HAVE_SSE4_2
-extern uint32_t crc32c_intel(unsigned char const *, unsigned long);
-extern void crc32c_intel_probe(void);
-#else
-#define crc32c_intel crc32c_sw
-static inline void crc32c_intel_probe(void)
-{
-}
-#endif /* ARCH_HAVE_SSE4_2 */
+/* Name of the implementation used by crc32c_update. */
+const char *crc32c_impl_name(void);
 
-static inline uint32_t fio_crc32c(unsigned char const *buf, unsigned long len)
+static inline uint32_t crc32c(unsigned char const *data, unsigned long length)
 {
-    if (crc32c_arm64_available)
-        return crc32c_arm64(buf, len);
-
-    if (crc32c_intel_available)
-        return crc32c_intel(buf, len);
-
-    return crc32c_sw(buf, len);
+    return crc32c_update(CRC32C_INIT, data, length);
 }
-#endif
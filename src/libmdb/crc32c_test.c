@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/time.h"
+#include "libmdb/crc32c.h"
+
+DEF_TEST(vectors)
+{
+    /* The check value of crc32c is 0xe3069283, the result is not inverted. */
+    unsigned char const check[] = "123456789";
+    EXPECT_EQ_UINT64(0xe3069283 ^ 0xffffffff, crc32c(check, 9));
+    EXPECT_EQ_UINT64(0xe3069283 ^ 0xffffffff, crc32c_sw(CRC32C_INIT, check, 9));
+
+    unsigned char zeros[32] = {0};
+    EXPECT_EQ_UINT64(0x8a9136aa ^ 0xffffffff, crc32c(zeros, sizeof(zeros)));
+
+    return 0;
+}
+
+DEF_TEST(unaligned)
+{
+    unsigned char buffer[4096 + 16];
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = seed >> 16;
+    }
+
+    printf("# crc32c implementation: %s\n", crc32c_impl_name());
+
+    /* Every alignment and tail length against the table. */
+    int errors = 0;
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t len = 0; len < 64; len++) {
+            if (crc32c_sw(CRC32C_INIT, buffer + offset, len) != crc32c(buffer + offset, len))
+                errors++;
+        }
+        if (crc32c_sw(CRC32C_INIT, buffer + offset, 4096) != crc32c(buffer + offset, 4096))
+            errors++;
+    }
+    EXPECT_EQ_INT(0, errors);
+
+    /* Extending the crc in pieces gives the same result. */
+    uint32_t crc = CRC32C_INIT;
+    for (size_t pos = 0; pos < 4096; pos += 100) {
+        size_t len = 4096 - pos < 100 ? 4096 - pos : 100;
+        crc = crc32c_update(crc, buffer + pos, len);
+    }
+    EXPECT_EQ_UINT64(crc32c(buffer, 4096), crc);
+
+    return 0;
+}
+
+DEF_TEST(throughput)
+{
+    size_t size = 1024 * 1024;
+    unsigned char *buffer = malloc(size);
+    CHECK_NOT_NULL(buffer);
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = i * 31;
+    }
+
+    size_t loops = 64;
+
+    uint32_t crc_sw = 0;
+    cdtime_t start = cdtime();
+    for (size_t l = 0; l < loops; l++) {
+        crc_sw += crc32c_sw(CRC32C_INIT, buffer, size);
+    }
+    double elapsed_sw = CDTIME_T_TO_DOUBLE(cdtime() - start);
+
+    uint32_t crc_hw = 0;
+    start = cdtime();
+    for (size_t l = 0; l < loops; l++) {
+        crc_hw += crc32c(buffer, size);
+    }
+    double elapsed_hw = CDTIME_T_TO_DOUBLE(cdtime() - start);
+
+    EXPECT_EQ_UINT64(crc_sw, crc_hw);
+
+    if ((elapsed_sw > 0) && (elapsed_hw > 0))
+        printf("# %zu MB: table %.0f us/MB, %s %.0f us/MB\n", loops,
+               1e6 * elapsed_sw / (double)loops, crc32c_impl_name(),
+               1e6 * elapsed_hw / (double)loops);
+
+    free(buffer);
+
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(vectors);
+    RUN_TEST(unaligned);
+    RUN_TEST(throughput);
+
+    END_TEST;
+}
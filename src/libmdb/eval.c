@@ -8,275 +8,1262 @@
 #include <stdint.h>
 #include <math.h>
 
+#include "libutils/common.h"
+#include "libmdb/mdb.h"
 #include "libmdb/mql.h"
 #include "libmdb/node.h"
 #include "libmdb/value.h"
 
-#if 0
+/* A query is evaluated for all the steps at once: every series is an array with
+ * one value per step, NAN when the series has no value in that step, so each
+ * operator is a plain loop over contiguous doubles. */
+typedef struct {
+    char *name;
+    label_set_t labels;
+    double *values;
+} mql_range_serie_t;
 
-int nsteps = (int)((ctx->end - ctx->start) / ctx->interval) +1
+typedef struct {
+    bool scalar;
+    size_t num;
+    size_t alloc;
+    mql_range_serie_t *ptr;
+} mql_range_t;
 
-for (int ts = ctx->start; ts <= ctx->end; ts += ctx->interval) {
+typedef struct {
+    label_set_t key;
+    size_t idx;
+} mql_range_key_t;
 
+typedef enum {
+    MQL_RANGE_FUNC_RATE,
+    MQL_RANGE_FUNC_INCREASE,
+    MQL_RANGE_FUNC_DELTA,
+    MQL_RANGE_FUNC_IRATE,
+    MQL_RANGE_FUNC_IDELTA,
+    MQL_RANGE_FUNC_CHANGES,
+    MQL_RANGE_FUNC_RESETS,
+    MQL_RANGE_FUNC_AVG_OVER_TIME,
+    MQL_RANGE_FUNC_SUM_OVER_TIME,
+    MQL_RANGE_FUNC_MIN_OVER_TIME,
+    MQL_RANGE_FUNC_MAX_OVER_TIME,
+    MQL_RANGE_FUNC_COUNT_OVER_TIME,
+    MQL_RANGE_FUNC_LAST_OVER_TIME,
+    MQL_RANGE_FUNC_PRESENT_OVER_TIME,
+    MQL_RANGE_FUNC_STDDEV_OVER_TIME,
+    MQL_RANGE_FUNC_STDVAR_OVER_TIME,
+} mql_range_func_e;
+
+static struct {
+    char *name;
+    mql_range_func_e func;
+} mql_range_funcs[] = {
+    { "rate",               MQL_RANGE_FUNC_RATE              },
+    { "increase",           MQL_RANGE_FUNC_INCREASE          },
+    { "delta",              MQL_RANGE_FUNC_DELTA             },
+    { "irate",              MQL_RANGE_FUNC_IRATE             },
+    { "idelta",             MQL_RANGE_FUNC_IDELTA            },
+    { "changes",            MQL_RANGE_FUNC_CHANGES           },
+    { "resets",             MQL_RANGE_FUNC_RESETS            },
+    { "avg_over_time",      MQL_RANGE_FUNC_AVG_OVER_TIME     },
+    { "sum_over_time",      MQL_RANGE_FUNC_SUM_OVER_TIME     },
+    { "min_over_time",      MQL_RANGE_FUNC_MIN_OVER_TIME     },
+    { "max_over_time",      MQL_RANGE_FUNC_MAX_OVER_TIME     },
+    { "count_over_time",    MQL_RANGE_FUNC_COUNT_OVER_TIME   },
+    { "last_over_time",     MQL_RANGE_FUNC_LAST_OVER_TIME    },
+    { "present_over_time",  MQL_RANGE_FUNC_PRESENT_OVER_TIME },
+    { "stddev_over_time",   MQL_RANGE_FUNC_STDDEV_OVER_TIME  },
+    { "stdvar_over_time",   MQL_RANGE_FUNC_STDVAR_OVER_TIME  },
+};
+
+static double mql_sgn(double x)
+{
+    if (x > 0)
+        return 1.0;
+    if (x < 0)
+        return -1.0;
+    return x;
 }
 
-#endif
+static struct {
+    char *name;
+    double (*func)(double);
+} mql_math_funcs[] = {
+    { "abs",   fabs  },
+    { "ceil",  ceil  },
+    { "floor", floor },
+    { "exp",   exp   },
+    { "ln",    log   },
+    { "log2",  log2  },
+    { "log10", log10 },
+    { "sqrt",  sqrt  },
+    { "sgn",   mql_sgn },
+};
 
+static int mql_eval_range(mql_eval_ctx_t *ctx, mql_node_t *node, mql_range_t *result);
 
-mql_value_t *mql_eval_binary_scalar_scalar (__attribute__((unused)) mql_eval_ctx_t *ctx,
-                                              mql_node_t *node,
-                                              mql_value_t *val1,
-                                              mql_value_t *val2)
+static inline size_t mql_eval_steps(mql_eval_ctx_t *ctx)
 {
-    double result = 0.0;
+    if ((ctx->step == 0) || (ctx->end <= ctx->start))
+        return 1;
+    return (ctx->end - ctx->start) / ctx->step + 1;
+}
 
-    switch (node->binary.op) {
-        case MQL_BINARY_OP_ADD:
-            result = val1->scalar.value + val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_SUB:
-            result = val1->scalar.value - val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_MUL:
-            result = val1->scalar.value * val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_DIV:
-            result = val1->scalar.value / val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_MOD:
-            result = fmod(val1->scalar.value, val2->scalar.value);
-            break;
-        case MQL_BINARY_OP_POW:
-            result = pow(val1->scalar.value, val2->scalar.value);
-            break;
-        case MQL_BINARY_OP_EQLC:
-            result = val1->scalar.value == val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_NEQ:
-            result = val1->scalar.value != val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_GTR:
-            result = val1->scalar.value > val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_GTE:
-            result = val1->scalar.value >= val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_LSS:
-            result = val1->scalar.value < val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_LTE:
-            result = val1->scalar.value <= val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_AND:
-            // FIXME error
-            break;
-        case MQL_BINARY_OP_OR:
-            // FIXME error
-            break;
-        case MQL_BINARY_OP_UNLESS:
-            // FIXME error
-            break;
+static inline int64_t mql_eval_step_time(mql_eval_ctx_t *ctx, size_t n)
+{
+    return (int64_t)(ctx->start + n * ctx->step);
+}
+
+static int mql_eval_error(mql_eval_ctx_t *ctx, const char *errmsg)
+{
+    ctx->errmsg = errmsg;
+    return -1;
+}
+
+static void mql_range_reset(mql_range_t *range)
+{
+    for (size_t i = 0; i < range->num; i++) {
+        free(range->ptr[i].name);
+        label_set_reset(&range->ptr[i].labels);
+        free(range->ptr[i].values);
     }
-    // FIXME free
-    return mql_value_scalar(0, result);
+    free(range->ptr);
+    *range = (mql_range_t){0};
 }
 
-mql_value_t *mql_eval_binary_vector_scalar (__attribute__((unused)) mql_eval_ctx_t *ctx,
-                                              mql_node_t *node,
-                                              mql_value_t *val1,
-                                              mql_value_t *val2)
+static mql_range_serie_t *mql_range_add(mql_range_t *range, size_t steps)
 {
-    double result = 0.0;
+    if (range->num >= range->alloc) {
+        size_t alloc = range->alloc == 0 ? 8 : range->alloc * 2;
+        mql_range_serie_t *tmp = realloc(range->ptr, sizeof(*tmp) * alloc);
+        if (tmp == NULL)
+            return NULL;
+        range->ptr = tmp;
+        range->alloc = alloc;
+    }
 
-    switch (node->binary.op) {
-        case MQL_BINARY_OP_ADD:
-            result = val1->scalar.value + val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_SUB:
-            result = val1->scalar.value - val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_MUL:
-            result = val1->scalar.value * val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_DIV:
-            result = val1->scalar.value / val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_MOD:
-//          result = val1->scalar.value % val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_POW:
-            result = pow(val1->scalar.value, val2->scalar.value);
-            break;
-        case MQL_BINARY_OP_EQLC:
-            result = val1->scalar.value == val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_NEQ:
-            result = val1->scalar.value != val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_GTR:
-            result = val1->scalar.value > val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_GTE:
-            result = val1->scalar.value >= val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_LSS:
-            result = val1->scalar.value < val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_LTE:
-            result = val1->scalar.value <= val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_AND:
-            // FIXME error
-            break;
-        case MQL_BINARY_OP_OR:
-            // FIXME error
-            break;
-        case MQL_BINARY_OP_UNLESS:
-            // FIXME error
-            break;
+    double *values = malloc(sizeof(*values) * steps);
+    if (values == NULL)
+        return NULL;
+    for (size_t i = 0; i < steps; i++)
+        values[i] = NAN;
+
+    mql_range_serie_t *serie = &range->ptr[range->num];
+    range->num++;
+    *serie = (mql_range_serie_t){.values = values};
+
+    return serie;
+}
+
+static int mql_range_scalar(mql_range_t *range, size_t steps, double value)
+{
+    mql_range_serie_t *serie = mql_range_add(range, steps);
+    if (serie == NULL)
+        return -1;
+
+    for (size_t i = 0; i < steps; i++)
+        serie->values[i] = value;
+
+    range->scalar = true;
+
+    return 0;
+}
+
+static void mql_range_drop_name(mql_range_t *range)
+{
+    for (size_t i = 0; i < range->num; i++) {
+        free(range->ptr[i].name);
+        range->ptr[i].name = NULL;
     }
-    // FIXME free
-    return mql_value_scalar(0, result);
 }
 
-mql_value_t *mql_eval_binary_vector_vector (__attribute__((unused)) mql_eval_ctx_t *ctx,
-                                              mql_node_t *node,
-                                              mql_value_t *val1,
-                                              mql_value_t *val2)
+static bool mql_labels_contains(mql_labels_t *labels, const char *name)
 {
-    double result = 0.0;
+    if (labels == NULL)
+        return false;
 
-    switch (node->binary.op) {
-        case MQL_BINARY_OP_ADD:
-            result = val1->scalar.value + val2->scalar.value;
-            break;
-        case MQL_BINARY_OP_SUB:
-            result = val1->scalar.value - val2->scalar.value;
+    for (int i = 0; i < labels->num; i++) {
+        if (strcmp(labels->labels[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* With include only the listed labels are kept, otherwise the listed labels are dropped. */
+static int mql_labels_filter(label_set_t *dst, label_set_t *src, mql_labels_t *labels, bool include)
+{
+    for (size_t i = 0; i < src->num; i++) {
+        if (mql_labels_contains(labels, src->ptr[i].name) != include)
+            continue;
+        int status = label_set_add(dst, true, src->ptr[i].name, src->ptr[i].value);
+        if (status != 0)
+            return status;
+    }
+
+    return 0;
+}
+
+static int mql_range_key_cmp(const void *a, const void *b)
+{
+    const mql_range_key_t *ka = a;
+    const mql_range_key_t *kb = b;
+    label_set_t la = ka->key;
+    label_set_t lb = kb->key;
+
+    int cmp = label_set_cmp(&la, &lb);
+    if (cmp != 0)
+        return cmp;
+
+    return (ka->idx > kb->idx) - (ka->idx < kb->idx);
+}
+
+static void mql_range_keys_free(mql_range_key_t *keys, size_t num)
+{
+    if (keys == NULL)
+        return;
+
+    for (size_t i = 0; i < num; i++)
+        label_set_reset(&keys[i].key);
+    free(keys);
+}
+
+/* Returns the keys of the series of a range sorted, so the series with the same
+ * key are together. */
+static mql_range_key_t *mql_range_keys(mql_range_t *range, mql_labels_t *labels, bool include)
+{
+    mql_range_key_t *keys = calloc(range->num == 0 ? 1 : range->num, sizeof(*keys));
+    if (keys == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < range->num; i++) {
+        keys[i].idx = i;
+        if (mql_labels_filter(&keys[i].key, &range->ptr[i].labels, labels, include) != 0) {
+            mql_range_keys_free(keys, range->num);
+            return NULL;
+        }
+    }
+
+    qsort(keys, range->num, sizeof(*keys), mql_range_key_cmp);
+
+    return keys;
+}
+
+/* Find the run of keys equal to key, returns the first and sets end past the last. */
+static size_t mql_range_keys_find(mql_range_key_t *keys, size_t num, label_set_t *key, size_t *end)
+{
+    size_t lo = 0;
+    size_t hi = num;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (label_set_cmp(&keys[mid].key, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t n = lo;
+    while ((n < num) && (label_set_cmp(&keys[n].key, key) == 0))
+        n++;
+
+    *end = n;
+    return lo;
+}
+
+static int mql_eval_vector_times(mql_eval_ctx_t *ctx, mql_node_vector_t *vector,
+                                 int64_t *times, size_t steps)
+{
+    for (size_t i = 0; i < steps; i++) {
+        switch (vector->at.at) {
+        case MQL_AT_NONE:
+            times[i] = mql_eval_step_time(ctx, i);
             break;
-        case MQL_BINARY_OP_MUL:
-            result = val1->scalar.value * val2->scalar.value;
+        case MQL_AT_TIMESTAMP:
+            times[i] = vector->at.timestamp * 1000;
             break;
-        case MQL_BINARY_OP_DIV:
-            result = val1->scalar.value / val2->scalar.value;
+        case MQL_AT_START:
+            times[i] = (int64_t)ctx->start;
             break;
-        case MQL_BINARY_OP_MOD:
-//          result = val1->scalar.value % val2->scalar.value;
+        case MQL_AT_END:
+            times[i] = (int64_t)ctx->end;
             break;
-        case MQL_BINARY_OP_POW:
-            result = pow(val1->scalar.value, val2->scalar.value);
+        }
+        times[i] -= vector->offset;
+    }
+
+    return 0;
+}
+
+static mdb_samples_list_t *mql_eval_fetch(mql_eval_ctx_t *ctx, mql_node_vector_t *vector,
+                                          int64_t start, int64_t end)
+{
+    if (ctx->mdb == NULL)
+        return NULL;
+
+    if (start < 0)
+        start = 0;
+    if (end < start)
+        end = start;
+
+    return mdb_fetch_samples(ctx->mdb, &vector->match, MS_TO_CDTIME_T(start), MS_TO_CDTIME_T(end));
+}
+
+/* Move the name and labels of the samples to the serie. */
+static void mql_range_serie_take(mql_range_serie_t *serie, mdb_samples_t *samples, bool name)
+{
+    if (name) {
+        serie->name = samples->name;
+        samples->name = NULL;
+    }
+    serie->labels = samples->labels;
+    samples->labels = (label_set_t){0};
+}
+
+static int mql_eval_vector(mql_eval_ctx_t *ctx, mql_node_vector_t *vector, mql_range_t *result)
+{
+    size_t steps = mql_eval_steps(ctx);
+
+    int64_t *times = malloc(sizeof(*times) * steps);
+    if (times == NULL)
+        return mql_eval_error(ctx, "out of memory");
+
+    mql_eval_vector_times(ctx, vector, times, steps);
+
+    int64_t lookback = CDTIME_T_TO_MS(MDB_LOOKBACK_DELTA);
+    mdb_samples_list_t *list = mql_eval_fetch(ctx, vector, times[0] - lookback, times[steps-1]);
+    if (list == NULL) {
+        free(times);
+        return mql_eval_error(ctx, "failed to fetch the series");
+    }
+
+    for (size_t j = 0; j < list->num; j++) {
+        mdb_samples_t *samples = &list->ptr[j];
+
+        mql_range_serie_t *serie = mql_range_add(result, steps);
+        if (serie == NULL) {
+            mdb_samples_list_free(list);
+            free(times);
+            return mql_eval_error(ctx, "out of memory");
+        }
+        mql_range_serie_take(serie, samples, true);
+
+        const int64_t *ts = samples->times;
+        const double *values = samples->values;
+        size_t num = samples->num;
+        size_t n = 0;
+        for (size_t i = 0; i < steps; i++) {
+            while ((n < num) && (ts[n] <= times[i]))
+                n++;
+            if ((n > 0) && (ts[n-1] > (times[i] - lookback)))
+                serie->values[i] = values[n-1];
+        }
+    }
+
+    mdb_samples_list_free(list);
+    free(times);
+
+    return 0;
+}
+
+/* Extrapolates the increase of the samples in the window to the whole window as Prometheus does. */
+static double mql_window_extrapolated(mql_range_func_e func, const int64_t *ts, const double *v,
+                                      const double *resets, size_t lo, size_t hi,
+                                      int64_t time, int64_t range)
+{
+    size_t n = hi - lo;
+    if (n < 2)
+        return NAN;
+
+    bool counter = func != MQL_RANGE_FUNC_DELTA;
+
+    double result = v[hi-1] - v[lo];
+    if (counter)
+        result += resets[hi-1] - resets[lo];
+
+    double duration_to_start = (double)(ts[lo] - (time - range)) / 1000.0;
+    double duration_to_end = (double)(time - ts[hi-1]) / 1000.0;
+    double sampled_interval = (double)(ts[hi-1] - ts[lo]) / 1000.0;
+    double average_duration = sampled_interval / (double)(n - 1);
+
+    if (counter && (result > 0) && (v[lo] >= 0)) {
+        double duration_to_zero = sampled_interval * (v[lo] / result);
+        if (duration_to_zero < duration_to_start)
+            duration_to_start = duration_to_zero;
+    }
+
+    double threshold = average_duration * 1.1;
+    double interval = sampled_interval;
+    interval += duration_to_start < threshold ? duration_to_start : average_duration / 2.0;
+    interval += duration_to_end < threshold ? duration_to_end : average_duration / 2.0;
+
+    if (sampled_interval <= 0)
+        return NAN;
+
+    result *= interval / sampled_interval;
+    if (func == MQL_RANGE_FUNC_RATE)
+        result /= (double)range / 1000.0;
+
+    return result;
+}
+
+/* Evaluates func over the window (time - range, time] of every step, the windows
+ * only move forward so both ends are found by walking the samples once. */
+static void mql_window_eval(mql_range_func_e func, const int64_t *ts, const double *v,
+                            const double *resets, size_t num,
+                            const int64_t *times, size_t steps, int64_t range, double *dst)
+{
+    size_t lo = 0;
+    size_t hi = 0;
+
+    for (size_t i = 0; i < steps; i++) {
+        int64_t time = times[i];
+        while ((hi < num) && (ts[hi] <= time))
+            hi++;
+        while ((lo < hi) && (ts[lo] <= (time - range)))
+            lo++;
+
+        size_t n = hi - lo;
+        if (n == 0)
+            continue;
+
+        const double *w = v + lo;
+        double result = NAN;
+
+        switch (func) {
+        case MQL_RANGE_FUNC_RATE:
+        case MQL_RANGE_FUNC_INCREASE:
+        case MQL_RANGE_FUNC_DELTA:
+            result = mql_window_extrapolated(func, ts, v, resets, lo, hi, time, range);
             break;
-        case MQL_BINARY_OP_EQLC:
-            result = val1->scalar.value == val2->scalar.value;
+        case MQL_RANGE_FUNC_IRATE:
+        case MQL_RANGE_FUNC_IDELTA: {
+            if (n < 2)
+                break;
+            double delta = w[n-1] - w[n-2];
+            if (func == MQL_RANGE_FUNC_IDELTA) {
+                result = delta;
+                break;
+            }
+            if (w[n-1] < w[n-2])
+                delta = w[n-1];
+            int64_t interval = ts[hi-1] - ts[hi-2];
+            if (interval > 0)
+                result = delta / ((double)interval / 1000.0);
+        }   break;
+        case MQL_RANGE_FUNC_CHANGES: {
+            double changes = 0;
+            for (size_t j = 1; j < n; j++)
+                changes += w[j] != w[j-1];
+            result = changes;
+        }   break;
+        case MQL_RANGE_FUNC_RESETS: {
+            double count = 0;
+            for (size_t j = 1; j < n; j++)
+                count += w[j] < w[j-1];
+            result = count;
+        }   break;
+        case MQL_RANGE_FUNC_AVG_OVER_TIME:
+        case MQL_RANGE_FUNC_SUM_OVER_TIME: {
+            double sum = 0;
+            for (size_t j = 0; j < n; j++)
+                sum += w[j];
+            result = func == MQL_RANGE_FUNC_SUM_OVER_TIME ? sum : sum / (double)n;
+        }   break;
+        case MQL_RANGE_FUNC_MIN_OVER_TIME: {
+            double min = w[0];
+            for (size_t j = 1; j < n; j++)
+                min = (w[j] < min) || isnan(min) ? w[j] : min;
+            result = min;
+        }   break;
+        case MQL_RANGE_FUNC_MAX_OVER_TIME: {
+            double max = w[0];
+            for (size_t j = 1; j < n; j++)
+                max = (w[j] > max) || isnan(max) ? w[j] : max;
+            result = max;
+        }   break;
+        case MQL_RANGE_FUNC_COUNT_OVER_TIME:
+            result = (double)n;
             break;
-        case MQL_BINARY_OP_NEQ:
-            result = val1->scalar.value != val2->scalar.value;
+        case MQL_RANGE_FUNC_LAST_OVER_TIME:
+            result = w[n-1];
             break;
-        case MQL_BINARY_OP_GTR:
-            result = val1->scalar.value > val2->scalar.value;
+        case MQL_RANGE_FUNC_PRESENT_OVER_TIME:
+            result = 1.0;
             break;
-        case MQL_BINARY_OP_GTE:
-            result = val1->scalar.value >= val2->scalar.value;
+        case MQL_RANGE_FUNC_STDDEV_OVER_TIME:
+        case MQL_RANGE_FUNC_STDVAR_OVER_TIME: {
+            double sum = 0;
+            for (size_t j = 0; j < n; j++)
+                sum += w[j];
+            double mean = sum / (double)n;
+            double var = 0;
+            for (size_t j = 0; j < n; j++)
+                var += (w[j] - mean) * (w[j] - mean);
+            var /= (double)n;
+            result = func == MQL_RANGE_FUNC_STDVAR_OVER_TIME ? var : sqrt(var);
+        }   break;
+        }
+
+        dst[i] = result;
+    }
+}
+
+static int mql_eval_range_func(mql_eval_ctx_t *ctx, mql_range_func_e func,
+                               mql_node_t *arg, mql_range_t *result)
+{
+    if ((arg == NULL) || (arg->kind != MQL_NODE_MATRIX))
+        return mql_eval_error(ctx, "expected a range vector argument");
+    if ((arg->matrix.expr == NULL) || (arg->matrix.expr->kind != MQL_NODE_VECTOR))
+        return mql_eval_error(ctx, "subqueries are not supported");
+
+    mql_node_vector_t *vector = &arg->matrix.expr->vector;
+    int64_t range = (int64_t)arg->matrix.range;
+    if (range <= 0)
+        return mql_eval_error(ctx, "invalid range");
+
+    size_t steps = mql_eval_steps(ctx);
+
+    int64_t *times = malloc(sizeof(*times) * steps);
+    if (times == NULL)
+        return mql_eval_error(ctx, "out of memory");
+
+    mql_eval_vector_times(ctx, vector, times, steps);
+
+    mdb_samples_list_t *list = mql_eval_fetch(ctx, vector, times[0] - range, times[steps-1]);
+    if (list == NULL) {
+        free(times);
+        return mql_eval_error(ctx, "failed to fetch the series");
+    }
+
+    bool counter = (func == MQL_RANGE_FUNC_RATE) || (func == MQL_RANGE_FUNC_INCREASE);
+    double *resets = NULL;
+
+    for (size_t j = 0; j < list->num; j++) {
+        mdb_samples_t *samples = &list->ptr[j];
+
+        mql_range_serie_t *serie = mql_range_add(result, steps);
+        if (serie == NULL)
+            goto error;
+        mql_range_serie_take(serie, samples, func == MQL_RANGE_FUNC_LAST_OVER_TIME);
+
+        if (counter && (samples->num > 0)) {
+            /* Accumulate the counter resets once, the correction of any window
+             * is then the difference of two entries. */
+            double *tmp = realloc(resets, sizeof(*resets) * samples->num);
+            if (tmp == NULL)
+                goto error;
+            resets = tmp;
+            const double *v = samples->values;
+            resets[0] = 0;
+            for (size_t i = 1; i < samples->num; i++)
+                resets[i] = resets[i-1] + (v[i] < v[i-1] ? v[i-1] : 0);
+        }
+
+        mql_window_eval(func, samples->times, samples->values, resets, samples->num,
+                        times, steps, range, serie->values);
+    }
+
+    free(resets);
+    mdb_samples_list_free(list);
+    free(times);
+    return 0;
+
+error:
+    free(resets);
+    mdb_samples_list_free(list);
+    free(times);
+    return mql_eval_error(ctx, "out of memory");
+}
+
+static int mql_eval_scalar_arg(mql_eval_ctx_t *ctx, mql_node_t *arg, mql_range_t *range)
+{
+    if (arg == NULL)
+        return mql_eval_error(ctx, "missing argument");
+
+    int status = mql_eval_range(ctx, arg, range);
+    if (status != 0)
+        return status;
+
+    if (!range->scalar) {
+        mql_range_reset(range);
+        return mql_eval_error(ctx, "expected a scalar argument");
+    }
+
+    return 0;
+}
+
+static int mql_eval_clamp(mql_eval_ctx_t *ctx, mql_node_list_t *args, bool has_min, bool has_max,
+                          mql_range_t *result)
+{
+    mql_range_t min = {0};
+    mql_range_t max = {0};
+    mql_node_list_t *arg = args->next;
+
+    if (has_min) {
+        if (mql_eval_scalar_arg(ctx, arg != NULL ? arg->expr : NULL, &min) != 0)
+            return -1;
+        arg = arg->next;
+    }
+    if (has_max) {
+        if (mql_eval_scalar_arg(ctx, arg != NULL ? arg->expr : NULL, &max) != 0) {
+            mql_range_reset(&min);
+            return -1;
+        }
+    }
+
+    int status = mql_eval_range(ctx, args->expr, result);
+    if (status == 0) {
+        size_t steps = mql_eval_steps(ctx);
+        mql_range_drop_name(result);
+        for (size_t j = 0; j < result->num; j++) {
+            double *values = result->ptr[j].values;
+            for (size_t i = 0; i < steps; i++) {
+                double v = values[i];
+                if (has_min && (v < min.ptr[0].values[i]))
+                    v = min.ptr[0].values[i];
+                if (has_max && (v > max.ptr[0].values[i]))
+                    v = max.ptr[0].values[i];
+                if (has_min && has_max && (min.ptr[0].values[i] > max.ptr[0].values[i]))
+                    v = NAN;
+                values[i] = v;
+            }
+        }
+    }
+
+    mql_range_reset(&min);
+    mql_range_reset(&max);
+    return status;
+}
+
+static int mql_eval_call(mql_eval_ctx_t *ctx, mql_node_call_t *call, mql_range_t *result)
+{
+    if (call->func == NULL)
+        return mql_eval_error(ctx, "unknown function");
+
+    const char *name = call->func->name;
+    mql_node_list_t *args = call->args;
+    size_t steps = mql_eval_steps(ctx);
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(mql_range_funcs); i++) {
+        if (strcmp(mql_range_funcs[i].name, name) == 0)
+            return mql_eval_range_func(ctx, mql_range_funcs[i].func,
+                                       args != NULL ? args->expr : NULL, result);
+    }
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(mql_math_funcs); i++) {
+        if (strcmp(mql_math_funcs[i].name, name) != 0)
+            continue;
+        if (args == NULL)
+            return mql_eval_error(ctx, "missing argument");
+
+        int status = mql_eval_range(ctx, args->expr, result);
+        if (status != 0)
+            return status;
+
+        double (*func)(double) = mql_math_funcs[i].func;
+        mql_range_drop_name(result);
+        for (size_t j = 0; j < result->num; j++) {
+            double *values = result->ptr[j].values;
+            for (size_t k = 0; k < steps; k++)
+                values[k] = func(values[k]);
+        }
+        return 0;
+    }
+
+    if (strcmp("time", name) == 0) {
+        int status = mql_range_scalar(result, steps, 0);
+        if (status != 0)
+            return mql_eval_error(ctx, "out of memory");
+        for (size_t i = 0; i < steps; i++)
+            result->ptr[0].values[i] = (double)mql_eval_step_time(ctx, i) / 1000.0;
+        return 0;
+    } else if (strcmp("vector", name) == 0) {
+        int status = mql_eval_scalar_arg(ctx, args != NULL ? args->expr : NULL, result);
+        if (status != 0)
+            return status;
+        result->scalar = false;
+        return 0;
+    } else if (strcmp("scalar", name) == 0) {
+        if (args == NULL)
+            return mql_eval_error(ctx, "missing argument");
+        mql_range_t vector = {0};
+        int status = mql_eval_range(ctx, args->expr, &vector);
+        if (status != 0)
+            return status;
+        if (vector.scalar) {
+            *result = vector;
+            return 0;
+        }
+        if (mql_range_scalar(result, steps, NAN) != 0) {
+            mql_range_reset(&vector);
+            return mql_eval_error(ctx, "out of memory");
+        }
+        /* Only a step with exactly one value is converted. */
+        double *dst = result->ptr[0].values;
+        for (size_t i = 0; i < steps; i++) {
+            size_t count = 0;
+            double value = NAN;
+            for (size_t j = 0; j < vector.num; j++) {
+                if (!isnan(vector.ptr[j].values[i])) {
+                    value = vector.ptr[j].values[i];
+                    count++;
+                }
+            }
+            dst[i] = count == 1 ? value : NAN;
+        }
+        mql_range_reset(&vector);
+        return 0;
+    } else if ((strcmp("clamp", name) == 0) && (args != NULL)) {
+        return mql_eval_clamp(ctx, args, true, true, result);
+    } else if ((strcmp("clamp_min", name) == 0) && (args != NULL)) {
+        return mql_eval_clamp(ctx, args, true, false, result);
+    } else if ((strcmp("clamp_max", name) == 0) && (args != NULL)) {
+        return mql_eval_clamp(ctx, args, false, true, result);
+    }
+
+    return mql_eval_error(ctx, "function not supported in range queries");
+}
+
+static int mql_eval_aggregate(mql_eval_ctx_t *ctx, mql_node_aggregate_t *aggregate,
+                              mql_range_t *result)
+{
+    switch (aggregate->op) {
+    case MQL_AGGREGATE_OP_AVG:
+    case MQL_AGGREGATE_OP_COUNT:
+    case MQL_AGGREGATE_OP_GROUP:
+    case MQL_AGGREGATE_OP_MAX:
+    case MQL_AGGREGATE_OP_MIN:
+    case MQL_AGGREGATE_OP_STDDEV:
+    case MQL_AGGREGATE_OP_STDVAR:
+    case MQL_AGGREGATE_OP_SUM:
+        break;
+    case MQL_AGGREGATE_OP_BOTTOMK:
+    case MQL_AGGREGATE_OP_COUNT_VALUES:
+    case MQL_AGGREGATE_OP_QUANTILE:
+    case MQL_AGGREGATE_OP_TOPK:
+        return mql_eval_error(ctx, "aggregation not supported in range queries");
+    }
+
+    if ((aggregate->args == NULL) || (aggregate->args->next != NULL))
+        return mql_eval_error(ctx, "expected one argument in aggregation");
+
+    mql_range_t input = {0};
+    int status = mql_eval_range(ctx, aggregate->args->expr, &input);
+    if (status != 0)
+        return status;
+
+    if (input.scalar) {
+        mql_range_reset(&input);
+        return mql_eval_error(ctx, "expected a vector in aggregation");
+    }
+
+    bool include = aggregate->modifier != MQL_AGGREGATE_WITHOUT;
+    mql_labels_t *labels = aggregate->modifier == MQL_AGGREGATE_NONE ? NULL : aggregate->labels;
+    mql_range_key_t *keys = mql_range_keys(&input, labels, include);
+    if (keys == NULL) {
+        mql_range_reset(&input);
+        return mql_eval_error(ctx, "out of memory");
+    }
+
+    size_t steps = mql_eval_steps(ctx);
+    double *count = malloc(sizeof(*count) * steps);
+    double *mean = malloc(sizeof(*mean) * steps);
+    if ((count == NULL) || (mean == NULL))
+        goto error;
+
+    size_t end = 0;
+    for (size_t start = 0; start < input.num; start = end) {
+        end = start + 1;
+        while ((end < input.num) && (label_set_cmp(&keys[start].key, &keys[end].key) == 0))
+            end++;
+
+        mql_range_serie_t *serie = mql_range_add(result, steps);
+        if (serie == NULL)
+            goto error;
+        serie->labels = keys[start].key;
+        keys[start].key = (label_set_t){0};
+
+        double *dst = serie->values;
+        for (size_t i = 0; i < steps; i++) {
+            count[i] = 0;
+            mean[i] = 0;
+        }
+
+        for (size_t k = start; k < end; k++) {
+            const double *src = input.ptr[keys[k].idx].values;
+            switch (aggregate->op) {
+            case MQL_AGGREGATE_OP_SUM:
+                for (size_t i = 0; i < steps; i++) {
+                    if (!isnan(src[i]))
+                        dst[i] = isnan(dst[i]) ? src[i] : dst[i] + src[i];
+                }
+                break;
+            case MQL_AGGREGATE_OP_MIN:
+                for (size_t i = 0; i < steps; i++) {
+                    if (isnan(dst[i]) || (src[i] < dst[i]))
+                        dst[i] = src[i];
+                }
+                break;
+            case MQL_AGGREGATE_OP_MAX:
+                for (size_t i = 0; i < steps; i++) {
+                    if (isnan(dst[i]) || (src[i] > dst[i]))
+                        dst[i] = src[i];
+                }
+                break;
+            case MQL_AGGREGATE_OP_COUNT:
+            case MQL_AGGREGATE_OP_GROUP:
+                for (size_t i = 0; i < steps; i++)
+                    count[i] += !isnan(src[i]);
+                break;
+            case MQL_AGGREGATE_OP_AVG:
+            case MQL_AGGREGATE_OP_STDDEV:
+            case MQL_AGGREGATE_OP_STDVAR:
+                /* Running mean and sum of squares of differences (Welford), the
+                 * latter is kept in dst. */
+                for (size_t i = 0; i < steps; i++) {
+                    if (isnan(src[i]))
+                        continue;
+                    count[i] += 1;
+                    double delta = src[i] - mean[i];
+                    mean[i] += delta / count[i];
+                    if (isnan(dst[i]))
+                        dst[i] = 0;
+                    dst[i] += delta * (src[i] - mean[i]);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        switch (aggregate->op) {
+        case MQL_AGGREGATE_OP_COUNT:
+            for (size_t i = 0; i < steps; i++)
+                dst[i] = count[i] > 0 ? count[i] : NAN;
             break;
-        case MQL_BINARY_OP_LSS:
-            result = val1->scalar.value < val2->scalar.value;
+        case MQL_AGGREGATE_OP_GROUP:
+            for (size_t i = 0; i < steps; i++)
+                dst[i] = count[i] > 0 ? 1.0 : NAN;
             break;
-        case MQL_BINARY_OP_LTE:
-            result = val1->scalar.value <= val2->scalar.value;
+        case MQL_AGGREGATE_OP_AVG:
+            for (size_t i = 0; i < steps; i++)
+                dst[i] = count[i] > 0 ? mean[i] : NAN;
             break;
-        case MQL_BINARY_OP_AND:
-            // FIXME error
+        case MQL_AGGREGATE_OP_STDVAR:
+            for (size_t i = 0; i < steps; i++)
+                dst[i] = count[i] > 0 ? dst[i] / count[i] : NAN;
             break;
-        case MQL_BINARY_OP_OR:
-            // FIXME error
+        case MQL_AGGREGATE_OP_STDDEV:
+            for (size_t i = 0; i < steps; i++)
+                dst[i] = count[i] > 0 ? sqrt(dst[i] / count[i]) : NAN;
             break;
-        case MQL_BINARY_OP_UNLESS:
-            // FIXME error
+        default:
             break;
+        }
     }
-    // FIXME free
-    return mql_value_scalar(0, result);
+
+    free(count);
+    free(mean);
+    mql_range_keys_free(keys, input.num);
+    mql_range_reset(&input);
+    return 0;
+
+error:
+    free(count);
+    free(mean);
+    mql_range_keys_free(keys, input.num);
+    mql_range_reset(&input);
+    return mql_eval_error(ctx, "out of memory");
 }
 
-mql_value_t *mql_eval_unary(__attribute__((unused)) mql_eval_ctx_t *ctx, mql_node_t *node)
+static inline bool mql_binary_op_is_comparison(mql_binary_op_e op)
 {
-    switch (node->unary.op) {
-        case MQL_UNARY_OP_ADD:
-            break;
-        case MQL_UNARY_OP_SUB:
-            break;
+    switch (op) {
+    case MQL_BINARY_OP_EQLC:
+    case MQL_BINARY_OP_NEQ:
+    case MQL_BINARY_OP_GTR:
+    case MQL_BINARY_OP_GTE:
+    case MQL_BINARY_OP_LSS:
+    case MQL_BINARY_OP_LTE:
+        return true;
+    default:
+        break;
+    }
+    return false;
+}
+
+#define MQL_BINARY_LOOP(expr)                                             \
+    for (size_t i = 0; i < steps; i++) {                                  \
+        double x = a[i];                                                  \
+        double y = b[i];                                                  \
+        dst[i] = (expr);                                                  \
+    }
+
+#define MQL_BINARY_CMP_LOOP(cmp)                                          \
+    if (bool_mod) {                                                       \
+        MQL_BINARY_LOOP(isnan(x) || isnan(y) ? NAN : (double)(cmp))       \
+    } else {                                                              \
+        MQL_BINARY_LOOP(!isnan(x) && !isnan(y) && (cmp) ? keep[i] : NAN)  \
     }
 
-    return NULL;
+/* Applies op to the values of every step, for a comparison without bool the value
+ * kept is taken from keep. */
+static void mql_binary_values(mql_binary_op_e op, bool bool_mod, const double *a, const double *b,
+                              const double *keep, double *dst, size_t steps)
+{
+    switch (op) {
+    case MQL_BINARY_OP_ADD:
+        MQL_BINARY_LOOP(x + y)
+        break;
+    case MQL_BINARY_OP_SUB:
+        MQL_BINARY_LOOP(x - y)
+        break;
+    case MQL_BINARY_OP_MUL:
+        MQL_BINARY_LOOP(x * y)
+        break;
+    case MQL_BINARY_OP_DIV:
+        MQL_BINARY_LOOP(x / y)
+        break;
+    case MQL_BINARY_OP_MOD:
+        MQL_BINARY_LOOP(fmod(x, y))
+        break;
+    case MQL_BINARY_OP_POW:
+        MQL_BINARY_LOOP(pow(x, y))
+        break;
+    case MQL_BINARY_OP_EQLC:
+        MQL_BINARY_CMP_LOOP(x == y)
+        break;
+    case MQL_BINARY_OP_NEQ:
+        MQL_BINARY_CMP_LOOP(x != y)
+        break;
+    case MQL_BINARY_OP_GTR:
+        MQL_BINARY_CMP_LOOP(x > y)
+        break;
+    case MQL_BINARY_OP_GTE:
+        MQL_BINARY_CMP_LOOP(x >= y)
+        break;
+    case MQL_BINARY_OP_LSS:
+        MQL_BINARY_CMP_LOOP(x < y)
+        break;
+    case MQL_BINARY_OP_LTE:
+        MQL_BINARY_CMP_LOOP(x <= y)
+        break;
+    case MQL_BINARY_OP_AND:
+    case MQL_BINARY_OP_OR:
+    case MQL_BINARY_OP_UNLESS:
+        break;
+    }
 }
 
-#if 0
-mql_value_t *mql_eval_vector(__attribute__((unused)) mql_eval_ctx_t *ctx, mql_node_t *node)
+static int mql_eval_binary_set(mql_eval_ctx_t *ctx, mql_node_binary_t *binary,
+                               mql_range_t *lhs, mql_range_t *rhs, mql_range_t *result)
 {
+    bool include = false;
+    mql_labels_t *labels = NULL;
+    if ((binary->mod != NULL) && (binary->mod->inclexcl_op != MQL_INCLEXCL_NONE)) {
+        include = binary->mod->inclexcl_op == MQL_INCLEXCL_ON;
+        labels = binary->mod->inclexcl_labels;
+    }
 
+    mql_range_key_t *lkeys = mql_range_keys(lhs, labels, include);
+    mql_range_key_t *rkeys = mql_range_keys(rhs, labels, include);
+    if ((lkeys == NULL) || (rkeys == NULL)) {
+        mql_range_keys_free(lkeys, lhs->num);
+        mql_range_keys_free(rkeys, rhs->num);
+        return mql_eval_error(ctx, "out of memory");
+    }
 
-    return NULL;
+    size_t steps = mql_eval_steps(ctx);
+
+    /* For and/unless the lhs is masked by the rhs with the same key, for or the
+     * rhs is masked by the lhs and appended. */
+    mql_range_t *src = binary->op == MQL_BINARY_OP_OR ? rhs : lhs;
+    mql_range_key_t *skeys = binary->op == MQL_BINARY_OP_OR ? rkeys : lkeys;
+    mql_range_t *mask = binary->op == MQL_BINARY_OP_OR ? lhs : rhs;
+    mql_range_key_t *mkeys = binary->op == MQL_BINARY_OP_OR ? lkeys : rkeys;
+    bool keep_matched = binary->op == MQL_BINARY_OP_AND;
+
+    for (size_t j = 0; j < src->num; j++) {
+        mql_range_serie_t *serie = &src->ptr[skeys[j].idx];
+        size_t end = 0;
+        size_t start = mql_range_keys_find(mkeys, mask->num, &skeys[j].key, &end);
+        for (size_t i = 0; i < steps; i++) {
+            bool matched = false;
+            for (size_t k = start; k < end; k++)
+                matched |= !isnan(mask->ptr[mkeys[k].idx].values[i]);
+            if (matched != keep_matched)
+                serie->values[i] = NAN;
+        }
+    }
+
+    mql_range_keys_free(lkeys, lhs->num);
+    mql_range_keys_free(rkeys, rhs->num);
+
+    *result = *lhs;
+    *lhs = (mql_range_t){0};
+
+    if (binary->op == MQL_BINARY_OP_OR) {
+        for (size_t j = 0; j < rhs->num; j++) {
+            mql_range_serie_t *serie = mql_range_add(result, steps);
+            if (serie == NULL)
+                return mql_eval_error(ctx, "out of memory");
+            free(serie->values);
+            *serie = rhs->ptr[j];
+            rhs->ptr[j] = (mql_range_serie_t){0};
+        }
+    }
+
+    return 0;
 }
 
-mql_value_t *mql_eval_matrix(__attribute__((unused)) mql_eval_ctx_t *ctx, mql_node_t *node)
+static int mql_eval_binary_vector(mql_eval_ctx_t *ctx, mql_node_binary_t *binary,
+                                  mql_range_t *lhs, mql_range_t *rhs, mql_range_t *result)
 {
+    bool bool_mod = false;
+    bool include = false;
+    mql_labels_t *labels = NULL;
+    if (binary->mod != NULL) {
+        if (binary->mod->group_op != MQL_GROUP_NONE)
+            return mql_eval_error(ctx, "group_left and group_right are not supported");
+        bool_mod = binary->mod->bool_mod;
+        if (binary->mod->inclexcl_op != MQL_INCLEXCL_NONE) {
+            include = binary->mod->inclexcl_op == MQL_INCLEXCL_ON;
+            labels = binary->mod->inclexcl_labels;
+        }
+    }
+
+    mql_range_key_t *lkeys = mql_range_keys(lhs, labels, include);
+    mql_range_key_t *rkeys = mql_range_keys(rhs, labels, include);
+    if ((lkeys == NULL) || (rkeys == NULL)) {
+        mql_range_keys_free(lkeys, lhs->num);
+        mql_range_keys_free(rkeys, rhs->num);
+        return mql_eval_error(ctx, "out of memory");
+    }
+
+    /* One-to-one matching needs the matching labels to be unique on both sides
+     * of the series that match, picking one of them would be an arbitrary answer. */
+    for (size_t i = 0; i < lhs->num; ) {
+        size_t lend = 0;
+        mql_range_keys_find(lkeys, lhs->num, &lkeys[i].key, &lend);
+        size_t rend = 0;
+        size_t rstart = mql_range_keys_find(rkeys, rhs->num, &lkeys[i].key, &rend);
+        if ((rstart != rend) && (((lend - i) > 1) || ((rend - rstart) > 1))) {
+            mql_range_keys_free(lkeys, lhs->num);
+            mql_range_keys_free(rkeys, rhs->num);
+            return mql_eval_error(ctx, "many-to-many matching not allowed: "
+                                       "matching labels must be unique on each side");
+        }
+        i = lend;
+    }
+    mql_range_keys_free(lkeys, lhs->num);
+
+    size_t steps = mql_eval_steps(ctx);
+    bool keep_name = mql_binary_op_is_comparison(binary->op) && !bool_mod;
+
+    for (size_t j = 0; j < lhs->num; j++) {
+        mql_range_serie_t *lserie = &lhs->ptr[j];
 
-    return NULL;
+        label_set_t key = {0};
+        if (mql_labels_filter(&key, &lserie->labels, labels, include) != 0) {
+            label_set_reset(&key);
+            mql_range_keys_free(rkeys, rhs->num);
+            return mql_eval_error(ctx, "out of memory");
+        }
+
+        size_t end = 0;
+        size_t start = mql_range_keys_find(rkeys, rhs->num, &key, &end);
+        if (start == end) {
+            label_set_reset(&key);
+            continue;
+        }
+
+        mql_range_serie_t *serie = mql_range_add(result, steps);
+        if (serie == NULL) {
+            label_set_reset(&key);
+            mql_range_keys_free(rkeys, rhs->num);
+            return mql_eval_error(ctx, "out of memory");
+        }
+        serie->labels = key;
+        if (keep_name && (lserie->name != NULL))
+            serie->name = strdup(lserie->name);
+
+        const double *rvalues = rhs->ptr[rkeys[start].idx].values;
+        mql_binary_values(binary->op, bool_mod, lserie->values, rvalues, lserie->values,
+                          serie->values, steps);
+    }
+
+    mql_range_keys_free(rkeys, rhs->num);
+    return 0;
 }
-#endif
 
-mql_value_t *mql_eval(mql_eval_ctx_t *ctx, mql_node_t *node)
+static int mql_eval_binary(mql_eval_ctx_t *ctx, mql_node_binary_t *binary, mql_range_t *result)
 {
-    mql_value_t *value = NULL;
+    mql_range_t lhs = {0};
+    mql_range_t rhs = {0};
 
+    int status = mql_eval_range(ctx, binary->lexpr, &lhs);
+    if (status != 0)
+        return status;
 
-    switch (node->kind) {
-        case MQL_NODE_AGGREGATE:
-//          value = mql_eval_aggregate(node);
-            break;
-        case MQL_NODE_BINARY: {
-            mql_value_t *lvalue = mql_eval(ctx, node->binary.lexpr);
-            if (lvalue == NULL) {
-                return NULL;
-            }
-            mql_value_t *rvalue = mql_eval(ctx, node->binary.rexpr);
-            if (rvalue == NULL) {
-                return NULL;
+    status = mql_eval_range(ctx, binary->rexpr, &rhs);
+    if (status != 0) {
+        mql_range_reset(&lhs);
+        return status;
+    }
+
+    size_t steps = mql_eval_steps(ctx);
+    bool bool_mod = (binary->mod != NULL) && binary->mod->bool_mod;
+
+    switch (binary->op) {
+    case MQL_BINARY_OP_AND:
+    case MQL_BINARY_OP_OR:
+    case MQL_BINARY_OP_UNLESS:
+        if (lhs.scalar || rhs.scalar) {
+            status = mql_eval_error(ctx, "set operators are only defined between vectors");
+        } else {
+            status = mql_eval_binary_set(ctx, binary, &lhs, &rhs, result);
+        }
+        break;
+    default:
+        if (lhs.scalar && rhs.scalar) {
+            status = mql_range_scalar(result, steps, NAN);
+            if (status != 0) {
+                status = mql_eval_error(ctx, "out of memory");
+                break;
             }
-            if ((lvalue->kind == MQL_VALUE_SCALAR) && (rvalue->kind == MQL_VALUE_SCALAR)) {
-                return mql_eval_binary_scalar_scalar(ctx, node, lvalue, rvalue);
-            } else if ((lvalue->kind == MQL_VALUE_SAMPLES) && (rvalue->kind == MQL_VALUE_SAMPLES)) {
-                return mql_eval_binary_vector_vector(ctx, node, lvalue, rvalue);
-            } else if ((lvalue->kind == MQL_VALUE_SCALAR) && (rvalue->kind == MQL_VALUE_SAMPLES)) {
-                return mql_eval_binary_vector_scalar(ctx, node, lvalue, rvalue);
-            } else if ((lvalue->kind == MQL_VALUE_SAMPLES) && (rvalue->kind == MQL_VALUE_SCALAR)) {
-                return mql_eval_binary_vector_scalar(ctx, node, lvalue, rvalue);
-            } else {
-                return NULL;
+            mql_binary_values(binary->op, true, lhs.ptr[0].values, rhs.ptr[0].values,
+                              lhs.ptr[0].values, result->ptr[0].values, steps);
+        } else if (lhs.scalar || rhs.scalar) {
+            mql_range_t *vector = lhs.scalar ? &rhs : &lhs;
+            const double *scalar = lhs.scalar ? lhs.ptr[0].values : rhs.ptr[0].values;
+            if (!mql_binary_op_is_comparison(binary->op) || bool_mod)
+                mql_range_drop_name(vector);
+            for (size_t j = 0; j < vector->num; j++) {
+                double *values = vector->ptr[j].values;
+                if (lhs.scalar) {
+                    mql_binary_values(binary->op, bool_mod, scalar, values, values, values, steps);
+                } else {
+                    mql_binary_values(binary->op, bool_mod, values, scalar, values, values, steps);
+                }
             }
-            break;
+            *result = *vector;
+            *vector = (mql_range_t){0};
+        } else {
+            status = mql_eval_binary_vector(ctx, binary, &lhs, &rhs, result);
         }
-        case MQL_NODE_UNARY:
-            value = mql_eval_unary(ctx, node);
-            break;
-        case MQL_NODE_CALL:
-            break;
-        case MQL_NODE_SUBQUERY:
+        break;
+    }
 
-            break;
-        case MQL_NODE_VECTOR:
-//          return mql_value_vector(node);
-            break;
-        case MQL_NODE_STRING:
-#if 0
-            return mql_value_string(0, node->string);
-#endif
-            break;
-        case MQL_NODE_NUMBER:
-            return mql_value_scalar(0, node->number);
-            break;
-        case MQL_NODE_MATRIX:
-            break;
+    mql_range_reset(&lhs);
+    mql_range_reset(&rhs);
+    return status;
+}
+
+static int mql_eval_range(mql_eval_ctx_t *ctx, mql_node_t *node, mql_range_t *result)
+{
+    if (node == NULL)
+        return mql_eval_error(ctx, "empty expression");
+
+    size_t steps = mql_eval_steps(ctx);
+
+    switch (node->kind) {
+    case MQL_NODE_AGGREGATE:
+        return mql_eval_aggregate(ctx, &node->aggregate, result);
+    case MQL_NODE_BINARY:
+        return mql_eval_binary(ctx, &node->binary, result);
+    case MQL_NODE_UNARY: {
+        int status = mql_eval_range(ctx, node->unary.expr, result);
+        if ((status != 0) || (node->unary.op == MQL_UNARY_OP_ADD))
+            return status;
+        if (!result->scalar)
+            mql_range_drop_name(result);
+        for (size_t j = 0; j < result->num; j++) {
+            double *values = result->ptr[j].values;
+            for (size_t i = 0; i < steps; i++)
+                values[i] = -values[i];
+        }
+        return 0;
+    }
+    case MQL_NODE_CALL:
+        return mql_eval_call(ctx, &node->call, result);
+    case MQL_NODE_VECTOR:
+        return mql_eval_vector(ctx, &node->vector, result);
+    case MQL_NODE_NUMBER:
+        if (mql_range_scalar(result, steps, node->number) != 0)
+            return mql_eval_error(ctx, "out of memory");
+        return 0;
+    case MQL_NODE_SUBQUERY:
+        return mql_eval_error(ctx, "subqueries are not supported");
+    case MQL_NODE_STRING:
+        return mql_eval_error(ctx, "strings are not supported in range queries");
+    case MQL_NODE_MATRIX:
+        return mql_eval_error(ctx, "a range vector must be the argument of a function");
     }
 
+    return mql_eval_error(ctx, "unknown expression");
+}
+
+mql_value_t *mql_eval(mql_eval_ctx_t *ctx, mql_node_t *node)
+{
+    if ((ctx == NULL) || (node == NULL))
+        return NULL;
+
+    mql_range_t range = {0};
+    if (mql_eval_range(ctx, node, &range) != 0) {
+        mql_range_reset(&range);
+        return NULL;
+    }
+
+    mql_value_t *value = mql_value_series();
+    if (value == NULL) {
+        mql_range_reset(&range);
+        return NULL;
+    }
+
+    size_t steps = mql_eval_steps(ctx);
+
+    if (range.num > 0) {
+        value->series.ptr = calloc(range.num, sizeof(*value->series.ptr));
+        if (value->series.ptr == NULL) {
+            mql_range_reset(&range);
+            mql_value_free(value);
+            return NULL;
+        }
+    }
+
+    for (size_t j = 0; j < range.num; j++) {
+        mql_range_serie_t *rserie = &range.ptr[j];
+
+        size_t num = 0;
+        for (size_t i = 0; i < steps; i++)
+            num += !isnan(rserie->values[i]);
+        if (num == 0)
+            continue;
+
+        mql_serie_t *serie = &value->series.ptr[value->series.size];
+        serie->points.ptr = malloc(sizeof(*serie->points.ptr) * num);
+        if (serie->points.ptr == NULL) {
+            mql_range_reset(&range);
+            mql_value_free(value);
+            return NULL;
+        }
+        value->series.size++;
+
+        for (size_t i = 0; i < steps; i++) {
+            if (isnan(rserie->values[i]))
+                continue;
+            serie->points.ptr[serie->points.size].timestamp = mql_eval_step_time(ctx, i);
+            serie->points.ptr[serie->points.size].value = rserie->values[i];
+            serie->points.size++;
+        }
+
+        serie->metric.name = rserie->name;
+        rserie->name = NULL;
+        serie->metric.labels = rserie->labels;
+        rserie->labels = (label_set_t){0};
+    }
+
+    mql_range_reset(&range);
+
     return value;
 }
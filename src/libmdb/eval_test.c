@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/time.h"
+#include "libmdb/mdb.h"
+
+#include <math.h>
+
+#define BASE 1000000
+
+static mdb_t *mdb;
+
+static void insert(const char *metric, const char *host, const char *dc, const char *sensor,
+                   int t, mdb_value_t value)
+{
+    label_set_t labels = {0};
+    label_set_add(&labels, true, "host", host);
+    if (dc != NULL)
+        label_set_add(&labels, true, "dc", dc);
+    if (sensor != NULL)
+        label_set_add(&labels, true, "sensor", sensor);
+    mdb_insert_metric(mdb, metric, &labels, TIME_T_TO_CDTIME_T(BASE + t),
+                      TIME_T_TO_CDTIME_T(10), value);
+    label_set_reset(&labels);
+}
+
+/* Every 10 seconds from 0 to 600:
+ *   req_total{host="a"} grows 1 per second.
+ *   req_total{host="b"} grows 2 per second and resets to zero at 300.
+ *   req_total{host="c"} starts at 500 with 5 and grows 1 per second.
+ *   temp{host="a",sensor="1"} is 10 and temp{host="b",sensor="1"} is 20.
+ *   limit{host="a"} and limit{host="b"} are 40. */
+static int seed(void)
+{
+    mdb = mdb_alloc();
+    if (mdb == NULL)
+        return -1;
+    mdb_init(mdb);
+
+    for (int t = 0; t <= 600; t += 10) {
+        insert("req_total", "a", "x", NULL, t, MDB_VALUE_COUNTER_FLOAT64(t));
+        insert("req_total", "b", "x", NULL, t, MDB_VALUE_COUNTER_FLOAT64(t < 300 ? 2 * t : 2 * (t - 300)));
+        if (t >= 500)
+            insert("req_total", "c", "y", NULL, t, MDB_VALUE_COUNTER_FLOAT64(5 + (t - 500)));
+        insert("temp", "a", "x", "1", t, MDB_VALUE_GAUGE_FLOAT64(10));
+        insert("temp", "b", "x", "1", t, MDB_VALUE_GAUGE_FLOAT64(20));
+        insert("limit", "a", "x", NULL, t, MDB_VALUE_GAUGE_FLOAT64(40));
+        insert("limit", "b", "x", NULL, t, MDB_VALUE_GAUGE_FLOAT64(40));
+    }
+
+    return 0;
+}
+
+static mdb_series_t *find_series(mdb_series_list_t *list, const char *host)
+{
+    for (size_t i = 0; i < list->num; i++) {
+        label_pair_t *pair = label_set_read(list->ptr[i].labels, "host");
+        if ((pair != NULL) && (strcmp(pair->value, host) == 0))
+            return &list->ptr[i];
+    }
+    return NULL;
+}
+
+static double query_value(const char *query, int t, const char *host)
+{
+    mdb_series_list_t *list = mdb_query(mdb, query, TIME_T_TO_CDTIME_T(BASE + t));
+    if (list == NULL)
+        return -1;
+
+    double value = NAN;
+    mdb_series_t *series = find_series(list, host);
+    if ((series != NULL) && (series->num == 1))
+        value = series->points[0].value;
+
+    mdb_series_list_free(list);
+    return value;
+}
+
+DEF_TEST(rate)
+{
+    struct {
+        char *query;
+        int t;
+        char *host;
+        double want;
+    } cases[] = {
+        /* Six samples over 50s, the start is extrapolated by the 10s to the window. */
+        { "rate(req_total[1m])",     400, "a", 1.0     },
+        { "increase(req_total[1m])", 400, "a", 60.0    },
+        { "rate(req_total[1m])",     400, "b", 2.0     },
+        /* The reset at 300 adds the 580 before it: 60 - 560 + 580 = 80 in 50s,
+         * extrapolated to the 60s of the window. */
+        { "increase(req_total[1m])", 330, "b", 96.0    },
+        { "rate(req_total[1m])",     330, "b", 1.6     },
+        /* The series starts inside the window, it is extrapolated only to the
+         * 5s where the counter would be zero: 30 * 35 / 30. */
+        { "increase(req_total[1m])", 530, "c", 35.0    },
+        { "rate(req_total[1m])",     530, "c", 35.0/60 },
+        { "delta(temp[1m])",         400, "a", 0.0     },
+    };
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++) {
+        printf("# %s at %d\n", cases[i].query, cases[i].t);
+        EXPECT_EQ_DOUBLE(cases[i].want, query_value(cases[i].query, cases[i].t, cases[i].host));
+    }
+
+    return 0;
+}
+
+DEF_TEST(matching)
+{
+    mdb_series_list_t *list = mdb_query(mdb, "temp / on(host) limit", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(2, list->num);
+    mdb_series_t *series = find_series(list, "a");
+    CHECK_NOT_NULL(series);
+    EXPECT_EQ_PTR(NULL, series->name);
+    /* With on the result only keeps the matching labels. */
+    EXPECT_EQ_INT(1, series->labels.num);
+    EXPECT_EQ_DOUBLE(0.25, series->points[0].value);
+    series = find_series(list, "b");
+    CHECK_NOT_NULL(series);
+    EXPECT_EQ_DOUBLE(0.5, series->points[0].value);
+    mdb_series_list_free(list);
+
+    list = mdb_query(mdb, "temp - ignoring(sensor) limit", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(2, list->num);
+    series = find_series(list, "b");
+    CHECK_NOT_NULL(series);
+    /* With ignoring the result drops the ignored labels. */
+    EXPECT_EQ_INT(2, series->labels.num);
+    OK(label_set_read(series->labels, "sensor") == NULL);
+    EXPECT_EQ_DOUBLE(-20, series->points[0].value);
+    mdb_series_list_free(list);
+
+    /* Without a modifier the sensor label is part of the key, nothing matches. */
+    list = mdb_query(mdb, "temp - limit", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(0, list->num);
+    mdb_series_list_free(list);
+
+    return 0;
+}
+
+DEF_TEST(comparison)
+{
+    mdb_series_list_t *list = mdb_query(mdb, "temp > 15", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    /* The filtered series keeps its name and value. */
+    EXPECT_EQ_INT(1, list->num);
+    EXPECT_EQ_STR("temp", list->ptr[0].name);
+    EXPECT_EQ_DOUBLE(20, list->ptr[0].points[0].value);
+    OK(find_series(list, "b") != NULL);
+    mdb_series_list_free(list);
+
+    list = mdb_query(mdb, "temp > bool 15", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(2, list->num);
+    mdb_series_t *series = find_series(list, "a");
+    CHECK_NOT_NULL(series);
+    EXPECT_EQ_PTR(NULL, series->name);
+    EXPECT_EQ_DOUBLE(0, series->points[0].value);
+    series = find_series(list, "b");
+    CHECK_NOT_NULL(series);
+    EXPECT_EQ_DOUBLE(1, series->points[0].value);
+    mdb_series_list_free(list);
+
+    list = mdb_query(mdb, "limit < bool on(host) temp", TIME_T_TO_CDTIME_T(BASE + 400));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(2, list->num);
+    EXPECT_EQ_DOUBLE(0, list->ptr[0].points[0].value);
+    EXPECT_EQ_DOUBLE(0, list->ptr[1].points[0].value);
+    mdb_series_list_free(list);
+
+    return 0;
+}
+
+DEF_TEST(many_to_many)
+{
+    /* Both temp series have dc="x", as both limit series. */
+    EXPECT_EQ_PTR(NULL, mdb_query(mdb, "temp / on(dc) limit", TIME_T_TO_CDTIME_T(BASE + 400)));
+    /* Duplicates only on the right hand side. */
+    EXPECT_EQ_PTR(NULL, mdb_query(mdb, "req_total{host=\"a\"} / on(dc) limit",
+                                  TIME_T_TO_CDTIME_T(BASE + 550)));
+    /* Duplicates that do not match anything are not an error. */
+    mdb_series_list_t *list = mdb_query(mdb, "req_total{host=\"c\"} / on(dc) temp",
+                                        TIME_T_TO_CDTIME_T(BASE + 550));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(0, list->num);
+    mdb_series_list_free(list);
+
+    return 0;
+}
+
+DEF_TEST(range)
+{
+    mdb_series_list_t *list = mdb_query_range(mdb, "rate(req_total{host=\"a\"}[1m])",
+                                              TIME_T_TO_CDTIME_T(BASE + 100),
+                                              TIME_T_TO_CDTIME_T(BASE + 200),
+                                              TIME_T_TO_CDTIME_T(20));
+    CHECK_NOT_NULL(list);
+    EXPECT_EQ_INT(1, list->num);
+    EXPECT_EQ_INT(6, list->ptr[0].num);
+    for (size_t i = 0; i < list->ptr[0].num; i++) {
+        EXPECT_EQ_UINT64((uint64_t)(BASE + 100 + 20 * i) * 1000, list->ptr[0].points[i].timestamp);
+        EXPECT_EQ_DOUBLE(1.0, list->ptr[0].points[i].value);
+    }
+    mdb_series_list_free(list);
+
+    /* The number of steps is capped. */
+    list = mdb_query_range(mdb, "temp", TIME_T_TO_CDTIME_T(BASE),
+                           TIME_T_TO_CDTIME_T(BASE + MDB_QUERY_RANGE_MAX_STEPS),
+                           TIME_T_TO_CDTIME_T(1));
+    CHECK_NOT_NULL(list);
+    mdb_series_list_free(list);
+
+    EXPECT_EQ_PTR(NULL, mdb_query_range(mdb, "temp", TIME_T_TO_CDTIME_T(BASE),
+                                        TIME_T_TO_CDTIME_T(BASE + MDB_QUERY_RANGE_MAX_STEPS + 1),
+                                        TIME_T_TO_CDTIME_T(1)));
+    EXPECT_EQ_PTR(NULL, mdb_query_range(mdb, "temp", 0, TIME_T_TO_CDTIME_T(BASE),
+                                        MS_TO_CDTIME_T(1)));
+    /* A step under a millisecond would be evaluated as an instant query. */
+    EXPECT_EQ_PTR(NULL, mdb_query_range(mdb, "temp", TIME_T_TO_CDTIME_T(BASE),
+                                        TIME_T_TO_CDTIME_T(BASE + 1), US_TO_CDTIME_T(100)));
+
+    return 0;
+}
+
+int main(void)
+{
+    if (seed() != 0)
+        return 1;
+
+    RUN_TEST(rate);
+    RUN_TEST(matching);
+    RUN_TEST(comparison);
+    RUN_TEST(many_to_many);
+    RUN_TEST(range);
+
+    mdb_free(mdb);
+
+    END_TEST;
+}
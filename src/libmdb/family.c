@@ -7,6 +7,18 @@
 #include "libmdb/family.h"
 
 #define METRIC_FAMILY_TABLE_SIZE 256
+#define FAMILY_SERIES_TABLE_SIZE 16
+
+static void family_series_free(void *arg, __attribute__((unused)) void *unused)
+{
+    family_series_t *fs = arg;
+    if (fs == NULL)
+        return;
+
+    label_set_reset(&fs->labels);
+    free(fs->series);
+    free(fs);
+}
 
 static void family_free(void *arg, __attribute__((unused)) void *unused)
 {
@@ -18,6 +30,9 @@ static void family_free(void *arg, __attribute__((unused)) void *unused)
     free(fam->help);
     free(fam->unit);
 
+    htable_destroy(&fam->series_table, family_series_free, NULL);
+    pthread_mutex_destroy(&fam->lock);
+
     free(fam);
 }
 
@@ -46,7 +61,7 @@ static int family_insert_cmp(const void *a, const void *b)
     return strcmp(fama->name, famb->name);
 }
 
-int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam)
+int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam, family_t **rfam)
 {
     htable_hash_t hash = htable_hash(mfam->name, HTABLE_HASH_INIT);
     family_t *fam = htable_find(&mdbfam->family_table, hash, mfam->name, family_find_cmp);
@@ -87,6 +102,9 @@ int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam)
         }
         fam->type = mfam->type;
 
+        pthread_mutex_init(&fam->lock, NULL);
+        htable_init(&fam->series_table, FAMILY_SERIES_TABLE_SIZE);
+
         int status = htable_add(&mdbfam->family_table, hash, fam, family_insert_cmp);
         if (status != 0) {
             // ERROR FIXME
@@ -94,6 +112,107 @@ int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam)
         }
     }
 
+    *rfam = fam;
+
+    return 0;
+}
+
+static inline htable_hash_t family_series_hash(uint64_t fingerprint)
+{
+    return (htable_hash_t)(fingerprint ^ (fingerprint >> 32));
+}
+
+typedef struct {
+    uint64_t fingerprint;
+    label_set_t *labels;
+} family_series_key_t;
+
+static int family_series_find_cmp(const void *a, const void *b)
+{
+    const family_series_key_t *key = (const family_series_key_t *)a;
+    const family_series_t *fs = (const family_series_t *)b;
+    if (key->fingerprint != fs->fingerprint)
+        return 1;
+    label_set_t labels = fs->labels;
+    return label_set_cmp(key->labels, &labels);
+}
+
+static int family_series_insert_cmp(const void *a, const void *b)
+{
+    const family_series_t *fsa = (const family_series_t *)a;
+    const family_series_t *fsb = (const family_series_t *)b;
+    if (fsa->fingerprint != fsb->fingerprint)
+        return 1;
+    label_set_t labelsa = fsa->labels;
+    label_set_t labelsb = fsb->labels;
+    return label_set_cmp(&labelsa, &labelsb);
+}
+
+bool family_series_get(family_t *fam, uint64_t fingerprint, label_set_t *labels,
+                       uint64_t layout, struct index_metric_s **series, size_t num)
+{
+    htable_hash_t hash = family_series_hash(fingerprint);
+    family_series_key_t key = {.fingerprint = fingerprint, .labels = labels};
+
+    pthread_mutex_lock(&fam->lock);
+
+    family_series_t *fs = htable_find(&fam->series_table, hash, &key, family_series_find_cmp);
+    bool found = (fs != NULL) && (fs->layout == layout) && (fs->num == num);
+    if (found)
+        memcpy(series, fs->series, sizeof(*series) * num);
+
+    pthread_mutex_unlock(&fam->lock);
+
+    return found;
+}
+
+int family_series_set(family_t *fam, uint64_t fingerprint, label_set_t *labels,
+                      uint64_t layout, struct index_metric_s **series, size_t num)
+{
+    struct index_metric_s **nseries = malloc(sizeof(*nseries) * num);
+    if (nseries == NULL)
+        return -1;
+    memcpy(nseries, series, sizeof(*nseries) * num);
+
+    htable_hash_t hash = family_series_hash(fingerprint);
+    family_series_key_t key = {.fingerprint = fingerprint, .labels = labels};
+
+    pthread_mutex_lock(&fam->lock);
+
+    family_series_t *fs = htable_find(&fam->series_table, hash, &key, family_series_find_cmp);
+    if (fs == NULL) {
+        fs = calloc(1, sizeof(*fs));
+        if (fs == NULL) {
+            pthread_mutex_unlock(&fam->lock);
+            free(nseries);
+            return -1;
+        }
+
+        fs->fingerprint = fingerprint;
+        if (label_set_clone(&fs->labels, *labels) != 0) {
+            pthread_mutex_unlock(&fam->lock);
+            free(fs);
+            free(nseries);
+            return -1;
+        }
+
+        /* The labels are not in the table, a failure means that the table could
+         * not grow and the empty entry is already stored. */
+        int status = htable_add(&fam->series_table, hash, fs, family_series_insert_cmp);
+        if (status != 0) {
+            pthread_mutex_unlock(&fam->lock);
+            free(nseries);
+            return -1;
+        }
+    }
+
+    free(fs->series);
+    fs->series = nseries;
+    fs->num = num;
+    fs->layout = layout;
+
+    pthread_mutex_unlock(&fam->lock);
+
     return 0;
 }
 
@@ -4,11 +4,27 @@
 
 #pragma once
 
+#include <pthread.h>
+
 #include "libutils/htable.h"
 #include "libmetric/metric.h"
 #include "libmdb/rindex.h"
 #include "libmdb/family_metric_list.h"
 
+struct index_metric_s;
+
+/* Index entries of all the series a metric of the family expands to, keyed on
+ * the fingerprint of the metric labels. The labels are kept to tell apart
+ * metrics with colliding fingerprints. The layout hash covers the family type
+ * and the bucket bounds, quantiles or state names. */
+typedef struct {
+    uint64_t fingerprint;
+    label_set_t labels;
+    uint64_t layout;
+    size_t num;
+    struct index_metric_s **series;
+} family_series_t;
+
 typedef struct {
     char *name;
     char *help;
@@ -17,6 +33,9 @@ typedef struct {
 
     uint32_t metric_name_len;
     rindex_name_t *metric_name;
+
+    pthread_mutex_t lock;
+    htable_t series_table; /* family_series_t */
 } family_t;
 
 typedef struct {
@@ -27,6 +46,12 @@ int family_init(mdb_family_t *mdbfam);
 
 void family_destroy(mdb_family_t *mdbfam);
 
-int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam);
+int family_getsert(mdb_family_t *mdbfam, metric_family_t *mfam, family_t **rfam);
+
+bool family_series_get(family_t *fam, uint64_t fingerprint, label_set_t *labels,
+                       uint64_t layout, struct index_metric_s **series, size_t num);
+
+int family_series_set(family_t *fam, uint64_t fingerprint, label_set_t *labels,
+                      uint64_t layout, struct index_metric_s **series, size_t num);
 
 mdb_family_metric_list_t *family_get_list(mdb_family_t *mdbfam);
@@ -46,23 +46,17 @@ static inline int index_metric_id_resize(index_metric_id_t *set, size_t need)
 
 static inline int index_metric_id_avail(index_metric_id_t *set)
 {
-    return set->alloc ? set->num - set->alloc : 0;
+    return set->alloc ? set->alloc - set->num : 0;
 }
 
-static int index_metric_alloc(index_metric_id_t *set, metric_id_t *id, index_metric_t **mc)
+static int index_metric_id_append(index_metric_id_t *set, index_metric_t *m, metric_id_t *id)
 {
     if (index_metric_id_avail(set) < 1) {
         if (index_metric_id_resize(set, 1) != 0)
             return ENOMEM;
     }
 
-    index_metric_t *m = calloc(1, sizeof(*m));
-    if (m == NULL) {
-        return ENOMEM;
-    }
-
     set->ptr[set->num] = m;
-    *mc = m;
     *id = set->num;
     set->num++;
 
@@ -117,7 +111,7 @@ static int index_insert_cmp(const void *a, const void *b)
     index_label_serialize(&bufa, &mcma->label);
 
     strbuf_putstr(&bufb, mcmb->name);
-    index_label_serialize(&bufa, &mcmb->label);
+    index_label_serialize(&bufb, &mcmb->label);
 
     return strcmp(bufa.ptr, bufb.ptr);
 }
@@ -136,6 +130,11 @@ static int index_find_cmp(const void *a, const void *b)
     return strcmp(metric, buf.ptr);
 }
 
+static inline index_shard_t *index_get_shard(mdb_index_t *index, htable_hash_t hash)
+{
+    return &index->shard[hash >> (sizeof(hash) * 8 - INDEX_SHARD_BITS)];
+}
+
 index_metric_t *index_find(mdb_index_t *index, const char *metric, const label_set_t *labels)
 {
     char buffer[4096] = "";
@@ -144,94 +143,157 @@ index_metric_t *index_find(mdb_index_t *index, const char *metric, const label_s
     index_label_serialize(&buf, labels);
 
     htable_hash_t hash = htable_hash(buf.ptr, HTABLE_HASH_INIT); // FIXME
-    index_metric_t *mcm = htable_find(&index->metric_table, hash, buf.ptr, index_find_cmp);
-    if (mcm != NULL)
-        return mcm;
+    index_shard_t *shard = index_get_shard(index, hash);
 
-    return NULL;
+    pthread_rwlock_rdlock(&shard->lock);
+    index_metric_t *mcm = htable_find(&shard->metric_table, hash, buf.ptr, index_find_cmp);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return mcm;
 }
 
-index_metric_t *index_insert(mdb_index_t *index, const char *metric, const label_set_t *labels)
+index_metric_t *index_insert(mdb_index_t *index, storage_t *storage, cdtime_t interval,
+                             const char *metric, const label_set_t *labels, bool *inserted)
 {
     char buffer[4096] = "";
     strbuf_t buf = STRBUF_CREATE_STATIC(buffer);
     strbuf_putstr(&buf, metric);
     index_label_serialize(&buf, labels);
 
+    *inserted = false;
+
     htable_hash_t hash = htable_hash(buf.ptr, HTABLE_HASH_INIT); // FIXME
-    index_metric_t *mcm = htable_find(&index->metric_table, hash, buf.ptr, index_find_cmp);
+    index_shard_t *shard = index_get_shard(index, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    index_metric_t *mcm = htable_find(&shard->metric_table, hash, buf.ptr, index_find_cmp);
     if (mcm != NULL) {
+        pthread_rwlock_unlock(&shard->lock);
         return mcm;
     }
 
-    metric_id_t id = 0;
-    int status = index_metric_alloc(&index->set, &id, &mcm);
-    if (status != 0) {
+    /* The series is fully built before it gets an id, so index_get_series never
+     * sees a half initialized entry. */
+    mcm = calloc(1, sizeof(*mcm));
+    if (mcm == NULL) {
+        pthread_rwlock_unlock(&shard->lock);
         return NULL;
     }
 
-    // set metric data
     mcm->name = strdup(metric);
-    if (mcm->name == NULL)
+    if (mcm->name == NULL) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(mcm);
         return NULL;
-    label_set_clone(&mcm->label, *labels);
-    mcm->id = id;
+    }
 
-    // FIXME mc->interval
+    if (labels != NULL)
+        label_set_clone(&mcm->label, *labels);
 
-    status = htable_add(&index->metric_table, hash, mcm, index_insert_cmp);
+    storage_id_init(storage, &mcm->sid, interval);
+
+    pthread_mutex_lock(&index->lock_set);
+    int status = index_metric_id_append(&index->set, mcm, &mcm->id);
+    pthread_mutex_unlock(&index->lock_set);
     if (status != 0) {
-        // ERROR FIXME
+        pthread_rwlock_unlock(&shard->lock);
+        index_metric_free(mcm, storage);
         return NULL;
     }
 
+    status = htable_add(&shard->metric_table, hash, mcm, index_insert_cmp);
+    if (status != 0) {
+        pthread_mutex_lock(&index->lock_set);
+        index->set.ptr[mcm->id] = NULL;
+        pthread_mutex_unlock(&index->lock_set);
+        pthread_rwlock_unlock(&shard->lock);
+        index_metric_free(mcm, storage);
+        return NULL;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    *inserted = true;
     return mcm;
 }
 
 int index_init(mdb_index_t *index)
 {
-    htable_init(&index->metric_table, HTABLE_METRIC_SIZE);
+    pthread_mutex_init(&index->lock_set, NULL);
+
+    for (size_t i = 0; i < INDEX_SHARDS; i++) {
+        pthread_rwlock_init(&index->shard[i].lock, NULL);
+        htable_init(&index->shard[i].metric_table, HTABLE_METRIC_SIZE);
+    }
+
     return 0;
 }
 
 int index_destroy(mdb_index_t *index, storage_t *storage)
 {
-    htable_destroy(&index->metric_table, index_metric_free, storage);
+    for (size_t i = 0; i < INDEX_SHARDS; i++) {
+        pthread_rwlock_wrlock(&index->shard[i].lock);
+        htable_destroy(&index->shard[i].metric_table, index_metric_free, storage);
+        pthread_rwlock_unlock(&index->shard[i].lock);
+        pthread_rwlock_destroy(&index->shard[i].lock);
+    }
+
+    pthread_mutex_lock(&index->lock_set);
     index_metric_id_reset(&index->set);
+    pthread_mutex_unlock(&index->lock_set);
+    pthread_mutex_destroy(&index->lock_set);
+
     return 0;
 }
 
+index_metric_t *index_get(mdb_index_t *index, metric_id_t id)
+{
+    index_metric_t *m = NULL;
+
+    pthread_mutex_lock(&index->lock_set);
+    if (id < index->set.num)
+        m = index->set.ptr[id];
+    pthread_mutex_unlock(&index->lock_set);
+
+    return m;
+}
+
 mdb_series_list_t *index_get_series(mdb_index_t *index)
 {
     mdb_series_list_t *sl = calloc(1, sizeof(*sl));
     if (sl == NULL)
         return NULL;
 
-    sl->num = index->set.num;
-    sl->ptr = NULL;
+    pthread_mutex_lock(&index->lock_set);
 
-    if (sl->num == 0)
+    if (index->set.num == 0) {
+        pthread_mutex_unlock(&index->lock_set);
         return sl;
+    }
 
     mdb_series_t *s = calloc(index->set.num, sizeof(*s));
     if (s == NULL) {
+        pthread_mutex_unlock(&index->lock_set);
         free(sl);
         return NULL;
     }
 
     sl->ptr = s;
 
-    for (size_t i =0, n=0; i < index->set.alloc; i++) {
+    size_t n = 0;
+    for (size_t i = 0; i < index->set.num; i++) {
         index_metric_t *m = index->set.ptr[i];
         if (m != NULL) {
             s[n].name = (m->name != NULL) ? strdup(m->name) : NULL;
             label_set_clone(&s[n].labels, m->label);
-
             n++;
-            if (n == index->set.num)
-                break;
         }
     }
 
+    pthread_mutex_unlock(&index->lock_set);
+
+    sl->num = n;
+
     return sl;
 }
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "libmetric/metric.h"
 #include "libmetric/metric_match.h"
 #include "libutils/htable.h"
@@ -11,11 +14,14 @@
 #include "libmdb/series_list.h"
 #include "libmdb/storage.h"
 
-typedef struct {
+typedef struct index_metric_s {
     metric_id_t id;
     char *name;
     label_set_t label;
     storage_id_t sid;
+    /* Set once the series is in the rindex, a failed insert is retried the
+     * next time the series is seen. */
+    atomic_bool rindexed;
 } index_metric_t;
 
 typedef struct {
@@ -24,15 +30,29 @@ typedef struct {
     index_metric_t **ptr;
 } index_metric_id_t;
 
+#define INDEX_SHARD_BITS 6
+#define INDEX_SHARDS     (1 << INDEX_SHARD_BITS)
+
+/* The series are spread over the shards by the hash of the metric name and labels,
+ * lookups only take the read lock of one shard. */
 typedef struct {
-    index_metric_id_t set;
+    pthread_rwlock_t lock;
     htable_t metric_table; /* index_metric_t */
+} index_shard_t;
+
+typedef struct {
+    pthread_mutex_t lock_set;
+    index_metric_id_t set;
+    index_shard_t shard[INDEX_SHARDS];
 } mdb_index_t;
 
 
+index_metric_t *index_get(mdb_index_t *index, metric_id_t id);
+
 index_metric_t *index_find(mdb_index_t *index, const char *metric, const label_set_t *labels);
 
-index_metric_t *index_insert(mdb_index_t *index, const char *metric, const label_set_t *labels);
+index_metric_t *index_insert(mdb_index_t *index, storage_t *storage, cdtime_t interval,
+                             const char *metric, const label_set_t *labels, bool *inserted);
 
 int index_init(mdb_index_t *index);
 
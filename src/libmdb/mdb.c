@@ -3,6 +3,7 @@
 // SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
 
 #include "ncollectd.h"
+#include "log.h"
 
 #include <pthread.h>
 
@@ -13,17 +14,27 @@
 #include "libmdb/rindex.h"
 #include "libmdb/family.h"
 #include "libmdb/storage.h"
+#include "libmdb/midx_disk.h"
 #include "libmdb/mdb.h"
+#include "libmdb/mql.h"
+
+/* Samples of the same series can be dispatched from several threads,
+ * the appends are serialized with a lock picked by the metric id. */
+#define MDB_SERIES_LOCKS 64
 
 struct mdb_s {
+    char *path;
+    cdtime_t retention;
     pthread_mutex_t lock_family;
     mdb_family_t family;
-    pthread_mutex_t lock_rindex;
     rindex_t rindex;
-    pthread_mutex_t lock_index;
     mdb_index_t index;
     pthread_mutex_t lock_storage;
     storage_t storage;
+    pthread_mutex_t lock_series[MDB_SERIES_LOCKS];
+    /* Series loaded from disk by the id in the snapshot, until the data is loaded. */
+    size_t load_num;
+    index_metric_t **load;
 };
 
 int mdb_config(mdb_t *mdb, mdb_config_t *config)
@@ -34,6 +45,17 @@ int mdb_config(mdb_t *mdb, mdb_config_t *config)
     if (config == NULL)
         return -1;
 
+    if (config->retention > 0)
+        mdb->retention = config->retention;
+
+    free(mdb->path);
+    mdb->path = NULL;
+    if ((config->path != NULL) && (config->path[0] != '\0')) {
+        mdb->path = strdup(config->path);
+        if (mdb->path == NULL)
+            return -1;
+    }
+
     return 0;
 }
 
@@ -43,10 +65,12 @@ mdb_t *mdb_alloc(void)
     if (mdb == NULL)
         return NULL;
 
+    mdb->retention = MDB_DEFAULT_RETENTION;
+
     pthread_mutex_init(&mdb->lock_family, NULL);
-    pthread_mutex_init(&mdb->lock_rindex, NULL);
-    pthread_mutex_init(&mdb->lock_index, NULL);
     pthread_mutex_init(&mdb->lock_storage, NULL);
+    for (size_t i = 0; i < MDB_SERIES_LOCKS; i++)
+        pthread_mutex_init(&mdb->lock_series[i], NULL);
 
     return mdb;
 }
@@ -59,7 +83,58 @@ int mdb_init(mdb_t *mdb)
     family_init(&mdb->family);
     rindex_init(&mdb->rindex);
     index_init(&mdb->index);
-    storage_init(&mdb->storage);
+    storage_init(&mdb->storage, mdb->retention);
+
+    return 0;
+}
+
+/* Add the series to the rindex unless it is already there. The rindex insert
+ * is idempotent, so concurrent callers can both insert the same series. */
+static int mdb_series_rindex(mdb_t *mdb, index_metric_t *idx,
+                             const char *metric, const label_set_t *labels)
+{
+    if (atomic_load_explicit(&idx->rindexed, memory_order_acquire))
+        return 0;
+
+    int status = rindex_insert(&mdb->rindex, idx->id, metric, labels);
+    if (status != 0)
+        return -1;
+
+    atomic_store_explicit(&idx->rindexed, true, memory_order_release);
+    return 0;
+}
+
+static int mdb_load_index_metric(uint64_t id, const char *metric, const label_set_t *labels,
+                                 void *arg)
+{
+    mdb_t *mdb = arg;
+
+    if (id > UINT32_MAX)
+        return -1;
+
+    if (id >= mdb->load_num) {
+        size_t num = mdb->load_num == 0 ? 1024 : mdb->load_num;
+        while (num <= id)
+            num *= 2;
+        index_metric_t **tmp = realloc(mdb->load, sizeof(*tmp) * num);
+        if (tmp == NULL) {
+            ERROR("realloc failed.");
+            return 1;
+        }
+        memset(tmp + mdb->load_num, 0, sizeof(*tmp) * (num - mdb->load_num));
+        mdb->load = tmp;
+        mdb->load_num = num;
+    }
+
+    bool inserted = false;
+    index_metric_t *idx = index_insert(&mdb->index, &mdb->storage, 0, metric, labels, &inserted);
+    if (idx == NULL)
+        return 1;
+
+    if (mdb_series_rindex(mdb, idx, metric, labels) != 0)
+        return 1;
+
+    mdb->load[id] = idx;
 
     return 0;
 }
@@ -68,21 +143,107 @@ int mdb_load_index(mdb_t *mdb)
 {
     if (mdb == NULL)
         return -1;
-    return 0;
+
+    if (mdb->path == NULL)
+        return 0;
+
+    return midx_disk_load_index(mdb->path, mdb_load_index_metric, mdb);
+}
+
+static int mdb_load_data_chunk(uint64_t id, cdtime_t interval, const storage_chunk_t *chunk,
+                               void *arg)
+{
+    mdb_t *mdb = arg;
+
+    if ((id >= mdb->load_num) || (mdb->load[id] == NULL))
+        return -1;
+
+    index_metric_t *idx = mdb->load[id];
+
+    pthread_mutex_t *lock = &mdb->lock_series[idx->id % MDB_SERIES_LOCKS];
+    pthread_mutex_lock(lock);
+    int status = storage_restore_chunk(&mdb->storage, &idx->sid, interval, chunk);
+    pthread_mutex_unlock(lock);
+
+    return status;
 }
 
 int mdb_load_data(mdb_t *mdb)
 {
     if (mdb == NULL)
         return -1;
-    return 0;
+
+    int status = 0;
+    if ((mdb->path != NULL) && (mdb->load != NULL))
+        status = midx_disk_load_chunks(mdb->path, mdb_load_data_chunk, mdb);
+
+    free(mdb->load);
+    mdb->load = NULL;
+    mdb->load_num = 0;
+
+    return status;
 }
 
-int mdb_replay_journal(mdb_t *mdb)
+int mdb_sync(mdb_t *mdb)
 {
     if (mdb == NULL)
         return -1;
-    return 0;
+
+    if (mdb->path == NULL)
+        return 0;
+
+    midx_disk_t midx = {0};
+    int status = midx_disk_create(&midx, mdb->path);
+    if (status != 0)
+        return -1;
+
+    pthread_mutex_lock(&mdb->index.lock_set);
+    metric_id_t num = mdb->index.set.num;
+    pthread_mutex_unlock(&mdb->index.lock_set);
+
+    size_t skipped = 0;
+    for (metric_id_t id = 0; id < num; id++) {
+        index_metric_t *idx = index_get(&mdb->index, id);
+        if (idx == NULL)
+            continue;
+
+        status = midx_disk_append_metric(&midx, idx->id, idx->name, &idx->label);
+        if (status == EINVAL) {
+            skipped++;
+            status = 0;
+            continue;
+        }
+        if (status != 0)
+            break;
+
+        pthread_mutex_t *lock = &mdb->lock_series[idx->id % MDB_SERIES_LOCKS];
+        pthread_mutex_lock(lock);
+        storage_chunk_entry_t *entry = idx->sid.chunk;
+        if (entry != NULL) {
+            for (storage_chunk_t *chunk = entry->head; chunk != NULL; chunk = chunk->next) {
+                if (chunk->num == 0)
+                    continue;
+                status = midx_disk_append_chunk(&midx, idx->id, entry->interval, chunk);
+                if (status != 0)
+                    break;
+            }
+        }
+        pthread_mutex_unlock(lock);
+
+        if (status != 0)
+            break;
+    }
+
+    if (status != 0) {
+        ERROR("Failed to write the mdb snapshot in '%s'.", mdb->path);
+        midx_disk_abort(&midx);
+        return -1;
+    }
+
+    if (skipped > 0)
+        WARNING("Skipped %zu series too large for the mdb snapshot.", skipped);
+
+    return midx_disk_commit(&midx);
 }
 
 int mdb_shutdown(mdb_t *mdb)
@@ -91,8 +252,6 @@ int mdb_shutdown(mdb_t *mdb)
         return -1;
 
 //    pthread_mutex_lock(&mdb->lock_family);
-//    pthread_mutex_lock(&mdb->lock_rindex);
-//    pthread_mutex_lock(&mdb->lock_index);
 
     return 0;
 }
@@ -104,21 +263,20 @@ void mdb_free(mdb_t *mdb)
     pthread_mutex_unlock(&mdb->lock_family);
     pthread_mutex_destroy(&mdb->lock_family);
 
-    pthread_mutex_lock(&mdb->lock_rindex);
     rindex_destroy(&mdb->rindex);
-    pthread_mutex_unlock(&mdb->lock_rindex);
-    pthread_mutex_destroy(&mdb->lock_rindex);
 
-    pthread_mutex_lock(&mdb->lock_index);
     index_destroy(&mdb->index, &mdb->storage);
-    pthread_mutex_unlock(&mdb->lock_index);
-    pthread_mutex_destroy(&mdb->lock_index);
 
     pthread_mutex_lock(&mdb->lock_storage);
     storage_destroy(&mdb->storage);
     pthread_mutex_unlock(&mdb->lock_storage);
     pthread_mutex_destroy(&mdb->lock_storage);
 
+    for (size_t i = 0; i < MDB_SERIES_LOCKS; i++)
+        pthread_mutex_destroy(&mdb->lock_series[i]);
+
+    free(mdb->load);
+    free(mdb->path);
     free(mdb);
 }
 
@@ -167,62 +325,128 @@ int mdb_insert_metric_id(mdb_t *mdb, __attribute__((unused)) metric_id_t id,
     return 0;
 }
 
-int mdb_insert_metric(mdb_t *mdb, const char *metric, const label_set_t *labels,
-                                  cdtime_t time, cdtime_t interval, mdb_value_t value)
+/* Series of a metric that are resolved without the cache, larger metrics
+ * (histograms with many buckets) use a heap array. */
+#define MDB_SERIES_STACK 32
+
+#define MDB_HASH64_INIT ((uint64_t)0xcbf29ce484222325)
+
+static inline uint64_t mdb_hash64(uint64_t hash, const void *data, size_t len)
 {
-    if (mdb == NULL)
-        return -1;
+    const unsigned char *udata = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint64_t)udata[i];
+        hash *= (uint64_t)0x100000001b3;
+    }
+    return hash;
+}
+
+static uint64_t mdb_label_fingerprint(const label_set_t *labels)
+{
+    uint64_t hash = MDB_HASH64_INIT;
 
-    storage_id_t *sid = NULL;
+    for (size_t i = 0; i < labels->num; i++) {
+        label_pair_t *pair = &labels->ptr[i];
+        hash = mdb_hash64(hash, pair->name, strlen(pair->name) + 1);
+        hash = mdb_hash64(hash, pair->value, strlen(pair->value) + 1);
+    }
 
-    pthread_mutex_lock(&mdb->lock_index);
-    index_metric_t *idx = index_find(&mdb->index, metric, labels);
-    if (idx == NULL) {
-        idx = index_insert(&mdb->index, metric, labels);
-        if (idx == NULL) {
-            pthread_mutex_unlock(&mdb->lock_index);
-            return -1;
+    return hash;
+}
+
+static uint64_t mdb_metric_layout(metric_family_t *fam, metric_t *m, size_t *num)
+{
+    uint64_t hash = mdb_hash64(MDB_HASH64_INIT, &fam->type, sizeof(fam->type));
+
+    switch(fam->type) {
+    case METRIC_TYPE_STATE_SET:
+        for (size_t j = 0; j < m->value.state_set.num; j++) {
+            const char *name = m->value.state_set.ptr[j].name;
+            hash = mdb_hash64(hash, name, strlen(name) + 1);
         }
+        *num = m->value.state_set.num;
+        break;
+    case METRIC_TYPE_SUMMARY: {
+        summary_t *s = m->value.summary;
+        for (size_t j = 0; j < s->num; j++)
+            hash = mdb_hash64(hash, &s->quantiles[j].quantile, sizeof(s->quantiles[j].quantile));
+        *num = s->num + 2;
+    }   break;
+    case METRIC_TYPE_HISTOGRAM:
+    case METRIC_TYPE_GAUGE_HISTOGRAM: {
+        histogram_t *h = m->value.histogram;
+        for (size_t j = 0; j < h->num; j++)
+            hash = mdb_hash64(hash, &h->buckets[j].maximum, sizeof(h->buckets[j].maximum));
+        *num = h->num + 2;
+    }   break;
+    default:
+        *num = 1;
+        break;
+    }
 
-        // FIXME
-        storage_id_init(&mdb->storage, &idx->sid, interval);
+    return hash;
+}
 
-        sid = &idx->sid;
+static void mdb_series_append(mdb_t *mdb, index_metric_t *idx,
+                              cdtime_t time, cdtime_t interval, mdb_value_t value)
+{
+    pthread_mutex_t *lock = &mdb->lock_series[idx->id % MDB_SERIES_LOCKS];
+    pthread_mutex_lock(lock);
+    storage_insert(&mdb->storage, &idx->sid, time, interval, value);
+    pthread_mutex_unlock(lock);
+}
 
-        pthread_mutex_lock(&mdb->lock_rindex);
-        int status = rindex_insert(&mdb->rindex, idx->id, metric, labels);
-        if (status != 0) {
-            pthread_mutex_unlock(&mdb->lock_index);
-            pthread_mutex_unlock(&mdb->lock_rindex);
+static int mdb_insert_series(mdb_t *mdb, const char *metric, const label_set_t *labels,
+                             cdtime_t time, cdtime_t interval, mdb_value_t value,
+                             index_metric_t **series)
+{
+    index_metric_t *idx = index_find(&mdb->index, metric, labels);
+    if (idx == NULL) {
+        bool inserted = false;
+        idx = index_insert(&mdb->index, &mdb->storage, interval, metric, labels, &inserted);
+        if (idx == NULL)
             return -1;
-        }
-        pthread_mutex_unlock(&mdb->lock_rindex);
-    } else {
-        sid = &idx->sid;
     }
-    pthread_mutex_unlock(&mdb->lock_index);
 
-    if (sid == NULL)
-        return 0;
+    if (mdb_series_rindex(mdb, idx, metric, labels) != 0)
+        return -1;
 
-    storage_insert(&mdb->storage, sid, time, interval, value);
+    mdb_series_append(mdb, idx, time, interval, value);
+
+    *series = idx;
 
     return 0;
 }
 
+int mdb_insert_metric(mdb_t *mdb, const char *metric, const label_set_t *labels,
+                                  cdtime_t time, cdtime_t interval, mdb_value_t value)
+{
+    if (mdb == NULL)
+        return -1;
+
+    index_metric_t *series = NULL;
+    return mdb_insert_series(mdb, metric, labels, time, interval, value, &series);
+}
+
 static int mdb_insert_metric_internal(mdb_t *mdb, const char *metric, const char *metric_suffix,
                                       const label_set_t *labels1, const label_set_t *labels2,
-                                      cdtime_t time, cdtime_t interval, mdb_value_t value)
+                                      cdtime_t time, cdtime_t interval, mdb_value_t value,
+                                      index_metric_t **series)
 {
+    if (*series != NULL) {
+        mdb_series_append(mdb, *series, time, interval, value);
+        return 0;
+    }
+
     size_t lsize = 0;
     lsize = (labels1 != NULL ? labels1->num : 0) + (labels2 != NULL ? labels2->num : 0);
 
     if (metric_suffix == NULL) {
         if (labels2 == NULL)
-            return mdb_insert_metric(mdb, metric, labels1, time, interval, value);
+            return mdb_insert_series(mdb, metric, labels1, time, interval, value, series);
 
         if (lsize == 0)
-            return mdb_insert_metric(mdb, metric, NULL, time, interval, value);
+            return mdb_insert_series(mdb, metric, NULL, time, interval, value, series);
 
         label_pair_t pairs[lsize];
         label_set_t labels = {.num = lsize, .ptr = pairs};
@@ -247,7 +471,7 @@ static int mdb_insert_metric_internal(mdb_t *mdb, const char *metric, const char
             label_set_qsort(&labels);
         }
 
-        return mdb_insert_metric(mdb, metric, &labels, time, interval, value);
+        return mdb_insert_series(mdb, metric, &labels, time, interval, value, series);
     }
 
     char buffer[4096] = "";
@@ -262,10 +486,10 @@ static int mdb_insert_metric_internal(mdb_t *mdb, const char *metric, const char
     }
 
     if (labels2 == NULL)
-        return mdb_insert_metric(mdb, buf.ptr, labels1, time, interval, value);
+        return mdb_insert_series(mdb, buf.ptr, labels1, time, interval, value, series);
 
     if (lsize == 0)
-        return mdb_insert_metric(mdb, buf.ptr, NULL, time, interval, value);
+        return mdb_insert_series(mdb, buf.ptr, NULL, time, interval, value, series);
 
     label_pair_t pairs[lsize];
     label_set_t labels = {.num = lsize, .ptr = pairs};
@@ -290,7 +514,119 @@ static int mdb_insert_metric_internal(mdb_t *mdb, const char *metric, const char
         label_set_qsort(&labels);
     }
 
-    return mdb_insert_metric(mdb, buf.ptr, &labels, time, interval, value);
+    return mdb_insert_series(mdb, buf.ptr, &labels, time, interval, value, series);
+}
+
+static int mdb_insert_metric_series(mdb_t *mdb, metric_family_t *fam, metric_t *m,
+                                    index_metric_t **series)
+{
+    int status = 0;
+
+    switch(fam->type) {
+    case METRIC_TYPE_UNKNOWN: {
+        mdb_value_t value = {0};
+        if (m->value.unknown.type == UNKNOWN_FLOAT64) {
+            value = MDB_VALUE_GAUGE_FLOAT64(m->value.unknown.float64);
+        } else {
+            value = MDB_VALUE_GAUGE_INT64(m->value.unknown.int64);
+        }
+        status |= mdb_insert_metric_internal(mdb, fam->name, NULL, &m->label, NULL,
+                                                  m->time, m->interval, value, &series[0]);
+    }   break;
+    case METRIC_TYPE_GAUGE: {
+        mdb_value_t value;
+        if (m->value.gauge.type == GAUGE_FLOAT64) {
+            value = MDB_VALUE_GAUGE_FLOAT64(m->value.gauge.float64);
+        } else {
+            value = MDB_VALUE_GAUGE_INT64(m->value.gauge.int64);
+        }
+        status |= mdb_insert_metric_internal(mdb, fam->name, NULL, &m->label, NULL,
+                                                  m->time, m->interval, value, &series[0]);
+    }   break;
+    case METRIC_TYPE_COUNTER: {
+        mdb_value_t value = {0};
+        if (m->value.counter.type == COUNTER_UINT64) {
+            value = MDB_VALUE_COUNTER_UINT64(m->value.counter.uint64);
+        } else {
+            value = MDB_VALUE_COUNTER_FLOAT64(m->value.counter.float64);
+        }
+        status |= mdb_insert_metric_internal(mdb, fam->name, "_total", &m->label, NULL,
+                                                  m->time, m->interval, value, &series[0]);
+    }   break;
+    case METRIC_TYPE_STATE_SET:
+        for (size_t j = 0; j < m->value.state_set.num; j++) {
+            label_pair_t label_pair = {.name = fam->name,
+                                       .value = m->value.state_set.ptr[j].name};
+            label_set_t label_set = {.num = 1, .ptr = &label_pair};
+            mdb_value_t value = MDB_VALUE_BOOL(m->value.state_set.ptr[j].enabled ? 1 : 0);
+
+            status |= mdb_insert_metric_internal(mdb, fam->name, NULL,
+                                                      &m->label, &label_set,
+                                                      m->time, m->interval, value, &series[j]);
+        }
+        break;
+    case METRIC_TYPE_INFO:
+        status |= mdb_insert_metric_internal(mdb, fam->name, "_info",
+                                                  &m->label, &m->value.info,
+                                                  m->time, m->interval, MDB_VALUE_INFO,
+                                                  &series[0]);
+        break;
+    case METRIC_TYPE_SUMMARY: {
+        summary_t *s = m->value.summary;
+
+        for (int j = s->num - 1; j >= 0; j--) {
+            char quantile[DTOA_MAX] = "";
+
+            if (series[j] == NULL)
+                dtoa(s->quantiles[j].quantile, quantile, sizeof(quantile));
+
+            label_pair_t label_pair = {.name = "quantile", .value = quantile};
+            label_set_t label_set = {.num = 1, .ptr = &label_pair};
+            status |= mdb_insert_metric_internal(mdb, fam->name, NULL,
+                                                 &m->label, &label_set, m->time, m->interval,
+                                                 MDB_VALUE_GAUGE_FLOAT64(s->quantiles[j].value),
+                                                 &series[j]);
+        }
+
+        status |= mdb_insert_metric_internal(mdb, fam->name, "_count", &m->label, NULL,
+                                             m->time, m->interval,
+                                             MDB_VALUE_GAUGE_INT64(s->count), &series[s->num]);
+        status |= mdb_insert_metric_internal(mdb, fam->name, "_sum", &m->label, NULL,
+                                             m->time, m->interval,
+                                             MDB_VALUE_GAUGE_FLOAT64(s->sum), &series[s->num + 1]);
+    }   break;
+    case METRIC_TYPE_HISTOGRAM:
+    case METRIC_TYPE_GAUGE_HISTOGRAM: {
+        histogram_t *h = m->value.histogram;
+
+        for (int j = h->num - 1; j >= 0; j--) {
+            char le[DTOA_MAX] = "";
+
+            if (series[j] == NULL)
+                dtoa(h->buckets[j].maximum, le, sizeof(le));
+
+            label_pair_t label_pair = {.name = "le", .value = le};
+            label_set_t label_set = {.num = 1, .ptr = &label_pair};
+            status |= mdb_insert_metric_internal(mdb, fam->name, "_bucket",
+                                         &m->label, &label_set, m->time, m->interval,
+                                         MDB_VALUE_GAUGE_INT64(h->buckets[j].counter),
+                                         &series[j]);
+        }
+
+        status |= mdb_insert_metric_internal(mdb, fam->name,
+                                     fam->type == METRIC_TYPE_HISTOGRAM ? "_count" : "_gcount",
+                                     &m->label, NULL, m->time, m->interval,
+                                     MDB_VALUE_GAUGE_INT64(histogram_counter(h)),
+                                     &series[h->num]);
+        status |= mdb_insert_metric_internal(mdb, fam->name,
+                                     fam->type == METRIC_TYPE_HISTOGRAM ?  "_sum" : "_gsum",
+                                     &m->label, NULL, m->time, m->interval,
+                                     MDB_VALUE_GAUGE_FLOAT64(histogram_sum(h)),
+                                     &series[h->num + 1]);
+    }   break;
+    }
+
+    return status;
 }
 
 int mdb_insert_metric_family(mdb_t *mdb, metric_family_t *fam)
@@ -298,112 +634,47 @@ int mdb_insert_metric_family(mdb_t *mdb, metric_family_t *fam)
     if (fam == NULL)
         return EINVAL;
 
+    family_t *family = NULL;
+
     pthread_mutex_lock(&mdb->lock_family);
-    int status = family_getsert(&mdb->family, fam);
+    int status = family_getsert(&mdb->family, fam, &family);
     pthread_mutex_unlock(&mdb->lock_family);
     if (status != 0) {
         // FIXME
+        family = NULL;
     }
 
-
+    /* A read plugin dispatches the same series every interval. The index entries a
+     * metric resolves to are cached in the family keyed on the labels,
+     * so known series are appended to the storage without building and looking up
+     * the series key. Index entries are never freed while the mdb is alive. */
     for (size_t i = 0; i < fam->metric.num; i++) {
         metric_t *m = &fam->metric.ptr[i];
 
-        switch(fam->type) {
-        case METRIC_TYPE_UNKNOWN: {
-            mdb_value_t value = {0};
-            if (m->value.unknown.type == UNKNOWN_FLOAT64) {
-                value = MDB_VALUE_GAUGE_FLOAT64(m->value.unknown.float64);
-            } else {
-                value = MDB_VALUE_GAUGE_INT64(m->value.unknown.int64);
-            }
-            status |= mdb_insert_metric_internal(mdb, fam->name, NULL, &m->label, NULL,
-                                                      m->time, m->interval, value);
-        }   break;
-        case METRIC_TYPE_GAUGE: {
-            mdb_value_t value;
-            if (m->value.gauge.type == GAUGE_FLOAT64) {
-                value = MDB_VALUE_GAUGE_FLOAT64(m->value.gauge.float64);
-            } else {
-                value = MDB_VALUE_GAUGE_INT64(m->value.gauge.int64);
-            }
-            status |= mdb_insert_metric_internal(mdb, fam->name, NULL, &m->label, NULL,
-                                                      m->time, m->interval, value);
-        }   break;
-        case METRIC_TYPE_COUNTER: {
-            mdb_value_t value = {0};
-            if (m->value.counter.type == COUNTER_UINT64) {
-                value = MDB_VALUE_COUNTER_UINT64(m->value.counter.uint64);
-            } else {
-                value = MDB_VALUE_COUNTER_FLOAT64(m->value.counter.float64);
-            }
-            status |= mdb_insert_metric_internal(mdb, fam->name, "_total", &m->label, NULL,
-                                                      m->time, m->interval, value);
-        }   break;
-        case METRIC_TYPE_STATE_SET:
-            for (size_t j = 0; j < m->value.state_set.num; j++) {
-                label_pair_t label_pair = {.name = fam->name,
-                                           .value = m->value.state_set.ptr[j].name};
-                label_set_t label_set = {.num = 1, .ptr = &label_pair};
-                mdb_value_t value = MDB_VALUE_BOOL(m->value.state_set.ptr[j].enabled ? 1 : 0);
-
-                status |= mdb_insert_metric_internal(mdb, fam->name, NULL,
-                                                          &m->label, &label_set,
-                                                          m->time, m->interval, value);
-            }
-            break;
-        case METRIC_TYPE_INFO:
-            status |= mdb_insert_metric_internal(mdb, fam->name, "_info",
-                                                      &m->label, &m->value.info,
-                                                      m->time, m->interval, MDB_VALUE_INFO);
-            break;
-        case METRIC_TYPE_SUMMARY: {
-            summary_t *s = m->value.summary;
-
-            for (int j = s->num - 1; j >= 0; j--) {
-                char quantile[DTOA_MAX];
-
-                dtoa(s->quantiles[j].quantile, quantile, sizeof(quantile));
+        size_t num = 0;
+        uint64_t layout = mdb_metric_layout(fam, m, &num);
+        uint64_t fingerprint = mdb_label_fingerprint(&m->label);
 
-                label_pair_t label_pair = {.name = "quantile", .value = quantile};
-                label_set_t label_set = {.num = 1, .ptr = &label_pair};
-                status |= mdb_insert_metric_internal(mdb, fam->name, NULL,
-                                                     &m->label, &label_set, m->time, m->interval,
-                                                     MDB_VALUE_GAUGE_FLOAT64(s->quantiles[j].value));
-            }
+        index_metric_t *series_stack[MDB_SERIES_STACK];
+        index_metric_t **series = series_stack;
+        if (num > MDB_SERIES_STACK) {
+            series = malloc(sizeof(*series) * num);
+            if (series == NULL)
+                return ENOMEM;
+        }
 
-            status |= mdb_insert_metric_internal(mdb, fam->name, "_count", &m->label, NULL,
-                                                 m->time, m->interval,
-                                                 MDB_VALUE_GAUGE_INT64(s->count));
-            status |= mdb_insert_metric_internal(mdb, fam->name, "_sum", &m->label, NULL,
-                                                 m->time, m->interval,
-                                                 MDB_VALUE_GAUGE_FLOAT64(s->sum));
-        }   break;
-        case METRIC_TYPE_HISTOGRAM:
-        case METRIC_TYPE_GAUGE_HISTOGRAM: {
-            histogram_t *h = m->value.histogram;
-
-            for (int j = h->num - 1; j >= 0; j--) {
-                char le[DTOA_MAX];
-                dtoa(h->buckets[j].maximum, le, sizeof(le));
+        bool cached = false;
+        if (family != NULL)
+            cached = family_series_get(family, fingerprint, &m->label, layout, series, num);
+        if (!cached)
+            memset(series, 0, sizeof(*series) * num);
 
-                label_pair_t label_pair = {.name = "le", .value = le};
-                label_set_t label_set = {.num = 1, .ptr = &label_pair};
-                status |= mdb_insert_metric_internal(mdb, fam->name, "_bucket",
-                                             &m->label, &label_set, m->time, m->interval,
-                                             MDB_VALUE_GAUGE_INT64(h->buckets[j].counter));
-            }
+        status = mdb_insert_metric_series(mdb, fam, m, series);
+        if ((status == 0) && !cached && (family != NULL))
+            family_series_set(family, fingerprint, &m->label, layout, series, num);
 
-            status |= mdb_insert_metric_internal(mdb, fam->name,
-                                         fam->type == METRIC_TYPE_HISTOGRAM ? "_count" : "_gcount",
-                                         &m->label, NULL, m->time, m->interval,
-                                         MDB_VALUE_GAUGE_INT64(histogram_counter(h)));
-            status |= mdb_insert_metric_internal(mdb, fam->name,
-                                         fam->type == METRIC_TYPE_HISTOGRAM ?  "_sum" : "_gsum",
-                                         &m->label, NULL, m->time, m->interval,
-                                         MDB_VALUE_GAUGE_FLOAT64(histogram_sum(h)));
-        }   break;
-        }
+        if (series != series_stack)
+            free(series);
 
         if (status != 0)
             return status;
@@ -445,10 +716,7 @@ strlist_t *mdb_get_metrics(mdb_t *mdb) /* match ¿? */
     if (mdb == NULL)
         return NULL;
 
-    pthread_mutex_lock(&mdb->lock_rindex);
-    strlist_t *sl = rindex_get_metrics(&mdb->rindex);
-    pthread_mutex_unlock(&mdb->lock_rindex);
-    return sl;
+    return rindex_get_metrics(&mdb->rindex);
 }
 
 mdb_series_list_t *mdb_get_series(mdb_t *mdb)
@@ -456,10 +724,7 @@ mdb_series_list_t *mdb_get_series(mdb_t *mdb)
     if (mdb == NULL)
         return NULL;
 
-    pthread_mutex_lock(&mdb->lock_index);
-    mdb_series_list_t *sl = index_get_series(&mdb->index);
-    pthread_mutex_unlock(&mdb->lock_index);
-    return sl;
+    return index_get_series(&mdb->index);
 }
 
 strlist_t *mdb_get_metric_label(mdb_t *mdb, char *metric)
@@ -467,10 +732,7 @@ strlist_t *mdb_get_metric_label(mdb_t *mdb, char *metric)
     if ((mdb == NULL) || (metric == NULL))
         return NULL;
 
-    pthread_mutex_lock(&mdb->lock_rindex);
-    strlist_t *sl = rindex_get_metric_labels(&mdb->rindex, metric);
-    pthread_mutex_unlock(&mdb->lock_rindex);
-    return sl;
+    return rindex_get_metric_labels(&mdb->rindex, metric);
 }
 
 strlist_t *mdb_get_metric_label_value(mdb_t *mdb, char *metric, char *label)
@@ -478,53 +740,243 @@ strlist_t *mdb_get_metric_label_value(mdb_t *mdb, char *metric, char *label)
     if ((mdb == NULL) || (metric == NULL) || (label == NULL))
         return NULL;
 
-    pthread_mutex_lock(&mdb->lock_rindex);
-    strlist_t *sl = rindex_get_metric_label_value(&mdb->rindex, metric, label);
-    pthread_mutex_unlock(&mdb->lock_rindex);
-    return sl;
+    return rindex_get_metric_label_value(&mdb->rindex, metric, label);
 }
 
-mdb_series_list_t * mdb_fetch(mdb_t *mdb, __attribute__((unused)) const metric_match_t *match,
-                                          __attribute__((unused)) cdtime_t time)
+mdb_samples_list_t *mdb_fetch_samples(mdb_t *mdb, const metric_match_t *match,
+                                      cdtime_t start, cdtime_t end)
 {
-    if (mdb == NULL)
+    if ((mdb == NULL) || (match == NULL))
         return NULL;
 
-    return NULL;
-}
+    metric_id_set_t result = {0};
+    int status = rindex_search(&mdb->rindex, &result, match);
+    if (status != 0) {
+        metric_id_set_destroy(&result);
+        return NULL;
+    }
 
-mdb_series_list_t *mdb_fetch_range(mdb_t *mdb, __attribute__((unused)) const metric_match_t *match,
-                                               __attribute__((unused)) cdtime_t start,
-                                               __attribute__((unused)) cdtime_t end,
-                                               __attribute__((unused)) cdtime_t step)
-{
-    if (mdb == NULL)
+    mdb_samples_list_t *list = calloc(1, sizeof(*list));
+    if (list == NULL) {
+        metric_id_set_destroy(&result);
         return NULL;
+    }
+
+    if (result.num == 0) {
+        metric_id_set_destroy(&result);
+        return list;
+    }
+
+    list->ptr = calloc(result.num, sizeof(*list->ptr));
+    if (list->ptr == NULL) {
+        metric_id_set_destroy(&result);
+        free(list);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < result.num; i++) {
+        index_metric_t *idx = index_get(&mdb->index, result.ptr[i]);
+        if (idx == NULL)
+            continue;
+
+        mdb_samples_t *samples = &list->ptr[list->num];
+
+        pthread_mutex_t *lock = &mdb->lock_series[idx->id % MDB_SERIES_LOCKS];
+        pthread_mutex_lock(lock);
+        status = storage_fetch_samples(&mdb->storage, &idx->sid, samples, start, end);
+        pthread_mutex_unlock(lock);
+
+        if (status != 0) {
+            mdb_samples_reset(samples);
+            metric_id_set_destroy(&result);
+            mdb_samples_list_free(list);
+            return NULL;
+        }
+
+        if (samples->num == 0) {
+            mdb_samples_reset(samples);
+            continue;
+        }
+
+        samples->name = (idx->name != NULL) ? strdup(idx->name) : NULL;
+        label_set_clone(&samples->labels, idx->label);
+        list->num++;
+    }
 
-    metric_id_set_t result= {0};
+    metric_id_set_destroy(&result);
 
-    pthread_mutex_lock(&mdb->lock_rindex);
+    return list;
+}
+
+/* With a step of zero only the last sample before end is fetched. */
+static mdb_series_list_t *mdb_fetch_series(mdb_t *mdb, const metric_match_t *match,
+                                           cdtime_t start, cdtime_t end, cdtime_t step)
+{
+    if ((mdb == NULL) || (match == NULL))
+        return NULL;
 
+    metric_id_set_t result = {0};
     int status = rindex_search(&mdb->rindex, &result, match);
     if (status != 0) {
-        // FIXME free result
-        pthread_mutex_unlock(&mdb->lock_rindex);
+        metric_id_set_destroy(&result);
         return NULL;
     }
 
-    pthread_mutex_unlock(&mdb->lock_rindex);
+    mdb_series_list_t *list = calloc(1, sizeof(*list));
+    if (list == NULL) {
+        metric_id_set_destroy(&result);
+        return NULL;
+    }
 
     if (result.num == 0) {
-        // FIXME free result
+        metric_id_set_destroy(&result);
+        return list;
+    }
+
+    list->ptr = calloc(result.num, sizeof(*list->ptr));
+    if (list->ptr == NULL) {
+        metric_id_set_destroy(&result);
+        free(list);
         return NULL;
     }
 
-    for (uint32_t i=0; i < result.num; i++) {
-//        storage_memory_entry_t *entry,
-//        storage_fetch_range(&mdb->storage, sid,
-//                            series, start, end, step);
-//        result.ptr[i]
+    for (uint32_t i = 0; i < result.num; i++) {
+        index_metric_t *idx = index_get(&mdb->index, result.ptr[i]);
+        if (idx == NULL)
+            continue;
+
+        mdb_series_t *series = &list->ptr[list->num];
+
+        pthread_mutex_t *lock = &mdb->lock_series[idx->id % MDB_SERIES_LOCKS];
+        pthread_mutex_lock(lock);
+        if (step == 0)
+            status = storage_fetch(&mdb->storage, &idx->sid, series, end);
+        else
+            status = storage_fetch_range(&mdb->storage, &idx->sid, series, start, end, step);
+        pthread_mutex_unlock(lock);
+
+        if ((status != 0) || (series->num == 0)) {
+            free(series->points);
+            series->points = NULL;
+            series->num = 0;
+            continue;
+        }
+
+        series->name = (idx->name != NULL) ? strdup(idx->name) : NULL;
+        label_set_clone(&series->labels, idx->label);
+        list->num++;
     }
 
-    return NULL;
+    metric_id_set_destroy(&result);
+
+    return list;
+}
+
+mdb_series_list_t *mdb_fetch(mdb_t *mdb, const metric_match_t *match, cdtime_t time)
+{
+    return mdb_fetch_series(mdb, match, time, time, 0);
+}
+
+mdb_series_list_t *mdb_fetch_range(mdb_t *mdb, const metric_match_t *match,
+                                   cdtime_t start, cdtime_t end, cdtime_t step)
+{
+    if (step == 0)
+        return NULL;
+
+    return mdb_fetch_series(mdb, match, start, end, step);
+}
+
+mdb_series_list_t *mdb_query_range(mdb_t *mdb, const char *query,
+                                   cdtime_t start, cdtime_t end, cdtime_t step)
+{
+    if ((mdb == NULL) || (query == NULL))
+        return NULL;
+
+    if (CDTIME_T_TO_MS(end) > CDTIME_T_TO_MS(start)) {
+        uint64_t step_ms = CDTIME_T_TO_MS(step);
+        if ((step_ms == 0) ||
+            (((CDTIME_T_TO_MS(end) - CDTIME_T_TO_MS(start)) / step_ms) > MDB_QUERY_RANGE_MAX_STEPS)) {
+            ERROR("Query '%s' exceeds the maximum of %d steps.", query, MDB_QUERY_RANGE_MAX_STEPS);
+            return NULL;
+        }
+    }
+
+    char *buffer = strdup(query);
+    if (buffer == NULL) {
+        ERROR("strdup failed.");
+        return NULL;
+    }
+
+    mql_status_t status = {0};
+    if ((mql_parser(buffer, &status) != 0) || (status.root == NULL)) {
+        ERROR("Failed to parse query '%s': %s.", query,
+              status.errmsg != NULL ? status.errmsg : "syntax error");
+        mql_node_free(status.root);
+        free(buffer);
+        return NULL;
+    }
+    free(buffer);
+
+    mql_eval_ctx_t ctx = {
+        .mdb = mdb,
+        .start = CDTIME_T_TO_MS(start),
+        .end = CDTIME_T_TO_MS(end),
+        .step = CDTIME_T_TO_MS(step),
+    };
+
+    mql_value_t *value = mql_eval(&ctx, status.root);
+    mql_node_free(status.root);
+    if (value == NULL) {
+        ERROR("Failed to evaluate query '%s': %s.", query,
+              ctx.errmsg != NULL ? ctx.errmsg : "unknown error");
+        return NULL;
+    }
+
+    mdb_series_list_t *list = calloc(1, sizeof(*list));
+    if (list == NULL) {
+        mql_value_free(value);
+        return NULL;
+    }
+
+    if (value->series.size > 0) {
+        list->ptr = calloc(value->series.size, sizeof(*list->ptr));
+        if (list->ptr == NULL) {
+            mql_value_free(value);
+            free(list);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < value->series.size; i++) {
+        mql_serie_t *serie = &value->series.ptr[i];
+        mdb_series_t *series = &list->ptr[list->num];
+
+        series->points = malloc(sizeof(*series->points) * serie->points.size);
+        if (series->points == NULL) {
+            mql_value_free(value);
+            mdb_series_list_free(list);
+            return NULL;
+        }
+        list->num++;
+
+        for (size_t j = 0; j < serie->points.size; j++) {
+            series->points[j].timestamp = serie->points.ptr[j].timestamp;
+            series->points[j].value = serie->points.ptr[j].value;
+        }
+        series->num = serie->points.size;
+
+        series->name = serie->metric.name;
+        serie->metric.name = NULL;
+        series->labels = serie->metric.labels;
+        serie->metric.labels = (label_set_t){0};
+    }
+
+    mql_value_free(value);
+
+    return list;
+}
+
+mdb_series_list_t *mdb_query(mdb_t *mdb, const char *query, cdtime_t time)
+{
+    return mdb_query_range(mdb, query, time, time, 0);
 }
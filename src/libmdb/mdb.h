@@ -45,8 +45,15 @@ typedef struct {
 #define MDB_VALUE_INFO \
     (mdb_value_t){.type = MDB_VALUE_TYPE_INFO}
 
+#define MDB_DEFAULT_RETENTION TIME_T_TO_CDTIME_T_STATIC(3600)
+/* How far back an instant selector looks for the last sample of a series. */
+#define MDB_LOOKBACK_DELTA TIME_T_TO_CDTIME_T_STATIC(300)
+/* Maximum number of steps a range query can be evaluated at. */
+#define MDB_QUERY_RANGE_MAX_STEPS 11000
+
 typedef struct {
-    char *path;
+    const char *path;
+    cdtime_t retention;
 } mdb_config_t;
 
 struct mdb_s;
@@ -64,7 +71,8 @@ int mdb_load_index(mdb_t *mdb);
 
 int mdb_load_data(mdb_t *mdb);
 
-int mdb_replay_journal(mdb_t *mdb);
+/* Write a snapshot of the index and the samples in the configured path. */
+int mdb_sync(mdb_t *mdb);
 
 int mdb_shutdown(mdb_t *mdb);
 
@@ -106,8 +114,15 @@ mql_value_t *mql_eval(mql_eval_ctx_t *ctx, mql_node_t *node);
 
 #endif
 
+mdb_samples_list_t *mdb_fetch_samples(mdb_t *mdb, const metric_match_t *match,
+                                      cdtime_t start, cdtime_t end);
+
 mdb_series_list_t *mdb_fetch(mdb_t *mdb, const metric_match_t *match, cdtime_t time);
 
 mdb_series_list_t *mdb_fetch_range(mdb_t *mdb, const metric_match_t *match,
                                    cdtime_t start, cdtime_t end, cdtime_t step);
 
+mdb_series_list_t *mdb_query(mdb_t *mdb, const char *query, cdtime_t time);
+
+mdb_series_list_t *mdb_query_range(mdb_t *mdb, const char *query,
+                                   cdtime_t start, cdtime_t end, cdtime_t step);
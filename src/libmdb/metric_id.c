@@ -10,9 +10,9 @@ int metric_id_set_cmp(void const *a, void const *b)
     metric_id_t const *ida = a;
     metric_id_t const *idb = b;
 
-    if (ida < idb)
+    if (*ida < *idb)
         return -1;
-    else if (ida > idb)
+    else if (*ida > *idb)
         return 1;
     else
         return 0;
@@ -109,15 +109,13 @@ int metric_id_set_union(metric_id_set_t *dst, metric_id_set_t *a, metric_id_set_
             i++;
         }
     }
-    while (i < a->num) {
+    if (i < a->num) {
         memcpy(dst->ptr + n, a->ptr + i, sizeof(*dst->ptr) * (a->num - i));
         n += a->num - i;
-        // dst->ptr[n++] = a->ptr[i++];
     }
-    while (j < b->num) {
+    if (j < b->num) {
         memcpy(dst->ptr + n, b->ptr + j, sizeof(*dst->ptr) * (b->num - j));
         n += b->num - j;
-        // dst->ptr[n++] = b->ptr[j++];
     }
 
     dst->num = n;
@@ -167,10 +165,9 @@ int metric_id_set_difference(metric_id_set_t *dst, metric_id_set_t *a, metric_id
             i++;
         }
     }
-    while (i < a->num) {
+    if (i < a->num) {
         memcpy(dst->ptr + n, a->ptr + i, sizeof(*dst->ptr) * (a->num - i));
         n += a->num - i;
-        // dst->ptr[n++] = a->ptr[i++];
     }
 
     dst->num = n;
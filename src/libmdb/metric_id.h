@@ -27,7 +27,7 @@ static inline uint32_t metric_id_size(metric_id_set_t *set)
 
 static inline uint32_t metric_id_set_avail(metric_id_set_t *set)
 {
-    return set->alloc ? set->num - set->alloc : 0;
+    return set->alloc - set->num;
 }
 
 int metric_id_set_resize(metric_id_set_t *set, uint32_t need);
@@ -103,7 +103,7 @@ static inline void metric_id_set_destroy(metric_id_set_t *set)
 
 static inline int metric_id_set_list_avail(metric_id_set_list_t *list)
 {
-    return list->alloc ? list->num - list->alloc : 0;
+    return (int)(list->alloc - list->num);
 }
 
 int metric_id_set_list_add(metric_id_set_list_t *list, metric_id_set_t *set);
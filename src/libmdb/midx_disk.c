@@ -2,92 +2,479 @@
 // SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
 // SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
 
-#include <stdio.h>
-#include <stdint.h>
+#include "ncollectd.h"
+#include "log.h"
 
-#define MIDX_INDEX_MAGIC  0x4e43444d49445849
-#define MIDX_INDEX_VERSION 0x01
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MIDX_DATA_MAGIC 0x4e43444d49445844
-#define MIDX_DATA_VERSION 0x01
+#include "libmdb/crc32c.h"
+#include "libmdb/midx_disk.h"
 
-#define MIDX_DATA_ENTRY_MAGIC 0x4d494458
+#define MIDX_DISK_INDEX_IDX "index.idx"
+#define MIDX_DISK_INDEX_DATA "index.db"
+#define MIDX_DISK_CHUNKS "chunks.db"
+#define MIDX_DISK_TMP_SUFFIX ".tmp"
 
-// __attribute__((packed))
+#define MIDX_DISK_DATA_SIZE_MAX UINT16_MAX
 
-typedef struct __attribute__((packed)) {
-    uint64_t magic;
-    uint64_t version;
-} midx_disk_index_header_t;
+typedef struct {
+    uint8_t *ptr;
+    size_t size;
+} midx_disk_map_t;
+
+static FILE *midx_disk_open_tmp(const char *path, const char *name)
+{
+    char file[PATH_MAX];
+    ssnprintf(file, sizeof(file), "%s/%s" MIDX_DISK_TMP_SUFFIX, path, name);
 
-typedef struct __attribute__((packed)) {
-    uint32_t crc32c;
-    uint32_t size;
-    uint64_t offset;
-} midx_disk_index_entry_t;
+    FILE *fp = fopen(file, "w");
+    if (fp == NULL)
+        ERROR("Cannot open '%s': %s.", file, STRERRNO);
 
-typedef struct __attribute__((packed)) {
-    uint64_t magic;
-    uint64_t version;
-} midx_disk_data_header_t;
+    return fp;
+}
 
-typedef struct __attribute__((packed)) {
-    uint32_t magic;
-    uint32_t crc32c;
-    uint64_t idx;
-    uint32_t size;
-    uint16_t labels_len;
-    uint16_t metric_len;
-    uint8_t data[];
-} midx_disk_data_entry_t;
+static int midx_disk_close_tmp(FILE *fp, bool sync)
+{
+    int status = 0;
 
-typedef struct {
-    int fd_idx;
-    int fd_data;
-} midx_disk_t;
+    if (sync) {
+        if (fflush(fp) != 0)
+            status = -1;
+        if ((status == 0) && (fsync(fileno(fp)) != 0))
+            status = -1;
+    }
 
-// midx_disk_index_header_t: 16
-// midx_disk_index_entry_t: 16
-// midx_disk_data_header_t: 16
-// midx_disk_data_entry_t: 24
+    if (fclose(fp) != 0)
+        status = -1;
 
-#if 0
+    return status;
+}
 
-midx_disk_open(const char *path);
+static int midx_disk_rename_tmp(const char *path, const char *name)
+{
+    char tmp[PATH_MAX];
+    ssnprintf(tmp, sizeof(tmp), "%s/%s" MIDX_DISK_TMP_SUFFIX, path, name);
+    char file[PATH_MAX];
+    ssnprintf(file, sizeof(file), "%s/%s", path, name);
 
-midx_disk_append(midx_disk_t *midx, metric)
+    if (rename(tmp, file) != 0) {
+        ERROR("Cannot rename '%s' to '%s': %s.", tmp, file, STRERRNO);
+        return -1;
+    }
 
-midx_disk_
-#endif
+    return 0;
+}
 
-"midx.db"
-"mdata.db"
+static void midx_disk_unlink_tmp(const char *path, const char *name)
+{
+    char file[PATH_MAX];
+    ssnprintf(file, sizeof(file), "%s/%s" MIDX_DISK_TMP_SUFFIX, path, name);
+    unlink(file);
+}
 
-/var/lib/ncollectiondb/index.db
-/var/lib/ncollectiondb/index.idx
+static void midx_disk_free(midx_disk_t *midx)
+{
+    free(midx->path);
+    free(midx->buffer);
+    *midx = (midx_disk_t){0};
+}
 
-/var/lib/ncollectiondb/data
-/var/lib/ncollectiondb/journal
+void midx_disk_abort(midx_disk_t *midx)
+{
+    if (midx == NULL)
+        return;
 
-/var/lib/ncollectiondb/index
-/var/lib/ncollectiondb/data
-/var/lib/ncollectiondb/journal
+    if (midx->fp_idx != NULL)
+        midx_disk_close_tmp(midx->fp_idx, false);
+    if (midx->fp_data != NULL)
+        midx_disk_close_tmp(midx->fp_data, false);
+    if (midx->fp_chunk != NULL)
+        midx_disk_close_tmp(midx->fp_chunk, false);
 
+    if (midx->path != NULL) {
+        midx_disk_unlink_tmp(midx->path, MIDX_DISK_INDEX_IDX);
+        midx_disk_unlink_tmp(midx->path, MIDX_DISK_INDEX_DATA);
+        midx_disk_unlink_tmp(midx->path, MIDX_DISK_CHUNKS);
+    }
 
+    midx_disk_free(midx);
+}
 
-int main (int argc, char *argv[])
+int midx_disk_create(midx_disk_t *midx, const char *path)
 {
-    fprintf(stderr, "midx_disk_index_header_t: %d\n", (int)sizeof(midx_disk_index_header_t));
-    fprintf(stderr, "midx_disk_index_entry_t: %d\n", (int)sizeof(midx_disk_index_entry_t));
-    fprintf(stderr, "midx_disk_data_header_t: %d\n", (int)sizeof(midx_disk_data_header_t));
-    fprintf(stderr, "midx_disk_data_entry_t: %d\n", (int)sizeof(midx_disk_data_entry_t));
+    if ((midx == NULL) || (path == NULL))
+        return -1;
+
+    *midx = (midx_disk_t){0};
+
+    if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+        ERROR("Cannot create directory '%s': %s.", path, STRERRNO);
+        return -1;
+    }
 
+    midx->path = strdup(path);
+    midx->buffer = malloc(sizeof(midx_disk_data_entry_t) + MIDX_DISK_DATA_SIZE_MAX);
+    if ((midx->path == NULL) || (midx->buffer == NULL)) {
+        ERROR("malloc failed.");
+        midx_disk_free(midx);
+        return -1;
+    }
 
-    int access(const char *pathname, int mode);
-    int faccessat(int dirfd, const char *pathname, int mode, int flags);
-    openat(dirfd,
+    midx->fp_idx = midx_disk_open_tmp(path, MIDX_DISK_INDEX_IDX);
+    midx->fp_data = midx_disk_open_tmp(path, MIDX_DISK_INDEX_DATA);
+    midx->fp_chunk = midx_disk_open_tmp(path, MIDX_DISK_CHUNKS);
+    if ((midx->fp_idx == NULL) || (midx->fp_data == NULL) || (midx->fp_chunk == NULL)) {
+        midx_disk_abort(midx);
+        return -1;
+    }
+
+    midx_disk_index_header_t idx_header = {.magic = MIDX_INDEX_MAGIC,
+                                           .version = MIDX_INDEX_VERSION};
+    midx_disk_data_header_t data_header = {.magic = MIDX_DATA_MAGIC,
+                                           .version = MIDX_DATA_VERSION};
+    midx_disk_chunk_header_t chunk_header = {.magic = MIDX_CHUNK_MAGIC,
+                                             .version = MIDX_CHUNK_VERSION};
+
+    size_t n = fwrite(&idx_header, sizeof(idx_header), 1, midx->fp_idx);
+    n += fwrite(&data_header, sizeof(data_header), 1, midx->fp_data);
+    n += fwrite(&chunk_header, sizeof(chunk_header), 1, midx->fp_chunk);
+    if (n != 3) {
+        ERROR("Cannot write headers in '%s'.", path);
+        midx_disk_abort(midx);
+        return -1;
+    }
+
+    midx->offset = sizeof(data_header);
 
     return 0;
 }
 
+int midx_disk_append_metric(midx_disk_t *midx, uint64_t idx,
+                            const char *metric, const label_set_t *labels)
+{
+    size_t metric_len = strlen(metric);
+    size_t labels_len = labels != NULL ? labels->num : 0;
+    if ((metric_len > UINT8_MAX) || (labels_len > UINT8_MAX))
+        return EINVAL;
+
+    size_t size = metric_len + 1;
+    for (size_t i = 0; i < labels_len; i++) {
+        size += strlen(labels->ptr[i].name) + 1;
+        size += strlen(labels->ptr[i].value) + 1;
+    }
+    if (size > MIDX_DISK_DATA_SIZE_MAX)
+        return EINVAL;
+
+    midx_disk_data_entry_t *entry = (midx_disk_data_entry_t *)midx->buffer;
+    entry->magic = MIDX_DATA_ENTRY_MAGIC;
+    entry->idx = idx;
+    entry->size = size;
+    entry->labels_len = labels_len;
+    entry->metric_len = metric_len;
+
+    uint8_t *data = entry->data;
+    memcpy(data, metric, metric_len + 1);
+    data += metric_len + 1;
+    for (size_t i = 0; i < labels_len; i++) {
+        size_t len = strlen(labels->ptr[i].name) + 1;
+        memcpy(data, labels->ptr[i].name, len);
+        data += len;
+        len = strlen(labels->ptr[i].value) + 1;
+        memcpy(data, labels->ptr[i].value, len);
+        data += len;
+    }
+
+    size_t entry_size = sizeof(*entry) + size;
+    entry->crc32c = crc32c(midx->buffer + offsetof(midx_disk_data_entry_t, idx),
+                           entry_size - offsetof(midx_disk_data_entry_t, idx));
+
+    midx_disk_index_entry_t idx_entry = {.crc32c = entry->crc32c,
+                                         .size = entry_size,
+                                         .offset = midx->offset};
+
+    if (fwrite(midx->buffer, entry_size, 1, midx->fp_data) != 1)
+        return -1;
+    if (fwrite(&idx_entry, sizeof(idx_entry), 1, midx->fp_idx) != 1)
+        return -1;
+
+    midx->offset += entry_size;
+
+    return 0;
+}
+
+int midx_disk_append_chunk(midx_disk_t *midx, uint64_t idx, cdtime_t interval,
+                           const storage_chunk_t *chunk)
+{
+    midx_disk_chunk_entry_t entry = {
+        .magic = MIDX_CHUNK_ENTRY_MAGIC,
+        .idx = idx,
+        .interval = interval,
+        .first_time = chunk->first_time,
+        .last_time = chunk->last_time,
+        .num = chunk->num,
+        .bits = chunk->bits,
+    };
+    memcpy(entry.data, chunk->data, sizeof(entry.data));
+
+    entry.crc32c = crc32c((uint8_t *)&entry + offsetof(midx_disk_chunk_entry_t, idx),
+                          sizeof(entry) - offsetof(midx_disk_chunk_entry_t, idx));
+
+    if (fwrite(&entry, sizeof(entry), 1, midx->fp_chunk) != 1)
+        return -1;
+
+    return 0;
+}
+
+int midx_disk_commit(midx_disk_t *midx)
+{
+    int status = midx_disk_close_tmp(midx->fp_idx, true);
+    midx->fp_idx = NULL;
+    status |= midx_disk_close_tmp(midx->fp_data, true);
+    midx->fp_data = NULL;
+    status |= midx_disk_close_tmp(midx->fp_chunk, true);
+    midx->fp_chunk = NULL;
+
+    if (status != 0) {
+        ERROR("Cannot write snapshot in '%s'.", midx->path);
+        midx_disk_abort(midx);
+        return -1;
+    }
+
+    /* The chunks are renamed the last: a chunk of a series missing in the index
+     * is skipped when loading. */
+    status = midx_disk_rename_tmp(midx->path, MIDX_DISK_INDEX_DATA);
+    status |= midx_disk_rename_tmp(midx->path, MIDX_DISK_INDEX_IDX);
+    status |= midx_disk_rename_tmp(midx->path, MIDX_DISK_CHUNKS);
+    if (status != 0) {
+        midx_disk_abort(midx);
+        return -1;
+    }
+
+    int fd = open(midx->path, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    midx_disk_free(midx);
+    return 0;
+}
 
+static int midx_disk_map(const char *path, const char *name, midx_disk_map_t *map)
+{
+    *map = (midx_disk_map_t){0};
+
+    char file[PATH_MAX];
+    ssnprintf(file, sizeof(file), "%s/%s", path, name);
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return ENOENT;
+        ERROR("Cannot open '%s': %s.", file, STRERRNO);
+        return -1;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        ERROR("Cannot stat '%s': %s.", file, STRERRNO);
+        close(fd);
+        return -1;
+    }
+
+    if (sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    /* Private and writable, the labels are passed to the callback pointing
+     * into the map. */
+    void *ptr = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        ERROR("Cannot mmap '%s': %s.", file, STRERRNO);
+        return -1;
+    }
+
+    madvise(ptr, sb.st_size, MADV_SEQUENTIAL);
+
+    map->ptr = ptr;
+    map->size = sb.st_size;
+
+    return 0;
+}
+
+static void midx_disk_unmap(midx_disk_map_t *map)
+{
+    if (map->ptr != NULL)
+        munmap(map->ptr, map->size);
+    *map = (midx_disk_map_t){0};
+}
+
+static int midx_disk_load_metric(midx_disk_map_t *map, const midx_disk_index_entry_t *idx_entry,
+                                 midx_disk_metric_cb cb, void *arg)
+{
+    if ((idx_entry->offset < sizeof(midx_disk_data_header_t)) ||
+        (idx_entry->offset > map->size) ||
+        (idx_entry->size < sizeof(midx_disk_data_entry_t)) ||
+        (idx_entry->size > (map->size - idx_entry->offset)))
+        return -1;
+
+    midx_disk_data_entry_t *entry = (midx_disk_data_entry_t *)(map->ptr + idx_entry->offset);
+    if ((entry->magic != MIDX_DATA_ENTRY_MAGIC) ||
+        ((sizeof(*entry) + entry->size) != idx_entry->size))
+        return -1;
+
+    uint32_t crc = crc32c((uint8_t *)entry + offsetof(midx_disk_data_entry_t, idx),
+                          idx_entry->size - offsetof(midx_disk_data_entry_t, idx));
+    if ((crc != entry->crc32c) || (crc != idx_entry->crc32c))
+        return -1;
+
+    char *data = (char *)entry->data;
+    char *end = data + entry->size;
+
+    if ((entry->metric_len >= entry->size) || (data[entry->metric_len] != '\0'))
+        return -1;
+    char *metric = data;
+    data += entry->metric_len + 1;
+
+    label_pair_t pairs[UINT8_MAX];
+    label_set_t labels = {.ptr = pairs, .num = entry->labels_len};
+    for (size_t i = 0; i < labels.num; i++) {
+        char *name = data;
+        char *name_end = memchr(name, '\0', end - name);
+        if (name_end == NULL)
+            return -1;
+        char *value = name_end + 1;
+        char *value_end = memchr(value, '\0', end - value);
+        if (value_end == NULL)
+            return -1;
+        pairs[i].name = name;
+        pairs[i].value = value;
+        data = value_end + 1;
+    }
+
+    return cb(entry->idx, metric, labels.num > 0 ? &labels : NULL, arg);
+}
+
+int midx_disk_load_index(const char *path, midx_disk_metric_cb cb, void *arg)
+{
+    if ((path == NULL) || (cb == NULL))
+        return -1;
+
+    midx_disk_map_t map_idx = {0};
+    int status = midx_disk_map(path, MIDX_DISK_INDEX_IDX, &map_idx);
+    if (status == ENOENT)
+        return 0;
+    if (status != 0)
+        return -1;
+
+    midx_disk_map_t map_data = {0};
+    status = midx_disk_map(path, MIDX_DISK_INDEX_DATA, &map_data);
+    if (status != 0) {
+        midx_disk_unmap(&map_idx);
+        if (status == ENOENT) {
+            WARNING("Missing '%s' in '%s', ignoring the index.", MIDX_DISK_INDEX_DATA, path);
+            return 0;
+        }
+        return -1;
+    }
+
+    midx_disk_index_header_t *idx_header = (midx_disk_index_header_t *)map_idx.ptr;
+    midx_disk_data_header_t *data_header = (midx_disk_data_header_t *)map_data.ptr;
+    if ((map_idx.size < sizeof(*idx_header)) || (map_data.size < sizeof(*data_header)) ||
+        (idx_header->magic != MIDX_INDEX_MAGIC) || (idx_header->version != MIDX_INDEX_VERSION) ||
+        (data_header->magic != MIDX_DATA_MAGIC) || (data_header->version != MIDX_DATA_VERSION)) {
+        WARNING("Invalid index header in '%s', ignoring the index.", path);
+        midx_disk_unmap(&map_idx);
+        midx_disk_unmap(&map_data);
+        return 0;
+    }
+
+    size_t num = (map_idx.size - sizeof(*idx_header)) / sizeof(midx_disk_index_entry_t);
+    midx_disk_index_entry_t *entries = (midx_disk_index_entry_t *)(map_idx.ptr + sizeof(*idx_header));
+
+    /* A truncated last entry is skipped. */
+    size_t invalid = ((map_idx.size - sizeof(*idx_header)) % sizeof(midx_disk_index_entry_t)) != 0;
+    status = 0;
+    for (size_t i = 0; i < num; i++) {
+        midx_disk_index_entry_t idx_entry = entries[i];
+        int ret = midx_disk_load_metric(&map_data, &idx_entry, cb, arg);
+        if (ret < 0) {
+            invalid++;
+        } else if (ret > 0) {
+            status = -1;
+            break;
+        }
+    }
+
+    if (invalid > 0)
+        WARNING("Skipped %zu invalid entries of the index in '%s'.", invalid, path);
+
+    midx_disk_unmap(&map_idx);
+    midx_disk_unmap(&map_data);
+
+    return status;
+}
+
+int midx_disk_load_chunks(const char *path, midx_disk_chunk_cb cb, void *arg)
+{
+    if ((path == NULL) || (cb == NULL))
+        return -1;
+
+    midx_disk_map_t map = {0};
+    int status = midx_disk_map(path, MIDX_DISK_CHUNKS, &map);
+    if (status == ENOENT)
+        return 0;
+    if (status != 0)
+        return -1;
+
+    midx_disk_chunk_header_t *header = (midx_disk_chunk_header_t *)map.ptr;
+    if ((map.size < sizeof(*header)) ||
+        (header->magic != MIDX_CHUNK_MAGIC) || (header->version != MIDX_CHUNK_VERSION)) {
+        WARNING("Invalid chunks header in '%s', ignoring the chunks.", path);
+        midx_disk_unmap(&map);
+        return 0;
+    }
+
+    size_t num = (map.size - sizeof(*header)) / sizeof(midx_disk_chunk_entry_t);
+    midx_disk_chunk_entry_t *entries = (midx_disk_chunk_entry_t *)(map.ptr + sizeof(*header));
+
+    size_t invalid = ((map.size - sizeof(*header)) % sizeof(midx_disk_chunk_entry_t)) != 0;
+    status = 0;
+    for (size_t i = 0; i < num; i++) {
+        midx_disk_chunk_entry_t *entry = &entries[i];
+        uint32_t crc = crc32c((uint8_t *)entry + offsetof(midx_disk_chunk_entry_t, idx),
+                              sizeof(*entry) - offsetof(midx_disk_chunk_entry_t, idx));
+        if ((entry->magic != MIDX_CHUNK_ENTRY_MAGIC) || (entry->crc32c != crc) ||
+            (entry->bits > (STORAGE_CHUNK_DATA_SIZE * 8))) {
+            invalid++;
+            continue;
+        }
+
+        storage_chunk_t chunk = {
+            .first_time = entry->first_time,
+            .last_time = entry->last_time,
+            .num = entry->num,
+            .bits = entry->bits,
+        };
+        memcpy(chunk.data, entry->data, sizeof(chunk.data));
+
+        int ret = cb(entry->idx, entry->interval, &chunk, arg);
+        if (ret < 0) {
+            invalid++;
+        } else if (ret > 0) {
+            status = -1;
+            break;
+        }
+    }
+
+    if (invalid > 0)
+        WARNING("Skipped %zu invalid chunks in '%s'.", invalid, path);
+
+    midx_disk_unmap(&map);
+
+    return status;
+}
@@ -7,6 +7,22 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "libmetric/label_set.h"
+#include "libmdb/storage.h"
+
+/* On disk snapshot of the mdb, all the integers are in host byte order.
+ *
+ * index.db:  the data header followed by a data entry for each series, the data
+ *            of the entry is the metric name and the label name and value pairs,
+ *            all of them '\0' terminated.
+ * index.idx: the index header followed by an index entry with the offset in
+ *            index.db of each data entry.
+ * chunks.db: the chunk header followed by the compressed chunks of each series
+ *            in time order.
+ *
+ * The crc32c of the entries covers all the fields after the crc32c.
+ */
+
 #define MIDX_INDEX_MAGIC  0x4e43444d49445849
 #define MIDX_INDEX_VERSION 0x01
 
@@ -15,6 +31,11 @@
 
 #define MIDX_DATA_ENTRY_MAGIC 0x4d494458
 
+#define MIDX_CHUNK_MAGIC 0x4e43444d49445843
+#define MIDX_CHUNK_VERSION 0x01
+
+#define MIDX_CHUNK_ENTRY_MAGIC 0x4d494443
+
 typedef struct __attribute__((packed)) {
     uint64_t magic;
     uint64_t version;
@@ -41,7 +62,54 @@ typedef struct __attribute__((packed)) {
     uint8_t data[];
 } midx_disk_data_entry_t;
 
+typedef struct __attribute__((packed)) {
+    uint64_t magic;
+    uint64_t version;
+} midx_disk_chunk_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t crc32c;
+    uint64_t idx;
+    uint64_t interval;
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t num;
+    uint32_t bits;
+    uint8_t data[STORAGE_CHUNK_DATA_SIZE];
+} midx_disk_chunk_entry_t;
+
 typedef struct {
-    int fd_idx;
-    int fd_data;
+    char *path;
+    FILE *fp_idx;
+    FILE *fp_data;
+    FILE *fp_chunk;
+    uint64_t offset;
+    uint8_t *buffer;
 } midx_disk_t;
+
+/* The load callbacks return a negative value to skip the entry and a positive
+ * value to stop loading. */
+typedef int (*midx_disk_metric_cb)(uint64_t idx, const char *metric, const label_set_t *labels,
+                                   void *arg);
+
+typedef int (*midx_disk_chunk_cb)(uint64_t idx, cdtime_t interval, const storage_chunk_t *chunk,
+                                  void *arg);
+
+/* The snapshot is written to temporary files that replace the previous
+ * snapshot in midx_disk_commit. */
+int midx_disk_create(midx_disk_t *midx, const char *path);
+
+int midx_disk_append_metric(midx_disk_t *midx, uint64_t idx,
+                            const char *metric, const label_set_t *labels);
+
+int midx_disk_append_chunk(midx_disk_t *midx, uint64_t idx, cdtime_t interval,
+                           const storage_chunk_t *chunk);
+
+int midx_disk_commit(midx_disk_t *midx);
+
+void midx_disk_abort(midx_disk_t *midx);
+
+int midx_disk_load_index(const char *path, midx_disk_metric_cb cb, void *arg);
+
+int midx_disk_load_chunks(const char *path, midx_disk_chunk_cb cb, void *arg);
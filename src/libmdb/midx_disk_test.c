@@ -0,0 +1,419 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/time.h"
+#include "libmdb/crc32c.h"
+#include "libmdb/midx_disk.h"
+
+#include <sys/stat.h>
+
+#define NUM_METRICS 3
+#define NUM_CHUNKS 4
+
+static char path[] = "/tmp/midx_disk_test.XXXXXX";
+
+typedef struct {
+    size_t num;
+    uint64_t idx[16];
+    char metric[16][64];
+    char labels[16][256];
+} loaded_index_t;
+
+typedef struct {
+    size_t num;
+    uint64_t idx[16];
+    cdtime_t interval[16];
+    storage_chunk_t chunks[16];
+} loaded_chunks_t;
+
+static void labels_to_string(char *buffer, size_t size, const label_set_t *labels)
+{
+    buffer[0] = '\0';
+    if (labels == NULL)
+        return;
+    for (size_t i = 0; i < labels->num; i++) {
+        size_t len = strlen(buffer);
+        ssnprintf(buffer + len, size - len, "%s%s=%s", i > 0 ? "," : "",
+                  labels->ptr[i].name, labels->ptr[i].value);
+    }
+}
+
+static int load_index_cb(uint64_t idx, const char *metric, const label_set_t *labels, void *arg)
+{
+    loaded_index_t *loaded = arg;
+    if (loaded->num >= STATIC_ARRAY_SIZE(loaded->idx))
+        return 1;
+    loaded->idx[loaded->num] = idx;
+    sstrncpy(loaded->metric[loaded->num], metric, sizeof(loaded->metric[0]));
+    labels_to_string(loaded->labels[loaded->num], sizeof(loaded->labels[0]), labels);
+    loaded->num++;
+    return 0;
+}
+
+static int load_chunk_cb(uint64_t idx, cdtime_t interval, const storage_chunk_t *chunk, void *arg)
+{
+    loaded_chunks_t *loaded = arg;
+    if (loaded->num >= STATIC_ARRAY_SIZE(loaded->idx))
+        return 1;
+    loaded->idx[loaded->num] = idx;
+    loaded->interval[loaded->num] = interval;
+    loaded->chunks[loaded->num] = *chunk;
+    loaded->num++;
+    return 0;
+}
+
+static int stop_cb(__attribute__((unused)) uint64_t idx,
+                   __attribute__((unused)) const char *metric,
+                   __attribute__((unused)) const label_set_t *labels, void *arg)
+{
+    size_t *calls = arg;
+    (*calls)++;
+    return 1;
+}
+
+static void make_chunk(storage_chunk_t *chunk, size_t n)
+{
+    *chunk = (storage_chunk_t){0};
+    chunk->first_time = TIME_T_TO_CDTIME_T(1000 + 100 * n);
+    chunk->last_time = TIME_T_TO_CDTIME_T(1090 + 100 * n);
+    chunk->num = 10 + n;
+    chunk->bits = 400 + n;
+    for (size_t i = 0; i < sizeof(chunk->data); i++)
+        chunk->data[i] = (uint8_t)(i * 7 + n);
+}
+
+static int write_snapshot(void)
+{
+    label_pair_t pairs_a[] = {{"host", "a"}, {"dc", "x"}};
+    label_set_t labels_a = {.ptr = pairs_a, .num = STATIC_ARRAY_SIZE(pairs_a)};
+    label_pair_t pairs_b[] = {{"host", "b"}};
+    label_set_t labels_b = {.ptr = pairs_b, .num = STATIC_ARRAY_SIZE(pairs_b)};
+
+    midx_disk_t midx = {0};
+    if (midx_disk_create(&midx, path) != 0)
+        return -1;
+
+    int status = midx_disk_append_metric(&midx, 1, "req_total", &labels_a);
+    status |= midx_disk_append_metric(&midx, 2, "req_total", &labels_b);
+    status |= midx_disk_append_metric(&midx, 7, "up", NULL);
+
+    for (size_t i = 0; i < NUM_CHUNKS; i++) {
+        storage_chunk_t chunk;
+        make_chunk(&chunk, i);
+        status |= midx_disk_append_chunk(&midx, i < 2 ? 1 : 7, TIME_T_TO_CDTIME_T(10), &chunk);
+    }
+
+    if (status != 0) {
+        midx_disk_abort(&midx);
+        return -1;
+    }
+
+    return midx_disk_commit(&midx);
+}
+
+static void file_path(char *buffer, size_t size, const char *name)
+{
+    ssnprintf(buffer, size, "%s/%s", path, name);
+}
+
+static off_t file_size(const char *name)
+{
+    char file[PATH_MAX];
+    file_path(file, sizeof(file), name);
+    struct stat sb;
+    if (stat(file, &sb) != 0)
+        return -1;
+    return sb.st_size;
+}
+
+static int file_truncate(const char *name, off_t size)
+{
+    char file[PATH_MAX];
+    file_path(file, sizeof(file), name);
+    return truncate(file, size);
+}
+
+static int file_write(const char *name, off_t offset, const void *data, size_t size)
+{
+    char file[PATH_MAX];
+    file_path(file, sizeof(file), name);
+    int fd = open(file, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pwrite(fd, data, size, offset);
+    close(fd);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+static int file_read(const char *name, off_t offset, void *data, size_t size)
+{
+    char file[PATH_MAX];
+    file_path(file, sizeof(file), name);
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, data, size, offset);
+    close(fd);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+static void remove_snapshot(void)
+{
+    const char *names[] = {"index.idx", "index.db", "chunks.db",
+                           "index.idx.tmp", "index.db.tmp", "chunks.db.tmp"};
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(names); i++) {
+        char file[PATH_MAX];
+        file_path(file, sizeof(file), names[i]);
+        unlink(file);
+    }
+}
+
+static size_t load_index(void)
+{
+    loaded_index_t loaded = {0};
+    if (midx_disk_load_index(path, load_index_cb, &loaded) != 0)
+        return SIZE_MAX;
+    return loaded.num;
+}
+
+static size_t load_chunks(void)
+{
+    loaded_chunks_t loaded = {0};
+    if (midx_disk_load_chunks(path, load_chunk_cb, &loaded) != 0)
+        return SIZE_MAX;
+    return loaded.num;
+}
+
+DEF_TEST(round_trip)
+{
+    /* Without a snapshot nothing is loaded. */
+    EXPECT_EQ_INT(0, load_index());
+    EXPECT_EQ_INT(0, load_chunks());
+
+    CHECK_ZERO(write_snapshot());
+    EXPECT_EQ_INT(-1, file_size("index.idx.tmp"));
+
+    loaded_index_t index = {0};
+    CHECK_ZERO(midx_disk_load_index(path, load_index_cb, &index));
+    EXPECT_EQ_INT(NUM_METRICS, index.num);
+    EXPECT_EQ_UINT64(1, index.idx[0]);
+    EXPECT_EQ_STR("req_total", index.metric[0]);
+    EXPECT_EQ_STR("host=a,dc=x", index.labels[0]);
+    EXPECT_EQ_UINT64(2, index.idx[1]);
+    EXPECT_EQ_STR("req_total", index.metric[1]);
+    EXPECT_EQ_STR("host=b", index.labels[1]);
+    EXPECT_EQ_UINT64(7, index.idx[2]);
+    EXPECT_EQ_STR("up", index.metric[2]);
+    EXPECT_EQ_STR("", index.labels[2]);
+
+    loaded_chunks_t chunks = {0};
+    CHECK_ZERO(midx_disk_load_chunks(path, load_chunk_cb, &chunks));
+    EXPECT_EQ_INT(NUM_CHUNKS, chunks.num);
+    for (size_t i = 0; i < chunks.num; i++) {
+        storage_chunk_t want;
+        make_chunk(&want, i);
+        EXPECT_EQ_UINT64(i < 2 ? 1 : 7, chunks.idx[i]);
+        EXPECT_EQ_UINT64(TIME_T_TO_CDTIME_T(10), chunks.interval[i]);
+        EXPECT_EQ_UINT64(want.first_time, chunks.chunks[i].first_time);
+        EXPECT_EQ_UINT64(want.last_time, chunks.chunks[i].last_time);
+        EXPECT_EQ_INT(want.num, chunks.chunks[i].num);
+        EXPECT_EQ_INT(want.bits, chunks.chunks[i].bits);
+        EXPECT_EQ_INT(0, memcmp(want.data, chunks.chunks[i].data, sizeof(want.data)));
+    }
+
+    /* A positive value of the callback stops loading. */
+    size_t calls = 0;
+    OK(midx_disk_load_index(path, stop_cb, &calls) != 0);
+    EXPECT_EQ_INT(1, calls);
+
+    /* An aborted snapshot leaves the previous one. */
+    midx_disk_t midx = {0};
+    CHECK_ZERO(midx_disk_create(&midx, path));
+    CHECK_ZERO(midx_disk_append_metric(&midx, 9, "other", NULL));
+    midx_disk_abort(&midx);
+    EXPECT_EQ_INT(-1, file_size("index.idx.tmp"));
+    EXPECT_EQ_INT(NUM_METRICS, load_index());
+
+    /* The metric name length is stored in 8 bits. */
+    char name[300];
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    CHECK_ZERO(midx_disk_create(&midx, path));
+    EXPECT_EQ_INT(EINVAL, midx_disk_append_metric(&midx, 9, name, NULL));
+    midx_disk_abort(&midx);
+
+    remove_snapshot();
+    return 0;
+}
+
+DEF_TEST(truncated)
+{
+    off_t idx_size = sizeof(midx_disk_index_header_t) +
+                     NUM_METRICS * sizeof(midx_disk_index_entry_t);
+    off_t chunk_size = sizeof(midx_disk_chunk_header_t) +
+                       NUM_CHUNKS * sizeof(midx_disk_chunk_entry_t);
+
+    CHECK_ZERO(write_snapshot());
+    EXPECT_EQ_INT(idx_size, file_size("index.idx"));
+    EXPECT_EQ_INT(chunk_size, file_size("chunks.db"));
+
+    /* In the middle of the last entry. */
+    CHECK_ZERO(file_truncate("index.idx", idx_size - sizeof(midx_disk_index_entry_t) / 2));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+    CHECK_ZERO(file_truncate("chunks.db", chunk_size - sizeof(midx_disk_chunk_entry_t) / 2));
+    EXPECT_EQ_INT(NUM_CHUNKS - 1, load_chunks());
+
+    /* In the middle of the header. */
+    CHECK_ZERO(file_truncate("index.idx", sizeof(midx_disk_index_header_t) / 2));
+    EXPECT_EQ_INT(0, load_index());
+    CHECK_ZERO(file_truncate("chunks.db", sizeof(midx_disk_chunk_header_t) / 2));
+    EXPECT_EQ_INT(0, load_chunks());
+
+    /* Empty files. */
+    CHECK_ZERO(file_truncate("index.idx", 0));
+    EXPECT_EQ_INT(0, load_index());
+    CHECK_ZERO(file_truncate("chunks.db", 0));
+    EXPECT_EQ_INT(0, load_chunks());
+
+    /* The entries of the index past the end of the data are skipped. */
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_truncate("index.db", file_size("index.db") - 1));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+    CHECK_ZERO(file_truncate("index.db", sizeof(midx_disk_data_header_t) + 4));
+    EXPECT_EQ_INT(0, load_index());
+    CHECK_ZERO(file_truncate("index.db", 0));
+    EXPECT_EQ_INT(0, load_index());
+
+    /* The index without its data. */
+    char file[PATH_MAX];
+    file_path(file, sizeof(file), "index.db");
+    CHECK_ZERO(unlink(file));
+    EXPECT_EQ_INT(0, load_index());
+
+    remove_snapshot();
+    return 0;
+}
+
+DEF_TEST(bad_header)
+{
+    uint64_t bad = 0xdeadbeef;
+    struct {
+        const char *name;
+        off_t offset;
+    } cases[] = {
+        { "index.idx", offsetof(midx_disk_index_header_t, magic)   },
+        { "index.idx", offsetof(midx_disk_index_header_t, version) },
+        { "index.db",  offsetof(midx_disk_data_header_t, magic)    },
+        { "index.db",  offsetof(midx_disk_data_header_t, version)  },
+        { "chunks.db", offsetof(midx_disk_chunk_header_t, magic)   },
+        { "chunks.db", offsetof(midx_disk_chunk_header_t, version) },
+    };
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++) {
+        printf("# %s at %d\n", cases[i].name, (int)cases[i].offset);
+        CHECK_ZERO(write_snapshot());
+        CHECK_ZERO(file_write(cases[i].name, cases[i].offset, &bad, sizeof(bad)));
+        if (strcmp(cases[i].name, "chunks.db") == 0) {
+            EXPECT_EQ_INT(NUM_METRICS, load_index());
+            EXPECT_EQ_INT(0, load_chunks());
+        } else {
+            EXPECT_EQ_INT(0, load_index());
+            EXPECT_EQ_INT(NUM_CHUNKS, load_chunks());
+        }
+    }
+
+    remove_snapshot();
+    return 0;
+}
+
+DEF_TEST(bad_entry)
+{
+    off_t idx_entry_offset = sizeof(midx_disk_index_header_t) + sizeof(midx_disk_index_entry_t);
+    midx_disk_index_entry_t idx_entry = {0};
+
+    /* An offset out of the data. */
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_read("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    idx_entry.offset = UINT64_MAX - 8;
+    CHECK_ZERO(file_write("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+
+    /* An offset inside the header of the data. */
+    idx_entry.offset = 4;
+    CHECK_ZERO(file_write("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+
+    /* A size out of the data. */
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_read("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    idx_entry.size = UINT32_MAX;
+    CHECK_ZERO(file_write("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+
+    /* A data entry that does not match its checksum. */
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_read("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    uint8_t byte = 'X';
+    CHECK_ZERO(file_write("index.db", idx_entry.offset + sizeof(midx_disk_data_entry_t),
+                          &byte, sizeof(byte)));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+
+    /* More labels than the data holds, with a valid checksum. */
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_read("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    uint8_t buffer[512];
+    CHECK_ZERO(file_read("index.db", idx_entry.offset, buffer, idx_entry.size));
+    midx_disk_data_entry_t *data_entry = (midx_disk_data_entry_t *)buffer;
+    data_entry->labels_len = UINT8_MAX;
+    data_entry->crc32c = crc32c(buffer + offsetof(midx_disk_data_entry_t, idx),
+                                idx_entry.size - offsetof(midx_disk_data_entry_t, idx));
+    idx_entry.crc32c = data_entry->crc32c;
+    CHECK_ZERO(file_write("index.db", idx_entry.offset, buffer, idx_entry.size));
+    CHECK_ZERO(file_write("index.idx", idx_entry_offset, &idx_entry, sizeof(idx_entry)));
+    EXPECT_EQ_INT(NUM_METRICS - 1, load_index());
+
+    /* A chunk that does not match its checksum. */
+    off_t chunk_offset = sizeof(midx_disk_chunk_header_t) + sizeof(midx_disk_chunk_entry_t);
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_write("chunks.db", chunk_offset + offsetof(midx_disk_chunk_entry_t, data),
+                          &byte, sizeof(byte)));
+    EXPECT_EQ_INT(NUM_CHUNKS - 1, load_chunks());
+
+    /* A chunk with more bits than its data, with a valid checksum. */
+    midx_disk_chunk_entry_t chunk_entry = {0};
+    CHECK_ZERO(write_snapshot());
+    CHECK_ZERO(file_read("chunks.db", chunk_offset, &chunk_entry, sizeof(chunk_entry)));
+    chunk_entry.bits = STORAGE_CHUNK_DATA_SIZE * 8 + 1;
+    chunk_entry.crc32c = crc32c((uint8_t *)&chunk_entry + offsetof(midx_disk_chunk_entry_t, idx),
+                                sizeof(chunk_entry) - offsetof(midx_disk_chunk_entry_t, idx));
+    CHECK_ZERO(file_write("chunks.db", chunk_offset, &chunk_entry, sizeof(chunk_entry)));
+    EXPECT_EQ_INT(NUM_CHUNKS - 1, load_chunks());
+
+    /* A bad entry magic. */
+    CHECK_ZERO(write_snapshot());
+    uint32_t magic = 0;
+    CHECK_ZERO(file_write("chunks.db", chunk_offset, &magic, sizeof(magic)));
+    EXPECT_EQ_INT(NUM_CHUNKS - 1, load_chunks());
+
+    remove_snapshot();
+    return 0;
+}
+
+int main(void)
+{
+    if (mkdtemp(path) == NULL)
+        return 1;
+
+    RUN_TEST(round_trip);
+    RUN_TEST(truncated);
+    RUN_TEST(bad_header);
+    RUN_TEST(bad_entry);
+
+    remove_snapshot();
+    rmdir(path);
+
+    END_TEST;
+}
@@ -11,6 +11,8 @@
 struct mql_node;
 typedef struct mql_node mql_node_t;
 
+struct mdb_s;
+
 typedef struct {
     int first_line;
     int first_column;
@@ -20,10 +22,13 @@ typedef struct {
     mql_node_t *root;
 } mql_status_t;
 
+/* The start, end and step of the evaluation are in milliseconds. */
 typedef struct {
+    struct mdb_s *mdb;
     uint64_t start;
     uint64_t end;
     uint64_t step;
+    const char *errmsg;
 } mql_eval_ctx_t;
 
 int mql_parser(char *query, mql_status_t *status);
@@ -183,16 +183,19 @@ static int rindex_name_insert_cmp(const void *a, const void *b)
     return strcmp(mcma->name, mcmb->name);
 }
 
-static inline rindex_name_t *rindex_name_get(rindex_t *mc, char *name)
+static inline rindex_shard_t *rindex_get_shard(rindex_t *rindex, htable_hash_t hash)
 {
-    htable_hash_t hash = htable_hash(name, HTABLE_HASH_INIT);
-    return htable_find(&mc->name_table, hash, name, rindex_name_find_cmp);
+    return &rindex->shard[hash >> (sizeof(hash) * 8 - RINDEX_SHARD_BITS)];
 }
 
-static rindex_name_t *rindex_name_getsert(rindex_t *mc, const char *name)
+static inline rindex_name_t *rindex_name_get(htable_t *hname, htable_hash_t hash, const char *name)
 {
-    htable_hash_t hash = htable_hash(name, HTABLE_HASH_INIT);
-    rindex_name_t *mcn = htable_find(&mc->name_table, hash, name, rindex_name_find_cmp);
+    return htable_find(hname, hash, name, rindex_name_find_cmp);
+}
+
+static rindex_name_t *rindex_name_getsert(htable_t *hname, htable_hash_t hash, const char *name)
+{
+    rindex_name_t *mcn = htable_find(hname, hash, name, rindex_name_find_cmp);
 
     if (mcn == NULL) {
         mcn = calloc(1, sizeof(*mcn));
@@ -208,7 +211,7 @@ static rindex_name_t *rindex_name_getsert(rindex_t *mc, const char *name)
         }
         htable_init(&mcn->labels, HTABLE_LABEL_SIZE); // FIXME error
 
-        int status = htable_add(&mc->name_table, hash, mcn, rindex_name_insert_cmp);
+        int status = htable_add(hname, hash, mcn, rindex_name_insert_cmp);
         if (status != 0) {
             // ERROR FIXME
             return NULL;
@@ -233,18 +236,17 @@ static void rindex_metric_free(void *arg)
 }
 #endif
 
-int rindex_insert(rindex_t *rindex, metric_id_t id, const char *metric, const label_set_t *label)
+static int rindex_insert_name(rindex_name_t *mcn, metric_id_t id, const label_set_t *label)
 {
-    rindex_name_t *mcn = rindex_name_getsert(rindex, metric);
-    if (mcn == NULL)
-        return -1;
-
     // Insert mcm in mcf
     int status = metric_id_set_insert(&mcn->ids, id);
     if (status != 0) {
         return -1;
     }
 
+    if (label == NULL)
+        return 0;
+
     for (size_t n = 0 ; n  < label->num; n++) {
         label_pair_t *pair = &label->ptr[n];
 
@@ -270,6 +272,23 @@ int rindex_insert(rindex_t *rindex, metric_id_t id, const char *metric, const la
     return 0;
 }
 
+int rindex_insert(rindex_t *rindex, metric_id_t id, const char *metric, const label_set_t *label)
+{
+    htable_hash_t hash = htable_hash(metric, HTABLE_HASH_INIT);
+    rindex_shard_t *shard = rindex_get_shard(rindex, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    int status = -1;
+    rindex_name_t *mcn = rindex_name_getsert(&shard->name_table, hash, metric);
+    if (mcn != NULL)
+        status = rindex_insert_name(mcn, id, label);
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return status;
+}
+
 #if 0
 static int rindex_insert_value(rindex_t *mc, metric_family_t *fam, metric_t *m,
                                      char *metric_name, size_t metric_name_len,
@@ -289,7 +308,10 @@ static int rindex_insert_value(rindex_t *mc, metric_family_t *fam, metric_t *m,
 
 int rindex_init(rindex_t *rindex)
 {
-    htable_init(&rindex->name_table, HTABLE_NAME_SIZE);
+    for (size_t i = 0; i < RINDEX_SHARDS; i++) {
+        pthread_rwlock_init(&rindex->shard[i].lock, NULL);
+        htable_init(&rindex->shard[i].name_table, HTABLE_NAME_SIZE);
+    }
 //    htable_init(&rindex->family_table, HTABLE_FAMILY_SIZE);
 //    htable_init(&rindex->metric_table, HTABLE_METRIC_SIZE);
     return 0;
@@ -297,7 +319,12 @@ int rindex_init(rindex_t *rindex)
 
 int rindex_destroy(rindex_t *rindex)
 {
-    htable_destroy(&rindex->name_table, rindex_name_free, NULL);
+    for (size_t i = 0; i < RINDEX_SHARDS; i++) {
+        pthread_rwlock_wrlock(&rindex->shard[i].lock);
+        htable_destroy(&rindex->shard[i].name_table, rindex_name_free, NULL);
+        pthread_rwlock_unlock(&rindex->shard[i].lock);
+        pthread_rwlock_destroy(&rindex->shard[i].lock);
+    }
 //    htable_destroy(&rindex->family_table, rindex_family_free);
 //    htable_destroy(&rindex->metric_table, rindex_metric_free);
     return 0;
@@ -305,31 +332,32 @@ int rindex_destroy(rindex_t *rindex)
 
 strlist_t *rindex_get_metrics(rindex_t *rindex)
 {
-    strlist_t *sl = strlist_alloc(rindex->name_table.used);
+    strlist_t *sl = strlist_alloc(0);
     if (sl == NULL)
         return NULL;
 
-    if (rindex->name_table.used == 0)
-        return sl;
+    for (size_t n = 0; n < RINDEX_SHARDS; n++) {
+        rindex_shard_t *shard = &rindex->shard[n];
 
-    for (size_t i=0;  i < rindex->name_table.size; i++) {
-        rindex_name_t *mn = rindex->name_table.tbl[i].data;
-        if ((mn != NULL) && (mn->name != NULL)) {
-            strlist_append(sl, mn->name);
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t i=0;  i < shard->name_table.size; i++) {
+            rindex_name_t *mn = shard->name_table.tbl[i].data;
+            if ((mn != NULL) && (mn->name != NULL)) {
+                strlist_append(sl, mn->name);
+            }
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
 
     return sl;
 }
 
-strlist_t *rindex_get_metric_labels(rindex_t *rindex, char *metric)
+static strlist_t *rindex_get_shard_metric_labels(htable_t *hname, htable_hash_t hash, char *metric)
 {
-    htable_hash_t hash = htable_hash(metric, HTABLE_HASH_INIT);
-    rindex_name_t *mn = htable_find(&rindex->name_table, hash, metric, rindex_name_find_cmp);
+    rindex_name_t *mn = rindex_name_get(hname, hash, metric);
     if (mn == NULL)
         return NULL;
 
-
     strlist_t *sl = strlist_alloc(mn->labels.used);
     if (sl == NULL)
         return NULL;
@@ -346,10 +374,22 @@ strlist_t *rindex_get_metric_labels(rindex_t *rindex, char *metric)
     return sl;
 }
 
-strlist_t *rindex_get_metric_label_value(rindex_t *rindex, char *metric, char *label)
+strlist_t *rindex_get_metric_labels(rindex_t *rindex, char *metric)
 {
     htable_hash_t hash = htable_hash(metric, HTABLE_HASH_INIT);
-    rindex_name_t *mn = htable_find(&rindex->name_table, hash, metric, rindex_name_find_cmp);
+    rindex_shard_t *shard = rindex_get_shard(rindex, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    strlist_t *sl = rindex_get_shard_metric_labels(&shard->name_table, hash, metric);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return sl;
+}
+
+static strlist_t *rindex_get_shard_metric_label_value(htable_t *hname, htable_hash_t hash,
+                                                      char *metric, char *label)
+{
+    rindex_name_t *mn = rindex_name_get(hname, hash, metric);
     if (mn == NULL)
         return NULL;
 
@@ -358,7 +398,7 @@ strlist_t *rindex_get_metric_label_value(rindex_t *rindex, char *metric, char *l
     if (ml == NULL)
         return NULL;
 
-    strlist_t *sl = strlist_alloc(mn->labels.used);
+    strlist_t *sl = strlist_alloc(ml->values.used);
     if (sl == NULL)
         return NULL;
 
@@ -374,6 +414,18 @@ strlist_t *rindex_get_metric_label_value(rindex_t *rindex, char *metric, char *l
     return sl;
 }
 
+strlist_t *rindex_get_metric_label_value(rindex_t *rindex, char *metric, char *label)
+{
+    htable_hash_t hash = htable_hash(metric, HTABLE_HASH_INIT);
+    rindex_shard_t *shard = rindex_get_shard(rindex, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    strlist_t *sl = rindex_get_shard_metric_label_value(&shard->name_table, hash, metric, label);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return sl;
+}
+
 static inline int rindex_id_intersect(metric_id_set_t *a, metric_id_set_t *b)
 {
     if (metric_id_size(a) == 0) {
@@ -437,7 +489,7 @@ static int rindex_match_metric_labels(metric_id_set_t *result, rindex_name_t *mc
                 for (size_t j=0; j < mcl->values.size; j++) {
                     if (mcl->values.tbl[j].data != NULL) {
                         rindex_label_value_t *mclv = mcl->values.tbl[j].data;
-                        if (regexec(pair->value.regex, mclv->lvalue, 0, NULL, REG_NOSUB)) {
+                        if (strmatch_exec(pair->value.regex, mclv->lvalue)) {
                             metric_id_set_clone(&cresult, &dst);
                             metric_id_set_union(&dst, &cresult, &mclv->ids);
                             metric_id_set_destroy(&cresult);
@@ -455,7 +507,7 @@ static int rindex_match_metric_labels(metric_id_set_t *result, rindex_name_t *mc
                 for (size_t j=0; j < mcl->values.size; j++) {
                     if (mcl->values.tbl[j].data != NULL) {
                         rindex_label_value_t *mclv = mcl->values.tbl[j].data;
-                        if (!regexec(pair->value.regex, mclv->lvalue, 0, NULL, REG_NOSUB)) {
+                        if (strmatch_exec(pair->value.regex, mclv->lvalue)) {
                             metric_id_set_clone(&cresult, &dst);
                             metric_id_set_union(&dst, &cresult, &mclv->ids);
                             metric_id_set_destroy(&cresult);
@@ -495,52 +547,103 @@ static int rindex_match_metric_labels(metric_id_set_t *result, rindex_name_t *mc
     return 0;
 }
 
-int rindex_search(rindex_t *rindex, metric_id_set_t *result, const metric_match_t *match)
+static bool rindex_match_name(metric_match_set_t *match, const char *name)
 {
-    if (result == NULL)
-        return 0;
-
-    metric_id_set_destroy(result);
-
-    if ((match->name == NULL) || (match->name->num == 0))
-        return 0;
-
-    if ((match->name->num == 1) && (match->name->ptr[0]->op == METRIC_MATCH_OP_EQL)) {
-        rindex_name_t *mcm = rindex_name_get(rindex, match->name->ptr[0]->value.string);
-        if (mcm == NULL) {
-            metric_id_set_destroy(result);
-        } else {
-            rindex_match_metric_labels(result, mcm, match->labels);
-        }
-        return 0;
-    }
-
-    for (size_t i = 0; i < match->name->num; i++) {
-        metric_match_pair_t *pair = match->name->ptr[i];
+    for (size_t i = 0; i < match->num; i++) {
+        metric_match_pair_t *pair = match->ptr[i];
         if (pair == NULL)
             continue;
+
         switch(pair->op) {
         case METRIC_MATCH_OP_NONE:
             break;
         case METRIC_MATCH_OP_EQL:
-            // FIXME
+            if (strcmp(pair->value.string, name) != 0)
+                return false;
             break;
         case METRIC_MATCH_OP_NEQ:
-            // FIXME
+            if (strcmp(pair->value.string, name) == 0)
+                return false;
             break;
         case METRIC_MATCH_OP_EQL_REGEX:
-            // FIXME
+            if (!strmatch_exec(pair->value.regex, name))
+                return false;
             break;
         case METRIC_MATCH_OP_NEQ_REGEX:
-            // FIXME
+            if (strmatch_exec(pair->value.regex, name))
+                return false;
             break;
         case METRIC_MATCH_OP_EXISTS:
-            // FIXME
             break;
         case METRIC_MATCH_OP_NEXISTS:
-            // FIXME
-            break;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int rindex_search_name(metric_id_set_t *result, rindex_name_t *mcm,
+                              const metric_match_t *match)
+{
+    int status = metric_id_set_clone(result, &mcm->ids);
+    if (status != 0)
+        return status;
+
+    return rindex_match_metric_labels(result, mcm, match->labels);
+}
+
+int rindex_search(rindex_t *rindex, metric_id_set_t *result, const metric_match_t *match)
+{
+    if (result == NULL)
+        return 0;
+
+    metric_id_set_destroy(result);
+
+    if ((match->name == NULL) || (match->name->num == 0))
+        return 0;
+
+    if ((match->name->num == 1) && (match->name->ptr[0]->op == METRIC_MATCH_OP_EQL)) {
+        const char *name = match->name->ptr[0]->value.string;
+        htable_hash_t hash = htable_hash(name, HTABLE_HASH_INIT);
+        rindex_shard_t *shard = rindex_get_shard(rindex, hash);
+
+        int status = 0;
+        pthread_rwlock_rdlock(&shard->lock);
+        rindex_name_t *mcm = rindex_name_get(&shard->name_table, hash, name);
+        if (mcm != NULL)
+            status = rindex_search_name(result, mcm, match);
+        pthread_rwlock_unlock(&shard->lock);
+        return status;
+    }
+
+    for (size_t n = 0; n < RINDEX_SHARDS; n++) {
+        rindex_shard_t *shard = &rindex->shard[n];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t i = 0; i < shard->name_table.size; i++) {
+            rindex_name_t *mcm = shard->name_table.tbl[i].data;
+            if ((mcm == NULL) || (mcm->name == NULL))
+                continue;
+            if (!rindex_match_name(match->name, mcm->name))
+                continue;
+
+            metric_id_set_t ids = {0};
+            int status = rindex_search_name(&ids, mcm, match);
+            if ((status == 0) && (metric_id_size(&ids) > 0)) {
+                metric_id_set_t prev = {0};
+                metric_id_set_swap(&prev, result);
+                status = metric_id_set_union(result, &prev, &ids);
+                metric_id_set_destroy(&prev);
+            }
+            metric_id_set_destroy(&ids);
+
+            if (status != 0) {
+                pthread_rwlock_unlock(&shard->lock);
+                return status;
+            }
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
 
     return 0;
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <pthread.h>
+
 #include "libutils/strlist.h"
 #include "libmetric/label_set.h"
 #include "libmetric/metric_match.h"
@@ -27,8 +29,18 @@ typedef struct {
     metric_id_set_t ids;
 } rindex_name_t;
 
+#define RINDEX_SHARD_BITS 4
+#define RINDEX_SHARDS     (1 << RINDEX_SHARD_BITS)
+
+/* Metric names are spread over the shards by hash, a query for one metric name
+ * only takes the read lock of its shard. */
 typedef struct {
+    pthread_rwlock_t lock;
     htable_t name_table;   /* rindex_name_t */
+} rindex_shard_t;
+
+typedef struct {
+    rindex_shard_t shard[RINDEX_SHARDS];
 } rindex_t;
 
 int rindex_init(rindex_t *rindex);
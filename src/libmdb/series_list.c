@@ -162,6 +162,55 @@ void mdb_series_list_free(mdb_series_list_t *list)
     for (size_t i = 0; i < list->num; i++) {
         free(list->ptr[i].name);
         label_set_reset(&list->ptr[i].labels);
+        free(list->ptr[i].points);
+    }
+    free(list->ptr);
+    free(list);
+}
+
+int mdb_samples_reserve(mdb_samples_t *samples, size_t need)
+{
+    if ((samples->alloc - samples->num) >= need)
+        return 0;
+
+    size_t alloc = samples->alloc == 0 ? 16 : samples->alloc;
+    while (alloc < (samples->num + need))
+        alloc *= 2;
+
+    int64_t *times = realloc(samples->times, sizeof(*times) * alloc);
+    if (times == NULL)
+        return -1;
+    samples->times = times;
+
+    double *values = realloc(samples->values, sizeof(*values) * alloc);
+    if (values == NULL)
+        return -1;
+    samples->values = values;
+
+    samples->alloc = alloc;
+
+    return 0;
+}
+
+void mdb_samples_reset(mdb_samples_t *samples)
+{
+    if (samples == NULL)
+        return;
+
+    free(samples->name);
+    label_set_reset(&samples->labels);
+    free(samples->times);
+    free(samples->values);
+    *samples = (mdb_samples_t){0};
+}
+
+void mdb_samples_list_free(mdb_samples_list_t *list)
+{
+    if (list == NULL)
+        return;
+
+    for (size_t i = 0; i < list->num; i++) {
+        mdb_samples_reset(&list->ptr[i]);
     }
     free(list->ptr);
     free(list);
@@ -227,6 +276,46 @@ int mdb_series_list_render(mdb_series_list_t *list, strbuf_t *buf,
     return rstatus;
 }
 
+int mdb_series_list_points_to_json(mdb_series_list_t *list, strbuf_t *buf, bool pretty)
+{
+    xson_render_t r = {0};
+
+    xson_render_init(&r, buf, XSON_RENDER_TYPE_JSON,
+                     pretty ? XSON_RENDER_OPTION_JSON_BEAUTIFY : 0);
+
+    xson_render_status_t rstatus = xson_render_array_open(&r);
+    for (size_t i = 0; i < list->num; i++) {
+        mdb_series_t *series = &list->ptr[i];
+        rstatus |= xson_render_map_open(&r);
+        rstatus |= xson_render_key_string(&r, "metric");
+        rstatus |= xson_render_map_open(&r);
+        if (series->name != NULL) {
+            rstatus |= xson_render_key_string(&r, "__name__");
+            rstatus |= xson_render_string(&r, series->name);
+        }
+        for (size_t j = 0; j < series->labels.num ; j++) {
+            rstatus |= xson_render_key_string(&r, series->labels.ptr[j].name);
+            rstatus |= xson_render_string(&r, series->labels.ptr[j].value);
+        }
+        rstatus |= xson_render_map_close(&r);
+        rstatus |= xson_render_key_string(&r, "values");
+        rstatus |= xson_render_array_open(&r);
+        for (size_t j = 0; j < series->num ; j++) {
+            char value[64];
+            snprintf(value, sizeof(value), "%.17g", series->points[j].value);
+            rstatus |= xson_render_array_open(&r);
+            rstatus |= xson_render_double(&r, (double)series->points[j].timestamp / 1000.0);
+            rstatus |= xson_render_string(&r, value);
+            rstatus |= xson_render_array_close(&r);
+        }
+        rstatus |= xson_render_array_close(&r);
+        rstatus |= xson_render_map_close(&r);
+    }
+    rstatus |= xson_render_array_close(&r);
+
+    return rstatus;
+}
+
 int mdb_series_list_to_json(mdb_series_list_t *list, strbuf_t *buf, bool pretty)
 {
     return mdb_series_list_render(list, buf, XSON_RENDER_TYPE_JSON,
@@ -16,7 +16,7 @@ typedef struct {
     char *name;
     label_set_t labels;
     size_t num;
-    mdb_point_t points[];
+    mdb_point_t *points;
 } mdb_series_t;
 
 typedef struct {
@@ -24,6 +24,40 @@ typedef struct {
     mdb_series_t *ptr;
 } mdb_series_list_t;
 
+/* Raw samples of a series as two contiguous arrays, the times are in milliseconds
+ * and sorted. */
+typedef struct {
+    char *name;
+    label_set_t labels;
+    size_t num;
+    size_t alloc;
+    int64_t *times;
+    double *values;
+} mdb_samples_t;
+
+typedef struct {
+    size_t num;
+    mdb_samples_t *ptr;
+} mdb_samples_list_t;
+
+int mdb_samples_reserve(mdb_samples_t *samples, size_t need);
+
+static inline int mdb_samples_append(mdb_samples_t *samples, int64_t time, double value)
+{
+    if (samples->num >= samples->alloc) {
+        if (mdb_samples_reserve(samples, 1) != 0)
+            return -1;
+    }
+    samples->times[samples->num] = time;
+    samples->values[samples->num] = value;
+    samples->num++;
+    return 0;
+}
+
+void mdb_samples_reset(mdb_samples_t *samples);
+
+void mdb_samples_list_free(mdb_samples_list_t *list);
+
 void mdb_series_list_free(mdb_series_list_t *list);
 
 int mdb_series_list_append(mdb_series_list_t *list, char *name);
@@ -32,6 +66,8 @@ mdb_series_list_t *mdb_series_list_parse(const char *data, size_t len);
 
 int mdb_series_list_to_json(mdb_series_list_t *list, strbuf_t *buf, bool pretty);
 
+int mdb_series_list_points_to_json(mdb_series_list_t *list, strbuf_t *buf, bool pretty);
+
 int mdb_series_list_to_yaml(mdb_series_list_t *list, strbuf_t *buf);
 
 int mdb_series_list_to_text(mdb_series_list_t *list, strbuf_t *buf);
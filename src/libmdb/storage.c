@@ -4,14 +4,401 @@
 
 #include "libmdb/storage.h"
 
-int storage_init(storage_t *storage)
+#define STORAGE_CHUNK_SLAB_SIZE 64
+/* Worst case of a sample: a 64 bits delta of delta and a value with new
+ * leading and trailing zeros. */
+#define STORAGE_CHUNK_SAMPLE_BITS_MAX (4 + 64 + 2 + 5 + 6 + 64)
+#define STORAGE_CHUNK_NO_ZEROS 0xff
+
+struct storage_chunk_slab_s {
+    storage_chunk_slab_t *next;
+    storage_chunk_t chunks[STORAGE_CHUNK_SLAB_SIZE];
+};
+
+typedef struct {
+    const storage_chunk_t *chunk;
+    uint32_t pos;
+    uint32_t n;
+    int64_t ms;
+    int64_t delta;
+    uint64_t value;
+    uint8_t leading;
+    uint8_t trailing;
+    bool error;
+} storage_chunk_iter_t;
+
+static inline double storage_value_to_double(mdb_value_t value)
+{
+    switch(value.type) {
+    case MDB_VALUE_TYPE_GAUGE_FLOAT64:
+        return value.float64;
+    case MDB_VALUE_TYPE_GAUGE_INT64:
+        return value.int64;
+    case MDB_VALUE_TYPE_COUNTER_UINT64:
+        return value.uint64;
+    case MDB_VALUE_TYPE_COUNTER_FLOAT64:
+        return value.float64;
+    case MDB_VALUE_TYPE_BOOL:
+        return value.boolean ? 1.0 : 0.0;
+    case MDB_VALUE_TYPE_INFO:
+        return 1.0;
+    }
+
+    return 0.0;
+}
+
+static storage_chunk_t *storage_chunk_alloc(storage_chunk_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->free == NULL) {
+        storage_chunk_slab_t *slab = malloc(sizeof(*slab));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        for (size_t i = 0; i < STORAGE_CHUNK_SLAB_SIZE; i++) {
+            slab->chunks[i].next = pool->free;
+            pool->free = &slab->chunks[i];
+        }
+
+        pool->alloc += STORAGE_CHUNK_SLAB_SIZE;
+    }
+
+    storage_chunk_t *chunk = pool->free;
+    pool->free = chunk->next;
+    pool->used++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    memset(chunk, 0, sizeof(*chunk));
+
+    return chunk;
+}
+
+static void storage_chunk_release(storage_chunk_pool_t *pool, storage_chunk_t *chunk)
+{
+    pthread_mutex_lock(&pool->lock);
+    chunk->next = pool->free;
+    pool->free = chunk;
+    pool->used--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void storage_chunk_put(storage_chunk_t *chunk, uint64_t value, unsigned int nbits)
+{
+    while (nbits > 0) {
+        unsigned int avail = 8 - (chunk->bits & 7);
+        unsigned int n = nbits < avail ? nbits : avail;
+        uint8_t bits = (value >> (nbits - n)) & ((1U << n) - 1);
+        chunk->data[chunk->bits >> 3] |= bits << (avail - n);
+        chunk->bits += n;
+        nbits -= n;
+    }
+}
+
+static inline uint64_t storage_chunk_get(storage_chunk_iter_t *iter, unsigned int nbits)
+{
+    uint64_t value = 0;
+
+    /* A corrupted chunk must not be read past the bits it holds. */
+    if ((nbits > 64) || ((iter->pos + nbits) > iter->chunk->bits)) {
+        iter->error = true;
+        return 0;
+    }
+
+    while (nbits > 0) {
+        unsigned int avail = 8 - (iter->pos & 7);
+        unsigned int n = nbits < avail ? nbits : avail;
+        uint8_t bits = (iter->chunk->data[iter->pos >> 3] >> (avail - n)) & ((1U << n) - 1);
+        value = (value << n) | bits;
+        iter->pos += n;
+        nbits -= n;
+    }
+
+    return value;
+}
+
+static inline bool storage_chunk_dod_fits(int64_t dod, unsigned int nbits)
+{
+    return (dod > -(INT64_C(1) << (nbits - 1))) && (dod <= (INT64_C(1) << (nbits - 1)));
+}
+
+static void storage_chunk_append(storage_chunk_entry_t *entry, storage_chunk_t *chunk,
+                                 int64_t ms, uint64_t value)
+{
+    if (chunk->num == 0) {
+        storage_chunk_put(chunk, ms, 64);
+        storage_chunk_put(chunk, value, 64);
+        entry->last_delta = 0;
+        entry->leading = STORAGE_CHUNK_NO_ZEROS;
+        entry->trailing = 0;
+    } else {
+        int64_t delta = ms - entry->last_ms;
+        int64_t dod = delta - entry->last_delta;
+
+        if (dod == 0) {
+            storage_chunk_put(chunk, 0x00, 1);
+        } else if (storage_chunk_dod_fits(dod, 14)) {
+            storage_chunk_put(chunk, 0x02, 2);
+            storage_chunk_put(chunk, (uint64_t)dod, 14);
+        } else if (storage_chunk_dod_fits(dod, 17)) {
+            storage_chunk_put(chunk, 0x06, 3);
+            storage_chunk_put(chunk, (uint64_t)dod, 17);
+        } else if (storage_chunk_dod_fits(dod, 20)) {
+            storage_chunk_put(chunk, 0x0e, 4);
+            storage_chunk_put(chunk, (uint64_t)dod, 20);
+        } else {
+            storage_chunk_put(chunk, 0x0f, 4);
+            storage_chunk_put(chunk, (uint64_t)dod, 64);
+        }
+
+        entry->last_delta = delta;
+
+        uint64_t xor = value ^ entry->last_value;
+        if (xor == 0) {
+            storage_chunk_put(chunk, 0x00, 1);
+        } else {
+            uint8_t leading = __builtin_clzll(xor);
+            uint8_t trailing = __builtin_ctzll(xor);
+            /* The leading zeros are stored in 5 bits. */
+            if (leading > 31)
+                leading = 31;
+
+            if ((entry->leading != STORAGE_CHUNK_NO_ZEROS) &&
+                (leading >= entry->leading) && (trailing >= entry->trailing)) {
+                storage_chunk_put(chunk, 0x02, 2);
+                storage_chunk_put(chunk, xor >> entry->trailing,
+                                         64 - entry->leading - entry->trailing);
+            } else {
+                unsigned int sigbits = 64 - leading - trailing;
+                storage_chunk_put(chunk, 0x03, 2);
+                storage_chunk_put(chunk, leading, 5);
+                /* 64 significant bits do not fit in 6 bits, they are stored as 0. */
+                storage_chunk_put(chunk, sigbits & 0x3f, 6);
+                storage_chunk_put(chunk, xor >> trailing, sigbits);
+                entry->leading = leading;
+                entry->trailing = trailing;
+            }
+        }
+    }
+
+    entry->last_ms = ms;
+    entry->last_value = value;
+    chunk->num++;
+}
+
+static inline void storage_chunk_iter_init(storage_chunk_iter_t *iter, const storage_chunk_t *chunk)
+{
+    *iter = (storage_chunk_iter_t){.chunk = chunk, .leading = STORAGE_CHUNK_NO_ZEROS};
+}
+
+static inline int64_t storage_chunk_get_dod(storage_chunk_iter_t *iter, unsigned int nbits)
+{
+    uint64_t bits = storage_chunk_get(iter, nbits);
+    if (bits > (UINT64_C(1) << (nbits - 1)))
+        return (int64_t)bits - (INT64_C(1) << nbits);
+    return (int64_t)bits;
+}
+
+static bool storage_chunk_next(storage_chunk_iter_t *iter, cdtime_t *time, double *value)
+{
+    if (iter->n >= iter->chunk->num)
+        return false;
+
+    if (iter->n == 0) {
+        iter->ms = (int64_t)storage_chunk_get(iter, 64);
+        iter->value = storage_chunk_get(iter, 64);
+    } else {
+        int64_t dod = 0;
+        if (storage_chunk_get(iter, 1) != 0) {
+            if (storage_chunk_get(iter, 1) == 0) {
+                dod = storage_chunk_get_dod(iter, 14);
+            } else if (storage_chunk_get(iter, 1) == 0) {
+                dod = storage_chunk_get_dod(iter, 17);
+            } else if (storage_chunk_get(iter, 1) == 0) {
+                dod = storage_chunk_get_dod(iter, 20);
+            } else {
+                dod = (int64_t)storage_chunk_get(iter, 64);
+            }
+        }
+
+        /* Wrap instead of overflowing on a corrupted chunk. */
+        iter->delta = (int64_t)((uint64_t)iter->delta + (uint64_t)dod);
+        iter->ms = (int64_t)((uint64_t)iter->ms + (uint64_t)iter->delta);
+
+        if (storage_chunk_get(iter, 1) != 0) {
+            if (storage_chunk_get(iter, 1) != 0) {
+                iter->leading = storage_chunk_get(iter, 5);
+                unsigned int sigbits = storage_chunk_get(iter, 6);
+                if (sigbits == 0)
+                    sigbits = 64;
+                if ((iter->leading + sigbits) > 64) {
+                    iter->error = true;
+                    return false;
+                }
+                iter->trailing = 64 - iter->leading - sigbits;
+            }
+            if (iter->leading == STORAGE_CHUNK_NO_ZEROS) {
+                iter->error = true;
+                return false;
+            }
+            unsigned int sigbits = 64 - iter->leading - iter->trailing;
+            iter->value ^= storage_chunk_get(iter, sigbits) << iter->trailing;
+        }
+    }
+
+    if (iter->error)
+        return false;
+
+    iter->n++;
+
+    union { uint64_t u; double d; } v = {.u = iter->value};
+    *value = v.d;
+    *time = MS_TO_CDTIME_T(iter->ms);
+
+    return true;
+}
+
+static int storage_chunk_insert(storage_chunk_store_t *store, storage_chunk_entry_t *entry,
+                                cdtime_t time, double dval)
+{
+    if ((store == NULL) || (entry == NULL))
+        return -1;
+
+    int64_t ms = CDTIME_T_TO_MS(time);
+    /* Samples are only appended in time order. */
+    if ((entry->tail != NULL) && (ms <= entry->last_ms))
+        return -1;
+
+    storage_chunk_t *chunk = entry->tail;
+    if ((chunk == NULL) ||
+        ((STORAGE_CHUNK_DATA_SIZE * 8 - chunk->bits) < STORAGE_CHUNK_SAMPLE_BITS_MAX)) {
+        chunk = storage_chunk_alloc(&store->pool);
+        if (chunk == NULL)
+            return -1;
+
+        if (entry->tail == NULL) {
+            entry->head = chunk;
+        } else {
+            entry->tail->next = chunk;
+        }
+        entry->tail = chunk;
+    }
+
+    union { double d; uint64_t u; } v = {.d = dval};
+    storage_chunk_append(entry, chunk, ms, v.u);
+
+    if (chunk->num == 1)
+        chunk->first_time = time;
+    chunk->last_time = time;
+
+    while ((entry->head != entry->tail) && ((entry->head->last_time + store->retention) < time)) {
+        storage_chunk_t *old = entry->head;
+        entry->head = old->next;
+        storage_chunk_release(&store->pool, old);
+    }
+
+    return 0;
+}
+
+/* Append a chunk read from disk, the encoder state of the series is restored
+ * from the samples of the chunk so the next samples can be appended to it. */
+static int storage_chunk_restore(storage_chunk_store_t *store, storage_chunk_entry_t *entry,
+                                 cdtime_t interval, const storage_chunk_t *src)
+{
+    if ((src->num == 0) || (src->bits > (STORAGE_CHUNK_DATA_SIZE * 8)))
+        return -1;
+
+    if ((entry->tail != NULL) && (src->first_time <= entry->tail->last_time))
+        return -1;
+
+    storage_chunk_iter_t iter;
+    storage_chunk_iter_init(&iter, src);
+
+    cdtime_t ptime = 0;
+    double pvalue = NAN;
+    while (storage_chunk_next(&iter, &ptime, &pvalue))
+        continue;
+
+    if (iter.error || (iter.n != src->num) || (iter.pos != src->bits) || (iter.ms != (int64_t)CDTIME_T_TO_MS(src->last_time)))
+        return -1;
+
+    storage_chunk_t *chunk = storage_chunk_alloc(&store->pool);
+    if (chunk == NULL)
+        return -1;
+
+    chunk->first_time = src->first_time;
+    chunk->last_time = src->last_time;
+    chunk->num = src->num;
+    chunk->bits = src->bits;
+    memcpy(chunk->data, src->data, sizeof(chunk->data));
+
+    if (entry->tail == NULL) {
+        entry->head = chunk;
+    } else {
+        entry->tail->next = chunk;
+    }
+    entry->tail = chunk;
+
+    entry->interval = interval;
+    entry->last_ms = iter.ms;
+    entry->last_delta = iter.delta;
+    entry->last_value = iter.value;
+    entry->leading = iter.leading;
+    entry->trailing = iter.trailing;
+
+    return 0;
+}
+
+static int storage_chunk_fetch_samples(storage_chunk_entry_t *entry, mdb_samples_t *samples,
+                                       cdtime_t start, cdtime_t end)
+{
+    int64_t start_ms = CDTIME_T_TO_MS(start);
+    int64_t end_ms = CDTIME_T_TO_MS(end);
+
+    for (storage_chunk_t *chunk = entry->head; chunk != NULL; chunk = chunk->next) {
+        if ((chunk->num == 0) || (chunk->last_time < start))
+            continue;
+        if (chunk->first_time > end)
+            break;
+
+        if (mdb_samples_reserve(samples, chunk->num) != 0)
+            return -1;
+
+        storage_chunk_iter_t iter;
+        storage_chunk_iter_init(&iter, chunk);
+
+        cdtime_t ptime = 0;
+        double pvalue = NAN;
+        while (storage_chunk_next(&iter, &ptime, &pvalue)) {
+            if (iter.ms < start_ms)
+                continue;
+            if (iter.ms > end_ms)
+                break;
+            samples->times[samples->num] = iter.ms;
+            samples->values[samples->num] = pvalue;
+            samples->num++;
+        }
+    }
+
+    return 0;
+}
+
+int storage_init(storage_t *storage, cdtime_t retention)
 {
     if (storage == NULL)
         return -1;
 
     storage->mem.length = 6;
 //    storage->mem.length = 300;
-    storage->type = STORAGE_TYPE_MEMORY;
+    storage->chunk.retention = retention;
+    pthread_mutex_init(&storage->chunk.pool.lock, NULL);
+    storage->type = STORAGE_TYPE_CHUNK;
 
     return 0;
 }
@@ -21,7 +408,19 @@ void storage_destroy(storage_t *storage)
     if (storage == NULL)
         return;
 
-    return;
+    storage_chunk_pool_t *pool = &storage->chunk.pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs != NULL) {
+        storage_chunk_slab_t *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free = NULL;
+    pool->alloc = 0;
+    pool->used = 0;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_destroy(&pool->lock);
 }
 
 void storage_id_destroy(storage_t *storage, storage_id_t *sid)
@@ -32,6 +431,17 @@ void storage_id_destroy(storage_t *storage, storage_id_t *sid)
     if (storage->type == STORAGE_TYPE_MEMORY) {
         free(sid->entry);
         sid->entry = NULL;
+    } else if (storage->type == STORAGE_TYPE_CHUNK) {
+        if (sid->chunk == NULL)
+            return;
+        storage_chunk_t *chunk = sid->chunk->head;
+        while (chunk != NULL) {
+            storage_chunk_t *next = chunk->next;
+            storage_chunk_release(&storage->chunk.pool, chunk);
+            chunk = next;
+        }
+        free(sid->chunk);
+        sid->chunk = NULL;
     }
 }
 
@@ -62,6 +472,17 @@ int storage_id_init(storage_t *storage, storage_id_t *sid, cdtime_t interval)
 
         sid->entry = entry;
 
+        return 0;
+    } else if (storage->type == STORAGE_TYPE_CHUNK) {
+        storage_chunk_entry_t *entry = calloc(1, sizeof(*entry));
+        if (entry == NULL)
+            return 0;
+
+        entry->interval = interval;
+        entry->leading = STORAGE_CHUNK_NO_ZEROS;
+
+        sid->chunk = entry;
+
         return 0;
     }
 
@@ -75,28 +496,7 @@ static int storage_memory_insert(storage_memory_t *mem, storage_memory_entry_t *
     if ((mem == NULL) || (entry == NULL))
         return -1;
 
-    double dval = 0.0;
-
-    switch(value.type) {
-    case MDB_VALUE_TYPE_GAUGE_FLOAT64:
-        dval = value.float64;
-        break;
-    case MDB_VALUE_TYPE_GAUGE_INT64:
-        dval = value.int64;
-        break;
-    case MDB_VALUE_TYPE_COUNTER_UINT64:
-        dval = value.uint64;
-        break;
-    case MDB_VALUE_TYPE_COUNTER_FLOAT64:
-        dval = value.float64;
-        break;
-    case MDB_VALUE_TYPE_BOOL:
-        dval = value.boolean ? 1.0 : 0.0;
-        break;
-    case MDB_VALUE_TYPE_INFO:
-        dval = 1.0;
-        break;
-    }
+    double dval = storage_value_to_double(value);
 
     assert(mem->length > 0);
     size_t length = mem->length;
@@ -121,96 +521,148 @@ static int storage_memory_insert(storage_memory_t *mem, storage_memory_entry_t *
     return 0;
 }
 
-static int storage_memory_fetch(storage_memory_t *mem, storage_memory_entry_t *entry,
-                                mdb_series_t *series,
-                                __attribute__((unused)) cdtime_t time)
-{
-    if ((mem == NULL) || (entry == NULL) || (series == NULL))
-        return -1;
-
-    return 0;
-}
-
-static int storage_memory_fetch_range(storage_memory_t *mem, storage_memory_entry_t *entry,
-                                      mdb_series_t *series,
-                                      __attribute__((unused)) cdtime_t start,
-                                      __attribute__((unused)) cdtime_t end,
-                                      __attribute__((unused)) cdtime_t step)
+static int storage_memory_fetch_samples(storage_memory_t *mem, storage_memory_entry_t *entry,
+                                        mdb_samples_t *samples, cdtime_t start, cdtime_t end)
 {
-    if ((mem == NULL) || (entry == NULL) || (series == NULL))
+    if ((mem == NULL) || (entry == NULL) || (samples == NULL))
         return -1;
-#if 0
-    cdtime_t st_start = entry->points[entry->head].time;
-    size_t n_end = entry->head + entry->num;
-    if (n_end >= mem->length)
-        n_end %= mem->length;
-    cdtime_t st_end =  entry->points[n_end].time;
 
-    if (end < st_start)
+    if (entry->num == 0)
         return 0;
-    if (start > st_end)
-        return 0;
-
-    cdtime_t start_ts = series->points[0].timestamp;
 
-    size_t n = 0;
-    while(n < entry->num)  {
-        size_t n = entry->heap + ts;
-        if (n > mem->length)
-            n %= mem->length;
+    if (mdb_samples_reserve(samples, entry->num) != 0)
+        return -1;
 
-        if (entry->points[n].time < start_ts)
+    size_t length = mem->length;
+    /* The oldest point is num positions behind the next free slot. */
+    size_t n = (entry->tail + length - entry->num) % length;
+    for (size_t i = 0; i < entry->num; i++) {
+        storage_memory_point_t *point = &entry->points[n];
+        n = (n + 1) % length;
+        if (point->time < start)
+            continue;
+        if (point->time > end)
             break;
-
-        n++;
+        samples->times[samples->num] = CDTIME_T_TO_MS(point->time);
+        samples->values[samples->num] = point->value;
+        samples->num++;
     }
 
-    if (n >= entry->num)
-        break;
+    return 0;
+}
 
-    for (size_t i = 0; i < series->num ; i++) {
-        cdtime_t ts = series->points[i].timestamp;
+int storage_insert(storage_t *storage, storage_id_t *sid,
+                   cdtime_t time, cdtime_t interval, mdb_value_t value)
+{
+    if ((storage == NULL) || (sid == NULL))
+        return -1;
 
+    if (storage->type == STORAGE_TYPE_MEMORY)
+        return storage_memory_insert(&storage->mem, sid->entry, time, interval, value);
+    else if (storage->type == STORAGE_TYPE_CHUNK)
+        return storage_chunk_insert(&storage->chunk, sid->chunk, time,
+                                    storage_value_to_double(value));
 
+    return 0;
+}
 
+int storage_restore_chunk(storage_t *storage, storage_id_t *sid, cdtime_t interval,
+                          const storage_chunk_t *chunk)
+{
+    if ((storage == NULL) || (sid == NULL) || (chunk == NULL))
+        return -1;
 
-    }
+    if ((storage->type != STORAGE_TYPE_CHUNK) || (sid->chunk == NULL))
+        return -1;
 
-#endif
-    return 0;
+    return storage_chunk_restore(&storage->chunk, sid->chunk, interval, chunk);
 }
 
-int storage_insert(storage_t *storage, storage_id_t *sid,
-                   cdtime_t time, cdtime_t interval, mdb_value_t value)
+int storage_fetch_samples(storage_t *storage, storage_id_t *sid, mdb_samples_t *samples,
+                          cdtime_t start, cdtime_t end)
 {
-    if ((storage == NULL) || (sid == NULL))
+    if ((storage == NULL) || (sid == NULL) || (samples == NULL))
         return -1;
 
     if (storage->type == STORAGE_TYPE_MEMORY)
-        return storage_memory_insert(&storage->mem, sid->entry, time, interval, value);
+        return storage_memory_fetch_samples(&storage->mem, sid->entry, samples, start, end);
+    else if ((storage->type == STORAGE_TYPE_CHUNK) && (sid->chunk != NULL))
+        return storage_chunk_fetch_samples(sid->chunk, samples, start, end);
 
     return 0;
 }
 
 int storage_fetch(storage_t *storage, storage_id_t *sid, mdb_series_t *series, cdtime_t time)
 {
-    if ((storage == NULL) || (sid == NULL))
+    if ((storage == NULL) || (sid == NULL) || (series == NULL))
         return -1;
 
-    if (storage->type == STORAGE_TYPE_MEMORY)
-        return storage_memory_fetch(&storage->mem, sid->entry, series, time);
+    series->num = 0;
 
+    mdb_samples_t samples = {0};
+    cdtime_t start = time > MDB_LOOKBACK_DELTA ? time - MDB_LOOKBACK_DELTA : 0;
+    int status = storage_fetch_samples(storage, sid, &samples, start, time);
+    if ((status != 0) || (samples.num == 0)) {
+        mdb_samples_reset(&samples);
+        return status;
+    }
+
+    mdb_point_t *points = realloc(series->points, sizeof(*points));
+    if (points == NULL) {
+        mdb_samples_reset(&samples);
+        return -1;
+    }
+    series->points = points;
+    series->points[0].timestamp = samples.times[samples.num - 1];
+    series->points[0].value = samples.values[samples.num - 1];
+    series->num = 1;
+
+    mdb_samples_reset(&samples);
     return 0;
 }
 
+/* Every step takes the last sample not older than the lookback delta. */
 int storage_fetch_range(storage_t *storage, storage_id_t *sid,
                         mdb_series_t *series, cdtime_t start, cdtime_t end, cdtime_t step)
 {
-    if ((storage == NULL) || (sid == NULL))
+    if ((storage == NULL) || (sid == NULL) || (series == NULL))
         return -1;
 
-    if (storage->type == STORAGE_TYPE_MEMORY)
-        return storage_memory_fetch_range(&storage->mem, sid->entry, series, start, end, step);
+    series->num = 0;
+
+    if ((step == 0) || (end < start))
+        return 0;
+
+    mdb_samples_t samples = {0};
+    cdtime_t first = start > MDB_LOOKBACK_DELTA ? start - MDB_LOOKBACK_DELTA : 0;
+    int status = storage_fetch_samples(storage, sid, &samples, first, end);
+    if ((status != 0) || (samples.num == 0)) {
+        mdb_samples_reset(&samples);
+        return status;
+    }
+
+    size_t steps = (end - start) / step + 1;
+    mdb_point_t *points = realloc(series->points, sizeof(*points) * steps);
+    if (points == NULL) {
+        mdb_samples_reset(&samples);
+        return -1;
+    }
+    series->points = points;
+
+    int64_t lookback = CDTIME_T_TO_MS(MDB_LOOKBACK_DELTA);
+    int64_t ts = CDTIME_T_TO_MS(start);
+    int64_t ts_step = CDTIME_T_TO_MS(step);
+    size_t n = 0;
+    for (size_t i = 0; i < steps; i++, ts += ts_step) {
+        while ((n < samples.num) && (samples.times[n] <= ts))
+            n++;
+        if ((n == 0) || (samples.times[n-1] <= (ts - lookback)))
+            continue;
+        series->points[series->num].timestamp = ts;
+        series->points[series->num].value = samples.values[n-1];
+        series->num++;
+    }
 
+    mdb_samples_reset(&samples);
     return 0;
 }
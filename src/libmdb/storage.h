@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <pthread.h>
+
 #include "libmdb/mdb.h"
 
 typedef struct {
@@ -25,21 +27,65 @@ typedef struct {
     size_t length;
 } storage_memory_t;
 
+/* Samples are compressed as in Facebook's Gorilla paper: the timestamps (in
+ * milliseconds) as delta of deltas and the values as the XOR with the previous
+ * value. A chunk is never changed once it is full. */
+#define STORAGE_CHUNK_DATA_SIZE 240
+
+typedef struct storage_chunk_s storage_chunk_t;
+struct storage_chunk_s {
+    storage_chunk_t *next;
+    cdtime_t first_time;
+    cdtime_t last_time;
+    uint32_t num;
+    uint32_t bits;
+    uint8_t data[STORAGE_CHUNK_DATA_SIZE];
+};
+
+typedef struct {
+    storage_chunk_t *head;
+    storage_chunk_t *tail;
+    cdtime_t interval;
+    int64_t last_ms;
+    int64_t last_delta;
+    uint64_t last_value;
+    uint8_t leading;
+    uint8_t trailing;
+} storage_chunk_entry_t;
+
+typedef struct storage_chunk_slab_s storage_chunk_slab_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    storage_chunk_t *free;
+    storage_chunk_slab_t *slabs;
+    size_t alloc;
+    size_t used;
+} storage_chunk_pool_t;
+
+typedef struct {
+    cdtime_t retention;
+    storage_chunk_pool_t pool;
+} storage_chunk_store_t;
+
 typedef struct {
     storage_memory_entry_t *entry;
+    storage_chunk_entry_t *chunk;
 } storage_id_t;
 
 typedef enum {
     STORAGE_TYPE_MEMORY,
+    STORAGE_TYPE_CHUNK,
     STORAGE_TYPE_DISK
 } storage_type_t;
 
 typedef struct {
     storage_type_t type;
     storage_memory_t mem;
+    storage_chunk_store_t chunk;
 } storage_t;
 
-int storage_init(storage_t *storage);
+int storage_init(storage_t *storage, cdtime_t retention);
 
 void storage_destroy(storage_t *storage);
 
@@ -50,8 +96,13 @@ int storage_id_init(storage_t *storage, storage_id_t *sid, cdtime_t interval);
 int storage_insert(storage_t *storage, storage_id_t *sid,
                    cdtime_t time, cdtime_t interval, mdb_value_t value);
 
+int storage_restore_chunk(storage_t *storage, storage_id_t *sid, cdtime_t interval,
+                          const storage_chunk_t *chunk);
+
+int storage_fetch_samples(storage_t *storage, storage_id_t *sid, mdb_samples_t *samples,
+                          cdtime_t start, cdtime_t end);
+
 int storage_fetch(storage_t *storage, storage_id_t *sid, mdb_series_t *series, cdtime_t time);
 
 int storage_fetch_range(storage_t *storage, storage_id_t *sid,
                         mdb_series_t *series, cdtime_t start, cdtime_t end, cdtime_t step);
-
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/time.h"
+#include "libmdb/storage.h"
+#include "libmdb/series_list.h"
+
+#include <math.h>
+#include <float.h>
+
+#define BASE_MS INT64_C(1700000000000)
+
+static uint64_t double_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static size_t chunk_count(storage_id_t *sid)
+{
+    size_t n = 0;
+    for (storage_chunk_t *chunk = sid->chunk->head; chunk != NULL; chunk = chunk->next)
+        n++;
+    return n;
+}
+
+static int fetch_all(storage_t *storage, storage_id_t *sid, mdb_samples_t *samples)
+{
+    samples->num = 0;
+    return storage_fetch_samples(storage, sid, samples, 0, MS_TO_CDTIME_T(INT64_C(1) << 42));
+}
+
+static int insert_ms(storage_t *storage, storage_id_t *sid, int64_t ms, double value)
+{
+    return storage_insert(storage, sid, MS_TO_CDTIME_T(ms), TIME_T_TO_CDTIME_T(10),
+                          MDB_VALUE_GAUGE_FLOAT64(value));
+}
+
+DEF_TEST(round_trip)
+{
+    struct {
+        int64_t ms;
+        double value;
+    } cases[] = {
+        { BASE_MS,                             0.0          },
+        /* Same delta twice: a zero delta of delta. */
+        { BASE_MS + 10000,                     0.0          },
+        { BASE_MS + 20000,                     1.0          },
+        /* Negative delta of delta in every size. */
+        { BASE_MS + 29999,                     -1.0         },
+        { BASE_MS + 29999 + 1,                 -0.0         },
+        { BASE_MS + 30000 + 5000,              NAN          },
+        { BASE_MS + 35000 + 70000,             INFINITY     },
+        { BASE_MS + 105000 + 1,                -INFINITY    },
+        { BASE_MS + 105001 + 600000,           DBL_MAX      },
+        { BASE_MS + 705001 + 1,                DBL_MIN      },
+        { BASE_MS + 705002 + 1,                -DBL_MAX     },
+        /* A jump that only fits in 64 bits and back. */
+        { BASE_MS + (INT64_C(1) << 40),        4.9e-324     },
+        { BASE_MS + (INT64_C(1) << 40) + 1,    1e300        },
+        { BASE_MS + (INT64_C(1) << 40) + 2,    1e300        },
+        { BASE_MS + (INT64_C(1) << 40) + 3,    -1e-300      },
+        { BASE_MS + (INT64_C(1) << 41),        12345.6789   },
+        { BASE_MS + (INT64_C(1) << 41) + 1000, NAN          },
+        { BASE_MS + (INT64_C(1) << 41) + 2000, NAN          },
+    };
+
+    storage_t storage = {0};
+    CHECK_ZERO(storage_init(&storage, TIME_T_TO_CDTIME_T((uint64_t)86400 * 365 * 200)));
+    storage_id_t sid = {0};
+    CHECK_ZERO(storage_id_init(&storage, &sid, TIME_T_TO_CDTIME_T(10)));
+    CHECK_NOT_NULL(sid.chunk);
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++)
+        CHECK_ZERO(insert_ms(&storage, &sid, cases[i].ms, cases[i].value));
+
+    /* Samples are only appended in time order. */
+    OK(insert_ms(&storage, &sid, cases[0].ms, 1.0) != 0);
+    OK(insert_ms(&storage, &sid, cases[STATIC_ARRAY_SIZE(cases) - 1].ms, 1.0) != 0);
+
+    mdb_samples_t samples = {0};
+    CHECK_ZERO(fetch_all(&storage, &sid, &samples));
+    EXPECT_EQ_INT(STATIC_ARRAY_SIZE(cases), samples.num);
+    for (size_t i = 0; i < samples.num; i++) {
+        EXPECT_EQ_UINT64(cases[i].ms, samples.times[i]);
+        EXPECT_EQ_UINT64(double_bits(cases[i].value), double_bits(samples.values[i]));
+    }
+
+    /* Only the samples inside the range are returned. */
+    samples.num = 0;
+    CHECK_ZERO(storage_fetch_samples(&storage, &sid, &samples, MS_TO_CDTIME_T(BASE_MS + 20000),
+                                     MS_TO_CDTIME_T(BASE_MS + 105000)));
+    EXPECT_EQ_INT(5, samples.num);
+    EXPECT_EQ_UINT64(BASE_MS + 20000, samples.times[0]);
+    EXPECT_EQ_UINT64(BASE_MS + 105000, samples.times[4]);
+
+    mdb_samples_reset(&samples);
+    storage_id_destroy(&storage, &sid);
+    storage_destroy(&storage);
+    return 0;
+}
+
+DEF_TEST(rollover)
+{
+    storage_t storage = {0};
+    CHECK_ZERO(storage_init(&storage, TIME_T_TO_CDTIME_T(86400)));
+    storage_id_t sid = {0};
+    CHECK_ZERO(storage_id_init(&storage, &sid, TIME_T_TO_CDTIME_T(10)));
+
+    /* Jittered timestamps and noisy values fill the chunks fast. */
+    uint32_t seed = 0x12345678;
+    size_t num = 2000;
+    int64_t ms = BASE_MS;
+    size_t failed = 0;
+    for (size_t i = 0; i < num; i++) {
+        seed = seed * 1103515245 + 12345;
+        ms += 10000 + (int64_t)(seed >> 24) - 128;
+        if (insert_ms(&storage, &sid, ms, (double)seed / 7.0) != 0)
+            failed++;
+    }
+    EXPECT_EQ_INT(0, failed);
+
+    size_t nchunks = chunk_count(&sid);
+    OK(nchunks > 1);
+    EXPECT_EQ_INT(nchunks, storage.chunk.pool.used);
+
+    size_t total = 0;
+    for (storage_chunk_t *chunk = sid.chunk->head; chunk != NULL; chunk = chunk->next) {
+        OK(chunk->bits <= (STORAGE_CHUNK_DATA_SIZE * 8));
+        OK(chunk->first_time <= chunk->last_time);
+        if (chunk->next != NULL)
+            OK(chunk->last_time < chunk->next->first_time);
+        total += chunk->num;
+    }
+    EXPECT_EQ_INT(num, total);
+
+    mdb_samples_t samples = {0};
+    CHECK_ZERO(fetch_all(&storage, &sid, &samples));
+    EXPECT_EQ_INT(num, samples.num);
+
+    seed = 0x12345678;
+    ms = BASE_MS;
+    for (size_t i = 0; i < samples.num; i++) {
+        seed = seed * 1103515245 + 12345;
+        ms += 10000 + (int64_t)(seed >> 24) - 128;
+        EXPECT_EQ_UINT64(ms, samples.times[i]);
+        EXPECT_EQ_UINT64(double_bits((double)seed / 7.0), double_bits(samples.values[i]));
+    }
+
+    mdb_samples_reset(&samples);
+    storage_id_destroy(&storage, &sid);
+    EXPECT_EQ_INT(0, storage.chunk.pool.used);
+    storage_destroy(&storage);
+    return 0;
+}
+
+DEF_TEST(retention)
+{
+    storage_t storage = {0};
+    CHECK_ZERO(storage_init(&storage, TIME_T_TO_CDTIME_T(3600)));
+    storage_id_t sid = {0};
+    CHECK_ZERO(storage_id_init(&storage, &sid, TIME_T_TO_CDTIME_T(1)));
+
+    /* Twelve hours of a sample per second. */
+    int64_t last_ms = 0;
+    size_t failed = 0;
+    for (int64_t t = 0; t < 12 * 3600; t++) {
+        last_ms = BASE_MS + t * 1000;
+        if (insert_ms(&storage, &sid, last_ms, (double)t) != 0)
+            failed++;
+    }
+    EXPECT_EQ_INT(0, failed);
+
+    /* Only the chunks with samples inside the retention are kept. */
+    cdtime_t now = MS_TO_CDTIME_T(last_ms);
+    cdtime_t retention = TIME_T_TO_CDTIME_T(3600);
+    OK((sid.chunk->head->last_time + retention) >= now);
+    OK(sid.chunk->head->first_time > MS_TO_CDTIME_T(BASE_MS + 10 * 3600 * 1000));
+    EXPECT_EQ_INT(chunk_count(&sid), storage.chunk.pool.used);
+    /* The expired chunks are reused from the pool. */
+    OK(storage.chunk.pool.alloc < 2 * storage.chunk.pool.used + 64);
+
+    mdb_samples_t samples = {0};
+    CHECK_ZERO(fetch_all(&storage, &sid, &samples));
+    OK(samples.num > 3600);
+    OK(samples.num < 12 * 3600);
+    EXPECT_EQ_UINT64(last_ms, samples.times[samples.num - 1]);
+    EXPECT_EQ_DOUBLE(12 * 3600 - 1, samples.values[samples.num - 1]);
+    size_t gaps = 0;
+    for (size_t i = 1; i < samples.num; i++) {
+        if ((samples.times[i] - samples.times[i - 1]) != 1000)
+            gaps++;
+    }
+    EXPECT_EQ_INT(0, gaps);
+
+    mdb_samples_reset(&samples);
+    storage_id_destroy(&storage, &sid);
+    storage_destroy(&storage);
+    return 0;
+}
+
+DEF_TEST(restore_chunk)
+{
+    storage_t storage = {0};
+    CHECK_ZERO(storage_init(&storage, TIME_T_TO_CDTIME_T(86400)));
+    storage_id_t src = {0};
+    CHECK_ZERO(storage_id_init(&storage, &src, TIME_T_TO_CDTIME_T(10)));
+
+    int64_t ms = BASE_MS;
+    size_t failed = 0;
+    for (size_t i = 0; i < 500; i++) {
+        ms += (i % 3) == 0 ? 10000 : 9990;
+        if (insert_ms(&storage, &src, ms, (i % 5) == 0 ? NAN : sin((double)i)) != 0)
+            failed++;
+    }
+    EXPECT_EQ_INT(0, failed);
+    OK(chunk_count(&src) > 1);
+
+    storage_id_t dst = {0};
+    CHECK_ZERO(storage_id_init(&storage, &dst, TIME_T_TO_CDTIME_T(10)));
+    for (storage_chunk_t *chunk = src.chunk->head; chunk != NULL; chunk = chunk->next)
+        CHECK_ZERO(storage_restore_chunk(&storage, &dst, TIME_T_TO_CDTIME_T(10), chunk));
+    EXPECT_EQ_INT(chunk_count(&src), chunk_count(&dst));
+
+    /* A chunk that is not newer than the last one is refused. */
+    OK(storage_restore_chunk(&storage, &dst, TIME_T_TO_CDTIME_T(10), src.chunk->tail) != 0);
+
+    /* The encoder state is restored, the next samples are appended to both the same way. */
+    for (size_t i = 0; i < 5; i++) {
+        ms += 20000 + i;
+        CHECK_ZERO(insert_ms(&storage, &src, ms, -(double)i));
+        CHECK_ZERO(insert_ms(&storage, &dst, ms, -(double)i));
+    }
+    EXPECT_EQ_INT(src.chunk->tail->bits, dst.chunk->tail->bits);
+    EXPECT_EQ_INT(0, memcmp(src.chunk->tail->data, dst.chunk->tail->data, STORAGE_CHUNK_DATA_SIZE));
+
+    mdb_samples_t src_samples = {0};
+    mdb_samples_t dst_samples = {0};
+    CHECK_ZERO(fetch_all(&storage, &src, &src_samples));
+    CHECK_ZERO(fetch_all(&storage, &dst, &dst_samples));
+    EXPECT_EQ_INT(src_samples.num, dst_samples.num);
+    for (size_t i = 0; (i < src_samples.num) && (i < dst_samples.num); i++) {
+        EXPECT_EQ_UINT64(src_samples.times[i], dst_samples.times[i]);
+        EXPECT_EQ_UINT64(double_bits(src_samples.values[i]), double_bits(dst_samples.values[i]));
+    }
+    mdb_samples_reset(&src_samples);
+    mdb_samples_reset(&dst_samples);
+
+    /* Corrupted chunks are refused. */
+    storage_id_t bad = {0};
+    CHECK_ZERO(storage_id_init(&storage, &bad, TIME_T_TO_CDTIME_T(10)));
+    storage_chunk_t chunk = *src.chunk->head;
+    chunk.next = NULL;
+
+    chunk.bits = STORAGE_CHUNK_DATA_SIZE * 8 + 1;
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk) != 0);
+    chunk.bits = src.chunk->head->bits - 1;
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk) != 0);
+    chunk.bits = src.chunk->head->bits;
+    chunk.num = src.chunk->head->num + 1;
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk) != 0);
+    chunk.num = 0;
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk) != 0);
+    chunk.num = src.chunk->head->num;
+    chunk.last_time += TIME_T_TO_CDTIME_T(1);
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk) != 0);
+    chunk.last_time = src.chunk->head->last_time;
+    /* Garbage must be refused or decoded inside the chunk, never read past it. */
+    uint32_t seed = 0xdeadbeef;
+    for (size_t i = 0; i < 1000; i++) {
+        seed = seed * 1103515245 + 12345;
+        chunk.data[(seed >> 8) % chunk.bits / 8] ^= 1 << ((seed >> 4) & 7);
+        storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), &chunk);
+        storage_id_destroy(&storage, &bad);
+        storage_id_init(&storage, &bad, TIME_T_TO_CDTIME_T(10));
+    }
+    CHECK_NOT_NULL(bad.chunk);
+    OK(storage_restore_chunk(&storage, &bad, TIME_T_TO_CDTIME_T(10), NULL) != 0);
+
+    storage_id_destroy(&storage, &bad);
+    storage_id_destroy(&storage, &src);
+    storage_id_destroy(&storage, &dst);
+    EXPECT_EQ_INT(0, storage.chunk.pool.used);
+    storage_destroy(&storage);
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(round_trip);
+    RUN_TEST(rollover);
+    RUN_TEST(retention);
+    RUN_TEST(restore_chunk);
+
+    END_TEST;
+}
@@ -37,6 +37,7 @@ void mql_value_free(mql_value_t *value)
                     label_set_reset(&serie->metric.labels);
                     free(serie->points.ptr);
                 }
+                free(value->series.ptr);
             }
             break;
         case MQL_VALUE_SAMPLES:
@@ -46,6 +47,7 @@ void mql_value_free(mql_value_t *value)
                     free(sample->metric.name);
                     label_set_reset(&sample->metric.labels);
                 }
+                free(value->samples.ptr);
             }
             break;
         case MQL_VALUE_SCALAR:
@@ -10,6 +10,7 @@
 #include "libutils/common.h"
 #include "libutils/strbuf.h"
 #include "libutils/pack.h"
+#include "libutils/strintern.h"
 #include "libmetric/label_set.h"
 #include "libmetric/metric_chars.h"
 
@@ -99,12 +100,29 @@ char *label_ndup_value_unescape(const char *value, size_t nv)
     return new_value;
 }
 
-int _label_set_add(label_set_t *labels, bool overwrite, bool unescape,
-                    const char *name, size_t sn, const char *value, size_t sv)
+static int label_set_reserve(label_set_t *labels, size_t num)
 {
-    if ((labels == NULL) || (name == NULL))
-        return EINVAL;
+    if (num <= labels->size)
+        return 0;
+
+    size_t size = labels->size < 4 ? 4 : labels->size * 2;
+    if (size < num)
+        size = num;
+
+    label_pair_t *tmp = realloc(labels->ptr, sizeof(*labels->ptr) * size);
+    if (tmp == NULL) {
+        ERROR("realloc failed.");
+        return ENOMEM;
+    }
+
+    labels->ptr = tmp;
+    labels->size = size;
 
+    return 0;
+}
+
+static bool label_set_find(label_set_t *labels, const char *name, size_t sn, size_t *ridx)
+{
     size_t lower = 0;
     size_t upper = labels->num;
     while (lower < upper) {
@@ -116,99 +134,146 @@ int _label_set_add(label_set_t *labels, bool overwrite, bool unescape,
         } else if (cmp > 0) {
             lower = idx + 1;
         } else {
-            if ((value == NULL) || (value[0] == '\0')) {
-                free(labels->ptr[idx].name);
-                free(labels->ptr[idx].value);
-                if (idx != (labels->num - 1))
-                    memmove(labels->ptr + idx, labels->ptr + (idx + 1),
-                            sizeof(*labels->ptr) * (labels->num - (idx + 1)));
-                labels->num--;
-                if (labels->num == 0) {
-                    free(labels->ptr);
-                    labels->ptr = NULL;
-                    return 0;
-                }
-
-                label_pair_t *tmp = realloc(labels->ptr, sizeof(*labels->ptr) * labels->num);
-                if (tmp == NULL) {
-                    ERROR("realloc failed.");
-                    return -1;
-                }
-                labels->ptr = tmp;
-
-                return 0;
-            }
-            if (overwrite) {
-                char *new_value = NULL;
-                if (unescape)
-                    new_value = label_ndup_value_unescape(value, sv);
-                else
-                    new_value = sstrndup(value, sv);
-                if (new_value == NULL) {
-                    ERROR("strdup failed.");
-                    return -1;
-                }
-                free(labels->ptr[idx].value);
-                labels->ptr[idx].value = new_value;
-            }
-            return 0;
+            *ridx = idx;
+            return true;
         }
     }
 
-    size_t idx = lower;
+    *ridx = lower;
+    return false;
+}
 
-    if ((value == NULL) || (value[0] == '\0'))
-        return 0;
+static void label_set_remove(label_set_t *labels, size_t idx)
+{
+    strintern_free(labels->ptr[idx].name);
+    strintern_free(labels->ptr[idx].value);
 
-    if (!label_check_name(name, sn))
-        return EINVAL;
+    if (idx != (labels->num - 1))
+        memmove(labels->ptr + idx, labels->ptr + (idx + 1),
+                sizeof(*labels->ptr) * (labels->num - (idx + 1)));
+    labels->num--;
 
-    errno = 0;
-    label_pair_t *tmp = realloc(labels->ptr, sizeof(labels->ptr[0]) * (labels->num + 1));
-    if (tmp == NULL) {
-        ERROR("realloc failed.");
-        return -1;
+    if (labels->num == 0) {
+        free(labels->ptr);
+        labels->ptr = NULL;
+        labels->size = 0;
     }
-    labels->ptr = tmp;
+}
 
-    char *lname = sstrndup(name, sn);
+static char *label_value_intern(const char *value, size_t sv, bool unescape)
+{
+    if (!unescape)
+        return strintern_ndup(value, sv);
 
-    char *lvalue = NULL;
-    if (unescape)
-        lvalue = label_ndup_value_unescape(value, sv);
-    else
-        lvalue = sstrndup(value, sv);
+    char *unescaped = label_ndup_value_unescape(value, sv);
+    if (unescaped == NULL)
+        return NULL;
 
-    if ((lname == NULL) || (lvalue == NULL)) {
-        ERROR("strdup failed.");
-        free(lname);
-        free(lvalue);
-        return -ENOMEM;
-    }
+    char *interned = strintern_dup(unescaped);
+    free(unescaped);
 
-    labels->num++;
+    return interned;
+}
 
-    if (idx != (labels->num - 1))
+/* Insert an already interned pair, the references are taken by the set. */
+static int label_set_insert(label_set_t *labels, size_t idx, char *name, char *value)
+{
+    int status = label_set_reserve(labels, labels->num + 1);
+    if (status != 0) {
+        strintern_free(name);
+        strintern_free(value);
+        return status;
+    }
+
+    if (idx != labels->num)
         memmove(labels->ptr + (idx + 1), labels->ptr + idx,
-                sizeof(*labels->ptr) * (labels->num - (idx + 1)));
+                sizeof(*labels->ptr) * (labels->num - idx));
 
-    labels->ptr[idx].name = lname;
-    labels->ptr[idx].value = lvalue;
+    labels->ptr[idx].name = name;
+    labels->ptr[idx].value = value;
+    labels->num++;
 
     return 0;
 }
 
+int _label_set_add(label_set_t *labels, bool overwrite, bool unescape,
+                    const char *name, size_t sn, const char *value, size_t sv)
+{
+    if ((labels == NULL) || (name == NULL))
+        return EINVAL;
+
+    size_t idx = 0;
+    if (label_set_find(labels, name, sn, &idx)) {
+        if ((value == NULL) || (value[0] == '\0')) {
+            label_set_remove(labels, idx);
+            return 0;
+        }
+        if (overwrite) {
+            char *new_value = label_value_intern(value, sv, unescape);
+            if (new_value == NULL) {
+                ERROR("strdup failed.");
+                return -1;
+            }
+            strintern_free(labels->ptr[idx].value);
+            labels->ptr[idx].value = new_value;
+        }
+        return 0;
+    }
+
+    if ((value == NULL) || (value[0] == '\0'))
+        return 0;
+
+    if (!label_check_name(name, sn))
+        return EINVAL;
+
+    char *lname = strintern_ndup(name, sn);
+    char *lvalue = label_value_intern(value, sv, unescape);
+    if ((lname == NULL) || (lvalue == NULL)) {
+        ERROR("strdup failed.");
+        strintern_free(lname);
+        strintern_free(lvalue);
+        return -ENOMEM;
+    }
+
+    return label_set_insert(labels, idx, lname, lvalue);
+}
+
 int label_set_add_set(label_set_t *labels, bool overwrite, label_set_t set)
 {
     if ((labels == NULL) || (set.num == 0))
         return EINVAL;
 
+    if (set.size == 0) {
+        for (size_t i = 0; i < set.num; i++) {
+            char const *name = set.ptr[i].name;
+            char const *value = set.ptr[i].value;
+
+            label_set_add(labels, overwrite, name, value);
+        }
+        return 0;
+    }
+
+    /* The strings of a set built by label_set are interned, they are only referenced. */
+    int status = label_set_reserve(labels, labels->num + set.num);
+    if (status != 0)
+        return status;
+
     for (size_t i = 0; i < set.num; i++) {
-        char const *name = set.ptr[i].name;
-        char const *value = set.ptr[i].value;
+        char *name = set.ptr[i].name;
+        char *value = set.ptr[i].value;
+
+        size_t idx = 0;
+        if (label_set_find(labels, name, strlen(name), &idx)) {
+            if (overwrite && (labels->ptr[idx].value != value)) {
+                strintern_free(labels->ptr[idx].value);
+                labels->ptr[idx].value = strintern_ref(value);
+            }
+            continue;
+        }
 
-        label_set_add(labels, overwrite, name, value);
+        label_set_insert(labels, idx, strintern_ref(name), strintern_ref(value));
     }
+
     return 0;
 }
 
@@ -222,11 +287,11 @@ int label_set_rename(label_set_t *labels, char *from, char *to)
     if (pair_from == NULL)
         return ENOENT;
 
-    char *new_name = strdup(to);
+    char *new_name = strintern_dup(to);
     if (new_name == NULL)
         return ENOMEM;
 
-    free(pair_from->name);
+    strintern_free(pair_from->name);
     pair_from->name = new_name;
 
     qsort(labels->ptr, labels->num, sizeof(*labels->ptr), label_pair_compare);
@@ -240,17 +305,17 @@ void label_set_reset(label_set_t *labels)
 
     if (labels->ptr != NULL) {
         for (size_t i = 0; i < labels->num; i++) {
-            free(labels->ptr[i].name);
-            free(labels->ptr[i].value);
+            strintern_free(labels->ptr[i].name);
+            strintern_free(labels->ptr[i].value);
         }
         free(labels->ptr);
         labels->ptr = NULL;
     }
 
     labels->num = 0;
+    labels->size = 0;
 }
 
- //__attribute__((stack_protect))
 int label_set_clone(label_set_t *dest, label_set_t src)
 {
     if (src.num == 0)
@@ -259,11 +324,21 @@ int label_set_clone(label_set_t *dest, label_set_t src)
     if (dest->ptr != NULL)
         label_set_reset(dest);
 
-    dest->ptr = calloc(src.num, sizeof(dest->ptr[0]));
+    dest->ptr = malloc(sizeof(dest->ptr[0]) * src.num);
     if (dest->ptr == NULL)
         return ENOMEM;
-
-    dest->num = src.num;
+    dest->size = src.num;
+
+    /* A set built by label_set is sorted and its strings are interned,
+     * the clone only takes references. */
+    if (src.size != 0) {
+        for (size_t i = 0; i < src.num; i++) {
+            dest->ptr[i].name = strintern_ref(src.ptr[i].name);
+            dest->ptr[i].value = strintern_ref(src.ptr[i].value);
+        }
+        dest->num = src.num;
+        return 0;
+    }
 
     size_t n = 0;
     for (size_t i = 0; i < src.num; i++) {
@@ -271,19 +346,13 @@ int label_set_clone(label_set_t *dest, label_set_t src)
             continue;
         if ((src.ptr[i].value == NULL) || (src.ptr[i].value[0] == '\0'))
             continue;
-        dest->ptr[n].name = strdup(src.ptr[i].name);
-        dest->ptr[n].value = strdup(src.ptr[i].value);
+        dest->ptr[n].name = strintern_dup(src.ptr[i].name);
+        dest->ptr[n].value = strintern_dup(src.ptr[i].value);
         if ((dest->ptr[n].name == NULL) || (dest->ptr[n].value == NULL)) {
             ERROR("strdup failed.");
-            /* make gcc analyzer happy */
-            if (dest->ptr[n].name != NULL) {
-                free(dest->ptr[n].name);
-                dest->ptr[n].name = NULL;
-            }
-            if (dest->ptr[n].value != NULL) {
-                free(dest->ptr[n].value);
-                dest->ptr[n].value = NULL;
-            }
+            strintern_free(dest->ptr[n].name);
+            strintern_free(dest->ptr[n].value);
+            dest->num = n;
             label_set_reset(dest);
             return ENOMEM;
         }
@@ -342,15 +411,23 @@ int label_set_cmp(label_set_t *l1, label_set_t *l2)
         return 1;
     }
 
+    if (l1->ptr == l2->ptr)
+        return 0;
+
+    /* Equal interned strings have the same pointer. */
     int cmp = 0;
     for (size_t i = 0; i < l1->num ; i++) {
-        cmp = strcmp(l1->ptr[i].name, l2->ptr[i].name);
-        if (cmp != 0)
-            return cmp;
+        if (l1->ptr[i].name != l2->ptr[i].name) {
+            cmp = strcmp(l1->ptr[i].name, l2->ptr[i].name);
+            if (cmp != 0)
+                return cmp;
+        }
 
-        cmp = strcmp(l1->ptr[i].value, l2->ptr[i].value);
-        if (cmp != 0)
-            return cmp;
+        if (l1->ptr[i].value != l2->ptr[i].value) {
+            cmp = strcmp(l1->ptr[i].value, l2->ptr[i].value);
+            if (cmp != 0)
+                return cmp;
+        }
     }
 
     return 0;
@@ -490,7 +567,7 @@ int label_set_pack(buf_t *buf, uint8_t id, const label_set_t *set)
     return status;
 }
 
-static int label_set_unpack_pair(rbuf_t *rbuf, char **rname, char **rvalue)
+int label_pair_unpack(rbuf_t *rbuf, char **rname, char **rvalue)
 {
     rbuf_t srbuf = {0};
     int status = unpack_block(rbuf, &srbuf);
@@ -528,10 +605,16 @@ int label_set_unpack(rbuf_t *rbuf, uint8_t id, label_set_t *set)
     if (status != 0)
         return status;
 
+    if (len <= rbuf_remain(rbuf)) {
+        status = label_set_reserve(set, set->num + len);
+        if (status != 0)
+            return status;
+    }
+
     for (size_t i = 0; i < len; i++) {
         char *name = NULL;
         char *value = NULL;
-        status |= label_set_unpack_pair(rbuf, &name, &value);
+        status |= label_pair_unpack(rbuf, &name, &value);
         if (status != 0)
             break;
 
@@ -23,10 +23,13 @@ typedef struct {
   char *value;
 } label_pair_t;
 
-/* label_set_t is a sorted set of labels. */
+/* label_set_t is a sorted set of labels. The names and values of the sets
+ * built with the label_set functions are interned strings (see
+ * libutils/strintern.h), they are shared and must not be modified or freed. */
 typedef struct {
   label_pair_t *ptr;
   size_t num;
+  size_t size;
 } label_set_t;
 
 #define LABEL_PAIR_CONST(n, v) (label_pair_const_t){.name=(n), .value=(v)}
@@ -74,3 +77,7 @@ int label_set_pack(buf_t *buf, uint8_t id, const label_set_t *set);
 
 int label_set_unpack(rbuf_t *rbuf, uint8_t id, label_set_t *set);
 
+/* label_pair_unpack reads one packed label pair, name and value point into
+ * the packed buffer and are not copied. */
+int label_pair_unpack(rbuf_t *rbuf, char **rname, char **rvalue);
+
@@ -491,22 +491,57 @@ static int metric_pack(buf_t *buf, metric_type_t type, metric_t *m)
     return status;
 }
 
-static int metric_unpack(rbuf_t *rbuf, metric_type_t type, metric_list_t *metrics)
+static int metric_view_label_unpack(rbuf_t *rbuf, uint8_t id, metric_family_view_t *view,
+                                    label_set_t *set)
 {
-    rbuf_t srbuf = {0};
-    int status = unpack_block(rbuf, &srbuf);
-    if (status != 0) {
+    size_t len = 0;
+    int status = unpack_size(rbuf, id, &len);
+    if (status != 0)
+        return status;
+
+    if (len > rbuf_remain(rbuf))
         return -1;
+
+    if ((view->label_num + len) > view->label_size) {
+        size_t size = view->label_size == 0 ? 64 : view->label_size * 2;
+        if (size < (view->label_num + len))
+            size = view->label_num + len;
+        label_pair_t *tmp = realloc(view->label, sizeof(*view->label) * size);
+        if (tmp == NULL)
+            return -1;
+        view->label = tmp;
+        view->label_size = size;
     }
 
-    metric_t *tmp = realloc(metrics->ptr, sizeof(*metrics->ptr) * (metrics->num + 1));
-    if (tmp == NULL)
-        return -1;
-    metrics->ptr = tmp;
+    /* The pairs are fixed up into set->ptr once the whole family is read,
+     * the label array can still move. */
+    for (size_t i = 0; i < len; i++) {
+        label_pair_t *pair = &view->label[view->label_num];
+        status = label_pair_unpack(rbuf, &pair->name, &pair->value);
+        if (status != 0)
+            return status;
+        view->label_num++;
+        set->num++;
+    }
 
-    memset(&metrics->ptr[metrics->num], 0, sizeof(*metrics->ptr));
+    return 0;
+}
+
+static void metric_view_reset(metric_t *m, metric_type_t type)
+{
+    m->label = (label_set_t){0};
+    if (type == METRIC_TYPE_INFO)
+        m->value.info = (label_set_t){0};
+    metric_reset(m, type);
+}
 
-    metric_t *m = &metrics->ptr[metrics->num];
+static int metric_unpack(rbuf_t *rbuf, metric_type_t type, metric_t *m, metric_family_view_t *view)
+{
+    rbuf_t srbuf = {0};
+    int status = unpack_block(rbuf, &srbuf);
+    if (status != 0) {
+        return -1;
+    }
 
     while (true) {
         uint8_t id = 0;
@@ -515,7 +550,10 @@ static int metric_unpack(rbuf_t *rbuf, metric_type_t type, metric_list_t *metric
 
         switch (id & 0xf0) {
         case METRIC_LABEL_ID:
-            status = label_set_unpack(&srbuf, id, &m->label);
+            if (view != NULL)
+                status = metric_view_label_unpack(&srbuf, id, view, &m->label);
+            else
+                status = label_set_unpack(&srbuf, id, &m->label);
             break;
         case METRIC_TIME_ID:
             status = unpack_uint64(&srbuf, &m->time);
@@ -583,7 +621,10 @@ static int metric_unpack(rbuf_t *rbuf, metric_type_t type, metric_list_t *metric
             break;
         case METRIC_INFO_ID:
             if (likely(type == METRIC_TYPE_INFO)) {
-                status = label_set_unpack(&srbuf, id, &m->value.info);
+                if (view != NULL)
+                    status = metric_view_label_unpack(&srbuf, id, view, &m->value.info);
+                else
+                    status = label_set_unpack(&srbuf, id, &m->value.info);
             } else {
                 status = 1;
             }
@@ -621,24 +662,48 @@ static int metric_unpack(rbuf_t *rbuf, metric_type_t type, metric_list_t *metric
     if (status != 0)
         return -1;
 
-    metrics->num++;
-
     unpack_avance_block(rbuf, &srbuf);
 
     return 0;
 }
 
-static int metric_list_unpack(rbuf_t *rbuf, uint8_t id, metric_type_t type, metric_list_t *metrics)
+static int metric_list_unpack(rbuf_t *rbuf, uint8_t id, metric_type_t type, metric_list_t *metrics,
+                              metric_family_view_t *view)
 {
     size_t len = 0;
     int status = unpack_size(rbuf, id, &len);
     if (status != 0)
         return status;
 
+    if (len == 0)
+        return 0;
+
+    /* Every packed metric takes at least a block header. */
+    if (len > (rbuf_remain(rbuf) / sizeof(uint32_t)))
+        return -1;
+
+    size_t num = metrics->num + len;
+    if ((view == NULL) || (num > view->metric_size)) {
+        metric_t *tmp = realloc(metrics->ptr, sizeof(*metrics->ptr) * num);
+        if (tmp == NULL)
+            return -1;
+        metrics->ptr = tmp;
+        if (view != NULL)
+            view->metric_size = num;
+    }
+
     for (size_t i = 0; i < len; i++) {
-        status = metric_unpack(rbuf, type, metrics);
-        if (status != 0)
+        metric_t *m = &metrics->ptr[metrics->num];
+        memset(m, 0, sizeof(*m));
+        status = metric_unpack(rbuf, type, m, view);
+        if (status != 0) {
+            if (view != NULL)
+                metric_view_reset(m, type);
+            else
+                metric_reset(m, type);
             break;
+        }
+        metrics->num++;
     }
 
     return status;
@@ -776,7 +841,7 @@ metric_family_t *metric_family_unpack(rbuf_t *rbuf)
             fam->type = type;
         }   break;
         case METRIC_FAMILY_METRIC_LIST_ID:
-            status |= metric_list_unpack(&srbuf, id, fam->type, &fam->metric);
+            status |= metric_list_unpack(&srbuf, id, fam->type, &fam->metric, NULL);
             break;
         }
 
@@ -796,3 +861,96 @@ metric_family_t *metric_family_unpack(rbuf_t *rbuf)
 
     return fam;
 }
+
+void metric_family_view_reset(metric_family_view_t *view)
+{
+    if (view == NULL)
+        return;
+
+    metric_family_t *fam = &view->fam;
+    for (size_t i = 0; i < fam->metric.num; i++) {
+        metric_view_reset(&fam->metric.ptr[i], fam->type);
+    }
+
+    fam->name = NULL;
+    fam->help = NULL;
+    fam->unit = NULL;
+    fam->type = 0;
+    fam->metric.num = 0;
+    view->label_num = 0;
+}
+
+void metric_family_view_destroy(metric_family_view_t *view)
+{
+    if (view == NULL)
+        return;
+
+    metric_family_view_reset(view);
+    free(view->fam.metric.ptr);
+    free(view->label);
+    *view = (metric_family_view_t){0};
+}
+
+int metric_family_view_unpack(rbuf_t *rbuf, metric_family_view_t *view)
+{
+    metric_family_view_reset(view);
+
+    rbuf_t srbuf = {0};
+    int status = unpack_block(rbuf, &srbuf);
+    if (status != 0)
+        return -1;
+
+    metric_family_t *fam = &view->fam;
+
+    while (true) {
+        uint8_t id = 0;
+
+        status |= unpack_id(&srbuf, &id);
+
+        switch (id & 0xf0) {
+        case METRIC_FAMILY_NAME_ID:
+            status |= unpack_refstring(&srbuf, id, &fam->name);
+            break;
+        case METRIC_FAMILY_HELP_ID:
+            status |= unpack_refstring(&srbuf, id, &fam->help);
+            break;
+        case METRIC_FAMILY_UNIT_ID:
+            status |= unpack_refstring(&srbuf, id, &fam->unit);
+            break;
+        case METRIC_FAMILY_TYPE_ID: {
+            uint8_t type = 0;
+            status |= unpack_uint8(&srbuf, &type);
+            fam->type = type;
+        }   break;
+        case METRIC_FAMILY_METRIC_LIST_ID:
+            status |= metric_list_unpack(&srbuf, id, fam->type, &fam->metric, view);
+            break;
+        }
+
+        if (status != 0)
+            break;
+
+        if (rbuf_remain(&srbuf) == 0)
+            break;
+    }
+
+    if (status != 0) {
+        metric_family_view_reset(view);
+        return -1;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < fam->metric.num; i++) {
+        metric_t *m = &fam->metric.ptr[i];
+        m->label.ptr = m->label.num > 0 ? view->label + pos : NULL;
+        pos += m->label.num;
+        if (fam->type == METRIC_TYPE_INFO) {
+            m->value.info.ptr = m->value.info.num > 0 ? view->label + pos : NULL;
+            pos += m->value.info.num;
+        }
+    }
+
+    unpack_avance_block(rbuf, &srbuf);
+
+    return 0;
+}
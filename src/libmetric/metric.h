@@ -208,3 +208,22 @@ int metric_family_pack(buf_t *buf, metric_family_t *fam);
 
 metric_family_t *metric_family_unpack(rbuf_t *rbuf);
 
+/* metric_family_view_t is a read-only view of a packed metric family. The
+ * strings and labels of "fam" point into the packed buffer, so the view is
+ * only valid while that buffer is. The metric and label arrays are kept
+ * between calls and reused for the next family. Use metric_family_clone()
+ * to get a copy that outlives the buffer or that can be modified. */
+typedef struct {
+    metric_family_t fam;
+    size_t metric_size;
+    label_pair_t *label;
+    size_t label_num;
+    size_t label_size;
+} metric_family_view_t;
+
+int metric_family_view_unpack(rbuf_t *rbuf, metric_family_view_t *view);
+
+void metric_family_view_reset(metric_family_view_t *view);
+
+void metric_family_view_destroy(metric_family_view_t *view);
+
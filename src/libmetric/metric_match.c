@@ -25,7 +25,7 @@ void metric_match_pair_free(metric_match_pair_t *pair)
             break;
         case METRIC_MATCH_OP_EQL_REGEX:
         case METRIC_MATCH_OP_NEQ_REGEX:
-            regfree(pair->value.regex);
+            strmatch_reset(pair->value.regex);
             free(pair->value.regex);
             break;
         case METRIC_MATCH_OP_EXISTS:
@@ -74,8 +74,10 @@ metric_match_pair_t *metric_match_pair_alloc(const char *name, metric_match_op_t
             metric_match_pair_free(pair);
             return NULL;
         }
-        int status = regcomp(pair->value.regex, value, REG_EXTENDED|REG_NOSUB);
+        int status = strmatch_compile(pair->value.regex, value, REG_NOSUB);
         if (status != 0) {
+            free(pair->value.regex);
+            pair->value.regex = NULL;
             metric_match_pair_free(pair);
             return NULL;
         }
@@ -368,10 +370,10 @@ static inline bool metric_match_value_cmp(metric_match_value_t value, metric_mat
             return strcmp(name, value.string) != 0;
             break;
         case METRIC_MATCH_OP_EQL_REGEX:
-            return regexec(value.regex, name, 0, NULL, 0) == 0;
+            return strmatch_exec(value.regex, name);
             break;
         case METRIC_MATCH_OP_NEQ_REGEX:
-            return regexec(value.regex, name, 0, NULL, 0) != 0;
+            return !strmatch_exec(value.regex, name);
             break;
         case METRIC_MATCH_OP_EXISTS:
             break;
@@ -6,8 +6,7 @@
 
 #include "ncollectd.h"
 #include "libmetric/metric.h"
-
-#include <regex.h>
+#include "libutils/strmatch.h"
 
 typedef enum {
     METRIC_MATCH_OP_NONE,
@@ -21,7 +20,7 @@ typedef enum {
 
 typedef union {
     char *string;
-    regex_t *regex;
+    strmatch_t *regex;
 } metric_match_value_t;
 
 typedef struct {
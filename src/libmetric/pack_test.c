@@ -382,6 +382,110 @@ DEF_TEST(pack_guage_histogram)
     return 0;
 }
 
+DEF_TEST(pack_view)
+{
+    metric_family_t fam1 = {
+        .name = "metric_view_counters",
+        .type = METRIC_TYPE_COUNTER,
+    };
+
+    metric_t m1 = {
+        .value.counter.uint64 = 7,
+        .time = 1710200311404036096, /* 1592748157.125 */
+    };
+    label_set_add(&m1.label, true, "alpha", "first");
+    label_set_add(&m1.label, true, "beta", "second");
+    metric_family_metric_append(&fam1, m1);
+    label_set_reset(&m1.label);
+
+    metric_t m2 = {
+        .value.counter.uint64 = 100,
+        .time = 1710200311404036096, /* 1592748157.125 */
+    };
+    metric_family_metric_append(&fam1, m2);
+
+    metric_t m3 = {
+        .value.counter.uint64 = 200,
+        .time = 1710200311404036096, /* 1592748157.125 */
+    };
+    label_set_add(&m3.label, true, "theta", "third");
+    metric_family_metric_append(&fam1, m3);
+    label_set_reset(&m3.label);
+
+    metric_family_t fam2 = {
+        .name = "system_uname",
+        .help = "System information",
+        .type = METRIC_TYPE_INFO,
+    };
+
+    metric_t m4 = {
+        .time = 1710200311404036096, /* 1592748157.125 */
+    };
+    label_set_add(&m4.label, true, "hostname", "arrakis.canopus");
+    label_set_add(&m4.value.info, true, "machine",  "riscv128");
+    label_set_add(&m4.value.info, true, "sysname",  "Linux");
+    metric_family_metric_append(&fam2, m4);
+    label_set_reset(&m4.label);
+    label_set_reset(&m4.value.info);
+
+    histogram_t *histogram = histogram_new();
+    histogram = histogram_bucket_append(histogram, INFINITY, 27892);
+    histogram = histogram_bucket_append(histogram, 1, 26351);
+    histogram = histogram_bucket_append(histogram, 0.1, 8954);
+    histogram->sum = 8953.332;
+
+    metric_family_t fam3 = {
+        .name = "histogram",
+        .type = METRIC_TYPE_HISTOGRAM,
+    };
+
+    metric_t m5 = {
+        .value.histogram = histogram,
+        .time = 1710200311404036096, /* 1592748157.125 */
+    };
+    label_set_add(&m5.label, true, "hostname", "arrakis.canopus");
+    metric_family_metric_append(&fam3, m5);
+    label_set_reset(&m5.label);
+    histogram_destroy(histogram);
+
+    buf_t buf = BUF_CREATE;
+    EXPECT_EQ_INT(0, metric_family_pack(&buf, &fam1));
+    EXPECT_EQ_INT(0, metric_family_pack(&buf, &fam2));
+    EXPECT_EQ_INT(0, metric_family_pack(&buf, &fam3));
+    EXPECT_EQ_INT(0, metric_family_pack(&buf, &fam1));
+
+    rbuf_t rbuf = {0};
+    buf2rbuf(&buf, &rbuf);
+
+    metric_family_view_t view = {0};
+    EXPECT_EQ_INT(0, metric_family_view_unpack(&rbuf, &view));
+    EXPECT_EQ_INT(0, test_metric_family_cmp(&fam1, &view.fam));
+    /* The view is read-only, compare a copy as comparing info metrics merges the labels. */
+    EXPECT_EQ_INT(0, metric_family_view_unpack(&rbuf, &view));
+    metric_family_t *clone = NULL;
+    CHECK_NOT_NULL(clone = metric_family_clone(&view.fam));
+    EXPECT_EQ_INT(0, test_metric_family_cmp(&fam2, clone));
+    metric_family_free(clone);
+
+    EXPECT_EQ_INT(0, metric_family_view_unpack(&rbuf, &view));
+    EXPECT_EQ_INT(0, test_metric_family_cmp(&fam3, &view.fam));
+    CHECK_NOT_NULL(clone = metric_family_clone(&view.fam));
+
+    EXPECT_EQ_INT(0, metric_family_view_unpack(&rbuf, &view));
+    EXPECT_EQ_INT(0, test_metric_family_cmp(&fam1, &view.fam));
+    EXPECT_EQ_INT(0, (int)rbuf_remain(&rbuf));
+    EXPECT_EQ_INT(0, test_metric_family_cmp(&fam3, clone));
+
+    metric_family_free(clone);
+    metric_family_view_destroy(&view);
+    buf_destroy(&buf);
+    metric_family_metric_reset(&fam1);
+    metric_family_metric_reset(&fam2);
+    metric_family_metric_reset(&fam3);
+
+    return 0;
+}
+
 int main(void)
 {
     RUN_TEST(pack_unknow);
@@ -394,6 +498,7 @@ int main(void)
     RUN_TEST(pack_summary);
     RUN_TEST(pack_histogram);
     RUN_TEST(pack_guage_histogram);
+    RUN_TEST(pack_view);
 
     END_TEST;
 }
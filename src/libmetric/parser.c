@@ -6,7 +6,7 @@
 #include "log.h"
 #include "libutils/strbuf.h"
 #include "libutils/common.h"
-#include "libutils/avltree.h"
+#include "libutils/htable.h"
 #include "libmetric/metric.h"
 #include "libmetric/metric_chars.h"
 #include "libmetric/parser.h"
@@ -42,12 +42,23 @@ typedef enum {
 typedef struct metric_parser_s {
     char *metric_prefix;
     label_set_t labels;
-    c_avl_tree_t *fams;
+    htable_t fams_index;
+    size_t fams_num;
+    size_t fams_size;
+    metric_family_t **fams;
     size_t lineno;
     strbuf_t buf;
     metric_family_t *last_fam;
+    size_t last_fam_len;
 } metric_parser_t;
 
+typedef struct {
+    const char *name;
+    size_t len;
+} metric_parser_fam_key_t;
+
+#define METRIC_PARSER_FAMS_INDEX_SIZE 64
+
 enum {
     SC_SPACE      = 1,
     SC_NEWLINE    = 2,
@@ -109,15 +120,22 @@ static void scan_init(void) {
 }
 #endif
 
-static bool isinteger(const char *str)
+/* Lines end with a newline when they are parsed in place in the buffer. */
+static inline bool scan_end(unsigned char sc)
+{
+    return (sc == 0) || (sc == SC_NEWLINE);
+}
+
+static bool isinteger(const char *str, size_t len)
 {
-    if ((str[0] == '-') || (str[0] == '+'))
+    if ((len > 0) && ((str[0] == '-') || (str[0] == '+'))) {
         str++;
+        len--;
+    }
 
-    while(*str != '\0') {
-        if(!isdigit((unsigned char)*str))
+    for (size_t i = 0; i < len; i++) {
+        if(!isdigit((unsigned char)str[i]))
             return false;
-        str++;
     }
 
     return true;
@@ -130,35 +148,66 @@ static inline int sstrncmpend(const char *str, size_t size, const char *suffix,
     return sstrncmp(str + (size - suffix_size), suffix_size, suffix, suffix_size);
 }
 
-static int metric_parser_fam_cmp(const void *a, const void *b)
+static int metric_parser_fam_find_cmp(const void *a, const void *b)
+{
+    const metric_parser_fam_key_t *key = a;
+    const metric_family_t *fam = b;
+    if (strncmp(key->name, fam->name, key->len) != 0)
+        return 1;
+    return fam->name[key->len] == '\0' ? 0 : 1;
+}
+
+static int metric_parser_fam_add_cmp(const void *a, const void *b)
 {
     const metric_family_t *fam_a = a;
     const metric_family_t *fam_b = b;
     return strcmp(fam_a->name, fam_b->name);
 }
 
+static void metric_parser_fam_nofree(__attribute__((unused)) void *data,
+                                     __attribute__((unused)) void *arg)
+{
+}
+
+static void metric_parser_fams_clear(metric_parser_t *mp)
+{
+    htable_destroy(&mp->fams_index, metric_parser_fam_nofree, NULL);
+    mp->fams_num = 0;
+    mp->last_fam = NULL;
+    mp->last_fam_len = 0;
+}
+
 static metric_family_t *metric_parser_get_family(metric_parser_t *mp, bool create,
                                                  const char *name, size_t name_size)
 {
-    char bname[4096];
-
-    if (name_size > (sizeof(bname)-1)) {
-        ERROR("family name greater than %zu.", sizeof(bname)-1);
-        return NULL;
+    if (mp->fams_index.tbl == NULL) {
+        if (htable_init(&mp->fams_index, METRIC_PARSER_FAMS_INDEX_SIZE) != 0) {
+            ERROR("htable_init failed.");
+            return NULL;
+        }
     }
 
-    sstrnncpy(bname, sizeof(bname), name, name_size);
+    htable_hash_t hash = htable_nhash(name, name_size, HTABLE_HASH_INIT);
 
-    metric_family_t qfam = { .name = bname };
-    metric_family_t *fam = NULL;
-    int status = c_avl_get(mp->fams, &qfam, (void *)&fam);
-    if (status == 0) {
+    metric_parser_fam_key_t key = { .name = name, .len = name_size };
+    metric_family_t *fam = htable_find(&mp->fams_index, hash, &key, metric_parser_fam_find_cmp);
+    if (fam != NULL)
         return fam;
-    }
 
     if (!create)
         return NULL;
 
+    if (mp->fams_num == mp->fams_size) {
+        size_t size = mp->fams_size == 0 ? 16 : mp->fams_size * 2;
+        metric_family_t **tmp = realloc(mp->fams, sizeof(*tmp) * size);
+        if (tmp == NULL) {
+            ERROR("realloc failed.");
+            return NULL;
+        }
+        mp->fams = tmp;
+        mp->fams_size = size;
+    }
+
     fam = calloc(1, sizeof (*fam));
     if (fam == NULL) {
         ERROR("calloc failed.");
@@ -167,24 +216,28 @@ static metric_family_t *metric_parser_get_family(metric_parser_t *mp, bool creat
 
     fam->type = METRIC_TYPE_UNKNOWN;
 
-    fam->name = strdup(bname);
+    fam->name = sstrndup(name, name_size);
     if (fam->name == NULL) {
         free(fam);
         ERROR("strdup failed.");
         return NULL;
     }
 
-    status = c_avl_insert(mp->fams, fam, (void *)fam);
+    int status = htable_add(&mp->fams_index, hash, fam, metric_parser_fam_add_cmp);
     if (status != 0) {
         free(fam->name);
         free(fam);
-        ERROR("c_avl_insert failed.");
+        ERROR("htable_add failed.");
         return NULL;
     }
 
+    mp->fams[mp->fams_num] = fam;
+    mp->fams_num++;
+
     return fam;
 }
 
+/* The labels are moved to the new metric when one is created. */
 static value_t *metric_familty_get_value(metric_family_t *fam, label_set_t *labels, cdtime_t time)
 {
     if (fam->metric.num > 0) {
@@ -193,10 +246,10 @@ static value_t *metric_familty_get_value(metric_family_t *fam, label_set_t *labe
             return &m->value;
     }
 
-    metric_t metric = (metric_t){.time = time};
-    label_set_clone(&metric.label, *labels);
+    metric_t metric = (metric_t){.time = time, .label = *labels};
     int status = metric_list_append(&fam->metric, metric);
     if ((status == 0) && (fam->metric.num > 0)) {
+        *labels = (label_set_t){0};
         metric_t *m = &fam->metric.ptr[fam->metric.num -1];
 
         switch(fam->type) {
@@ -220,8 +273,6 @@ static value_t *metric_familty_get_value(metric_family_t *fam, label_set_t *labe
         }
 
         return &m->value;
-    } else {
-        label_set_reset(&metric.label); //FIXME
     }
 
     return NULL;
@@ -242,7 +293,7 @@ static ssize_t metric_parser_labels(label_set_t *labels, const char *line,
 
         while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
             ptr++;
-        if (sc == 0)
+        if (scan_end(sc))
             return -1;
 
         const char *label = ptr;
@@ -275,15 +326,14 @@ static ssize_t metric_parser_labels(label_set_t *labels, const char *line,
 
         const char *value = ptr;
         while (true) {
-            if (*ptr == 0)
+            ptr += strcspn(ptr, "\"\\\n");
+            if ((*ptr == '\0') || (*ptr == '\n'))
                 return -1;
             if (*ptr == '"')
                 break;
-            if (*ptr == '\\') {
-                ptr++;
-                if (*ptr == 0)
-                    return -6;
-            }
+            ptr++; // skip '\\'
+            if ((*ptr == '\0') || (*ptr == '\n'))
+                return -6;
             ptr++;
         }
         size_t value_size = ptr - value;
@@ -409,7 +459,7 @@ static metric_family_t *metric_parse_find_family(metric_parser_t *mp,
     metric_family_t *fam = mp->last_fam;
     if (fam != NULL) {
         size_t metric_len = metric_parser_type_metric_len(fam->type, metric, metric_size);
-        size_t name_len = strlen(fam->name);
+        size_t name_len = mp->last_fam_len;
         if (metric_len == name_len) {
             if (strncmp(metric, fam->name, name_len) == 0)
                 return fam;
@@ -432,12 +482,14 @@ static metric_family_t *metric_parse_find_family(metric_parser_t *mp,
     fam = metric_parser_get_family(mp, false, metric, metric_len);
     if (fam != NULL) {
         mp->last_fam = fam;
+        mp->last_fam_len = metric_len;
         return fam;
     }
 
     fam = metric_parser_get_family(mp, true, metric, metric_size);
     if (fam != NULL) {
         mp->last_fam = fam;
+        mp->last_fam_len = metric_size;
         return fam;
     }
     return NULL;
@@ -450,7 +502,7 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
 
     while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
         ptr++;
-    if (sc == 0)
+    if (scan_end(sc))
         return 0;
 
     const char *metric = ptr;
@@ -474,7 +526,7 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
 
     while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
         ptr++;
-    if (sc == 0)
+    if (scan_end(sc))
         return -1;
 
     metric_sub_type_t metric_sub_type = METRIC_SUB_TYPE_UNKNOWN;
@@ -585,35 +637,28 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
 
     while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
         ptr++;
-    if (sc == 0) {
+    if (scan_end(sc)) {
         label_set_reset(&labels);
         return -1;
     }
 
-    const char *value_number = ptr;
+    /* The value and the timestamp are converted in place, strtod and strtoull
+     * stop at the space or newline that ends them. */
+    const char *number = ptr;
     do {
         ptr++;
         sc = scan_code[(unsigned char)*ptr];
-    } while ((sc != SC_SPACE) && (sc != 0));
+    } while ((sc != SC_SPACE) && !scan_end(sc));
 
-    size_t value_size = ptr - value_number;
-    char number[64] = {'0','\0'};
-    if (value_size > 0)
-        sstrnncpy(number, sizeof(number), value_number, value_size);
+    size_t number_size = ptr - number;
 
     cdtime_t time = 0;
     if (sc == SC_SPACE) {
         while (scan_code[(unsigned char)*ptr] == SC_SPACE)
             ptr++;
 
-        const char *timestamp = ptr;
-        while (scan_code[(unsigned char)*ptr] == SC_DIGIT)
-            ptr++;
-        size_t timestamp_size = ptr - timestamp;
-        if (timestamp_size > 0) {
-            char buffer[16];
-            sstrnncpy(buffer, sizeof(buffer), timestamp, timestamp_size);
-            unsigned long long tms = strtoull(buffer, NULL, 10);
+        if (scan_code[(unsigned char)*ptr] == SC_DIGIT) {
+            unsigned long long tms = strtoull(ptr, NULL, 10);
             time = MS_TO_CDTIME_T(tms);
         }
     }
@@ -621,26 +666,26 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
     switch (metric_sub_type) {
     case METRIC_SUB_TYPE_UNKNOWN: {
         value_t value = VALUE_UNKNOWN(strtod(number, NULL));
-        metric_t m = (metric_t){.value = value, .time = time};
-        label_set_clone(&m.label, labels);
-        metric_list_append(&fam->metric, m);
+        metric_t m = (metric_t){.value = value, .time = time, .label = labels};
+        if (metric_list_append(&fam->metric, m) == 0)
+            labels = (label_set_t){0};
     }   break;
     case METRIC_SUB_TYPE_GAUGE: {
         value_t value = VALUE_GAUGE(strtod(number, NULL));
-        metric_t m = (metric_t){.value = value, .time = time};
-        label_set_clone(&m.label, labels);
-        metric_list_append(&fam->metric, m);
+        metric_t m = (metric_t){.value = value, .time = time, .label = labels};
+        if (metric_list_append(&fam->metric, m) == 0)
+            labels = (label_set_t){0};
     }   break;
     case METRIC_SUB_TYPE_COUNTER_TOTAL: {
         value_t value = {0};
-        if(isinteger(number)) {
+        if(isinteger(number, number_size)) {
             value = VALUE_COUNTER(strtoull(number, NULL, 10));
         } else {
             value = VALUE_COUNTER_FLOAT64(strtod(number, NULL));
         }
-        metric_t m = (metric_t){.value = value, .time = time};
-        label_set_clone(&m.label, labels);
-        metric_list_append(&fam->metric, m);
+        metric_t m = (metric_t){.value = value, .time = time, .label = labels};
+        if (metric_list_append(&fam->metric, m) == 0)
+            labels = (label_set_t){0};
     }   break;
     case METRIC_SUB_TYPE_COUNTER_CREATED:
         break;
@@ -656,9 +701,9 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
         }
         break;
     case METRIC_SUB_TYPE_INFO: {
-        metric_t m = (metric_t){.time = time};
-        label_set_clone(&m.label, labels);
-        metric_list_append(&fam->metric, m);
+        metric_t m = (metric_t){.time = time, .label = labels};
+        if (metric_list_append(&fam->metric, m) == 0)
+            labels = (label_set_t){0};
     }   break;
     case METRIC_SUB_TYPE_SUMMARY_COUNT: {
         value_t *value = metric_familty_get_value(fam, &labels, time);
@@ -676,9 +721,7 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
         if (label_value != NULL) {
             value_t *value = metric_familty_get_value(fam, &labels, time);
             if (value != NULL) {
-                char vnumber[64] = {'0','\0'};
-                sstrnncpy(vnumber, sizeof(vnumber), label_value, label_value_size);
-                double quantile = strtod(vnumber, NULL);
+                double quantile = strtod(label_value, NULL);
                 double qvalue = strtod(number, NULL);
                 summary_t *summary = summary_quantile_append(value->summary, quantile, qvalue);
                 if (summary != NULL)
@@ -700,9 +743,7 @@ static int metric_parse_metric(metric_parser_t *mp, const char *line)
         if (label_value != NULL) {
             value_t *value = metric_familty_get_value(fam, &labels, time);
             if (value != NULL) {
-                char vnumber[64] = {'0','\0'};
-                sstrnncpy(vnumber, sizeof(vnumber), label_value, label_value_size);
-                double maximum = strtod(vnumber, NULL);
+                double maximum = strtod(label_value, NULL);
                 uint64_t counter = strtoull(number, NULL, 10);
                 histogram_t *histogram = histogram_bucket_append(value->histogram, maximum, counter);
                 if (histogram != NULL)
@@ -781,7 +822,7 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
     while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
         ptr++;
 
-    if (sc == 0)
+    if (scan_end(sc))
         return 0;
 
     if ((sc == SC_COLON) || (sc == SC_ALPHA))
@@ -795,7 +836,7 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
     while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
         ptr++;
 
-    if (sc == 0)
+    if (scan_end(sc))
         return 0;
 
     metric_comment_t comment_type;
@@ -822,7 +863,7 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
     if (comment_type == METRIC_COMMENT_END) {
         while ((sc = scan_code[(unsigned char)*ptr]) == SC_SPACE)
             ptr++;
-        if (sc == 0)
+        if (scan_end(sc))
             return 1;
         return 0;
     }
@@ -853,6 +894,7 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
         return -1;
     }
     mp->last_fam = fam;
+    mp->last_fam_len = metric_size;
 
     if (sc == SC_SPACE) {
         while (scan_code[(unsigned char)*ptr] == SC_SPACE)
@@ -862,7 +904,7 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
     }
 
     const char *text = ptr;
-    while (scan_code[(unsigned char)*ptr] != 0)
+    while (!scan_end(scan_code[(unsigned char)*ptr]))
         ptr++;
     size_t text_size = ptr - text;
     if (text_size == 0)
@@ -902,38 +944,57 @@ int metric_parse_line(metric_parser_t *mp, const char *line)
     return 0;
 }
 
+/* Complete lines are parsed in place in the buffer, only a line split between
+ * two calls is copied to mp->buf. */
 int metric_parse_buffer(metric_parser_t *mp, char *buffer, size_t buffer_len)
 {
     if (buffer == NULL) {
         if (strbuf_len(&mp->buf) > 0) {
+            mp->lineno += 1;
             int status = metric_parse_line(mp, mp->buf.ptr);
+            strbuf_reset(&mp->buf);
             if (status < 0)
                 return status;
         }
         return 0;
     }
 
-    while (buffer_len > 0) {
+    if (strbuf_len(&mp->buf) > 0) {
         char *end = memchr(buffer, '\n', buffer_len);
-        if (end != NULL) {
-            size_t line_size = end - buffer;
-            mp->lineno += 1;
-            if (line_size > 0) { // FIXME
-                strbuf_putstrn(&mp->buf, buffer, line_size);
+        if (end == NULL) {
+            strbuf_putstrn(&mp->buf, buffer, buffer_len);
+            return 0;
+        }
 
-                int status = metric_parse_line(mp, mp->buf.ptr);
-                if (status < 0) {
-                    return status;
-                }
-            }
+        size_t line_size = end - buffer;
+        strbuf_putstrn(&mp->buf, buffer, line_size);
+        mp->lineno += 1;
+        int status = metric_parse_line(mp, mp->buf.ptr);
+        strbuf_reset(&mp->buf);
+        if (status < 0)
+            return status;
 
-            strbuf_reset(&mp->buf);
-            buffer_len -= line_size; // FIXME +1
-            buffer = end + 1;              // +1
-        } else {
+        buffer_len -= line_size + 1;
+        buffer = end + 1;
+    }
+
+    while (buffer_len > 0) {
+        char *end = memchr(buffer, '\n', buffer_len);
+        if (end == NULL) {
             strbuf_putstrn(&mp->buf, buffer, buffer_len);
-            buffer_len = 0;
+            break;
         }
+
+        size_t line_size = end - buffer;
+        mp->lineno += 1;
+        if (line_size > 0) {
+            int status = metric_parse_line(mp, buffer);
+            if (status < 0)
+                return status;
+        }
+
+        buffer_len -= line_size + 1;
+        buffer = end + 1;
     }
 
     return 0;
@@ -941,16 +1002,12 @@ int metric_parse_buffer(metric_parser_t *mp, char *buffer, size_t buffer_len)
 
 void metric_parser_reset(metric_parser_t *mp)
 {
-    while (true) {
-        metric_family_t *fam;
-        int status = c_avl_pick(mp->fams, (void *)&fam,  NULL);
-        if (status != 0)
-            break;
-        metric_family_free(fam);
+    for (size_t i = 0; i < mp->fams_num; i++) {
+        metric_family_free(mp->fams[i]);
     }
+    metric_parser_fams_clear(mp);
 
     mp->lineno = 0;
-    mp->last_fam = NULL;
     strbuf_reset(&mp->buf);
 }
 
@@ -964,7 +1021,7 @@ void metric_parser_free(metric_parser_t *mp)
     free(mp->metric_prefix);
     label_set_reset(&mp->labels);
 
-    c_avl_destroy(mp->fams);
+    free(mp->fams);
 
     strbuf_destroy(&mp->buf);
 
@@ -989,12 +1046,6 @@ metric_parser_t *metric_parser_alloc(char *metric_prefix, label_set_t *labels)
     if ((labels != NULL) && (labels->num > 0))
         label_set_clone(&mp->labels, *labels);
 
-    mp->fams = c_avl_create(metric_parser_fam_cmp);
-    if (mp->fams == NULL) {
-        metric_parser_free(mp);
-        return NULL;
-    }
-
     mp->buf = STRBUF_CREATE;
 
     return mp;
@@ -1011,11 +1062,8 @@ int metric_parser_dispatch(metric_parser_t *mp, dispatch_metric_family_t dispatc
     if (time == 0)
         time = cdtime();
 
-    while (true) {
-        metric_family_t *fam;
-        int status = c_avl_pick(mp->fams, (void *)&fam,  NULL);
-        if (status != 0)
-            break;
+    for (size_t i = 0; i < mp->fams_num; i++) {
+        metric_family_t *fam = mp->fams[i];
 
         if (mp->metric_prefix != NULL) {
             size_t len = strlen(fam->name);
@@ -1043,8 +1091,8 @@ int metric_parser_dispatch(metric_parser_t *mp, dispatch_metric_family_t dispatc
         }
 
         if (mp->labels.num > 0) {
-            for (size_t i = 0; i < fam->metric.num; i++) {
-                metric_t *m = &fam->metric.ptr[i];
+            for (size_t j = 0; j < fam->metric.num; j++) {
+                metric_t *m = &fam->metric.ptr[j];
                 label_set_add_set(&m->label, true, mp->labels);
             }
         }
@@ -1054,6 +1102,8 @@ int metric_parser_dispatch(metric_parser_t *mp, dispatch_metric_family_t dispatc
         metric_family_free(fam);
     }
 
+    metric_parser_fams_clear(mp);
+
     return 0;
 }
 
@@ -1061,6 +1111,6 @@ int metric_parser_size(metric_parser_t *mp)
 {
     if (mp == NULL)
         return 0;
-    return c_avl_size(mp->fams);
+    return mp->fams_num;
 }
 
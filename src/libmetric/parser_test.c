@@ -4,6 +4,7 @@
 
 #include "ncollectd.h"
 #include "libmetric/metric.h"
+#include "libutils/strbuf.h"
 #include "libmetric/parser.h"
 #include "libtest/testing.h"
 
@@ -36,6 +37,40 @@ static int dispatch_metric_family(metric_family_t *fam,
     return 0;
 }
 
+static int test_parse_buffer(char *input, size_t len, size_t chunk,
+                             metric_family_t *fams, size_t num)
+{
+    metric_parser_t *mp = metric_parser_alloc(NULL, NULL);
+    if (mp == NULL)
+        return -1;
+
+    int status = 0;
+    for (size_t offset = 0; offset < len; offset += chunk) {
+        size_t size = (len - offset) < chunk ? (len - offset) : chunk;
+        status |= metric_parse_buffer(mp, input + offset, size);
+    }
+    status |= metric_parse_buffer(mp, NULL, 0);
+
+    EXPECT_EQ_INT(0, status);
+
+    metric_parser_dispatch(mp, dispatch_metric_family, NULL, 0);
+
+    EXPECT_EQ_FAM_LIST(fams, num, g_fams, g_fams_num);
+
+    metric_parser_free(mp);
+
+    for (size_t j = 0; j < g_fams_num; j++) {
+        free(g_fams[j].name);
+        metric_family_metric_reset(&g_fams[j]);
+    }
+
+    free(g_fams);
+    g_fams = NULL;
+    g_fams_num = 0;
+
+    return 0;
+}
+
 DEF_TEST(metric_parser)
 {
     struct {
@@ -282,28 +317,85 @@ DEF_TEST(metric_parser)
     };
 
     for (size_t i = 0; i < (sizeof(cases) / sizeof(cases[0])); i++) {
-        metric_parser_t *mp = metric_parser_alloc(NULL, NULL);
+        size_t len = strlen(cases[i].input);
+        /* Feed the input at once and split in chunks as it arrives from a scrape. */
+        size_t chunks[] = { len, 1, 3, 7 };
+        for (size_t j = 0; j < (sizeof(chunks) / sizeof(chunks[0])); j++) {
+            int status = test_parse_buffer(cases[i].input, len, chunks[j],
+                                           cases[i].fams, cases[i].num);
+            if (status != 0)
+                return status;
+        }
+    }
 
-        int status =  metric_parse_buffer(mp, cases[i].input, strlen(cases[i].input));
-        status |= metric_parse_buffer(mp, NULL, 0);
+    return 0;
+}
+
+static int dispatch_metric_family_discard(__attribute__((unused)) metric_family_t *fam,
+                                          __attribute__((unused)) plugin_filter_t *filter,
+                                          __attribute__((unused)) cdtime_t time)
+{
+    return 0;
+}
 
-        EXPECT_EQ_INT(0, status);
+DEF_TEST(metric_parser_throughput)
+{
+    strbuf_t buf = STRBUF_CREATE;
+    size_t lines = 0;
 
-        metric_parser_dispatch(mp, dispatch_metric_family, NULL, 0);
+    for (size_t i = 0; i < 100; i++) {
+        strbuf_putstr(&buf, "# HELP http_requests Requests.\n# TYPE http_requests counter\n");
+        lines += 2;
+        for (size_t j = 0; j < 10; j++) {
+            strbuf_printf(&buf, "http_requests_total{handler=\"/api/v%zu\",code=\"%zu\","
+                                "instance=\"host%zu.example.org:9100\"} %zu 1700000000000\n",
+                                i, 200 + j, i, i * j);
+            lines++;
+        }
+        strbuf_printf(&buf, "# TYPE latency_%zu histogram\n", i);
+        lines++;
+        for (size_t j = 0; j < 10; j++) {
+            strbuf_printf(&buf, "latency_%zu_bucket{method=\"GET\",le=\"%zu\"} %zu\n", i, j, j);
+            lines++;
+        }
+        strbuf_printf(&buf, "latency_%zu_bucket{method=\"GET\",le=\"+Inf\"} 10\n"
+                            "latency_%zu_sum{method=\"GET\"} 45.5\n"
+                            "latency_%zu_count{method=\"GET\"} 10\n", i, i, i);
+        lines += 3;
+    }
 
-        EXPECT_EQ_FAM_LIST(cases[i].fams, cases[i].num, g_fams, g_fams_num);
+    size_t len = strbuf_len(&buf);
+    size_t loops = 50;
+    /* Chunk size of a typical curl write callback. */
+    size_t chunk = 16384;
 
-        metric_parser_free(mp);
+    metric_parser_t *mp = metric_parser_alloc(NULL, NULL);
+    OK(mp != NULL);
 
-        for (size_t j = 0; j < g_fams_num; j++) {
-            free(g_fams[j].name);
-            metric_family_metric_reset(&g_fams[j]);
+    int status = 0;
+    int fams_num = 0;
+    cdtime_t start = cdtime();
+    for (size_t i = 0; i < loops; i++) {
+        for (size_t offset = 0; offset < len; offset += chunk) {
+            size_t size = (len - offset) < chunk ? (len - offset) : chunk;
+            status |= metric_parse_buffer(mp, buf.ptr + offset, size);
         }
-
-        free(g_fams);
-        g_fams = NULL;
-        g_fams_num = 0;
+        status |= metric_parse_buffer(mp, NULL, 0);
+        fams_num = metric_parser_size(mp);
+        metric_parser_dispatch(mp, dispatch_metric_family_discard, NULL, 0);
     }
+    double elapsed = CDTIME_T_TO_DOUBLE(cdtime() - start);
+
+    EXPECT_EQ_INT(0, status);
+    EXPECT_EQ_INT(101, fams_num);
+
+    if (elapsed > 0)
+        printf("# parsed %zu lines in %.3fs, %.0f lines/s, %.1f MiB/s\n", lines * loops, elapsed,
+               (double)(lines * loops) / elapsed,
+               (double)(len * loops) / elapsed / (1024.0 * 1024.0));
+
+    metric_parser_free(mp);
+    strbuf_destroy(&buf);
 
     return 0;
 }
@@ -311,6 +403,7 @@ DEF_TEST(metric_parser)
 int main(void)
 {
     RUN_TEST(metric_parser);
+    RUN_TEST(metric_parser_throughput);
 
     END_TEST;
 }
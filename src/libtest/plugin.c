@@ -12,6 +12,7 @@ static int (*g_config_cb)(config_item_t *);
 static plugin_init_cb g_init_cb;
 static int (*g_simple_read_cb)(void);
 static plugin_write_cb g_write_cb;
+static plugin_write_batch_cb g_write_batch_cb;
 static plugin_flush_cb g_flush_cb;
 static cdtime_t g_flush_interval;
 static cdtime_t g_flush_timeout;
@@ -110,9 +111,30 @@ int plugin_register_write(__attribute__((unused)) const char *group,
     return 0;
 }
 
+int plugin_register_write_batch(__attribute__((unused)) const char *group,
+                                __attribute__((unused)) const char *name,
+                                plugin_write_batch_cb write_batch_cb,
+                                plugin_flush_cb flush_cb, cdtime_t flush_interval,
+                                cdtime_t flush_timeout,
+                                __attribute__((unused)) size_t batch_size,
+                                __attribute__((unused)) cdtime_t batch_timeout,
+                                user_data_t const *ud)
+{
+    g_write_batch_cb = write_batch_cb;
+    g_flush_cb = flush_cb;
+    g_flush_interval = flush_interval;
+    g_flush_timeout = flush_timeout;
+    if (ud == NULL)
+        memset(&g_write_ud, 0, sizeof(g_write_ud));
+    else
+        memcpy(&g_write_ud, ud, sizeof(g_write_ud));
+    return 0;
+}
+
 int plugin_unregister_write(__attribute__((unused)) char const *name)
 {
     g_write_cb = NULL;
+    g_write_batch_cb = NULL;
     g_flush_cb = NULL;
     g_flush_interval = 0;
     g_flush_timeout = 0;
@@ -289,6 +311,11 @@ int plugin_test_read(void)
 
 int plugin_test_write(metric_family_t const *fam)
 {
+    if (g_write_batch_cb != NULL) {
+        metric_family_t *fams[] = { (metric_family_t *)(uintptr_t)fam };
+        metric_family_list_t faml = { .fixed = true, .pos = 1, .size = 1, .ptr = fams };
+        return g_write_batch_cb(&faml, &g_write_ud);
+    }
     if (g_write_cb == NULL)
         return 0;
     return g_write_cb(fam, &g_write_ud);
@@ -11,7 +11,7 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE /* For setgroups */
 
-/* _GNU_SOURCE is needed in Linux to use execvpe */
+/* _GNU_SOURCE is needed in Linux to use execvpe and clone */
 #define _GNU_SOURCE
 
 #include "log.h"
@@ -22,12 +22,218 @@
 
 #include <grp.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+
+/* The child is started with clone(CLONE_VM|CLONE_VFORK): it runs in the memory
+ * of the daemon until the exec, so the page tables of the daemon are not copied
+ * as with fork(2).  posix_spawn(3) would do the same, but it can not change the
+ * user and group of the child. */
+#if defined(KERNEL_LINUX) && defined(HAVE_EXECVPE)
+#define EXEC_USE_CLONE
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 extern char **environ;
 static const long int MAX_GRBUF_SIZE = 65536;
 
+static void close_all(int fd_in, int fd_out, int fd_err)
+{
+#if defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM) || defined(HAVE_FCNTL_CLOSEM)
+    int fd_max = fd_in;
+    if (fd_out > fd_max)
+        fd_max = fd_out;
+    if (fd_err > fd_max)
+        fd_max = fd_err;
+
+#ifdef HAVE_CLOSE_RANGE
+#ifdef CLOSE_RANGE_UNSHARE
+    close_range(fd_max + 1, ~0U, CLOSE_RANGE_UNSHARE);
+#else
+    close_range(fd_max + 1, ~0U, 0);
+#endif
+#elif defined(HAVE_CLOSEFROM)
+    closefrom(fd_max + 1);
+#elif defined(HAVE_FCNTL_CLOSEM)
+    fcntl(fd_max + 1, F_CLOSEM, 0);
+#endif
+
+    for (int fd = 0; fd < fd_max; fd++) {
+        if ((fd == fd_in) || (fd == fd_out) || (fd == fd_err))
+            continue;
+        close(fd);
+    }
+#else
+    int fd_num = getdtablesize();
+    for (int fd = 0; fd < fd_num; fd++) {
+        if ((fd == fd_in) || (fd == fd_out) || (fd == fd_err))
+            continue;
+        close(fd);
+    }
+#endif
+}
+
+/* Closes all file descriptors but the pipe ends of the child, and connects
+ * them to STDIN, STDOUT and STDERR. */
+static void exec_child_fds(int fd_in, int fd_out, int fd_err)
+{
+    close_all(fd_in, fd_out, fd_err);
+
+    /* Connect the 'in' pipe to STDIN */
+    if (fd_in != STDIN_FILENO) {
+        dup2(fd_in, STDIN_FILENO);
+        close(fd_in);
+    }
+
+    /* Now connect the 'out' pipe to STDOUT */
+    if (fd_out != STDOUT_FILENO) {
+        dup2(fd_out, STDOUT_FILENO);
+        close(fd_out);
+    }
+
+    /* Now connect the 'err' pipe to STDERR */
+    if (fd_err != STDERR_FILENO) {
+        dup2(fd_err, STDERR_FILENO);
+        close(fd_err);
+    }
+}
+
+#ifdef EXEC_USE_CLONE
+#define EXEC_CHILD_STACK_SIZE (256 * 1024)
+
+#ifdef SYS_setuid32
+#define EXEC_SYS_SETGROUPS SYS_setgroups32
+#define EXEC_SYS_SETGID SYS_setgid32
+#define EXEC_SYS_SETRESGID SYS_setresgid32
+#define EXEC_SYS_SETUID SYS_setuid32
+#else
+#define EXEC_SYS_SETGROUPS SYS_setgroups
+#define EXEC_SYS_SETGID SYS_setgid
+#define EXEC_SYS_SETRESGID SYS_setresgid
+#define EXEC_SYS_SETUID SYS_setuid
+#endif
+
+typedef struct {
+    cexec_t *pm;
+    int fd_in;
+    int fd_out;
+    int fd_err;
+    /* Written by the child, the parent reads them when clone returns. */
+    volatile int error;
+    const char * volatile failed;
+} exec_spawn_t;
+
+/* Runs on the memory of the parent, that is suspended until the exec or the
+ * exit of the child: only system calls are allowed here.  The set*id
+ * functions of the libc can not be used because they signal every thread of
+ * the process to change their credentials. */
+static int exec_spawn_child(void *arg)
+{
+    exec_spawn_t *spawn = arg;
+    cexec_t *pm = spawn->pm;
+
+    /* The signal handlers of the parent must not run on its memory. */
+    for (int sig = 1; sig < _NSIG; sig++) {
+        struct sigaction sa = {0};
+        if (sigaction(sig, NULL, &sa) != 0)
+            continue;
+        if ((sa.sa_handler == SIG_DFL) || (sa.sa_handler == SIG_IGN))
+            continue;
+        sa.sa_handler = SIG_DFL;
+        sa.sa_flags = 0;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, NULL);
+    }
+
+    exec_child_fds(spawn->fd_in, spawn->fd_out, spawn->fd_err);
+
+    if (getuid() == 0) {
+        gid_t glist[2] = { pm->gid, pm->egid };
+        size_t glist_len = ((pm->gid != pm->egid) && (pm->egid != -1)) ? 2 : 1;
+        syscall(EXEC_SYS_SETGROUPS, glist_len, glist);
+    }
+
+    if (syscall(EXEC_SYS_SETGID, pm->gid) != 0) {
+        spawn->failed = "setgid";
+        goto failed;
+    }
+
+    if ((pm->egid != -1) && (syscall(EXEC_SYS_SETRESGID, -1, pm->egid, -1) != 0)) {
+        spawn->failed = "setegid";
+        goto failed;
+    }
+
+    if (syscall(EXEC_SYS_SETUID, pm->uid) != 0) {
+        spawn->failed = "setuid";
+        goto failed;
+    }
+
+    /* Unblock all signals */
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigprocmask(SIG_SETMASK, &ss, NULL);
+
+    execvpe(pm->exec, pm->argv, pm->envp);
+
+    spawn->failed = "exec";
+failed:
+    spawn->error = errno;
+    _exit(127);
+}
+
+static int exec_spawn(cexec_t *pm, int fd_in, int fd_out, int fd_err)
+{
+    void *stack = mmap(NULL, EXEC_CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        PLUGIN_ERROR("mmap failed: %s", STRERRNO);
+        return -1;
+    }
+
+    exec_spawn_t spawn = {
+        .pm = pm,
+        .fd_in = fd_in,
+        .fd_out = fd_out,
+        .fd_err = fd_err,
+    };
+
+    /* Until it resets the handlers a signal would run them in the child. */
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    /* The stack grows down on all the architectures supported by Linux but hppa. */
+    int pid = clone(exec_spawn_child, (char *)stack + EXEC_CHILD_STACK_SIZE,
+                    CLONE_VM | CLONE_VFORK | SIGCHLD, &spawn);
+    int clone_errno = errno;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    munmap(stack, EXEC_CHILD_STACK_SIZE);
+
+    if (pid < 0) {
+        PLUGIN_ERROR("clone failed: %s", STRERROR(clone_errno));
+        return -1;
+    }
+
+    if (spawn.failed != NULL) {
+        waitpid(pid, NULL, 0);
+        if (strcmp(spawn.failed, "exec") == 0)
+            PLUGIN_ERROR("Failed to execute '%s': %s", pm->exec, STRERROR(spawn.error));
+        else
+            PLUGIN_ERROR("%s failed: %s", spawn.failed, STRERROR(spawn.error));
+        return -1;
+    }
+
+    return pid;
+}
+#else
 __attribute__((noreturn))
 static void exec_child(const char *file, char *const argv[], char *envp[],
                        int uid, int gid, int egid)
@@ -88,6 +294,26 @@ static void reset_signal_mask(void)
     sigprocmask(SIG_SETMASK, &ss, /* old mask = */ NULL);
 }
 
+static int exec_spawn(cexec_t *pm, int fd_in, int fd_out, int fd_err)
+{
+    int pid = fork();
+    if (pid < 0) {
+        PLUGIN_ERROR("fork failed: %s", STRERRNO);
+        return -1;
+    } else if (pid == 0) {
+        exec_child_fds(fd_in, fd_out, fd_err);
+
+        /* Unblock all signals */
+        reset_signal_mask();
+
+        exec_child(pm->exec, pm->argv, pm->envp, pm->uid, pm->gid, pm->egid);
+        /* does not return */
+    }
+
+    return pid;
+}
+#endif
+
 static int create_pipe(int fd_pipe[2])
 {
     int status = pipe(fd_pipe);
@@ -167,53 +393,11 @@ static int getegr_id(char *group, int gid)
     return -2;
 }
 
-static void close_all(int fd_in, int fd_out, int fd_err)
+/* Looks up the user and group of the program once, the result is kept in pm. */
+static int exec_resolve_ids(cexec_t *pm)
 {
-#if defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM) || defined(HAVE_FCNTL_CLOSEM)
-    int fd_max = fd_in;
-    if (fd_out > fd_max)
-        fd_max = fd_out;
-    if (fd_err > fd_max)
-        fd_max = fd_err;
-
-#ifdef HAVE_CLOSE_RANGE
-#ifdef CLOSE_RANGE_UNSHARE
-    close_range(fd_max + 1, ~0U, CLOSE_RANGE_UNSHARE);
-#else
-    close_range(fd_max + 1, ~0U, 0);
-#endif
-#elif defined(HAVE_CLOSEFROM)
-    closefrom(fd_max + 1);
-#elif defined(HAVE_FCNTL_CLOSEM)
-    fcntl(fd_max + 1, F_CLOSEM, 0);
-#endif
-
-    for (int fd = 0; fd < fd_max; fd++) {
-        if ((fd == fd_in) || (fd == fd_out) || (fd == fd_err))
-            continue;
-        close(fd);
-    }
-#else
-    int fd_num = getdtablesize();
-    for (int fd = 0; fd < fd_num; fd++) {
-        if ((fd == fd_in) || (fd == fd_out) || (fd == fd_err))
-            continue;
-        close(fd);
-    }
-#endif
-}
-
-/*
- * Creates three pipes (one for reading, one for writing and one for errors),
- * forks a child, sets up the pipes so that fd_in is connected to STDIN of
- * the child and fd_out is connected to STDOUT and fd_err is connected to STDERR
- * of the child. Then is calls 'exec_child'.
- */
-int exec_fork_child(cexec_t *pm, bool can_be_root, int *fd_in, int *fd_out, int *fd_err)
-{
-    int fd_pipe_in[2] = {-1, -1};
-    int fd_pipe_out[2] = {-1, -1};
-    int fd_pipe_err[2] = {-1, -1};
+    if (pm->resolved)
+        return 0;
 
     long int nambuf_size = sysconf(_SC_GETPW_R_SIZE_MAX);
     if (nambuf_size <= 0)
@@ -222,10 +406,6 @@ int exec_fork_child(cexec_t *pm, bool can_be_root, int *fd_in, int *fd_out, int
         nambuf_size = 4096;
     char nambuf[nambuf_size];
 
-    if ((create_pipe(fd_pipe_in) == -1) || (create_pipe(fd_pipe_out) == -1) ||
-        (create_pipe(fd_pipe_err) == -1))
-        goto failed;
-
     int uid = getuid();
     int gid = getgid();
 
@@ -236,62 +416,60 @@ int exec_fork_child(cexec_t *pm, bool can_be_root, int *fd_in, int *fd_out, int
         if (status != 0) {
             PLUGIN_ERROR("Failed to get user information for user ''%s'': %s",
                          pm->user, STRERROR(status));
-            goto failed;
+            return -1;
         }
 
         if (sp_ptr == NULL) {
             PLUGIN_ERROR("No such user: '%s'", pm->user);
-            goto failed;
+            return -1;
         }
 
         uid = sp.pw_uid;
         gid = sp.pw_gid;
     }
 
-    if ((can_be_root == false) && (uid == 0)) {
-        PLUGIN_ERROR("Cowardly refusing to exec program as root.");
-        goto failed;
-    }
-
     /* The group configured in the configfile is set as effective group, because
      * this way the forked process can (re-)gain the user's primary group. */
     int egid = getegr_id(pm->group, gid);
     if (egid == -2)
-        goto failed;
-
-    int pid = fork();
-    if (pid < 0) {
-        PLUGIN_ERROR("fork failed: %s", STRERRNO);
-        goto failed;
-    } else if (pid == 0) {
-        /* Close all file descriptors but the pipe end we need. */
-        close_all(fd_pipe_in[0], fd_pipe_out[1], fd_pipe_err[1]);
+        return -1;
 
-        /* Connect the 'in' pipe to STDIN */
-        if (fd_pipe_in[0] != STDIN_FILENO) {
-            dup2(fd_pipe_in[0], STDIN_FILENO);
-            close(fd_pipe_in[0]);
-        }
+    pm->uid = uid;
+    pm->gid = gid;
+    pm->egid = egid;
+    pm->resolved = true;
 
-        /* Now connect the 'out' pipe to STDOUT */
-        if (fd_pipe_out[1] != STDOUT_FILENO) {
-            dup2(fd_pipe_out[1], STDOUT_FILENO);
-            close(fd_pipe_out[1]);
-        }
+    return 0;
+}
 
-        /* Now connect the 'err' pipe to STDERR */
-        if (fd_pipe_err[1] != STDERR_FILENO) {
-            dup2(fd_pipe_err[1], STDERR_FILENO);
-            close(fd_pipe_err[1]);
-        }
+/*
+ * Creates three pipes (one for reading, one for writing and one for errors),
+ * starts a child, sets up the pipes so that fd_in is connected to STDIN of
+ * the child and fd_out is connected to STDOUT and fd_err is connected to STDERR
+ * of the child. Then it executes the program as the configured user and group.
+ */
+int exec_fork_child(cexec_t *pm, bool can_be_root, int *fd_in, int *fd_out, int *fd_err)
+{
+    int fd_pipe_in[2] = {-1, -1};
+    int fd_pipe_out[2] = {-1, -1};
+    int fd_pipe_err[2] = {-1, -1};
 
-        /* Unblock all signals */
-        reset_signal_mask();
+    if (exec_resolve_ids(pm) != 0)
+        return -1;
 
-        exec_child(pm->exec, pm->argv, pm->envp, uid, gid, egid);
-        /* does not return */
+    if ((can_be_root == false) && (pm->uid == 0)) {
+        PLUGIN_ERROR("Cowardly refusing to exec program as root.");
+        return -1;
     }
 
+    if ((create_pipe(fd_pipe_in) == -1) || (create_pipe(fd_pipe_out) == -1) ||
+        (create_pipe(fd_pipe_err) == -1))
+        goto failed;
+
+    int pid = exec_spawn(pm, fd_pipe_in[0], fd_pipe_out[1], fd_pipe_err[1]);
+    if (pid < 0)
+        goto failed;
+
     close(fd_pipe_in[0]);
     close(fd_pipe_out[1]);
     close(fd_pipe_err[1]);
@@ -466,4 +644,376 @@ void exec_reset(cexec_t *pm)
         free(pm->envp);
         pm->envp = NULL;
     }
+
+    pm->resolved = false;
+}
+
+#define EXEC_REAPER_LINE_SIZE 4096
+/* Interval to look for the exit of a child that closed its pipes. */
+#define EXEC_REAPER_WAIT_MS 100
+
+typedef struct exec_child_s exec_child_t;
+struct exec_child_s {
+    pid_t pid;
+    int fd_out;
+    int fd_err;
+    size_t out_len;
+    size_t err_len;
+    char out[EXEC_REAPER_LINE_SIZE];
+    char err[EXEC_REAPER_LINE_SIZE];
+    cdtime_t last_read;
+    exec_watch_t watch;
+    exec_child_t *next;
+};
+
+struct exec_reaper_s {
+    pthread_mutex_t lock;
+    bool loop;
+    int wake[2];
+    exec_child_t *children;
+    size_t children_num;
+    struct pollfd *fds;
+    exec_child_t **fds_child;
+    size_t fds_size;
+};
+
+exec_reaper_t *exec_reaper_alloc(void)
+{
+    exec_reaper_t *reaper = calloc(1, sizeof(*reaper));
+    if (reaper == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        return NULL;
+    }
+
+    if (create_pipe(reaper->wake) != 0) {
+        free(reaper);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        int flags = fcntl(reaper->wake[i], F_GETFL);
+        fcntl(reaper->wake[i], F_SETFL, flags | O_NONBLOCK);
+        fcntl(reaper->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_init(&reaper->lock, NULL);
+    reaper->loop = true;
+
+    return reaper;
+}
+
+static void exec_reaper_wakeup(exec_reaper_t *reaper)
+{
+    char c = 0;
+    ssize_t len = write(reaper->wake[1], &c, 1);
+    (void)len;
+}
+
+int exec_reaper_watch(exec_reaper_t *reaper, pid_t pid, int fd_out, int fd_err,
+                      const exec_watch_t *watch)
+{
+    exec_child_t *child = calloc(1, sizeof(*child));
+    if (child == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        kill(pid, SIGTERM);
+        if (fd_out >= 0)
+            close(fd_out);
+        if (fd_err >= 0)
+            close(fd_err);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    child->pid = pid;
+    child->fd_out = fd_out;
+    child->fd_err = fd_err;
+    child->last_read = cdtime();
+    child->watch = *watch;
+
+    pthread_mutex_lock(&reaper->lock);
+    child->next = reaper->children;
+    reaper->children = child;
+    reaper->children_num++;
+    pthread_mutex_unlock(&reaper->lock);
+
+    exec_reaper_wakeup(reaper);
+
+    return 0;
+}
+
+static void exec_reaper_line(exec_child_t *child, bool is_err, char *line)
+{
+    size_t len = strlen(line);
+    if ((len > 0) && (line[len - 1] == '\r'))
+        line[len - 1] = '\0';
+
+    if (is_err) {
+        if (child->watch.err_cb != NULL)
+            child->watch.err_cb(line, child->watch.arg);
+        else
+            PLUGIN_ERROR("Program with pid %d: %s", (int)child->pid, line);
+    } else if (child->watch.out_cb != NULL) {
+        child->watch.out_cb(line, child->watch.arg);
+    }
+}
+
+/* Reads from one of the pipes of the child and splits the data in lines,
+ * returns false when the pipe has been closed. */
+static bool exec_reaper_read(exec_child_t *child, bool is_err)
+{
+    int fd = is_err ? child->fd_err : child->fd_out;
+    char *buffer = is_err ? child->err : child->out;
+    size_t *buffer_len = is_err ? &child->err_len : &child->out_len;
+
+    ssize_t len = read(fd, buffer + *buffer_len, EXEC_REAPER_LINE_SIZE - 1 - *buffer_len);
+    if (len < 0) {
+        if ((errno == EAGAIN) || (errno == EINTR))
+            return true;
+        PLUGIN_ERROR("Failed to read pipe from child %d: %s", (int)child->pid, STRERRNO);
+        len = 0;
+    }
+
+    if (len == 0) {
+        /* A last line without a newline. */
+        if (*buffer_len > 0) {
+            buffer[*buffer_len] = '\0';
+            exec_reaper_line(child, is_err, buffer);
+            *buffer_len = 0;
+        }
+        return false;
+    }
+
+    if (!is_err)
+        child->last_read = cdtime();
+
+    *buffer_len += len;
+    buffer[*buffer_len] = '\0';
+
+    char *line = buffer;
+    char *pnl;
+    while ((pnl = strchr(line, '\n')) != NULL) {
+        *pnl = '\0';
+        exec_reaper_line(child, is_err, line);
+        line = pnl + 1;
+    }
+
+    size_t left = *buffer_len - (line - buffer);
+    if (left == (EXEC_REAPER_LINE_SIZE - 1)) {
+        /* The line does not fit in the buffer. */
+        exec_reaper_line(child, is_err, buffer);
+        left = 0;
+    } else if ((left > 0) && (line != buffer)) {
+        memmove(buffer, line, left);
+    }
+    *buffer_len = left;
+
+    return true;
+}
+
+static void exec_reaper_close(int *fd)
+{
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+static void exec_reaper_remove(exec_reaper_t *reaper, exec_child_t *child)
+{
+    pthread_mutex_lock(&reaper->lock);
+    exec_child_t **ptr = &reaper->children;
+    while (*ptr != NULL) {
+        if (*ptr == child) {
+            *ptr = child->next;
+            reaper->children_num--;
+            break;
+        }
+        ptr = &(*ptr)->next;
+    }
+    pthread_mutex_unlock(&reaper->lock);
+
+    free(child);
+}
+
+/* Builds the poll set, returns the number of entries and the poll timeout. */
+static size_t exec_reaper_prepare(exec_reaper_t *reaper, cdtime_t now, int *timeout)
+{
+    size_t size = 1 + 2 * reaper->children_num;
+    if (size > reaper->fds_size) {
+        struct pollfd *fds = realloc(reaper->fds, size * sizeof(*fds));
+        if (fds == NULL)
+            return 0;
+        reaper->fds = fds;
+
+        exec_child_t **fds_child = realloc(reaper->fds_child, size * sizeof(*fds_child));
+        if (fds_child == NULL)
+            return 0;
+        reaper->fds_child = fds_child;
+
+        reaper->fds_size = size;
+    }
+
+    reaper->fds[0] = (struct pollfd){ .fd = reaper->wake[0], .events = POLLIN };
+    reaper->fds_child[0] = NULL;
+    size_t n = 1;
+
+    cdtime_t wait = 0;
+    for (exec_child_t *child = reaper->children; child != NULL; child = child->next) {
+        if (child->fd_out >= 0) {
+            reaper->fds[n] = (struct pollfd){ .fd = child->fd_out, .events = POLLIN };
+            reaper->fds_child[n] = child;
+            n++;
+        }
+        if (child->fd_err >= 0) {
+            reaper->fds[n] = (struct pollfd){ .fd = child->fd_err, .events = POLLIN };
+            reaper->fds_child[n] = child;
+            n++;
+        }
+
+        cdtime_t child_wait = 0;
+        if ((child->fd_out < 0) && (child->fd_err < 0)) {
+            child_wait = MS_TO_CDTIME_T(EXEC_REAPER_WAIT_MS);
+        } else if ((child->fd_out >= 0) && (child->watch.idle_cb != NULL) &&
+                   (child->watch.idle_timeout > 0)) {
+            cdtime_t deadline = child->last_read + child->watch.idle_timeout;
+            child_wait = deadline > now ? deadline - now : 1;
+        }
+
+        if ((child_wait > 0) && ((wait == 0) || (child_wait < wait)))
+            wait = child_wait;
+    }
+
+    *timeout = wait == 0 ? -1 : (int)CDTIME_T_TO_MS(wait) + 1;
+
+    return n;
+}
+
+void *exec_reaper_run(void *arg)
+{
+    exec_reaper_t *reaper = arg;
+
+    while (true) {
+        pthread_mutex_lock(&reaper->lock);
+        if (!reaper->loop) {
+            pthread_mutex_unlock(&reaper->lock);
+            break;
+        }
+        int timeout = -1;
+        size_t nfds = exec_reaper_prepare(reaper, cdtime(), &timeout);
+        pthread_mutex_unlock(&reaper->lock);
+
+        if (nfds == 0) {
+            PLUGIN_ERROR("realloc failed.");
+            nfds = 1;
+            timeout = 1000;
+        }
+
+        int status = poll(reaper->fds, nfds, timeout);
+        if (status < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN))
+                continue;
+            PLUGIN_ERROR("poll failed: %s", STRERRNO);
+            break;
+        }
+
+        if (reaper->fds[0].revents != 0) {
+            char buffer[64];
+            while (read(reaper->wake[0], buffer, sizeof(buffer)) > 0);
+        }
+
+        for (size_t i = 1; i < nfds; i++) {
+            if (reaper->fds[i].revents == 0)
+                continue;
+
+            exec_child_t *child = reaper->fds_child[i];
+            bool is_err = reaper->fds[i].fd == child->fd_err;
+
+            if (!exec_reaper_read(child, is_err))
+                exec_reaper_close(is_err ? &child->fd_err : &child->fd_out);
+        }
+
+        /* Only this thread unlinks children and exec_reaper_watch only prepends
+         * them, the list from the head taken under the lock is stable. */
+        pthread_mutex_lock(&reaper->lock);
+        exec_child_t *child = reaper->children;
+        pthread_mutex_unlock(&reaper->lock);
+
+        cdtime_t now = cdtime();
+        while (child != NULL) {
+            exec_child_t *next = child->next;
+
+            if ((child->fd_out >= 0) || (child->fd_err >= 0)) {
+                if ((child->fd_out >= 0) && (child->watch.idle_cb != NULL) &&
+                    (child->watch.idle_timeout > 0) &&
+                    ((now - child->last_read) >= child->watch.idle_timeout)) {
+                    child->watch.idle_cb(now, child->watch.arg);
+                    child->last_read = now;
+                }
+                child = next;
+                continue;
+            }
+
+            int child_status = 0;
+            pid_t pid = waitpid(child->pid, &child_status, WNOHANG);
+            if (pid == 0) {
+                child = next;
+                continue;
+            }
+
+            if (pid < 0) {
+                PLUGIN_ERROR("waitpid(%d) failed: %s", (int)child->pid, STRERRNO);
+                child_status = -1;
+            }
+
+            if (child->watch.exit_cb != NULL)
+                child->watch.exit_cb(child_status, child->watch.arg);
+
+            exec_reaper_remove(reaper, child);
+            child = next;
+        }
+    }
+
+    return NULL;
+}
+
+void exec_reaper_stop(exec_reaper_t *reaper)
+{
+    if (reaper == NULL)
+        return;
+
+    pthread_mutex_lock(&reaper->lock);
+    reaper->loop = false;
+    pthread_mutex_unlock(&reaper->lock);
+
+    exec_reaper_wakeup(reaper);
+}
+
+void exec_reaper_free(exec_reaper_t *reaper)
+{
+    if (reaper == NULL)
+        return;
+
+    exec_child_t *child = reaper->children;
+    while (child != NULL) {
+        exec_child_t *next = child->next;
+
+        kill(child->pid, SIGTERM);
+        exec_reaper_close(&child->fd_out);
+        exec_reaper_close(&child->fd_err);
+
+        int status = 0;
+        if (waitpid(child->pid, &status, 0) < 0)
+            status = -1;
+
+        if (child->watch.exit_cb != NULL)
+            child->watch.exit_cb(status, child->watch.arg);
+
+        free(child);
+        child = next;
+    }
+
+    close_pipe(reaper->wake);
+    pthread_mutex_destroy(&reaper->lock);
+    free(reaper->fds);
+    free(reaper->fds_child);
+    free(reaper);
 }
@@ -4,12 +4,22 @@
 
 #pragma once
 
+#include "libutils/time.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
 typedef struct {
     char *user;
     char *group;
     char *exec;
     char **argv;
     char **envp;
+    /* user and group resolved by the first exec_fork_child. */
+    bool resolved;
+    int uid;
+    int gid;
+    int egid;
 } cexec_t;
 
 int cf_util_exec_append_env(config_item_t *ci, cexec_t *pm);
@@ -21,3 +31,38 @@ int cexec_append_env(cexec_t *pm, const char *key, const char *value);
 void exec_reset(cexec_t *pm);
 
 int exec_fork_child(cexec_t *pm, bool can_be_root, int *fd_in, int *fd_out, int *fd_err);
+
+/* A reaper multiplexes the pipes of many children with poll(2) in a single
+ * thread, the callbacks are called from that thread. */
+
+typedef struct {
+    /* Called with every line the child writes to stdout or stderr, without the
+     * newline.  Lines written to stderr are logged as errors if err_cb is NULL. */
+    void (*out_cb)(char *line, void *arg);
+    void (*err_cb)(char *line, void *arg);
+    /* Called when the child did not write to stdout for idle_timeout. */
+    void (*idle_cb)(cdtime_t now, void *arg);
+    cdtime_t idle_timeout;
+    /* Called once the child has closed its pipes and has been reaped, status
+     * is the one returned by waitpid(2) or -1 if the child could not be reaped. */
+    void (*exit_cb)(int status, void *arg);
+    void *arg;
+} exec_watch_t;
+
+struct exec_reaper_s;
+typedef struct exec_reaper_s exec_reaper_t;
+
+exec_reaper_t *exec_reaper_alloc(void);
+
+/* Start routine of the reaper thread, returns after exec_reaper_stop. */
+void *exec_reaper_run(void *arg);
+
+/* Hands the child and its pipes over to the reaper.  On failure the child is
+ * killed and reaped, and the exit_cb is not called. */
+int exec_reaper_watch(exec_reaper_t *reaper, pid_t pid, int fd_out, int fd_err,
+                      const exec_watch_t *watch);
+
+void exec_reaper_stop(exec_reaper_t *reaper);
+
+/* Terminates the children still watched, calling their exit_cb. */
+void exec_reaper_free(exec_reaper_t *reaper);
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/exec.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define RESULT_LINES 8
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char out[RESULT_LINES][64];
+    size_t out_num;
+    char err[RESULT_LINES][64];
+    size_t err_num;
+    bool exited;
+    int status;
+} result_t;
+
+static void result_init(result_t *res)
+{
+    *res = (result_t){0};
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_cond_init(&res->cond, NULL);
+}
+
+static void result_destroy(result_t *res)
+{
+    pthread_mutex_destroy(&res->lock);
+    pthread_cond_destroy(&res->cond);
+}
+
+static void out_cb(char *line, void *arg)
+{
+    result_t *res = arg;
+    pthread_mutex_lock(&res->lock);
+    if (res->out_num < RESULT_LINES)
+        sstrncpy(res->out[res->out_num++], line, sizeof(res->out[0]));
+    pthread_mutex_unlock(&res->lock);
+}
+
+static void err_cb(char *line, void *arg)
+{
+    result_t *res = arg;
+    pthread_mutex_lock(&res->lock);
+    if (res->err_num < RESULT_LINES)
+        sstrncpy(res->err[res->err_num++], line, sizeof(res->err[0]));
+    pthread_mutex_unlock(&res->lock);
+}
+
+static void exit_cb(int status, void *arg)
+{
+    result_t *res = arg;
+    pthread_mutex_lock(&res->lock);
+    res->exited = true;
+    res->status = status;
+    pthread_cond_broadcast(&res->cond);
+    pthread_mutex_unlock(&res->lock);
+}
+
+/* Waits up to ten seconds for the exit_cb. */
+static bool result_wait(result_t *res)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+
+    pthread_mutex_lock(&res->lock);
+    while (!res->exited) {
+        if (pthread_cond_timedwait(&res->cond, &res->lock, &deadline) != 0)
+            break;
+    }
+    bool exited = res->exited;
+    pthread_mutex_unlock(&res->lock);
+
+    return exited;
+}
+
+static int spawn(exec_reaper_t *reaper, char *script, result_t *res)
+{
+    char *argv[] = {"/bin/sh", "-c", script, NULL};
+    char *envp[] = {"PATH=/usr/bin:/bin", NULL};
+    cexec_t pm = {.exec = "/bin/sh", .argv = argv, .envp = envp};
+
+    int fd_out = -1;
+    int fd_err = -1;
+    int pid = exec_fork_child(&pm, true, NULL, &fd_out, &fd_err);
+    if (pid < 0)
+        return -1;
+
+    exec_watch_t watch = {.out_cb = out_cb, .err_cb = err_cb, .exit_cb = exit_cb, .arg = res};
+    return exec_reaper_watch(reaper, pid, fd_out, fd_err, &watch);
+}
+
+static exec_reaper_t *reaper;
+static pthread_t reaper_thread;
+
+DEF_TEST(lines)
+{
+    result_t res;
+    result_init(&res);
+
+    CHECK_ZERO(spawn(reaper, "printf 'one\\ntwo\\r\\n\\nthree'; printf 'err\\n' >&2; exit 3",
+                     &res));
+    OK(result_wait(&res));
+
+    /* The last line is delivered without a newline, a \r before the newline is removed. */
+    EXPECT_EQ_INT(4, res.out_num);
+    EXPECT_EQ_STR("one", res.out[0]);
+    EXPECT_EQ_STR("two", res.out[1]);
+    EXPECT_EQ_STR("", res.out[2]);
+    EXPECT_EQ_STR("three", res.out[3]);
+    EXPECT_EQ_INT(1, res.err_num);
+    EXPECT_EQ_STR("err", res.err[0]);
+
+    OK(WIFEXITED(res.status));
+    EXPECT_EQ_INT(3, WEXITSTATUS(res.status));
+
+    result_destroy(&res);
+    return 0;
+}
+
+DEF_TEST(many)
+{
+    result_t results[16];
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(results); i++) {
+        result_init(&results[i]);
+        char script[64];
+        ssnprintf(script, sizeof(script), "echo %zu; exit %zu", i, i);
+        CHECK_ZERO(spawn(reaper, script, &results[i]));
+    }
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(results); i++) {
+        OK(result_wait(&results[i]));
+        EXPECT_EQ_INT(1, results[i].out_num);
+        EXPECT_EQ_INT(i, atoi(results[i].out[0]));
+        OK(WIFEXITED(results[i].status));
+        EXPECT_EQ_INT(i, WEXITSTATUS(results[i].status));
+        result_destroy(&results[i]);
+    }
+
+    return 0;
+}
+
+DEF_TEST(exec_failed)
+{
+    char *argv[] = {"/nonexistent/program", NULL};
+    char *envp[] = {NULL};
+    cexec_t pm = {.exec = "/nonexistent/program", .argv = argv, .envp = envp};
+
+    int fd_out = -1;
+    int fd_err = -1;
+    int pid = exec_fork_child(&pm, true, NULL, &fd_out, &fd_err);
+    if (pid < 0) {
+        EXPECT_EQ_INT(-1, fd_out);
+        EXPECT_EQ_INT(-1, fd_err);
+        return 0;
+    }
+
+    /* Without clone the failure is only seen in the exit status of the child. */
+    result_t res;
+    result_init(&res);
+    exec_watch_t watch = {.out_cb = out_cb, .err_cb = err_cb, .exit_cb = exit_cb, .arg = &res};
+    CHECK_ZERO(exec_reaper_watch(reaper, pid, fd_out, fd_err, &watch));
+    OK(result_wait(&res));
+    OK(WIFEXITED(res.status));
+    OK(WEXITSTATUS(res.status) != 0);
+    result_destroy(&res);
+
+    return 0;
+}
+
+DEF_TEST(free_running)
+{
+    result_t res;
+    result_init(&res);
+
+    CHECK_ZERO(spawn(reaper, "echo started; exec sleep 60", &res));
+
+    /* Wait for the child to be running. */
+    for (int i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&res.lock);
+        size_t out_num = res.out_num;
+        pthread_mutex_unlock(&res.lock);
+        if (out_num > 0)
+            break;
+        usleep(10000);
+    }
+    EXPECT_EQ_INT(1, res.out_num);
+
+    exec_reaper_stop(reaper);
+    CHECK_ZERO(pthread_join(reaper_thread, NULL));
+
+    cdtime_t start = cdtime();
+    exec_reaper_free(reaper);
+    reaper = NULL;
+    OK((cdtime() - start) < TIME_T_TO_CDTIME_T(10));
+
+    OK(res.exited);
+    OK(WIFSIGNALED(res.status));
+    EXPECT_EQ_INT(SIGTERM, WTERMSIG(res.status));
+
+    result_destroy(&res);
+    return 0;
+}
+
+int main(void)
+{
+    reaper = exec_reaper_alloc();
+    if (reaper == NULL)
+        return 1;
+    if (pthread_create(&reaper_thread, NULL, exec_reaper_run, reaper) != 0)
+        return 1;
+
+    RUN_TEST(lines);
+    RUN_TEST(many);
+    RUN_TEST(exec_failed);
+    RUN_TEST(free_running);
+
+    if (reaper != NULL) {
+        exec_reaper_stop(reaper);
+        pthread_join(reaper_thread, NULL);
+        exec_reaper_free(reaper);
+    }
+
+    END_TEST;
+}
@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libutils/multimatch.h"
+
+#include <regex.h>
+
+typedef struct {
+    char *str;
+    size_t len;
+    uint32_t id;
+} multimatch_literal_t;
+
+struct multimatch_s {
+    size_t size;
+    bool *always;
+
+    multimatch_literal_t *literals;
+    size_t literals_num;
+
+    /* Bytes that are not in any literal share the class zero. */
+    uint8_t classes[256];
+    size_t classes_num;
+
+    /* Aho-Corasick automaton as a full transition table of states_num x classes_num. */
+    uint32_t *delta;
+    size_t states_num;
+    /* Regexes found when entering each state, including the ones of the suffixes. */
+    uint32_t *out_offset;
+    uint32_t *out_num;
+    uint32_t *out_ids;
+};
+
+static bool multimatch_is_meta(char c)
+{
+    switch (c) {
+    case '.': case '[': case ']': case '(': case ')': case '*': case '+':
+    case '?': case '{': case '}': case '|': case '^': case '$': case '\\':
+        return true;
+    }
+    return false;
+}
+
+/* Skip a bracket expression, ptr points after the '['. */
+static const char *multimatch_skip_bracket(const char *ptr)
+{
+    if (*ptr == '^')
+        ptr++;
+    if (*ptr == ']')
+        ptr++;
+
+    while ((*ptr != '\0') && (*ptr != ']')) {
+        if ((ptr[0] == '[') && ((ptr[1] == ':') || (ptr[1] == '.') || (ptr[1] == '='))) {
+            char delim = ptr[1];
+            ptr += 2;
+            while ((*ptr != '\0') && !((ptr[0] == delim) && (ptr[1] == ']')))
+                ptr++;
+            if (*ptr == '\0')
+                return ptr;
+            ptr += 2;
+            continue;
+        }
+        ptr++;
+    }
+
+    if (*ptr == ']')
+        ptr++;
+    return ptr;
+}
+
+/* Skip a parenthesized group, ptr points after the '('. */
+static const char *multimatch_skip_group(const char *ptr)
+{
+    int depth = 1;
+
+    while (*ptr != '\0') {
+        if (*ptr == '\\') {
+            ptr += ptr[1] != '\0' ? 2 : 1;
+            continue;
+        }
+        if (*ptr == '[') {
+            ptr = multimatch_skip_bracket(ptr + 1);
+            continue;
+        }
+        if (*ptr == '(') {
+            depth++;
+        } else if (*ptr == ')') {
+            depth--;
+            if (depth == 0)
+                return ptr + 1;
+        }
+        ptr++;
+    }
+
+    return ptr;
+}
+
+/* Return the end of the alternative that starts at ptr. */
+static const char *multimatch_branch_end(const char *ptr)
+{
+    while ((*ptr != '\0') && (*ptr != '|')) {
+        if (*ptr == '\\') {
+            ptr += ptr[1] != '\0' ? 2 : 1;
+        } else if (*ptr == '[') {
+            ptr = multimatch_skip_bracket(ptr + 1);
+        } else if (*ptr == '(') {
+            ptr = multimatch_skip_group(ptr + 1);
+        } else {
+            ptr++;
+        }
+    }
+    return ptr;
+}
+
+/* Parse an interval expression, ptr points after the '{'.  Return the end of
+ * the interval and the minimum count in min, or NULL if it cannot be parsed. */
+static const char *multimatch_interval(const char *ptr, const char *end, unsigned long *min)
+{
+    *min = 0;
+    if ((ptr < end) && isdigit((unsigned char)*ptr)) {
+        *min = strtoul(ptr, NULL, 10);
+        while ((ptr < end) && isdigit((unsigned char)*ptr))
+            ptr++;
+    } else if ((ptr >= end) || (*ptr != ',')) {
+        return NULL;
+    }
+
+    if ((ptr < end) && (*ptr == ',')) {
+        ptr++;
+        while ((ptr < end) && isdigit((unsigned char)*ptr))
+            ptr++;
+    }
+
+    if ((ptr >= end) || (*ptr != '}'))
+        return NULL;
+
+    return ptr + 1;
+}
+
+/* Copy to literal the longest run of characters that any match of the
+ * alternative between ptr and end must contain, returns its length.  The run
+ * being scanned is kept in literal after the longest one found so far. */
+static size_t multimatch_branch_literal(const char *ptr, const char *end, char *literal)
+{
+    size_t best = 0;
+    size_t run = 0;
+
+    while (ptr < end) {
+        bool is_literal = false;
+        char c = *ptr;
+        const char *next = ptr + 1;
+
+        if (c == '\\') {
+            if (multimatch_is_meta(ptr[1])) {
+                c = ptr[1];
+                is_literal = true;
+            }
+            next = ptr[1] != '\0' ? ptr + 2 : ptr + 1;
+        } else if (c == '[') {
+            next = multimatch_skip_bracket(ptr + 1);
+        } else if (c == '(') {
+            next = multimatch_skip_group(ptr + 1);
+        } else if (!multimatch_is_meta(c)) {
+            is_literal = true;
+        }
+
+        bool optional = false;
+        bool repeated = false;
+        while (next < end) {
+            if ((*next == '*') || (*next == '?')) {
+                optional = true;
+                next++;
+            } else if (*next == '+') {
+                repeated = true;
+                next++;
+            } else if (*next == '{') {
+                unsigned long min = 0;
+                next = multimatch_interval(next + 1, end, &min);
+                if (next == NULL)
+                    return 0;
+                if (min == 0)
+                    optional = true;
+                repeated = true;
+            } else {
+                break;
+            }
+        }
+
+        if (is_literal && !optional) {
+            literal[best + 1 + run] = c;
+            run++;
+        }
+
+        if (!is_literal || optional || repeated) {
+            if (run > best) {
+                memmove(literal, literal + best + 1, run);
+                best = run;
+            }
+            run = 0;
+        }
+
+        ptr = next;
+    }
+
+    if (run > best) {
+        memmove(literal, literal + best + 1, run);
+        best = run;
+    }
+
+    return best;
+}
+
+size_t multimatch_regex_literals(const char *regex, char *literal)
+{
+    size_t num = 0;
+    char *out = literal;
+    const char *ptr = regex;
+
+    while (true) {
+        const char *end = multimatch_branch_end(ptr);
+        size_t len = multimatch_branch_literal(ptr, end, out);
+        if (len == 0)
+            return 0;
+        out[len] = '\0';
+        out += len + 1;
+        num++;
+        if (*end == '\0')
+            break;
+        ptr = end + 1;
+    }
+
+    return num;
+}
+
+multimatch_t *multimatch_create(void)
+{
+    return calloc(1, sizeof(multimatch_t));
+}
+
+static void multimatch_automaton_free(multimatch_t *mm)
+{
+    free(mm->delta);
+    mm->delta = NULL;
+    free(mm->out_offset);
+    mm->out_offset = NULL;
+    free(mm->out_num);
+    mm->out_num = NULL;
+    free(mm->out_ids);
+    mm->out_ids = NULL;
+    mm->states_num = 0;
+}
+
+void multimatch_free(multimatch_t *mm)
+{
+    if (mm == NULL)
+        return;
+
+    multimatch_automaton_free(mm);
+
+    for (size_t i = 0; i < mm->literals_num; i++) {
+        free(mm->literals[i].str);
+    }
+    free(mm->literals);
+    free(mm->always);
+    free(mm);
+}
+
+size_t multimatch_size(const multimatch_t *mm)
+{
+    return mm->size;
+}
+
+int multimatch_add(multimatch_t *mm, const char *regex, int cflags)
+{
+    bool *always = realloc(mm->always, (mm->size + 1) * sizeof(*always));
+    if (always == NULL)
+        return -1;
+    mm->always = always;
+
+    uint32_t id = mm->size;
+    mm->always[id] = true;
+    mm->size++;
+
+    if (cflags & REG_ICASE)
+        return id;
+
+    size_t len = strlen(regex);
+    char *literal = malloc(len + 1);
+    if (literal == NULL)
+        return -1;
+
+    size_t num = multimatch_regex_literals(regex, literal);
+    if (num == 0) {
+        free(literal);
+        return id;
+    }
+
+    multimatch_literal_t *tmp = realloc(mm->literals,
+                                        (mm->literals_num + num) * sizeof(*tmp));
+    if (tmp == NULL) {
+        free(literal);
+        return -1;
+    }
+    mm->literals = tmp;
+
+    char *ptr = literal;
+    for (size_t i = 0; i < num; i++) {
+        size_t ptr_len = strlen(ptr);
+        char *str = strdup(ptr);
+        if (str == NULL) {
+            free(literal);
+            return -1;
+        }
+        mm->literals[mm->literals_num] = (multimatch_literal_t){.str = str, .len = ptr_len, .id = id};
+        mm->literals_num++;
+        ptr += ptr_len + 1;
+    }
+
+    mm->always[id] = false;
+
+    free(literal);
+    return id;
+}
+
+int multimatch_compile(multimatch_t *mm)
+{
+    multimatch_automaton_free(mm);
+
+    memset(mm->classes, 0, sizeof(mm->classes));
+    mm->classes_num = 1;
+    size_t max_states = 1;
+    for (size_t i = 0; i < mm->literals_num; i++) {
+        for (size_t j = 0; j < mm->literals[i].len; j++) {
+            unsigned char c = mm->literals[i].str[j];
+            if (mm->classes[c] == 0)
+                mm->classes[c] = mm->classes_num++;
+        }
+        max_states += mm->literals[i].len;
+    }
+
+    size_t classes_num = mm->classes_num;
+
+    /* Build the trie in the transition table, zero is the root and no edge. */
+    uint32_t *trie = calloc(max_states * classes_num, sizeof(*trie));
+    uint32_t *own_head = calloc(max_states, sizeof(*own_head));
+    uint32_t *own_next = calloc(mm->literals_num + 1, sizeof(*own_next));
+    uint32_t *fail = calloc(max_states, sizeof(*fail));
+    uint32_t *queue = calloc(max_states, sizeof(*queue));
+    mm->out_offset = calloc(max_states, sizeof(*mm->out_offset));
+    mm->out_num = calloc(max_states, sizeof(*mm->out_num));
+    if ((trie == NULL) || (own_head == NULL) || (own_next == NULL) || (fail == NULL) ||
+        (queue == NULL) || (mm->out_offset == NULL) || (mm->out_num == NULL)) {
+        free(trie);
+        free(own_head);
+        free(own_next);
+        free(fail);
+        free(queue);
+        multimatch_automaton_free(mm);
+        return -1;
+    }
+
+    size_t states_num = 1;
+    for (size_t i = 0; i < mm->literals_num; i++) {
+        uint32_t state = 0;
+        for (size_t j = 0; j < mm->literals[i].len; j++) {
+            uint8_t class = mm->classes[(unsigned char)mm->literals[i].str[j]];
+            uint32_t next = trie[state * classes_num + class];
+            if (next == 0) {
+                next = states_num++;
+                trie[state * classes_num + class] = next;
+            }
+            state = next;
+        }
+        /* The literals are numbered from one in the output lists. */
+        own_next[i + 1] = own_head[state];
+        own_head[state] = i + 1;
+    }
+
+    /* Breadth first, the failure state of each state is less deep and its
+     * output list is complete when the state is visited. */
+    size_t out_size = 0;
+    size_t queue_head = 0;
+    size_t queue_tail = 0;
+    queue[queue_tail++] = 0;
+    while (queue_head < queue_tail) {
+        uint32_t state = queue[queue_head++];
+
+        size_t own_num = 0;
+        for (uint32_t lit = own_head[state]; lit != 0; lit = own_next[lit])
+            own_num++;
+
+        uint32_t *out_ids = realloc(mm->out_ids, (out_size + own_num + mm->out_num[fail[state]]) *
+                                                 sizeof(*out_ids));
+        if ((out_ids == NULL) && ((out_size + own_num + mm->out_num[fail[state]]) > 0)) {
+            free(trie);
+            free(own_head);
+            free(own_next);
+            free(fail);
+            free(queue);
+            multimatch_automaton_free(mm);
+            return -1;
+        }
+        mm->out_ids = out_ids;
+
+        mm->out_offset[state] = out_size;
+        for (uint32_t lit = own_head[state]; lit != 0; lit = own_next[lit])
+            mm->out_ids[out_size++] = mm->literals[lit - 1].id;
+        if (state != 0) {
+            uint32_t fstate = fail[state];
+            for (size_t i = 0; i < mm->out_num[fstate]; i++)
+                mm->out_ids[out_size++] = mm->out_ids[mm->out_offset[fstate] + i];
+        }
+        mm->out_num[state] = out_size - mm->out_offset[state];
+
+        for (size_t class = 0; class < classes_num; class++) {
+            uint32_t next = trie[state * classes_num + class];
+            if ((next != 0) && (class != 0)) {
+                fail[next] = state == 0 ? 0 : trie[fail[state] * classes_num + class];
+                queue[queue_tail++] = next;
+            } else {
+                /* Turn the missing edges in the transitions of the failure state. */
+                trie[state * classes_num + class] = state == 0 ? 0 :
+                                                    trie[fail[state] * classes_num + class];
+            }
+        }
+    }
+
+    free(own_head);
+    free(own_next);
+    free(fail);
+    free(queue);
+
+    mm->delta = trie;
+    mm->states_num = states_num;
+
+    return 0;
+}
+
+void multimatch_candidates(const multimatch_t *mm, const char *str, bool *candidates)
+{
+    if (mm->size == 0)
+        return;
+
+    memcpy(candidates, mm->always, mm->size * sizeof(*candidates));
+
+    if (mm->delta == NULL)
+        return;
+
+    size_t classes_num = mm->classes_num;
+    uint32_t state = 0;
+    for (const unsigned char *ptr = (const unsigned char *)str; *ptr != '\0'; ptr++) {
+        state = mm->delta[state * classes_num + mm->classes[*ptr]];
+        uint32_t num = mm->out_num[state];
+        if (num == 0)
+            continue;
+        const uint32_t *ids = mm->out_ids + mm->out_offset[state];
+        for (uint32_t i = 0; i < num; i++)
+            candidates[ids[i]] = true;
+    }
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-only                             */
+/* SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín  */
+/* SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Prefilter for a set of POSIX extended regexes matched against the same
+ * strings.  The literals that every match of a regex must contain are extracted
+ * when the regex is added, and all of them are searched at once with an
+ * Aho-Corasick automaton: a regex whose literals are not in the string can not
+ * match it and regexec can be skipped.  Regexes without a required literal are
+ * always candidates. */
+
+struct multimatch_s;
+typedef struct multimatch_s multimatch_t;
+
+multimatch_t *multimatch_create(void);
+
+void multimatch_free(multimatch_t *mm);
+
+/* Add a regex, returns its index or a negative value on error. The cflags are
+ * the ones used to compile the regex, with REG_ICASE it is always a candidate. */
+int multimatch_add(multimatch_t *mm, const char *regex, int cflags);
+
+/* Build the automaton, must be called after the last multimatch_add. */
+int multimatch_compile(multimatch_t *mm);
+
+size_t multimatch_size(const multimatch_t *mm);
+
+/* Set in candidates, an array of multimatch_size elements, which regexes can
+ * match the string. */
+void multimatch_candidates(const multimatch_t *mm, const char *str, bool *candidates);
+
+/* Copy to literal the longest literal that any string matching the regex must
+ * contain, for each alternative of the regex separated by '\0'. Returns the
+ * number of alternatives or zero if any alternative has no required literal.
+ * The literal buffer must have at least the size of the regex plus one. */
+size_t multimatch_regex_literals(const char *regex, char *literal);
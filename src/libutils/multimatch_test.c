@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/strbuf.h"
+#include "libutils/time.h"
+#include "libutils/multimatch.h"
+
+#include <regex.h>
+
+DEF_TEST(literals)
+{
+    struct {
+        char *regex;
+        char *literals;
+    } cases[] = {
+        { "GET /api/v1",                     "GET /api/v1"    },
+        { "^([0-9.]+) .* \"GET ([^ ]*) HTTP", " \"GET "        },
+        { "abc|de",                          "abc|de"         },
+        { "a|.*",                            NULL             },
+        { "colou?r",                         "colo"           },
+        { "ab+c",                            "ab"             },
+        { "x{0,3}yz",                        "yz"             },
+        { "a{2}bc",                          "bc"             },
+        { "xa{,3}yz",                        "yz"             },
+        { "ab{2,}cd",                        "ab"             },
+        { "ab{x}cd",                         NULL             },
+        { "ab{2",                            NULL             },
+        { "\\.php$",                         ".php"           },
+        { "[abc]+def",                       "def"            },
+        { "[]|]xy",                          "xy"             },
+        { "[[:digit:]]+ms",                  "ms"             },
+        { "(GET|POST) /x",                   " /x"            },
+        { "status=(5[0-9][0-9])",            "status="        },
+        { "",                                NULL             },
+        { "[0-9]+",                          NULL             },
+    };
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++) {
+        char literal[256];
+        size_t num = multimatch_regex_literals(cases[i].regex, literal);
+        if (cases[i].literals == NULL) {
+            EXPECT_EQ_INT(0, num);
+            continue;
+        }
+
+        strbuf_t buf = STRBUF_CREATE;
+        char *ptr = literal;
+        for (size_t j = 0; j < num; j++) {
+            if (j > 0)
+                strbuf_putchar(&buf, '|');
+            strbuf_putstr(&buf, ptr);
+            ptr += strlen(ptr) + 1;
+        }
+        EXPECT_EQ_STR(cases[i].literals, buf.ptr);
+        strbuf_destroy(&buf);
+    }
+
+    return 0;
+}
+
+DEF_TEST(candidates)
+{
+    char *regexes[] = {
+        "GET /api/v1",
+        "(GET|POST) /login",
+        "error|warning",
+        "[0-9]+",
+        "timeout",
+        "ms$",
+    };
+    size_t regexes_num = STATIC_ARRAY_SIZE(regexes);
+
+    struct {
+        char *str;
+        bool candidates[6];
+    } cases[] = {
+        { "GET /api/v1/users",       { true,  false, false, true, false, false } },
+        { "POST /login 12ms",        { false, true,  false, true, false, true  } },
+        { "a warning about timeout", { false, false, true,  true, true,  false } },
+        { "",                        { false, false, false, true, false, false } },
+    };
+
+    multimatch_t *mm = multimatch_create();
+    CHECK_NOT_NULL(mm);
+    for (size_t i = 0; i < regexes_num; i++) {
+        EXPECT_EQ_INT(i, multimatch_add(mm, regexes[i], REG_EXTENDED));
+    }
+    CHECK_ZERO(multimatch_compile(mm));
+    EXPECT_EQ_INT(regexes_num, multimatch_size(mm));
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++) {
+        bool candidates[6];
+        multimatch_candidates(mm, cases[i].str, candidates);
+        for (size_t j = 0; j < regexes_num; j++) {
+            EXPECT_EQ_INT(cases[i].candidates[j], candidates[j]);
+        }
+    }
+
+    multimatch_free(mm);
+
+    return 0;
+}
+
+DEF_TEST(no_literals)
+{
+    char *regexes[] = {
+        "^[0-9]+$",
+        "^[a-z]+$",
+        "GET",
+        "POST",
+    };
+
+    multimatch_t *mm = multimatch_create();
+    CHECK_NOT_NULL(mm);
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(regexes); i++) {
+        EXPECT_EQ_INT(i, multimatch_add(mm, regexes[i], REG_EXTENDED));
+    }
+    CHECK_ZERO(multimatch_compile(mm));
+
+    bool candidates[4];
+    multimatch_candidates(mm, "POST", candidates);
+    EXPECT_EQ_INT(true, candidates[0]);
+    EXPECT_EQ_INT(true, candidates[1]);
+    EXPECT_EQ_INT(false, candidates[2]);
+    EXPECT_EQ_INT(true, candidates[3]);
+
+    multimatch_free(mm);
+
+    return 0;
+}
+
+DEF_TEST(throughput)
+{
+    static const char *methods[] = { "GET", "POST", "PUT", "DELETE" };
+    static const char *agents[] = { "curl/8.5.0", "Mozilla/5.0 (X11; Linux x86_64)", "Go-http-client/1.1" };
+
+    size_t regexes_num = 40;
+    regex_t regexes[40];
+    multimatch_t *mm = multimatch_create();
+    CHECK_NOT_NULL(mm);
+
+    for (size_t i = 0; i < regexes_num; i++) {
+        char regex[256];
+        switch (i % 4) {
+        case 0:
+            snprintf(regex, sizeof(regex), "\"(GET|HEAD) /api/v%zu/([a-z]+) HTTP/1\\.[01]\" ([0-9]{3})", i);
+            break;
+        case 1:
+            snprintf(regex, sizeof(regex), "\"POST /service%zu/[a-z]+ HTTP/1\\.1\" (5[0-9][0-9]) ([0-9]+)", i);
+            break;
+        case 2:
+            snprintf(regex, sizeof(regex), "upstream_%zu rt=([0-9.]+)", i);
+            break;
+        case 3:
+            snprintf(regex, sizeof(regex), "^([0-9.]+) .* \"[A-Z]+ /static/asset%zu\\.(css|js) ", i);
+            break;
+        }
+        CHECK_ZERO(regcomp(&regexes[i], regex, REG_EXTENDED | REG_NEWLINE));
+        EXPECT_EQ_INT(i, multimatch_add(mm, regex, REG_EXTENDED | REG_NEWLINE));
+    }
+    CHECK_ZERO(multimatch_compile(mm));
+
+    size_t lines_num = 2000;
+    char **lines = calloc(lines_num, sizeof(*lines));
+    CHECK_NOT_NULL(lines);
+    for (size_t i = 0; i < lines_num; i++) {
+        strbuf_t buf = STRBUF_CREATE;
+        strbuf_printf(&buf, "10.0.%zu.%zu - - [10/Oct/2024:13:55:36 +0000] \"%s ",
+                      (i / 256) % 256, i % 256, methods[i % 4]);
+        if (i % 5 == 0)
+            strbuf_printf(&buf, "/api/v%zu/users", (i * 7) % 50);
+        else if (i % 5 == 1)
+            strbuf_printf(&buf, "/service%zu/orders", (i * 3) % 50);
+        else if (i % 5 == 2)
+            strbuf_printf(&buf, "/static/asset%zu.css", i % 60);
+        else
+            strbuf_printf(&buf, "/index.html?page=%zu", i);
+        strbuf_printf(&buf, " HTTP/1.1\" %d %zu \"-\" \"%s\" upstream_%zu rt=0.%03zu",
+                      i % 11 == 0 ? 503 : 200, 512 + i, agents[i % 3], i % 45, i % 1000);
+        lines[i] = buf.ptr;
+    }
+
+    size_t loops = 10;
+    regmatch_t re_match[8];
+
+    size_t matches_regexec = 0;
+    cdtime_t start = cdtime();
+    for (size_t l = 0; l < loops; l++) {
+        for (size_t i = 0; i < lines_num; i++) {
+            for (size_t j = 0; j < regexes_num; j++) {
+                if (regexec(&regexes[j], lines[i], STATIC_ARRAY_SIZE(re_match), re_match, 0) == 0)
+                    matches_regexec++;
+            }
+        }
+    }
+    double elapsed_regexec = CDTIME_T_TO_DOUBLE(cdtime() - start);
+
+    size_t matches_multimatch = 0;
+    start = cdtime();
+    for (size_t l = 0; l < loops; l++) {
+        for (size_t i = 0; i < lines_num; i++) {
+            bool candidates[40];
+            multimatch_candidates(mm, lines[i], candidates);
+            for (size_t j = 0; j < regexes_num; j++) {
+                if (!candidates[j])
+                    continue;
+                if (regexec(&regexes[j], lines[i], STATIC_ARRAY_SIZE(re_match), re_match, 0) == 0)
+                    matches_multimatch++;
+            }
+        }
+    }
+    double elapsed_multimatch = CDTIME_T_TO_DOUBLE(cdtime() - start);
+
+    OK(matches_regexec > 0);
+    EXPECT_EQ_INT(matches_regexec, matches_multimatch);
+
+    if ((elapsed_regexec > 0) && (elapsed_multimatch > 0))
+        printf("# %zu lines x %zu regexes: regexec %.0f lines/s, multimatch %.0f lines/s\n",
+               lines_num * loops, regexes_num,
+               (double)(lines_num * loops) / elapsed_regexec,
+               (double)(lines_num * loops) / elapsed_multimatch);
+
+    for (size_t i = 0; i < lines_num; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    for (size_t i = 0; i < regexes_num; i++) {
+        regfree(&regexes[i]);
+    }
+    multimatch_free(mm);
+
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(literals);
+    RUN_TEST(candidates);
+    RUN_TEST(no_literals);
+    RUN_TEST(throughput);
+
+    END_TEST;
+}
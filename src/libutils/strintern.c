@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libutils/htable.h"
+#include "libutils/strintern.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define STRINTERN_SHARD_BITS 6
+#define STRINTERN_SHARDS (1 << STRINTERN_SHARD_BITS)
+#define STRINTERN_BUCKETS_MIN 256
+
+typedef struct strintern_entry_s strintern_entry_t;
+struct strintern_entry_s {
+    strintern_entry_t *next;
+    atomic_uint refcount;
+    uint32_t hash;
+    size_t len;
+    char str[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t used;
+    size_t size;
+    strintern_entry_t **buckets;
+} strintern_shard_t;
+
+static pthread_once_t strintern_once = PTHREAD_ONCE_INIT;
+static strintern_shard_t strintern_shards[STRINTERN_SHARDS];
+
+static void strintern_init(void)
+{
+    for (size_t i = 0; i < STRINTERN_SHARDS; i++)
+        pthread_mutex_init(&strintern_shards[i].lock, NULL);
+}
+
+static inline strintern_entry_t *strintern_entry(char *str)
+{
+    return (void *)(str - offsetof(strintern_entry_t, str));
+}
+
+static inline size_t strintern_bucket(uint32_t hash, size_t size)
+{
+    return (hash >> STRINTERN_SHARD_BITS) & (size - 1);
+}
+
+static void strintern_resize(strintern_shard_t *shard)
+{
+    size_t size = shard->size == 0 ? STRINTERN_BUCKETS_MIN : shard->size * 2;
+
+    strintern_entry_t **buckets = calloc(size, sizeof(*buckets));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < shard->size; i++) {
+        strintern_entry_t *entry = shard->buckets[i];
+        while (entry != NULL) {
+            strintern_entry_t *next = entry->next;
+            size_t n = strintern_bucket(entry->hash, size);
+            entry->next = buckets[n];
+            buckets[n] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->size = size;
+}
+
+char *strintern_ndup(const char *str, size_t len)
+{
+    if (str == NULL)
+        return NULL;
+
+    pthread_once(&strintern_once, strintern_init);
+
+    uint32_t hash = htable_nhash(str, len, HTABLE_HASH_INIT);
+    strintern_shard_t *shard = &strintern_shards[hash & (STRINTERN_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->size > 0) {
+        strintern_entry_t *entry = shard->buckets[strintern_bucket(hash, shard->size)];
+        for (; entry != NULL; entry = entry->next) {
+            if ((entry->hash != hash) || (entry->len != len) || (memcmp(entry->str, str, len) != 0))
+                continue;
+            /* An entry whose count dropped to zero is being released by another
+             * thread and cannot be referenced again. */
+            unsigned int refcount = atomic_load(&entry->refcount);
+            while ((refcount != 0) &&
+                   !atomic_compare_exchange_weak(&entry->refcount, &refcount, refcount + 1));
+            if (refcount != 0) {
+                pthread_mutex_unlock(&shard->lock);
+                return entry->str;
+            }
+        }
+    }
+
+    if (shard->used >= shard->size)
+        strintern_resize(shard);
+
+    strintern_entry_t *entry = NULL;
+    if (shard->size > 0)
+        entry = malloc(sizeof(*entry) + len + 1);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    atomic_init(&entry->refcount, 1);
+    entry->hash = hash;
+    entry->len = len;
+    memcpy(entry->str, str, len);
+    entry->str[len] = '\0';
+
+    size_t n = strintern_bucket(hash, shard->size);
+    entry->next = shard->buckets[n];
+    shard->buckets[n] = entry;
+    shard->used++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry->str;
+}
+
+char *strintern_ref(char *str)
+{
+    if (str == NULL)
+        return NULL;
+
+    atomic_fetch_add(&strintern_entry(str)->refcount, 1);
+    return str;
+}
+
+void strintern_free(char *str)
+{
+    if (str == NULL)
+        return;
+
+    strintern_entry_t *entry = strintern_entry(str);
+    if (atomic_fetch_sub(&entry->refcount, 1) != 1)
+        return;
+
+    strintern_shard_t *shard = &strintern_shards[entry->hash & (STRINTERN_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    strintern_entry_t **prev = &shard->buckets[strintern_bucket(entry->hash, shard->size)];
+    while (*prev != NULL) {
+        if (*prev == entry) {
+            *prev = entry->next;
+            shard->used--;
+            break;
+        }
+        prev = &(*prev)->next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    free(entry);
+}
+
+size_t strintern_count(void)
+{
+    pthread_once(&strintern_once, strintern_init);
+
+    size_t count = 0;
+    for (size_t i = 0; i < STRINTERN_SHARDS; i++) {
+        pthread_mutex_lock(&strintern_shards[i].lock);
+        count += strintern_shards[i].used;
+        pthread_mutex_unlock(&strintern_shards[i].lock);
+    }
+
+    return count;
+}
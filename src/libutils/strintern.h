@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-only                             */
+/* SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín  */
+/* SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com> */
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+/* Interned strings are stored once for the whole process with a reference
+ * count, the same string always returns the same pointer while it is referenced.
+ * They must not be modified and are released with strintern_free. */
+
+char *strintern_ndup(const char *str, size_t len);
+
+static inline char *strintern_dup(const char *str)
+{
+    if (str == NULL)
+        return NULL;
+    return strintern_ndup(str, strlen(str));
+}
+
+/* Return a new reference to an interned string. */
+char *strintern_ref(char *str);
+
+void strintern_free(char *str);
+
+/* Number of distinct interned strings. */
+size_t strintern_count(void);
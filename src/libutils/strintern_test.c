@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/strintern.h"
+
+#include <pthread.h>
+
+DEF_TEST(strintern)
+{
+    size_t count = strintern_count();
+
+    char *a = strintern_dup("instance");
+    CHECK_NOT_NULL(a);
+    EXPECT_EQ_STR("instance", a);
+
+    char buffer[] = "instance=foo";
+    char *b = strintern_ndup(buffer, strlen("instance"));
+    EXPECT_EQ_PTR(a, b);
+
+    char *c = strintern_dup("host");
+    OK(a != c);
+    EXPECT_EQ_INT(count + 2, strintern_count());
+
+    EXPECT_EQ_PTR(c, strintern_ref(c));
+    strintern_free(c);
+    strintern_free(c);
+    EXPECT_EQ_INT(count + 1, strintern_count());
+
+    strintern_free(a);
+    EXPECT_EQ_INT(count + 1, strintern_count());
+    strintern_free(b);
+    EXPECT_EQ_INT(count, strintern_count());
+
+    char *e = strintern_dup("");
+    CHECK_NOT_NULL(e);
+    EXPECT_EQ_STR("", e);
+    strintern_free(e);
+
+    OK(strintern_dup(NULL) == NULL);
+    strintern_free(NULL);
+
+    return 0;
+}
+
+#define STRINTERN_THREADS 8
+#define STRINTERN_LOOPS 20000
+
+static void *strintern_thread(__attribute__((unused)) void *arg)
+{
+    char name[32];
+
+    for (int i = 0; i < STRINTERN_LOOPS; i++) {
+        snprintf(name, sizeof(name), "label%d", i % 97);
+        char *a = strintern_dup(name);
+        char *b = strintern_dup(name);
+        if ((a == NULL) || (a != b) || (strcmp(a, name) != 0))
+            return (void *)1;
+        strintern_free(a);
+        strintern_free(b);
+    }
+
+    return NULL;
+}
+
+DEF_TEST(threads)
+{
+    size_t count = strintern_count();
+
+    pthread_t threads[STRINTERN_THREADS];
+    for (size_t i = 0; i < STRINTERN_THREADS; i++)
+        CHECK_ZERO(pthread_create(&threads[i], NULL, strintern_thread, NULL));
+
+    for (size_t i = 0; i < STRINTERN_THREADS; i++) {
+        void *ret = NULL;
+        CHECK_ZERO(pthread_join(threads[i], &ret));
+        OK(ret == NULL);
+    }
+
+    EXPECT_EQ_INT(count, strintern_count());
+
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(strintern);
+    RUN_TEST(threads);
+
+    END_TEST;
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libutils/strmatch.h"
+
+static bool strmatch_is_meta(char c)
+{
+    switch (c) {
+    case '.': case '[': case ']': case '(': case ')': case '*': case '+':
+    case '?': case '{': case '}': case '|': case '^': case '$': case '\\':
+        return true;
+    }
+    return false;
+}
+
+static bool strmatch_is_quantifier(char c)
+{
+    return (c == '*') || (c == '+') || (c == '?') || (c == '{');
+}
+
+/* Split a pattern of the form [^]literal[.*literal][$] in its literal parts,
+ * returns false if the pattern has any other regex construct. */
+static bool strmatch_analyze(const char *pattern, strmatch_type_t *type,
+                             char *prefix, size_t *prefix_len, char *suffix, size_t *suffix_len)
+{
+    const char *ptr = pattern;
+    bool anchor_start = false;
+    bool anchor_end = false;
+
+    if (*ptr == '^') {
+        anchor_start = true;
+        ptr++;
+    }
+
+    size_t wildcards = 0;
+    bool wildcard_start = false;
+    bool wildcard_end = false;
+    char *dst = prefix;
+    size_t *dst_len = prefix_len;
+    *prefix_len = 0;
+    *suffix_len = 0;
+
+    while (*ptr != '\0') {
+        char c = *ptr;
+        if ((c == '$') && (ptr[1] == '\0')) {
+            anchor_end = true;
+            break;
+        }
+
+        if ((c == '.') && (ptr[1] == '*')) {
+            ptr += 2;
+            if (strmatch_is_quantifier(*ptr))
+                return false;
+            if ((*prefix_len == 0) && (wildcards == 0)) {
+                wildcard_start = true;
+                continue;
+            }
+            if ((*ptr == '\0') || ((ptr[0] == '$') && (ptr[1] == '\0'))) {
+                wildcard_end = true;
+                continue;
+            }
+            if (wildcards > 0)
+                return false;
+            wildcards++;
+            dst = suffix;
+            dst_len = suffix_len;
+            continue;
+        }
+
+        if (c == '\\') {
+            if (!strmatch_is_meta(ptr[1]))
+                return false;
+            c = ptr[1];
+            ptr += 2;
+        } else {
+            if (strmatch_is_meta(c))
+                return false;
+            ptr++;
+        }
+
+        if (strmatch_is_quantifier(*ptr))
+            return false;
+        if (wildcard_end)
+            return false;
+
+        dst[*dst_len] = c;
+        (*dst_len)++;
+    }
+
+    prefix[*prefix_len] = '\0';
+    suffix[*suffix_len] = '\0';
+
+    if (wildcard_start)
+        anchor_start = false;
+    if (wildcard_end)
+        anchor_end = false;
+
+    if (wildcards > 0) {
+        if (!anchor_start || !anchor_end)
+            return false;
+        *type = STRMATCH_PREFIX_SUFFIX;
+        return true;
+    }
+
+    if (anchor_start && anchor_end) {
+        *type = STRMATCH_EXACT;
+    } else if (anchor_start) {
+        *type = *prefix_len == 0 ? STRMATCH_ANY : STRMATCH_PREFIX;
+    } else if (anchor_end) {
+        if (*prefix_len == 0) {
+            *type = STRMATCH_ANY;
+        } else {
+            memcpy(suffix, prefix, *prefix_len + 1);
+            *suffix_len = *prefix_len;
+            *prefix_len = 0;
+            prefix[0] = '\0';
+            *type = STRMATCH_SUFFIX;
+        }
+    } else {
+        *type = *prefix_len == 0 ? STRMATCH_ANY : STRMATCH_CONTAINS;
+    }
+
+    return true;
+}
+
+int strmatch_compile(strmatch_t *sm, const char *pattern, int cflags)
+{
+    memset(sm, 0, sizeof(*sm));
+
+    int status = regcomp(&sm->regex, pattern, cflags | REG_EXTENDED);
+    if (status != 0)
+        return status;
+
+    sm->type = STRMATCH_REGEX;
+
+    /* With REG_ICASE the literals can not be compared as is and with REG_NEWLINE
+     * the wildcard does not match a newline. */
+    if (cflags & (REG_ICASE | REG_NEWLINE))
+        return 0;
+
+    size_t len = strlen(pattern);
+    char *prefix = malloc(len + 1);
+    char *suffix = malloc(len + 1);
+    if ((prefix == NULL) || (suffix == NULL)) {
+        free(prefix);
+        free(suffix);
+        return 0;
+    }
+
+    strmatch_type_t type = STRMATCH_REGEX;
+    size_t prefix_len = 0;
+    size_t suffix_len = 0;
+    if (!strmatch_analyze(pattern, &type, prefix, &prefix_len, suffix, &suffix_len)) {
+        free(prefix);
+        free(suffix);
+        return 0;
+    }
+
+    sm->type = type;
+    sm->prefix = prefix;
+    sm->prefix_len = prefix_len;
+    sm->suffix = suffix;
+    sm->suffix_len = suffix_len;
+
+    return 0;
+}
+
+void strmatch_reset(strmatch_t *sm)
+{
+    if (sm == NULL)
+        return;
+
+    free(sm->prefix);
+    free(sm->suffix);
+    regfree(&sm->regex);
+    memset(sm, 0, sizeof(*sm));
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0-only                             */
+/* SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín  */
+/* SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com> */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <regex.h>
+
+/* A POSIX extended regex that is analyzed when compiled: patterns that are only
+ * a literal string with optional anchors and ".*" wildcards are matched with
+ * string comparisons instead of regexec.  The regex is always compiled so
+ * submatches can still be requested with strmatch_regexec. */
+
+typedef enum {
+    STRMATCH_REGEX,
+    STRMATCH_ANY,
+    STRMATCH_EXACT,
+    STRMATCH_PREFIX,
+    STRMATCH_SUFFIX,
+    STRMATCH_CONTAINS,
+    STRMATCH_PREFIX_SUFFIX,
+} strmatch_type_t;
+
+typedef struct {
+    strmatch_type_t type;
+    char *prefix;
+    size_t prefix_len;
+    char *suffix;
+    size_t suffix_len;
+    regex_t regex;
+} strmatch_t;
+
+/* Returns zero on success or the regcomp error code. */
+int strmatch_compile(strmatch_t *sm, const char *pattern, int cflags);
+
+void strmatch_reset(strmatch_t *sm);
+
+static inline bool strmatch_exec(const strmatch_t *sm, const char *str)
+{
+    switch (sm->type) {
+    case STRMATCH_REGEX:
+        return regexec(&sm->regex, str, 0, NULL, 0) == 0;
+    case STRMATCH_ANY:
+        return true;
+    case STRMATCH_EXACT:
+        return strcmp(str, sm->prefix) == 0;
+    case STRMATCH_PREFIX:
+        return strncmp(str, sm->prefix, sm->prefix_len) == 0;
+    case STRMATCH_SUFFIX: {
+        size_t len = strlen(str);
+        if (len < sm->suffix_len)
+            return false;
+        return memcmp(str + len - sm->suffix_len, sm->suffix, sm->suffix_len) == 0;
+    }
+    case STRMATCH_CONTAINS:
+        return strstr(str, sm->prefix) != NULL;
+    case STRMATCH_PREFIX_SUFFIX: {
+        size_t len = strlen(str);
+        if (len < (sm->prefix_len + sm->suffix_len))
+            return false;
+        if (memcmp(str, sm->prefix, sm->prefix_len) != 0)
+            return false;
+        return memcmp(str + len - sm->suffix_len, sm->suffix, sm->suffix_len) == 0;
+    }
+    }
+    return false;
+}
+
+/* Same as regexec, but a literal pattern that does not match returns REG_NOMATCH
+ * without running the regex. */
+static inline int strmatch_regexec(const strmatch_t *sm, const char *str,
+                                   size_t nmatch, regmatch_t *pmatch, int eflags)
+{
+    if ((sm->type != STRMATCH_REGEX) && (eflags == 0) && !strmatch_exec(sm, str))
+        return REG_NOMATCH;
+    return regexec(&sm->regex, str, nmatch, pmatch, eflags);
+}
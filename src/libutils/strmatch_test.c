@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/strmatch.h"
+
+DEF_TEST(type)
+{
+    struct {
+        char *pattern;
+        strmatch_type_t type;
+        char *prefix;
+        char *suffix;
+    } cases[] = {
+        { "^go_gc_duration$",  STRMATCH_EXACT,         "go_gc_duration", ""        },
+        { "^go_",              STRMATCH_PREFIX,        "go_",            ""        },
+        { "^go_.*",            STRMATCH_PREFIX,        "go_",            ""        },
+        { "_total$",           STRMATCH_SUFFIX,        "",               "_total"  },
+        { ".*_total$",         STRMATCH_SUFFIX,        "",               "_total"  },
+        { "bytes",             STRMATCH_CONTAINS,      "bytes",          ""        },
+        { "^node_.*_bytes$",   STRMATCH_PREFIX_SUFFIX, "node_",          "_bytes"  },
+        { "^node\\.cpu$",      STRMATCH_EXACT,         "node.cpu",       ""        },
+        { ".*",                STRMATCH_ANY,           "",               ""        },
+        { "^$",                STRMATCH_EXACT,         "",               ""        },
+        { "^go_(gc|mem)",      STRMATCH_REGEX,         NULL,             NULL      },
+        { "^go_.+",            STRMATCH_REGEX,         NULL,             NULL      },
+        { "^gos*",             STRMATCH_REGEX,         NULL,             NULL      },
+        { "[a-z]+",            STRMATCH_REGEX,         NULL,             NULL      },
+        { "node_.*_bytes",     STRMATCH_REGEX,         NULL,             NULL      },
+        { "^a.*b.*c$",         STRMATCH_REGEX,         NULL,             NULL      },
+    };
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(cases); i++) {
+        strmatch_t sm = {0};
+        CHECK_ZERO(strmatch_compile(&sm, cases[i].pattern, 0));
+        EXPECT_EQ_INT(cases[i].type, sm.type);
+        if (cases[i].prefix != NULL) {
+            EXPECT_EQ_STR(cases[i].prefix, sm.prefix);
+            EXPECT_EQ_STR(cases[i].suffix, sm.suffix);
+        }
+        strmatch_reset(&sm);
+    }
+
+    strmatch_t sm = {0};
+    CHECK_ZERO(strmatch_compile(&sm, "^go_", REG_ICASE));
+    EXPECT_EQ_INT(STRMATCH_REGEX, sm.type);
+    OK(strmatch_exec(&sm, "GO_threads"));
+    strmatch_reset(&sm);
+
+    OK(strmatch_compile(&sm, "^go_(", 0) != 0);
+
+    return 0;
+}
+
+DEF_TEST(regexec)
+{
+    char *patterns[] = {
+        "^go_gc_duration$", "^go_", "^go_.*", "_total$", ".*_total$", "bytes", "^node_.*_bytes$",
+        "^node\\.cpu$", ".*", "^$", "^", "$", "^.*", "^.*cpu.*$", "^a.*a$", "^go_(gc|mem)",
+        "node_.*_bytes", "x*",
+    };
+    char *strings[] = {
+        "", "a", "aa", "go_", "go_gc_duration", "go_gc_duration_seconds", "http_requests_total",
+        "_total", "total", "node_memory_bytes", "node__bytes", "node_bytes", "node.cpu", "nodeXcpu",
+        "cpu_bytes_free", "go_memstats",
+    };
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(patterns); i++) {
+        strmatch_t sm = {0};
+        regex_t regex;
+        CHECK_ZERO(strmatch_compile(&sm, patterns[i], 0));
+        CHECK_ZERO(regcomp(&regex, patterns[i], REG_EXTENDED | REG_NOSUB));
+
+        for (size_t j = 0; j < STATIC_ARRAY_SIZE(strings); j++) {
+            bool expect = regexec(&regex, strings[j], 0, NULL, 0) == 0;
+            char text[256];
+            snprintf(text, sizeof(text), "'%s' ~ '%s'", strings[j], patterns[i]);
+            OK1(expect == strmatch_exec(&sm, strings[j]), text);
+            OK1(expect == (strmatch_regexec(&sm, strings[j], 0, NULL, 0) == 0), text);
+        }
+
+        regfree(&regex);
+        strmatch_reset(&sm);
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(type);
+    RUN_TEST(regexec);
+
+    END_TEST;
+}
@@ -13,20 +13,116 @@
 #include "libutils/tail.h"
 
 #include <fcntl.h>
+#include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#ifndef TAIL_BUFFER_SIZE
+#define TAIL_BUFFER_SIZE 65536
+#endif
+
+static void tail_inotify_close(tail_t *tail)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (tail->inotify)
+        close(tail->inotify_fd);
+#endif
+    tail->inotify = false;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Watch the file for changes and its directory for a new file with the same
+ * name, when inotify can not be used the file is read on every call. */
+static void tail_inotify_watch(tail_t *tail)
+{
+    if (!tail->inotify) {
+        tail->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (tail->inotify_fd < 0) {
+            WARNING("inotify_init1 for '%s' failed: %s", tail->file, STRERRNO);
+            return;
+        }
+        tail->inotify = true;
+        tail->inotify_wd = -1;
+
+        char *dir = strdup(tail->file);
+        if (dir == NULL) {
+            ERROR("strdup failed.");
+            tail_inotify_close(tail);
+            return;
+        }
+        tail->inotify_dir_wd = inotify_add_watch(tail->inotify_fd, dirname(dir),
+                                                 IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+        free(dir);
+        if (tail->inotify_dir_wd < 0) {
+            WARNING("Cannot watch the directory of '%s': %s", tail->file, STRERRNO);
+            tail_inotify_close(tail);
+            return;
+        }
+    }
+
+    if (tail->inotify_wd >= 0)
+        inotify_rm_watch(tail->inotify_fd, tail->inotify_wd);
+
+    tail->inotify_wd = inotify_add_watch(tail->inotify_fd, tail->file,
+                                         IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (tail->inotify_wd < 0) {
+        WARNING("Cannot watch '%s': %s", tail->file, STRERRNO);
+        tail_inotify_close(tail);
+    }
+}
+#endif
+
+/* Drain the pending inotify events, returns true if there can be something new
+ * to read or the file could have been rotated. */
+static bool tail_inotify_changed(tail_t *tail)
+{
+    if (!tail->inotify)
+        return true;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    const char *name = strrchr(tail->file, '/');
+    name = name == NULL ? tail->file : name + 1;
+
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(tail->inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            WARNING("Reading inotify events for '%s' failed: %s", tail->file, STRERRNO);
+            tail_inotify_close(tail);
+            return true;
+        }
+
+        for (char *ptr = buf; ptr < (buf + len);) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            /* The directory events are only relevant for our file name. */
+            if ((event->wd != tail->inotify_dir_wd) ||
+                ((event->len > 0) && (strcmp(event->name, name) == 0)))
+                changed = true;
+            ptr += sizeof(*event) + event->len;
+        }
+    }
+
+    return changed;
+#else
+    return true;
+#endif
+}
 
 void tail_free(tail_t *tail)
 {
     if (tail == NULL)
         return;
 
-    if (tail->fh != NULL)
-        fclose(tail->fh);
-
-    free(tail->file);
+    tail_reset(tail);
 
     free(tail);
     return;
@@ -37,10 +133,14 @@ void tail_reset(tail_t *tail)
     if (tail == NULL)
         return;
 
-    if (tail->fh != NULL)
-        fclose(tail->fh);
+    tail_close(tail);
+
+    free(tail->buf);
+    tail->buf = NULL;
+    tail->buf_size = 0;
 
     free(tail->file);
+    tail->file = NULL;
     return;
 }
 
@@ -66,14 +166,20 @@ tail_t *tail_alloc(char *file, bool force_rewind)
 
 int tail_close(tail_t *tail)
 {
-    if (tail->fh == NULL)
+    tail_inotify_close(tail);
+
+    if (!tail->open)
         return 0;
 
-    fclose(tail->fh);
-    tail->fh = NULL;
+    close(tail->fd);
+    tail->fd = -1;
+    tail->open = false;
+    tail->buf_len = 0;
     return 0;
 }
 
+/* Returns 1 if the open file is still the current one, 0 if it was reopened or
+ * truncated and there can be more to read, and a negative value on error. */
 int tail_reopen(tail_t *tail)
 {
     struct stat stat_buf = {0};
@@ -85,19 +191,19 @@ int tail_reopen(tail_t *tail)
     }
 
     /* The file is already open.. */
-    if ((tail->fh != NULL) && (stat_buf.st_ino == tail->stat.st_ino)) {
+    if (tail->open && (stat_buf.st_ino == tail->stat.st_ino)) {
+        memcpy(&tail->stat, &stat_buf, sizeof(struct stat));
         /* Seek to the beginning if file was truncated */
-        if (stat_buf.st_size < tail->stat.st_size) {
+        if (stat_buf.st_size < tail->offset) {
             PLUGIN_INFO("File '%s' was truncated.", tail->file);
-            status = fseek(tail->fh, 0, SEEK_SET);
-            if (status != 0) {
-                ERROR("fseek '%s' failed: %s", tail->file, STRERRNO);
-                fclose(tail->fh);
-                tail->fh = NULL;
+            if (lseek(tail->fd, 0, SEEK_SET) < 0) {
+                ERROR("lseek '%s' failed: %s", tail->file, STRERRNO);
+                tail_close(tail);
                 return -1;
             }
+            tail->offset = 0;
+            return 0;
         }
-        memcpy(&tail->stat, &stat_buf, sizeof(struct stat));
         return 1;
     }
 
@@ -108,80 +214,119 @@ int tail_reopen(tail_t *tail)
     if ((tail->stat.st_ino == 0) || (tail->stat.st_ino == stat_buf.st_ino))
         seek_end = !tail->force_rewind;
 
-    FILE *fh = fopen(tail->file, "r");
-    if (fh == NULL) {
+#ifdef HAVE_SYS_INOTIFY_H
+    /* Watch before opening, a rotation in between is seen as a new event. */
+    tail_inotify_watch(tail);
+#endif
+
+    int fd = open(tail->file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         ERROR("Cannot open '%s': %s", tail->file, STRERRNO);
         return -1;
     }
 
+    off_t offset = 0;
     if (seek_end != 0) {
-        status = fseek(fh, 0, SEEK_END);
-        if (status != 0) {
-            ERROR("fseek '%s' failed: %s", tail->file, STRERRNO);
-            fclose(fh);
+        offset = lseek(fd, 0, SEEK_END);
+        if (offset < 0) {
+            ERROR("lseek '%s' failed: %s", tail->file, STRERRNO);
+            close(fd);
             return -1;
         }
     }
 
-    if (tail->fh != NULL)
-        fclose(tail->fh);
-    tail->fh = fh;
+    if (tail->open)
+        close(tail->fd);
+    tail->fd = fd;
+    tail->open = true;
+    tail->offset = offset;
     memcpy(&tail->stat, &stat_buf, sizeof(struct stat));
 
     return 0;
 }
 
-int tail_readline(tail_t *tail, char *buf, size_t buflen)
+/* Split the first len bytes of the buffer in lines, the incomplete last line is
+ * moved to the start of the buffer unless it must be flushed. */
+static void tail_read_lines(tail_t *tail, size_t len, bool flush,
+                            tail_line_cb callback, void *data)
 {
-    if (tail->fh == NULL) {
-        int status = tail_reopen(tail);
-        if (status < 0)
-            return status;
-    }
-    assert(tail->fh != NULL);
+    char *ptr = tail->buf;
+    char *end = tail->buf + len;
 
-    /* Try to read from the filehandle. If that succeeds, everything appears to
-     * be fine and we can return. */
-    clearerr(tail->fh);
-    if (fgets(buf, buflen, tail->fh) != NULL) {
-        buf[buflen - 1] = '\0';
-        return 0;
+    while (ptr < end) {
+        char *eol = memchr(ptr, '\n', end - ptr);
+        if (eol == NULL)
+            break;
+        *eol = '\0';
+        callback(data, ptr, eol - ptr);
+        ptr = eol + 1;
     }
 
-    /* Check if we encountered an error */
-    if (ferror(tail->fh) != 0) {
-        /* Jupp, error. Force `cu_tail_reopen' to reopen the file.. */
-        fclose(tail->fh);
-        tail->fh = NULL;
+    size_t rest = end - ptr;
+    /* A line longer than the buffer is split as fgets did. */
+    if ((rest > 0) && (flush || (rest == tail->buf_size))) {
+        ptr[rest] = '\0';
+        callback(data, ptr, rest);
+        rest = 0;
     }
-    /* else: eof -> check if the file was moved away and reopen the new file if
-     * so.. */
-
-    int status = tail_reopen(tail);
-    /* error -> return with error */
-    if (status < 0) {
-        return status;
-    /* file end reached and file not reopened -> nothing more to read */
-    } else if (status > 0) {
-        buf[0] = 0;
+
+    if ((rest > 0) && (ptr != tail->buf))
+        memmove(tail->buf, ptr, rest);
+    tail->buf_len = rest;
+}
+
+int tail_read(tail_t *tail, tail_line_cb callback, void *data)
+{
+    if (!tail->open) {
+        int status = tail_reopen(tail);
+        if (status < 0)
+            return status;
+        tail->changed = true;
+    } else if (!tail->changed && !tail_inotify_changed(tail)) {
         return 0;
     }
+    /* Until the end of the current file is reached without errors. */
+    tail->changed = true;
 
-    /* If we get here: file was re-opened and there may be more to read.. Let's
-     * try again. */
-    if (fgets(buf, buflen, tail->fh) != NULL) {
-        buf[buflen - 1] = '\0';
-        return 0;
+    if (tail->buf == NULL) {
+        tail->buf = malloc(TAIL_BUFFER_SIZE + 1);
+        if (tail->buf == NULL) {
+            ERROR("malloc failed.");
+            return -1;
+        }
+        tail->buf_size = TAIL_BUFFER_SIZE;
+        tail->buf_len = 0;
     }
 
-    if (ferror(tail->fh) != 0) {
-        WARNING("fgets '%s' returned an error: %s", tail->file, STRERRNO);
-        fclose(tail->fh);
-        tail->fh = NULL;
-        return -1;
+    while (true) {
+        ssize_t len = read(tail->fd, tail->buf + tail->buf_len, tail->buf_size - tail->buf_len);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("read '%s' failed: %s", tail->file, STRERRNO);
+            tail_close(tail);
+            return -1;
+        }
+
+        if (len > 0) {
+            tail->offset += len;
+            tail_read_lines(tail, tail->buf_len + len, false, callback, data);
+            continue;
+        }
+
+        /* eof -> check if the file was moved away or truncated and reopen it.. */
+        int status = tail_reopen(tail);
+        if (status < 0)
+            return status;
+        /* file end reached and file not reopened -> nothing more to read */
+        if (status > 0)
+            break;
+
+        /* The last line of the previous file will not be completed. */
+        if (tail->buf_len > 0)
+            tail_read_lines(tail, tail->buf_len, true, callback, data);
     }
 
-    /* EOf, well, apparently the new file is empty.. */
-    buf[0] = 0;
+    tail->changed = false;
     return 0;
 }
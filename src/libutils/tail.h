@@ -10,16 +10,40 @@
 
 #pragma once
 
-#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 
+/* Follow a file that is being appended, the file is read in large blocks and
+ * split in lines without copying them.  Where inotify is available the file and
+ * its directory are watched, so reading when nothing changed is a single
+ * non-blocking read of the inotify descriptor, and rotations are noticed as
+ * soon as they happen. */
+
 typedef struct {
     char *file;
-    FILE *fh;
-    struct stat stat;
     bool force_rewind;
+    bool open;
+    int fd;
+    struct stat stat;
+    off_t offset;
+    /* The start of the buffer keeps the partial last line of the previous read. */
+    char *buf;
+    size_t buf_size;
+    size_t buf_len;
+    bool changed;
+    bool inotify;
+    int inotify_fd;
+    int inotify_wd;
+    int inotify_dir_wd;
 } tail_t;
 
+/* Called for each line read, the line is NUL terminated without the trailing
+ * newline and points into the tail buffer: it can be modified but it is only
+ * valid until the callback returns. */
+typedef int (*tail_line_cb)(void *data, char *line, size_t len);
+
 void tail_free(tail_t *tail);
 
 void tail_reset(tail_t *tail);
@@ -30,5 +54,6 @@ int tail_close(tail_t *tail);
 
 int tail_reopen(tail_t *tail);
 
-int tail_readline(tail_t *tail, char *buf, size_t buflen);
-
+/* Read all the lines appended to the file since the last call, returns zero on
+ * success or a negative value when the file can not be read. */
+int tail_read(tail_t *tail, tail_line_cb callback, void *data);
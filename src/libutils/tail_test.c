@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#include "ncollectd.h"
+#include "libtest/testing.h"
+#include "libutils/strbuf.h"
+#include "libutils/tail.h"
+
+static int tail_test_line(void *data, char *line, size_t len)
+{
+    strbuf_t *buf = data;
+    if (strlen(line) != len)
+        return -1;
+    strbuf_putstrn(buf, line, len);
+    strbuf_putchar(buf, '|');
+    return 0;
+}
+
+static int tail_test_append(const char *file, const char *str)
+{
+    FILE *fh = fopen(file, "a");
+    if (fh == NULL)
+        return -1;
+    fputs(str, fh);
+    fclose(fh);
+    return 0;
+}
+
+#define EXPECT_TAIL_READ(expect, tail)                                  \
+    do {                                                                \
+        strbuf_t buf = STRBUF_CREATE;                                   \
+        CHECK_ZERO(tail_read(tail, tail_test_line, &buf));              \
+        EXPECT_EQ_STR(expect, buf.ptr == NULL ? "" : buf.ptr);          \
+        strbuf_destroy(&buf);                                           \
+    } while (0)
+
+DEF_TEST(tail_read)
+{
+    char dir[] = "/tmp/tail_test.XXXXXX";
+    CHECK_NOT_NULL(mkdtemp(dir));
+
+    char file[256];
+    char rotated[256];
+    snprintf(file, sizeof(file), "%s/test.log", dir);
+    snprintf(rotated, sizeof(rotated), "%s/test.log.1", dir);
+
+    CHECK_ZERO(tail_test_append(file, "a\nb\n"));
+
+    tail_t *tail = tail_alloc(file, true);
+    CHECK_NOT_NULL(tail);
+
+    EXPECT_TAIL_READ("a|b|", tail);
+    EXPECT_TAIL_READ("", tail);
+
+    /* An incomplete line is kept until its end is written. */
+    CHECK_ZERO(tail_test_append(file, "c\n\npar"));
+    EXPECT_TAIL_READ("c||", tail);
+    CHECK_ZERO(tail_test_append(file, "tial\n"));
+    EXPECT_TAIL_READ("partial|", tail);
+
+    /* The rest of the rotated file is read before the new one. */
+    CHECK_ZERO(rename(file, rotated));
+    CHECK_ZERO(tail_test_append(rotated, "d\nlast"));
+    CHECK_ZERO(tail_test_append(file, "new\n"));
+    EXPECT_TAIL_READ("d|last|new|", tail);
+
+    CHECK_ZERO(truncate(file, 0));
+    CHECK_ZERO(tail_test_append(file, "t\n"));
+    EXPECT_TAIL_READ("t|", tail);
+
+    /* Lines longer than the buffer are split. */
+    size_t long_len = 65536 + 100;
+    char *long_line = malloc(long_len + 2);
+    CHECK_NOT_NULL(long_line);
+    memset(long_line, 'x', long_len);
+    long_line[long_len] = '\n';
+    long_line[long_len + 1] = '\0';
+    CHECK_ZERO(tail_test_append(file, long_line));
+    strbuf_t buf = STRBUF_CREATE;
+    CHECK_ZERO(tail_read(tail, tail_test_line, &buf));
+    EXPECT_EQ_INT(long_len + 2, strbuf_len(&buf));
+    strbuf_destroy(&buf);
+    free(long_line);
+
+    tail_free(tail);
+
+    unlink(file);
+    unlink(rotated);
+    rmdir(dir);
+
+    return 0;
+}
+
+int main(void)
+{
+    RUN_TEST(tail_read);
+
+    END_TEST;
+}
@@ -119,6 +119,11 @@ static cf_global_option_t cf_global_options[] = {
     { "post-cache-filter",      NULL, 0, "post-cache"     },
     { "max-read-interval",      NULL, 0, "86400"          },
     { "normalize-interval",     NULL, 0, "false"          },
+    { "mdb-retention",          NULL, 0, "3600"           },
+    { "mdb-path",               NULL, 0, NULL             },
+    { "mdb-sync-interval",      NULL, 0, "300"            },
+    { "log-queue-size",         NULL, 0, "1024"           },
+    { "log-rate-limit",         NULL, 0, "10"             },
     { "proc-path",              NULL, 0, "/proc"          },
     { "sys-path",               NULL, 0, "/sys"           },
 };
@@ -509,6 +514,7 @@ static int dispatch_block_control_socket(const config_item_t *ci)
 static int dispatch_block_queue_memory(const config_item_t *ci, queue_type_t type, cf_queue_t *queue)
 {
     queue->type = CF_QUEUE_MEMORY;
+    queue->memory.mode = CF_QUEUE_MEMORY_LIST;
 
     if (type == QUEUE_METRICS) {
         queue->memory.limit_high = QUEUE_METRICS_MEMORY_LIMIT_HIGH;
@@ -530,6 +536,20 @@ static int dispatch_block_queue_memory(const config_item_t *ci, queue_type_t typ
             int value = 0;
             status = cf_util_get_int(child, &value);
             queue->memory.limit_low = value;
+        } else if (strcasecmp("mode", child->key) == 0) {
+            char mode[8];
+            status = cf_util_get_string_buffer(child, mode, sizeof(mode));
+            if (status == 0) {
+                if (strcasecmp("list", mode) == 0) {
+                    queue->memory.mode = CF_QUEUE_MEMORY_LIST;
+                } else if ((type == QUEUE_METRICS) && (strcasecmp("ring", mode) == 0)) {
+                    queue->memory.mode = CF_QUEUE_MEMORY_RING;
+                } else {
+                    ERROR("Invalid memory queue mode '%s' in %s:%d",
+                          mode, cf_get_file(child), cf_get_lineno(child));
+                    status = -1;
+                }
+            }
         } else {
             ERROR("Unknown memory option '%s' in %s:%d",
                   child->key, cf_get_file(child), cf_get_lineno(child));
@@ -575,7 +595,7 @@ static int dispatch_block_queue_journal(const config_item_t *ci, queue_type_t ty
         }
         queue->journal.checksum = true;
         queue->journal.compress = 0;
-        queue->journal.retention_size = 10;
+        queue->journal.retention_size = 1024*1024*1024;
         queue->journal.retention_time = TIME_T_TO_CDTIME_T(60*60*24);
         queue->journal.segment_size = 1024*1024*10;
     } else {
@@ -587,7 +607,7 @@ static int dispatch_block_queue_journal(const config_item_t *ci, queue_type_t ty
         }
         queue->journal.checksum = true;
         queue->journal.compress = 0;
-        queue->journal.retention_size = 10;
+        queue->journal.retention_size = 1024*1024*1024;
         queue->journal.retention_time = TIME_T_TO_CDTIME_T(60*60*24);
         queue->journal.segment_size = 1024*1024*10;
     }
@@ -603,14 +623,14 @@ static int dispatch_block_queue_journal(const config_item_t *ci, queue_type_t ty
         } else if (strcasecmp("compress", child->key) == 0) {
             // FIXME
         } else if (strcasecmp("retention-size", child->key) == 0) {
-            int value = 0;
-            status = cf_util_get_int(child, &value);
+            double value = 0;
+            status = cf_util_get_double(child, &value);
             queue->journal.retention_size = value;
         } else if (strcasecmp("retention-time", child->key) == 0) {
             status = cf_util_get_cdtime(child, &queue->journal.retention_time);
         } else if (strcasecmp("segment-size", child->key) == 0) {
-            int value = 0;
-            status = cf_util_get_int(child, &value);
+            double value = 0;
+            status = cf_util_get_double(child, &value);
             queue->journal.segment_size = value;
         } else {
             ERROR("Unknown journal option '%s' in %s:%d",
@@ -22,9 +22,15 @@ typedef enum {
     CF_QUEUE_JOURNAL
 } cf_queue_type_t;
 
+typedef enum {
+    CF_QUEUE_MEMORY_LIST,
+    CF_QUEUE_MEMORY_RING
+} cf_queue_memory_mode_t;
+
 typedef struct {
     cf_queue_type_t type;
     struct {
+        cf_queue_memory_mode_t mode;
         long limit_high;
         long limit_low;
     } memory;
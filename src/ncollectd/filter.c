@@ -7,12 +7,12 @@
 #include "libutils/common.h"
 #include "libutils/complain.h"
 #include "libutils/config.h"
+#include "libutils/strintern.h"
+#include "libutils/strmatch.h"
 #include "libmetric/metric_chars.h"
 #include "plugin_internal.h"
 #include "filter.h"
 
-#include <regex.h>
-
 typedef enum {
     FILTER_STMT_TYPE_IF,
     FILTER_STMT_TYPE_ELIF,
@@ -75,7 +75,7 @@ typedef struct {
     filter_list_type_t type;
     union {
         char *str;
-        regex_t *regex;
+        strmatch_t *regex;
     };
 } filter_list_item_t;
 
@@ -126,12 +126,13 @@ struct filter_stmt_s {
         } stmt_label_rename;
         struct {
             char *label;
-            regex_t *regex;
+            strmatch_t *regex;
             filter_sub_list_t replace;
         } stmt_sub;
         struct {
             char *label;
-            regex_t *regex;
+            strmatch_t *regex;
+            bool capture;
             filter_stmt_t *stmt;
         } stmt_match;
         filter_stmt_list_t stmt_list;
@@ -139,11 +140,55 @@ struct filter_stmt_s {
     filter_stmt_t *next;
 };
 
+/* The statements of a filter are compiled in a flat list of instructions, the
+ * if, elif, else and unless blocks are turned into conditional jumps. */
+typedef enum {
+    FILTER_OP_MATCH,
+    FILTER_OP_NMATCH,
+    FILTER_OP_JUMP,
+    FILTER_OP_CALL,
+    FILTER_OP_DROP,
+    FILTER_OP_STOP,
+    FILTER_OP_RETURN,
+    FILTER_OP_STMT,
+} filter_op_t;
+
+typedef struct {
+    filter_op_t op;
+    filter_stmt_t *stmt;
+    /* Target of FILTER_OP_JUMP and of a failed FILTER_OP_MATCH or FILTER_OP_NMATCH. */
+    size_t jump;
+    /* Slot plus one in the decision cache of the result of the metric name part
+     * of a match, or the first slot of the cache of the called filter. */
+    size_t cache;
+    size_t cache_num;
+    /* The instruction only depends on the metric name, so it gives the same
+     * result for all the metrics of a family. */
+    bool family;
+} filter_insn_t;
+
 struct plugin_filter_s {
     char *name;
     filter_stmt_t *ptr;
+    size_t insn_num;
+    size_t insn_size;
+    filter_insn_t *insn;
+    size_t cache_num;
 };
 
+/* The decision cache keeps the result of the metric name part of the matches
+ * while the metric name is the name of the family being processed. */
+typedef enum {
+    FILTER_CACHE_UNKNOWN = 0,
+    FILTER_CACHE_FALSE,
+    FILTER_CACHE_TRUE,
+} filter_cache_t;
+
+typedef struct {
+    const char *name;
+    uint8_t *cache;
+} filter_exec_t;
+
 typedef struct {
     size_t size;
     plugin_filter_t **ptr;
@@ -198,6 +243,7 @@ void filter_free(plugin_filter_t *filter)
 
     free(filter->name);
     filter_stmt_free(filter->ptr);
+    free(filter->insn);
     free(filter);
 }
 
@@ -208,6 +254,7 @@ void plugin_filter_free(plugin_filter_t *filter)
 
     free(filter->name);
     filter_stmt_free(filter->ptr);
+    free(filter->insn);
     free(filter);
 }
 
@@ -220,6 +267,11 @@ void filter_reset(plugin_filter_t *filter)
     filter->name = NULL;
     filter_stmt_free(filter->ptr);
     filter->ptr = NULL;
+    free(filter->insn);
+    filter->insn = NULL;
+    filter->insn_num = 0;
+    filter->insn_size = 0;
+    filter->cache_num = 0;
 }
 
 void filter_global_free(void)
@@ -722,8 +774,8 @@ static filter_stmt_t *filter_config_stmt_list(const config_item_t *ci, filter_st
     }
 
     for (int i = 0; i < ci->values_num; i++) {
-        if ((ci->values[0].type != CONFIG_TYPE_STRING) &&
-            (ci->values[0].type != CONFIG_TYPE_REGEX)) {
+        if ((ci->values[i].type != CONFIG_TYPE_STRING) &&
+            (ci->values[i].type != CONFIG_TYPE_REGEX)) {
             ERROR("'%s' statement require a list of strings or regex as argument in %s:%d.",
                   ci->key, cf_get_file(ci), cf_get_lineno(ci));
             return NULL;
@@ -743,10 +795,15 @@ static filter_stmt_t *filter_config_stmt_list(const config_item_t *ci, filter_st
     stmt->stmt_list.num = ci->values_num;
 
     for (int i = 0; i < ci->values_num; i++) {
-        if (ci->values[i].type != CONFIG_TYPE_STRING) {
+        if (ci->values[i].type == CONFIG_TYPE_STRING) {
             stmt->stmt_list.ptr[i].type = FILTER_LIST_TYPE_STR;
             stmt->stmt_list.ptr[i].str = strdup(ci->values[i].value.string);
-        } else if (ci->values[i].type != CONFIG_TYPE_REGEX) {
+            if (stmt->stmt_list.ptr[i].str == NULL) {
+                ERROR("strdup failed.");
+                filter_stmt_free(stmt);
+                return NULL;
+            }
+        } else if (ci->values[i].type == CONFIG_TYPE_REGEX) {
             stmt->stmt_list.ptr[i].type = FILTER_LIST_TYPE_REGEX;
             stmt->stmt_list.ptr[i].regex = calloc(1, sizeof(*stmt->stmt_list.ptr[i].regex));
             if (stmt->stmt_list.ptr[i].regex == NULL) {
@@ -755,9 +812,11 @@ static filter_stmt_t *filter_config_stmt_list(const config_item_t *ci, filter_st
                 return NULL;
             }
 
-            int status = regcomp(stmt->stmt_list.ptr[i].regex, ci->values[i].value.string,
-                                                               REG_EXTENDED);
+            int status = strmatch_compile(stmt->stmt_list.ptr[i].regex,
+                                          ci->values[i].value.string, REG_NOSUB);
             if (status != 0) {
+                free(stmt->stmt_list.ptr[i].regex);
+                stmt->stmt_list.ptr[i].regex = NULL;
                 ERROR("regcom '%s' failed in %s:%d: %s.", ci->values[i].value.string,
                       cf_get_file(ci), cf_get_lineno(ci), STRERRNO);
                 filter_stmt_free(stmt);
@@ -834,8 +893,10 @@ static filter_stmt_t *filter_config_stmt_sub(const config_item_t *ci, filter_stm
         return NULL;
     }
 
-    int status = regcomp(stmt->stmt_sub.regex, pattern, REG_EXTENDED);
+    int status = strmatch_compile(stmt->stmt_sub.regex, pattern, 0);
     if (status != 0) {
+        free(stmt->stmt_sub.regex);
+        stmt->stmt_sub.regex = NULL;
         ERROR("regcom '%s' failed in %s:%d: %s.", pattern, cf_get_file(ci), cf_get_lineno(ci),
               STRERRNO);
         filter_stmt_free(stmt);
@@ -845,6 +906,69 @@ static filter_stmt_t *filter_config_stmt_sub(const config_item_t *ci, filter_stm
     return stmt;
 }
 
+static bool filter_sub_list_has_ref(filter_sub_list_t *slist)
+{
+    for (size_t i = 0; i < slist->num; i++) {
+        if (slist->ptr[i].type == FILTER_SUB_REF)
+            return true;
+    }
+    return false;
+}
+
+static bool filter_stmt_need_capture(filter_stmt_t *stmt)
+{
+    for (; stmt != NULL; stmt = stmt->next) {
+        switch(stmt->type) {
+        case FILTER_STMT_TYPE_METRIC_RENAME:
+            if (filter_sub_list_has_ref(&stmt->stmt_metric_rename.to))
+                return true;
+            break;
+        case FILTER_STMT_TYPE_LABEL_SET:
+            if (filter_sub_list_has_ref(&stmt->stmt_label_set.value))
+                return true;
+            break;
+        case FILTER_STMT_TYPE_LABEL_RENAME:
+            if (filter_sub_list_has_ref(&stmt->stmt_label_rename.to))
+                return true;
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+static bool filter_sub_list_has_label(filter_sub_list_t *slist)
+{
+    for (size_t i = 0; i < slist->num; i++) {
+        if (slist->ptr[i].type == FILTER_SUB_LABEL)
+            return true;
+    }
+    return false;
+}
+
+static bool filter_stmt_is_family(filter_stmt_t *stmt)
+{
+    switch(stmt->type) {
+    case FILTER_STMT_TYPE_METRIC_RENAME:
+        return !filter_sub_list_has_label(&stmt->stmt_metric_rename.to);
+    case FILTER_STMT_TYPE_METRIC_SUB:
+    case FILTER_STMT_TYPE_METRIC_GSUB:
+        return !filter_sub_list_has_label(&stmt->stmt_sub.replace);
+    case FILTER_STMT_TYPE_METRIC_MATCH:
+        for (filter_stmt_t *child = stmt->stmt_match.stmt; child != NULL; child = child->next) {
+            if (child->type != FILTER_STMT_TYPE_METRIC_RENAME)
+                return false;
+            if (!filter_stmt_is_family(child))
+                return false;
+        }
+        return true;
+    default:
+        break;
+    }
+    return false;
+}
+
 static filter_stmt_t *filter_config_stmt_match(const config_item_t *ci, filter_stmt_type_t type)
 {
     char *label = NULL;
@@ -890,8 +1014,10 @@ static filter_stmt_t *filter_config_stmt_match(const config_item_t *ci, filter_s
         return NULL;
     }
 
-    int status = regcomp(match_stmt->stmt_match.regex, pattern, REG_EXTENDED);
+    int status = strmatch_compile(match_stmt->stmt_match.regex, pattern, 0);
     if (status != 0) {
+        free(match_stmt->stmt_match.regex);
+        match_stmt->stmt_match.regex = NULL;
         ERROR("regcom '%s' failed in %s:%d: %s.", pattern,
               cf_get_file(ci), cf_get_lineno(ci), STRERRNO);
         filter_stmt_free(match_stmt);
@@ -933,6 +1059,7 @@ static filter_stmt_t *filter_config_stmt_match(const config_item_t *ci, filter_s
     }
 
     match_stmt->stmt_match.stmt = root_stmt;
+    match_stmt->stmt_match.capture = filter_stmt_need_capture(root_stmt);
 
     return match_stmt;
 }
@@ -997,7 +1124,7 @@ void filter_stmt_free(filter_stmt_t *root)
                     if (root->stmt_list.ptr[i].type == FILTER_LIST_TYPE_STR) {
                         free(root->stmt_list.ptr[i].str);
                     } else if (root->stmt_list.ptr[i].type == FILTER_LIST_TYPE_REGEX) {
-                        regfree(root->stmt_list.ptr[i].regex);
+                        strmatch_reset(root->stmt_list.ptr[i].regex);
                         free(root->stmt_list.ptr[i].regex);
                     }
                 }
@@ -1011,19 +1138,15 @@ void filter_stmt_free(filter_stmt_t *root)
         case FILTER_STMT_TYPE_LABEL_VALUE_SUB:
         case FILTER_STMT_TYPE_LABEL_VALUE_GSUB:
             free(root->stmt_sub.label);
-            if (root->stmt_sub.regex != NULL) {
-                regfree(root->stmt_sub.regex);
-                free(root->stmt_sub.regex);
-            }
+            strmatch_reset(root->stmt_sub.regex);
+            free(root->stmt_sub.regex);
             filter_sub_list_reset(&root->stmt_sub.replace);
             break;
         case FILTER_STMT_TYPE_METRIC_MATCH:
         case FILTER_STMT_TYPE_LABEL_VALUE_MATCH:
             free(root->stmt_match.label);
-            if (root->stmt_match.regex != NULL) {
-                regfree(root->stmt_match.regex);
-                free(root->stmt_match.regex);
-            }
+            strmatch_reset(root->stmt_match.regex);
+            free(root->stmt_match.regex);
             filter_stmt_free(root->stmt_match.stmt);
             break;
         }
@@ -1187,6 +1310,139 @@ static filter_stmt_t *filter_config_stmt(const config_item_t *ci, bool *error, b
     return root_stmt;
 }
 
+static filter_insn_t *filter_insn_append(plugin_filter_t *filter, filter_op_t op,
+                                                                 filter_stmt_t *stmt)
+{
+    if (filter->insn_num == filter->insn_size) {
+        size_t size = filter->insn_size == 0 ? 16 : filter->insn_size * 2;
+        filter_insn_t *tmp = realloc(filter->insn, sizeof(*tmp) * size);
+        if (tmp == NULL) {
+            ERROR("realloc failed.");
+            return NULL;
+        }
+        filter->insn = tmp;
+        filter->insn_size = size;
+    }
+
+    filter_insn_t *insn = &filter->insn[filter->insn_num];
+    filter->insn_num++;
+
+    *insn = (filter_insn_t){ .op = op, .stmt = stmt };
+
+    return insn;
+}
+
+static int filter_compile_stmt(plugin_filter_t *filter, filter_stmt_t *stmt)
+{
+    for (; stmt != NULL; stmt = stmt->next) {
+        filter_insn_t *insn = NULL;
+
+        switch(stmt->type) {
+        case FILTER_STMT_TYPE_IF:
+        case FILTER_STMT_TYPE_UNLESS: {
+            /* The jumps to the end of the chain are linked through the jump
+             * field until the end is known. */
+            size_t jump_end = SIZE_MAX;
+            filter_stmt_t *block = stmt;
+            while (block != NULL) {
+                if (block->type == FILTER_STMT_TYPE_ELSE) {
+                    if (filter_compile_stmt(filter, block->stmt_if.stmt) != 0)
+                        return -1;
+                    break;
+                }
+
+                size_t pos = filter->insn_num;
+                insn = filter_insn_append(filter, block->type == FILTER_STMT_TYPE_UNLESS ?
+                                                  FILTER_OP_NMATCH : FILTER_OP_MATCH, block);
+                if (insn == NULL)
+                    return -1;
+                if ((block->stmt_if.match.name != NULL) &&
+                    (block->stmt_if.match.name->num > 0)) {
+                    filter->cache_num++;
+                    insn->cache = filter->cache_num;
+                }
+                insn->family = (block->stmt_if.match.labels == NULL) ||
+                               (block->stmt_if.match.labels->num == 0);
+
+                if (filter_compile_stmt(filter, block->stmt_if.stmt) != 0)
+                    return -1;
+
+                filter_stmt_t *next = block == stmt ? stmt->stmt_if.next : block->next;
+                if (next != NULL) {
+                    insn = filter_insn_append(filter, FILTER_OP_JUMP, block);
+                    if (insn == NULL)
+                        return -1;
+                    insn->family = true;
+                    insn->jump = jump_end;
+                    jump_end = filter->insn_num - 1;
+                }
+
+                filter->insn[pos].jump = filter->insn_num;
+                block = next;
+            }
+
+            while (jump_end != SIZE_MAX) {
+                size_t next = filter->insn[jump_end].jump;
+                filter->insn[jump_end].jump = filter->insn_num;
+                jump_end = next;
+            }
+            continue;
+        }
+        case FILTER_STMT_TYPE_ELIF:
+        case FILTER_STMT_TYPE_ELSE:
+            continue;
+        case FILTER_STMT_TYPE_DROP:
+            insn = filter_insn_append(filter, FILTER_OP_DROP, stmt);
+            break;
+        case FILTER_STMT_TYPE_STOP:
+            insn = filter_insn_append(filter, FILTER_OP_STOP, stmt);
+            break;
+        case FILTER_STMT_TYPE_RETURN:
+            insn = filter_insn_append(filter, FILTER_OP_RETURN, stmt);
+            break;
+        case FILTER_STMT_TYPE_CALL:
+            insn = filter_insn_append(filter, FILTER_OP_CALL, stmt);
+            if (insn != NULL) {
+                insn->cache = filter->cache_num;
+                insn->cache_num = stmt->stmt_call.filter->cache_num;
+                filter->cache_num += insn->cache_num;
+            }
+            break;
+        default:
+            insn = filter_insn_append(filter, FILTER_OP_STMT, stmt);
+            if (insn != NULL)
+                insn->family = filter_stmt_is_family(stmt);
+            break;
+        }
+
+        if (insn == NULL)
+            return -1;
+
+        if (insn->op != FILTER_OP_STMT)
+            insn->family = true;
+    }
+
+    return 0;
+}
+
+static int filter_compile(plugin_filter_t *filter)
+{
+    filter->insn_num = 0;
+    filter->cache_num = 0;
+
+    int status = filter_compile_stmt(filter, filter->ptr);
+    if (status != 0) {
+        free(filter->insn);
+        filter->insn = NULL;
+        filter->insn_num = 0;
+        filter->insn_size = 0;
+        filter->cache_num = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
 int filter_global_configure(const config_item_t *ci)
 {
     if ((ci->values_num != 1) || (ci->values[0].type != CONFIG_TYPE_STRING)) {
@@ -1226,6 +1482,9 @@ int filter_global_configure(const config_item_t *ci)
         nstmt->next = stmt;
     }
 
+    if (filter_compile(filter) != 0)
+        return -1;
+
     return 0;
 }
 
@@ -1260,6 +1519,9 @@ int plugin_filter_configure(const config_item_t *ci, plugin_filter_t **filter)
         nstmt->next = stmt;
     }
 
+    if (filter_compile(*filter) != 0)
+        return -1;
+
     return 0;
 }
 
@@ -1417,7 +1679,7 @@ static int filter_replace(filter_sub_list_t *replace, strbuf_t *buf,
     return 0;
 }
 
-static int filter_sub(regex_t *reg, strbuf_t *buf, char *str, filter_sub_list_t *replace,
+static int filter_sub(strmatch_t *reg, strbuf_t *buf, char *str, filter_sub_list_t *replace,
                                     char *name, label_set_t *labels, bool global)
 {
     regoff_t str_len = strlen(str);
@@ -1425,7 +1687,7 @@ static int filter_sub(regex_t *reg, strbuf_t *buf, char *str, filter_sub_list_t
     regmatch_t re_match[10];
     int nmatch = 0;
 
-    while(regexec(reg, str, STATIC_ARRAY_SIZE(re_match), re_match, eflags) == 0) {
+    while(strmatch_regexec(reg, str, STATIC_ARRAY_SIZE(re_match), re_match, eflags) == 0) {
         regoff_t so = re_match[0].rm_so;
         regoff_t eo = re_match[0].rm_eo;
 
@@ -1474,14 +1736,14 @@ static int filter_list_labels(filter_stmt_list_t *list, filter_stmt_type_t type,
     for (size_t i = 0; i < labels->num; i++) {
         bool remove = type == FILTER_STMT_TYPE_LABEL_ALLOW ? true : false;
         for (size_t j = 0; j < list->num; j++) {
-            filter_list_item_t *item = &list->ptr[i];
+            filter_list_item_t *item = &list->ptr[j];
             if (item->type == FILTER_LIST_TYPE_STR) {
                 if (strcmp(labels->ptr[i].name, item->str) == 0) {
                     remove = type == FILTER_STMT_TYPE_LABEL_ALLOW ? false : true;
                     break;
                 }
             } else if (item->type == FILTER_LIST_TYPE_REGEX) {
-                if (regexec(item->regex, labels->ptr[i].name, 0, NULL, REG_NOSUB) == 0) {
+                if (strmatch_exec(item->regex, labels->ptr[i].name)) {
                     remove = type == FILTER_STMT_TYPE_LABEL_ALLOW ? false : true;
                     break;
                 }
@@ -1489,45 +1751,22 @@ static int filter_list_labels(filter_stmt_list_t *list, filter_stmt_type_t type,
         }
 
         if (remove) {
-            free(labels->ptr[i].name);
-            labels->ptr[i].name = NULL;
-            free(labels->ptr[i].value);
-            labels->ptr[i].value = NULL;
+            strintern_free(labels->ptr[i].name);
+            strintern_free(labels->ptr[i].value);
         } else {
+            labels->ptr[remain] = labels->ptr[i];
             remain++;
         }
     }
 
-    if (remain == labels->num)
-        return 0;
+    labels->num = remain;
 
     if (remain == 0) {
         free(labels->ptr);
         labels->ptr = NULL;
-        labels->num = 0;
-        return 0;
-    }
-
-    label_pair_t *tmp = malloc(sizeof(*tmp) * remain);
-    if (tmp == NULL) {
-        ERROR("malloc failed.");
-        label_set_reset(labels);
-        return ENOMEM;
-    }
-
-    size_t j = 0;
-    for (size_t i = 0; i < labels->num; i++) {
-        if (labels->ptr[i].name != NULL) {
-            tmp[j].name = labels->ptr[i].name;
-            tmp[j].value = labels->ptr[i].value;
-            j++;
-        }
+        labels->size = 0;
     }
 
-    free(labels->ptr);
-    labels->ptr = tmp;
-    labels->num = remain;
-
     return 0;
 }
 
@@ -1603,30 +1842,34 @@ static int filter_process_stmt_match(filter_stmt_t *root, uint64_t *flags,
     size_t re_match_num = STATIC_ARRAY_SIZE(re_match);
     regoff_t str_len = 0;
     char *str = NULL;
+    const char *value = NULL;
 
     if (root->type == FILTER_STMT_TYPE_METRIC_MATCH) {
-        if (regexec(root->stmt_match.regex, fam->name, re_match_num, re_match, 0) != 0)
-            return 0;
-        str = strdup(fam->name);
-        if (str == NULL) {
-            ERROR("strdup failed.");
-            return -1;
-        }
-        str_len = strlen(str);
+        value = fam->name;
     } else if (root->type == FILTER_STMT_TYPE_LABEL_VALUE_MATCH) {
         label_pair_t *pair = label_set_read(m->label, root->stmt_match.label);
         if (pair == NULL)
             return 0;
-        if (regexec(root->stmt_match.regex, pair->value, re_match_num, re_match, 0) != 0)
+        value = pair->value;
+    } else {
+        return 0;
+    }
+
+    /* Without references to the submatches in the statements the regex is
+     * only needed for the matchers that are not a literal string. */
+    if (!root->stmt_match.capture) {
+        if (!strmatch_exec(root->stmt_match.regex, value))
+            return 0;
+        re_match_num = 0;
+    } else {
+        if (strmatch_regexec(root->stmt_match.regex, value, re_match_num, re_match, 0) != 0)
             return 0;
-        str = strdup(pair->value);
+        str = strdup(value);
         if (str == NULL) {
             ERROR("strdup failed.");
             return -1;
         }
         str_len = strlen(str);
-    } else {
-        return 0;
     }
 
     filter_stmt_t *stmt = root->stmt_match.stmt;
@@ -1655,268 +1898,426 @@ static int filter_process_stmt_match(filter_stmt_t *root, uint64_t *flags,
     return 0;
 }
 
-filter_result_t filter_process_stmt(filter_stmt_t *stmt, uint64_t *flags,
-                                                         metric_family_t *fam, metric_t *m)
+static void filter_process_stmt(filter_stmt_t *stmt, uint64_t *flags,
+                                                    metric_family_t *fam, metric_t *m)
 {
-    if ((fam == NULL) || (m == NULL))
-        return FILTER_RESULT_CONTINUE;
-
-    filter_result_t result = FILTER_RESULT_CONTINUE;
-
-    while (stmt != NULL) {
-        switch(stmt->type) {
-        case FILTER_STMT_TYPE_IF:
-        case FILTER_STMT_TYPE_UNLESS: {
-            bool match = metric_match_cmp(&stmt->stmt_if.match, fam->name, &m->label);
-            if (stmt->type == FILTER_STMT_TYPE_UNLESS)
-                match = !match;
-            if (match) {
-                result = filter_process_stmt(stmt->stmt_if.stmt, flags, fam, m);
-                if (result != FILTER_RESULT_CONTINUE)
-                    return result;
-            } else {
-                filter_stmt_t *next = stmt->stmt_if.next;
-                while (next != NULL) {
-                    if (next->type == FILTER_STMT_TYPE_ELIF) {
-                        if (metric_match_cmp(&next->stmt_if.match, fam->name, &m->label)) {
-                            result = filter_process_stmt(next->stmt_if.stmt, flags, fam, m);
-                            if (result != FILTER_RESULT_CONTINUE)
-                                return result;
-                            break;
+    switch(stmt->type) {
+    case FILTER_STMT_TYPE_IF:
+    case FILTER_STMT_TYPE_ELIF:
+    case FILTER_STMT_TYPE_ELSE:
+    case FILTER_STMT_TYPE_UNLESS:
+    case FILTER_STMT_TYPE_DROP:
+    case FILTER_STMT_TYPE_STOP:
+    case FILTER_STMT_TYPE_RETURN:
+    case FILTER_STMT_TYPE_CALL:
+        break;
+    case FILTER_STMT_TYPE_WRITE:
+        filter_write(stmt, fam, m);
+        break;
+    case FILTER_STMT_TYPE_SCALE:
+        filter_scale(stmt, fam, m);
+        break;
+    case FILTER_STMT_TYPE_SHIFT:
+        filter_shift(stmt, fam, m);
+        break;
+    case FILTER_STMT_TYPE_METRIC_RENAME:
+        filter_stmt_metric_rename(stmt, NULL, 0, NULL, 0, flags, fam, m);
+        break;
+    case FILTER_STMT_TYPE_LABEL_SET:
+        filter_stmt_label_set(stmt, NULL, 0, NULL, 0, fam, m);
+        break;
+    case FILTER_STMT_TYPE_LABEL_UNSET:
+        label_set_add(&m->label, true, stmt->stmt_label_unset.label, NULL);
+        break;
+    case FILTER_STMT_TYPE_LABEL_RENAME:
+        filter_stmt_label_rename(stmt, NULL, 0, NULL, 0, fam, m);
+        break;
+    case FILTER_STMT_TYPE_LABEL_ALLOW:
+    case FILTER_STMT_TYPE_LABEL_IGNORE:
+        filter_list_labels(&stmt->stmt_list, stmt->type, &m->label);
+        break;
+    case FILTER_STMT_TYPE_METRIC_SUB:
+    case FILTER_STMT_TYPE_METRIC_GSUB: {
+        bool global = stmt->type == FILTER_STMT_TYPE_METRIC_GSUB ? true : false;
+        strbuf_t buf = STRBUF_CREATE;
+        int status = filter_sub(stmt->stmt_sub.regex, &buf, fam->name,
+                                &stmt->stmt_sub.replace, fam->name, &m->label, global);
+        if (status > 0) {
+            if (buf.ptr != NULL) {
+                char *metric_name = strdup(buf.ptr);
+                if (metric_name != NULL) {
+                    if (*flags & FILTER_FAM_METRIC_ALLOC)
+                        free(fam->name);
+                    fam->name = metric_name;
+                    *flags |= FILTER_FAM_METRIC_ALLOC;
+                }
+            }
+        }
+        strbuf_destroy(&buf);
+    }   break;
+    case FILTER_STMT_TYPE_LABEL_SUB:
+    case FILTER_STMT_TYPE_LABEL_GSUB: {
+        bool global = stmt->type == FILTER_STMT_TYPE_LABEL_GSUB ? true : false;
+        strbuf_t buf = STRBUF_CREATE;
+        for(size_t i = 0; i < m->label.num; i++) {
+            char *name = m->label.ptr[i].name;
+            int status = filter_sub(stmt->stmt_sub.regex, &buf, name,
+                                    &stmt->stmt_sub.replace, fam->name, &m->label, global);
+            if (status > 0) {
+                if (buf.ptr != NULL) {
+                    label_pair_t *pair = label_set_read(m->label, buf.ptr);
+                    if (pair == NULL) {
+                        char *new_name = strintern_dup(buf.ptr);
+                        if (new_name != NULL) {
+                            strintern_free(m->label.ptr[i].name);
+                            m->label.ptr[i].name = new_name;
+                            label_set_qsort(&m->label);
                         }
-                    } else if (next->type == FILTER_STMT_TYPE_ELSE) {
-                        result = filter_process_stmt(next->stmt_if.stmt, flags, fam, m);
-                        if (result != FILTER_RESULT_CONTINUE)
-                            return result;
-                        break;
                     }
-                    next = next->next;
                 }
             }
-        }   break;
-        case FILTER_STMT_TYPE_ELIF:
-            break;
-        case FILTER_STMT_TYPE_ELSE:
-            break;
-        case FILTER_STMT_TYPE_DROP:
-            return FILTER_RESULT_DROP;
-            break;
-        case FILTER_STMT_TYPE_STOP:
-            return FILTER_RESULT_STOP;
-            break;
-        case FILTER_STMT_TYPE_RETURN:
-            return FILTER_RESULT_RETURN;
-            break;
-        case FILTER_STMT_TYPE_CALL:
-            result = filter_process_stmt(stmt->stmt_call.filter->ptr, flags, fam, m);
-            if ((result == FILTER_RESULT_DROP) || (result == FILTER_RESULT_STOP))
-                return result;
-            break;
-        case FILTER_STMT_TYPE_WRITE:
-            filter_write(stmt, fam, m);
-            break;
-        case FILTER_STMT_TYPE_SCALE:
-            filter_scale(stmt, fam, m);
-            break;
-        case FILTER_STMT_TYPE_SHIFT:
-            filter_shift(stmt, fam, m);
-            break;
-        case FILTER_STMT_TYPE_METRIC_RENAME:
-            filter_stmt_metric_rename(stmt, NULL, 0, NULL, 0, flags, fam, m);
-            break;
-        case FILTER_STMT_TYPE_LABEL_SET:
-            filter_stmt_label_set(stmt, NULL, 0, NULL, 0, fam, m);
-            break;
-        case FILTER_STMT_TYPE_LABEL_UNSET:
-            label_set_add(&m->label, true, stmt->stmt_label_unset.label, NULL);
-            break;
-        case FILTER_STMT_TYPE_LABEL_RENAME:
-            filter_stmt_label_rename(stmt, NULL, 0, NULL, 0, fam, m);
-            break;
-        case FILTER_STMT_TYPE_LABEL_ALLOW:
-        case FILTER_STMT_TYPE_LABEL_IGNORE:
-            filter_list_labels(&stmt->stmt_list, stmt->type, &m->label);
-            break;
-        case FILTER_STMT_TYPE_METRIC_SUB:
-        case FILTER_STMT_TYPE_METRIC_GSUB: {
-            bool global = stmt->type == FILTER_STMT_TYPE_METRIC_GSUB ? true : false;
-            strbuf_t buf = STRBUF_CREATE;
-            int status = filter_sub(stmt->stmt_sub.regex, &buf, fam->name,
+            strbuf_reset(&buf);
+        }
+        strbuf_destroy(&buf);
+    }   break;
+    case FILTER_STMT_TYPE_LABEL_VALUE_SUB:
+    case FILTER_STMT_TYPE_LABEL_VALUE_GSUB: {
+        bool global = stmt->type == FILTER_STMT_TYPE_LABEL_VALUE_GSUB ? true : false;
+        strbuf_t buf = STRBUF_CREATE;
+        label_pair_t *pair = label_set_read(m->label, stmt->stmt_sub.label);
+        if (pair != NULL) {
+            int status = filter_sub(stmt->stmt_sub.regex, &buf, pair->value,
                                     &stmt->stmt_sub.replace, fam->name, &m->label, global);
             if (status > 0) {
                 if (buf.ptr != NULL) {
-                    char *metric_name = strdup(buf.ptr);
-                    if (metric_name != NULL) {
-                        if (*flags & FILTER_FAM_METRIC_ALLOC)
-                            free(fam->name);
-                        fam->name = metric_name;
-                        *flags |= FILTER_FAM_METRIC_ALLOC;
+                    char *new_value = strintern_dup(buf.ptr);
+                    if (new_value != NULL) {
+                        strintern_free(pair->value);
+                        pair->value = new_value;
                     }
                 }
             }
-            strbuf_destroy(&buf);
+        }
+        strbuf_destroy(&buf);
+    }   break;
+    case FILTER_STMT_TYPE_METRIC_MATCH:
+    case FILTER_STMT_TYPE_LABEL_VALUE_MATCH:
+        filter_process_stmt_match(stmt, flags, fam, m);
+        break;
+    }
+}
+
+static filter_result_t filter_process_insn(plugin_filter_t *filter, filter_exec_t *exec,
+                                           uint8_t *cache, uint64_t *flags,
+                                           metric_family_t *fam, metric_t *m)
+{
+    size_t pc = 0;
+
+    while (pc < filter->insn_num) {
+        filter_insn_t *insn = &filter->insn[pc];
+        pc++;
+
+        switch (insn->op) {
+        case FILTER_OP_MATCH:
+        case FILTER_OP_NMATCH: {
+            metric_match_t *match = &insn->stmt->stmt_if.match;
+            bool result = true;
+            if ((insn->cache > 0) && (cache != NULL) && (fam->name == exec->name)) {
+                uint8_t *decision = &cache[insn->cache - 1];
+                if (*decision == FILTER_CACHE_UNKNOWN)
+                    *decision = metric_match_cmp(match, fam->name, NULL) ? FILTER_CACHE_TRUE
+                                                                         : FILTER_CACHE_FALSE;
+                result = *decision == FILTER_CACHE_TRUE;
+            } else {
+                result = metric_match_cmp(match, fam->name, NULL);
+            }
+            if (result)
+                result = metric_match_cmp(match, NULL, &m->label);
+            if (insn->op == FILTER_OP_NMATCH)
+                result = !result;
+            if (!result)
+                pc = insn->jump;
         }   break;
-        case FILTER_STMT_TYPE_LABEL_SUB:
-        case FILTER_STMT_TYPE_LABEL_GSUB: {
-            bool global = stmt->type == FILTER_STMT_TYPE_LABEL_GSUB ? true : false;
-            strbuf_t buf = STRBUF_CREATE;
-            for(size_t i = 0; i < m->label.num; i++) {
-                char *name = m->label.ptr[i].name;
-                int status = filter_sub(stmt->stmt_sub.regex, &buf, name,
-                                        &stmt->stmt_sub.replace, fam->name, &m->label, global);
-                if (status > 0) {
-                    if (buf.ptr != NULL) {
-                        label_pair_t *pair = label_set_read(m->label, buf.ptr);
-                        if (pair == NULL) {
-                            char *new_name = strdup(buf.ptr);
-                            if (new_name != NULL) {
-                                free(m->label.ptr[i].name);
-                                m->label.ptr[i].name = new_name;
-                                label_set_qsort(&m->label);
-                            }
-                        }
-                    }
-                }
-                strbuf_reset(&buf);
+        case FILTER_OP_JUMP:
+            pc = insn->jump;
+            break;
+        case FILTER_OP_CALL: {
+            plugin_filter_t *call = insn->stmt->stmt_call.filter;
+            uint8_t *call_cache = NULL;
+            /* The called filter can have more statements appended after this
+             * one was compiled, then it runs without the decision cache. */
+            if ((cache != NULL) && (call->cache_num <= insn->cache_num))
+                call_cache = cache + insn->cache;
+            filter_result_t result = filter_process_insn(call, exec, call_cache, flags, fam, m);
+            if ((result == FILTER_RESULT_DROP) || (result == FILTER_RESULT_STOP))
+                return result;
+        }   break;
+        case FILTER_OP_DROP:
+            return FILTER_RESULT_DROP;
+        case FILTER_OP_STOP:
+            return FILTER_RESULT_STOP;
+        case FILTER_OP_RETURN:
+            return FILTER_RESULT_RETURN;
+        case FILTER_OP_STMT:
+            filter_process_stmt(insn->stmt, flags, fam, m);
+            break;
+        }
+    }
+
+    return FILTER_RESULT_CONTINUE;
+}
+
+/* Run the filter for all the metrics of the family at once, it stops without
+ * result when the path of the filter reaches an instruction that depends on
+ * the labels or values of the metrics. */
+static bool filter_process_insn_family(plugin_filter_t *filter, filter_exec_t *exec,
+                                       uint8_t *cache, uint64_t *flags,
+                                       metric_family_t *fam, filter_result_t *result)
+{
+    metric_t m = {0};
+    size_t pc = 0;
+
+    while (pc < filter->insn_num) {
+        filter_insn_t *insn = &filter->insn[pc];
+        pc++;
+
+        if (!insn->family)
+            return false;
+
+        switch (insn->op) {
+        case FILTER_OP_MATCH:
+        case FILTER_OP_NMATCH: {
+            metric_match_t *match = &insn->stmt->stmt_if.match;
+            bool matched = true;
+            if ((insn->cache > 0) && (cache != NULL) && (fam->name == exec->name)) {
+                uint8_t *decision = &cache[insn->cache - 1];
+                if (*decision == FILTER_CACHE_UNKNOWN)
+                    *decision = metric_match_cmp(match, fam->name, NULL) ? FILTER_CACHE_TRUE
+                                                                         : FILTER_CACHE_FALSE;
+                matched = *decision == FILTER_CACHE_TRUE;
+            } else {
+                matched = metric_match_cmp(match, fam->name, NULL);
             }
-            strbuf_destroy(&buf);
+            if (insn->op == FILTER_OP_NMATCH)
+                matched = !matched;
+            if (!matched)
+                pc = insn->jump;
         }   break;
-        case FILTER_STMT_TYPE_LABEL_VALUE_SUB:
-        case FILTER_STMT_TYPE_LABEL_VALUE_GSUB: {
-            bool global = stmt->type == FILTER_STMT_TYPE_LABEL_VALUE_GSUB ? true : false;
-            strbuf_t buf = STRBUF_CREATE;
-            label_pair_t *pair = label_set_read(m->label, stmt->stmt_sub.label);
-            if (pair != NULL) {
-                int status = filter_sub(stmt->stmt_sub.regex, &buf, pair->value,
-                                        &stmt->stmt_sub.replace, fam->name, &m->label, global);
-                if (status > 0) {
-                    if (buf.ptr != NULL) {
-                        char *new_value = strdup(buf.ptr);
-                        if (new_value != NULL) {
-                            free(pair->value);
-                            pair->value = new_value;
-                        }
-                    }
-                }
+        case FILTER_OP_JUMP:
+            pc = insn->jump;
+            break;
+        case FILTER_OP_CALL: {
+            plugin_filter_t *call = insn->stmt->stmt_call.filter;
+            uint8_t *call_cache = NULL;
+            if ((cache != NULL) && (call->cache_num <= insn->cache_num))
+                call_cache = cache + insn->cache;
+            filter_result_t call_result = FILTER_RESULT_CONTINUE;
+            if (!filter_process_insn_family(call, exec, call_cache, flags, fam, &call_result))
+                return false;
+            if ((call_result == FILTER_RESULT_DROP) || (call_result == FILTER_RESULT_STOP)) {
+                *result = call_result;
+                return true;
             }
-            strbuf_destroy(&buf);
         }   break;
-        case FILTER_STMT_TYPE_METRIC_MATCH:
-        case FILTER_STMT_TYPE_LABEL_VALUE_MATCH:
-            filter_process_stmt_match(stmt, flags, fam, m);
+        case FILTER_OP_DROP:
+            *result = FILTER_RESULT_DROP;
+            return true;
+        case FILTER_OP_STOP:
+            *result = FILTER_RESULT_STOP;
+            return true;
+        case FILTER_OP_RETURN:
+            *result = FILTER_RESULT_RETURN;
+            return true;
+        case FILTER_OP_STMT:
+            filter_process_stmt(insn->stmt, flags, fam, &m);
             break;
         }
-        stmt = stmt->next;
     }
 
-    return result;
+    *result = FILTER_RESULT_CONTINUE;
+    return true;
 }
 
-int filter_process(plugin_filter_t *filter, metric_family_list_t *faml)
+/* The families of the list that are not processed yet are skipped, so the
+ * metrics renamed to them are not processed twice. */
+static metric_family_t *filter_family_find(metric_family_list_t *faml, const char *name,
+                                           size_t n, size_t num)
 {
-    if ((filter == NULL) || (faml == NULL))
-        return -1;
+    for (size_t i = 0; i < faml->pos; i++) {
+        if ((i > n) && (i < num))
+            continue;
+        if (strcmp(name, faml->ptr[i]->name) == 0)
+            return faml->ptr[i];
+    }
 
-    if ((faml->pos != 1) || (faml->ptr == NULL))
-        return -1;
+    return NULL;
+}
 
-    metric_family_t *fam = faml->ptr[0];
+static metric_family_t *filter_family_get(metric_family_list_t *faml, size_t n, size_t num,
+                                          char *name, uint64_t flags, metric_family_t *fam)
+{
+    metric_family_t *found = filter_family_find(faml, name, n, num);
+    if (found != NULL) {
+        if (flags & FILTER_FAM_METRIC_ALLOC)
+            free(name);
+        return found;
+    }
 
-    size_t remain = 0;
+    metric_family_t *new_fam = calloc(1, sizeof(*new_fam));
+    if (new_fam == NULL) {
+        ERROR("calloc failed.");
+        if (flags & FILTER_FAM_METRIC_ALLOC)
+            free(name);
+        return NULL;
+    }
 
-    for (size_t i = 0; i < fam->metric.num; i++) {
-        metric_family_t sfam  = {
-            .name = fam->name,
-            .help = NULL,
-            .unit = NULL,
-            .type = fam->type,
-        };
-        uint64_t flags = 0;
-
-        filter_result_t result = filter_process_stmt(filter->ptr, &flags, &sfam,
-                                                                  &fam->metric.ptr[i]);
+    if (flags & FILTER_FAM_METRIC_ALLOC) {
+        new_fam->name = name;
+    } else {
+        new_fam->name = strdup(name);
+        if (new_fam->name == NULL) {
+            ERROR("strdup failed.");
+            free(new_fam);
+            return NULL;
+        }
+    }
+
+    new_fam->type = fam->type;
+
+    if (metric_family_list_append(faml, new_fam) != 0) {
+        ERROR("Too many metric families in the list.");
+        free(new_fam->name);
+        free(new_fam);
+        return NULL;
+    }
+
+    return new_fam;
+}
+
+static void filter_process_family(plugin_filter_t *filter, filter_exec_t *exec,
+                                  metric_family_list_t *faml, size_t n, size_t num)
+{
+    metric_family_t *fam = faml->ptr[n];
+
+    if (fam->metric.num == 0)
+        return;
+
+    exec->name = fam->name;
+    if (exec->cache != NULL)
+        memset(exec->cache, 0, filter->cache_num * sizeof(*exec->cache));
+
+    metric_family_t sfam  = {
+        .name = fam->name,
+        .help = NULL,
+        .unit = NULL,
+        .type = fam->type,
+    };
+    uint64_t flags = 0;
+    filter_result_t result = FILTER_RESULT_CONTINUE;
+
+    if (filter_process_insn_family(filter, exec, exec->cache, &flags, &sfam, &result)) {
         if (result == FILTER_RESULT_DROP) {
-            metric_reset(&fam->metric.ptr[i], fam->type);
-            continue;
+            if (flags & FILTER_FAM_METRIC_ALLOC)
+                free(sfam.name);
+            metric_family_metric_reset(fam);
+            return;
         }
 
-        if (flags) {
-            metric_family_t *new_fam = NULL;
-            size_t j = 0;
-            for (j = 0; j < faml->pos; j++) {
-                if (strcmp(sfam.name, faml->ptr[j]->name ) == 0) {
-                    new_fam = faml->ptr[j];
-                    break;
+        if ((flags == 0) || (strcmp(sfam.name, fam->name) == 0)) {
+            if (flags & FILTER_FAM_METRIC_ALLOC)
+                free(sfam.name);
+            return;
+        }
+
+        /* The whole family is renamed in place when there is not another
+         * family with the new name to merge with. */
+        if (filter_family_find(faml, sfam.name, n, num) == NULL) {
+            char *name = sfam.name;
+            if (!(flags & FILTER_FAM_METRIC_ALLOC)) {
+                name = strdup(sfam.name);
+                if (name == NULL) {
+                    ERROR("strdup failed.");
+                    return;
                 }
             }
+            free(fam->name);
+            fam->name = name;
+            return;
+        }
 
-            if ((j == 0) && (new_fam != NULL)) {
-                if (flags & FILTER_FAM_METRIC_ALLOC)
-                    free(sfam.name);
-                remain++;
-                continue;
-            }
+        metric_family_t *new_fam = filter_family_get(faml, n, num, sfam.name, flags, fam);
+        if (new_fam == NULL)
+            return;
 
-            if (new_fam == NULL) {
-                new_fam = calloc(1, sizeof(*new_fam));
-                if (new_fam == NULL) {
-                    ERROR("calloc failed.");
-                    continue;
-                }
+        for (size_t i = 0; i < fam->metric.num; i++)
+            metric_list_append(&new_fam->metric, fam->metric.ptr[i]);
 
-                if (flags & FILTER_FAM_METRIC_ALLOC) {
-                    new_fam->name = sfam.name;
-                } else {
-                    new_fam->name = strdup(sfam.name);
-                    if (new_fam->name == NULL) {
-                        ERROR("strdup failed.");
-                        free(new_fam);
-                        continue;
-                    }
-                }
+        free(fam->metric.ptr);
+        fam->metric.ptr = NULL;
+        fam->metric.num = 0;
+        return;
+    }
 
-                new_fam->type = fam->type;
+    if (flags & FILTER_FAM_METRIC_ALLOC)
+        free(sfam.name);
 
-                metric_family_list_append(faml, new_fam);
-            } else {
-                if (flags & FILTER_FAM_METRIC_ALLOC)
-                    free(sfam.name);
-            }
+    size_t remain = 0;
 
-            metric_list_append(&new_fam->metric, fam->metric.ptr[i]);
-            memset(&fam->metric.ptr[i], 0, sizeof(fam->metric.ptr[i]));
+    for (size_t i = 0; i < fam->metric.num; i++) {
+        sfam.name = fam->name;
+        flags = 0;
 
-        } else {
-            remain++;
+        result = filter_process_insn(filter, exec, exec->cache, &flags, &sfam,
+                                     &fam->metric.ptr[i]);
+        if (result == FILTER_RESULT_DROP) {
+            if (flags & FILTER_FAM_METRIC_ALLOC)
+                free(sfam.name);
+            metric_reset(&fam->metric.ptr[i], fam->type);
+            continue;
+        }
+
+        if (flags && (strcmp(sfam.name, fam->name) != 0)) {
+            metric_family_t *new_fam = filter_family_get(faml, n, num, sfam.name, flags, fam);
+            if (new_fam != NULL) {
+                metric_list_append(&new_fam->metric, fam->metric.ptr[i]);
+                continue;
+            }
+        } else if (flags & FILTER_FAM_METRIC_ALLOC) {
+            free(sfam.name);
         }
+
+        if (remain != i)
+            fam->metric.ptr[remain] = fam->metric.ptr[i];
+        remain++;
     }
 
+    fam->metric.num = remain;
     if (remain == 0) {
         free(fam->metric.ptr);
         fam->metric.ptr = NULL;
-        fam->metric.num = 0;
     }
+}
 
-    if ((faml->pos == 1) && ((remain == fam->metric.num) || (remain == 0)))
-        return 0;
+int filter_process(plugin_filter_t *filter, metric_family_list_t *faml)
+{
+    if ((filter == NULL) || (faml == NULL))
+        return -1;
 
-    if ((remain > 0) && (remain != fam->metric.num)) {
-        metric_t *metric = calloc(remain, sizeof(*metric));
-        size_t n = 0;
-        for (size_t i = 0; i < fam->metric.num; i++) {
-            if (fam->metric.ptr[i].time != 0) {
-                metric[n].value = fam->metric.ptr[i].value;
-                metric[n].time = fam->metric.ptr[i].time;
-                metric[n].interval = fam->metric.ptr[i].interval;
-                metric[n].label = fam->metric.ptr[i].label;
-                n++;
-            }
-        }
+    if ((faml->pos == 0) || (faml->ptr == NULL))
+        return -1;
 
-        free(fam->metric.ptr);
-        fam->metric.ptr = metric;
-        fam->metric.num = n;
+    filter_exec_t exec = { .name = NULL, .cache = NULL };
+    if (filter->cache_num > 0)
+        exec.cache = calloc(filter->cache_num, sizeof(*exec.cache));
+
+    /* The families appended by the renames are not processed again. */
+    size_t num = faml->pos;
+    for (size_t i = 0; i < num; i++) {
+        if (faml->ptr[i] != NULL)
+            filter_process_family(filter, &exec, faml, i, num);
     }
 
+    free(exec.cache);
+
     return 0;
 }
@@ -117,10 +117,123 @@ typedef struct {
     char *value;
 } http_query_t;
 
-int http_query_split(__attribute__((unused)) char *string,
-                     __attribute__((unused)) http_query_t *fields,
-                     __attribute__((unused)) size_t size)
+static void http_query_decode(char *str)
 {
+    char *dst = str;
+    for (char *src = str; *src != '\0'; src++) {
+        if (*src == '+') {
+            *dst++ = ' ';
+        } else if ((src[0] == '%') && isxdigit((unsigned char)src[1]) &&
+                                      isxdigit((unsigned char)src[2])) {
+            char hex[3] = {src[1], src[2], '\0'};
+            *dst++ = (char)strtol(hex, NULL, 16);
+            src += 2;
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+}
+
+int http_query_split(char *string, http_query_t *fields, size_t size)
+{
+    size_t i = 0;
+    char *ptr = string;
+    char *saveptr = NULL;
+    char *field = NULL;
+    while ((i < size) && ((field = strtok_r(ptr, "&", &saveptr)) != NULL)) {
+        ptr = NULL;
+
+        char *value = strchr(field, '=');
+        if (value != NULL) {
+            *value = '\0';
+            value++;
+        } else {
+            value = field + strlen(field);
+        }
+
+        http_query_decode(field);
+        http_query_decode(value);
+
+        fields[i].name = field;
+        fields[i].value = value;
+        i++;
+    }
+
+    return (int)i;
+}
+
+static char *http_query_get(http_query_t *fields, int num, const char *name)
+{
+    for (int i = 0; i < num; i++) {
+        if (strcmp(fields[i].name, name) == 0)
+            return fields[i].value;
+    }
+    return NULL;
+}
+
+static int http_query_get_time(http_query_t *fields, int num, const char *name, cdtime_t *ret)
+{
+    char *str = http_query_get(fields, num, name);
+    if ((str == NULL) || (*str == '\0'))
+        return -1;
+
+    char *endptr = NULL;
+    errno = 0;
+    double value = strtod(str, &endptr);
+    if ((errno != 0) || (endptr == str) || (*endptr != '\0') || (value < 0))
+        return -1;
+
+    *ret = DOUBLE_TO_CDTIME_T(value);
+    return 0;
+}
+
+static int handle_query_range(httpd_client_t *client, http_version_t http_version,
+                              strbuf_t *buf, char *query)
+{
+    if (query == NULL) {
+        httpd_response(client, http_version, HTTP_STATUS_400, NULL, NULL, 0);
+        return 0;
+    }
+
+    http_query_t fields[16];
+    int num = http_query_split(query, fields, STATIC_ARRAY_SIZE(fields));
+
+    char *expr = http_query_get(fields, num, "query");
+    cdtime_t start = 0;
+    cdtime_t end = 0;
+    cdtime_t step = 0;
+    if ((expr == NULL) ||
+        (http_query_get_time(fields, num, "start", &start) != 0) ||
+        (http_query_get_time(fields, num, "end", &end) != 0) ||
+        (http_query_get_time(fields, num, "step", &step) != 0) ||
+        (step == 0) || (end < start) ||
+        (((end - start) / step) > MDB_QUERY_RANGE_MAX_STEPS)) {
+        httpd_response(client, http_version, HTTP_STATUS_400, NULL, NULL, 0);
+        return 0;
+    }
+
+    mdb_series_list_t *list = mdb_query_range(mdb, expr, start, end, step);
+    if (list == NULL) {
+        httpd_response(client, http_version, HTTP_STATUS_400, NULL, NULL, 0);
+        return 0;
+    }
+
+    int status = strbuf_putstr(buf, "{\"status\":\"success\",\"data\":"
+                                    "{\"resultType\":\"matrix\",\"result\":");
+    status |= mdb_series_list_points_to_json(list, buf, false);
+    status |= strbuf_putstr(buf, "}}");
+    mdb_series_list_free(list);
+    if (status != 0) {
+        httpd_response(client, http_version, HTTP_STATUS_500, NULL, NULL, 0);
+        return 0;
+    }
+
+    http_header_t headers[] = {
+        { .header_name = HTTP_HEADER_CONTENT_TYPE, .value = "application/json" }
+    };
+    http_header_set_t header_set = {.num = STATIC_ARRAY_SIZE(headers), .ptr = headers };
+    httpd_response(client, http_version, HTTP_STATUS_200, &header_set, buf->ptr, strbuf_len(buf));
 
     return 0;
 }
@@ -163,14 +276,18 @@ static int httpd_request(httpd_client_t *client,
         }
     }
 
-#if 0
-    char *query = strchr(path, '?');
+    char *xpath = sstrndup(path, path_len);
+    if (xpath == NULL) {
+        httpd_response(client, http_version, HTTP_STATUS_500, NULL, NULL, 0);
+        return 0;
+    }
+
+    char *query = strchr(xpath, '?');
     if (query != NULL) {
         *query = '\0';
         query++;
     }
-#endif
-    char *xpath = sstrndup(path, path_len);
+
 fprintf(stderr, "httpd_request : %s\n", xpath);
     char *pfields[8];
     int npfields = http_path_split(xpath, pfields, STATIC_ARRAY_SIZE(pfields));
@@ -348,7 +465,21 @@ fprintf(stderr, "httpd_request:  write: %d\n",(int)content_length);
         break;
     case 11:
         if (strcmp(pfields[2], "query_range") == 0) {
+            char *form = NULL;
+            if (http_method == HTTP_METHOD_POST) {
+                form = sstrndup(content, content_length);
+                if (form == NULL)
+                    goto error_500;
+                query = form;
+            } else if (http_method != HTTP_METHOD_GET) {
+                goto error_501;
+            }
 
+            status = handle_query_range(client, http_version, &buf, query);
+            free(form);
+            free(xpath);
+            strbuf_destroy(&buf);
+            return status;
         }
         break;
     case 12:
@@ -4,14 +4,19 @@
 
 /* From https://github.com/omniti-labs/jlog */
 
+/* _GNU_SOURCE is needed in Linux to use fallocate */
+#define _GNU_SOURCE
+
 #include "ncollectd.h"
 #include "plugin_internal.h"
 #include "libutils/avltree.h"
 #include "libcompress/lz4.h"
+#include "libmdb/crc32c.h"
 
 #include <sys/uio.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <fcntl.h>
 // #include <assert.h>
 
 #include "journal.h"
@@ -39,9 +44,17 @@ static journal_ctx_t *journal_ctx_new(journal_t *j);
 #define IFS_CH '/'
 
 #define BUFFERED_INDICES 1024
+#define JOURNAL_WRITE_BATCH 64
+#define JOURNAL_READ_BATCH 256
+#define JOURNAL_STAGE_SIZE_MAX (4*1024*1024)
+#define JOURNAL_RECLAIM_INTERVAL TIME_T_TO_CDTIME_T(10)
 #define PRE_COMMIT_BUFFER_SIZE_DEFAULT 0
 #define IS_COMPRESS_MAGIC_HDR(hdr) ((hdr & DEFAULT_HDR_MAGIC_COMPRESSION) == DEFAULT_HDR_MAGIC_COMPRESSION)
 #define IS_COMPRESS_MAGIC(ctx) IS_COMPRESS_MAGIC_HDR((ctx)->meta->hdr_magic)
+/* Flag of the header magic in the metastore: the reserved field of the message
+ * headers holds the crc32c of the message instead of the magic. */
+#define JOURNAL_HDR_CHECKSUM 0x80
+#define IS_CHECKSUM_MAGIC(ctx) (((ctx)->meta->hdr_magic & JOURNAL_HDR_CHECKSUM) != 0)
 
 static const char journal_hexchars[] = "0123456789abcdef";
 
@@ -172,6 +185,8 @@ const char *journal_err_string(int err)
         return "JOURNAL_ERR_NOT_SUPPORTED";
     case JOURNAL_ERR_CLOSE_LOGID:
         return "JOURNAL_ERR_CLOSE_LOGID";
+    case JOURNAL_ERR_CHECKSUM:
+        return "JOURNAL_ERR_CHECKSUM";
     default:
         return "Unknown";
     }
@@ -510,6 +525,73 @@ static int journal_file_truncate(journal_file_t *f, off_t len)
     return 0;
 }
 
+/* Reserve len bytes for the file without changing its size, so a segment is
+ * allocated in one extent instead of growing with each append. */
+static int journal_file_preallocate(__attribute__((unused)) journal_file_t *f,
+                                    __attribute__((unused)) off_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    int rv;
+    while ((rv = fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, len)) == -1 && errno == EINTR);
+    if (rv == 0)
+        return 1;
+#endif
+    return 0;
+}
+
+/* crc32c of a message: the header after the reserved field and the payload as
+ * it is stored, compressed or not. */
+static uint32_t journal_message_crc(const journal_message_header_compressed_t *hdr,
+                                    size_t hdr_size, const void *data, size_t len)
+{
+    uint32_t crc = crc32c_update(CRC32C_INIT,
+                                 (const unsigned char *)hdr + sizeof(hdr->reserved),
+                                 hdr_size - sizeof(hdr->reserved));
+    return crc32c_update(crc, data, len);
+}
+
+/* Copy the header of the mapped message at rec and check its reserved field: the
+ * magic, or the crc32c of the message, that must end before end, in a journal
+ * with checksums. */
+static bool journal_mapped_message_valid(journal_ctx_t *ctx,
+                                         journal_message_header_compressed_t *hdr,
+                                         size_t hdr_size, const char *rec, const char *end)
+{
+    memcpy(hdr, rec, hdr_size);
+
+    if (!IS_CHECKSUM_MAGIC(ctx))
+        return hdr->reserved == ctx->meta->hdr_magic;
+
+    size_t len = IS_COMPRESS_MAGIC(ctx) ? hdr->compressed_len : hdr->mlen;
+    if (((size_t)(end - rec) < hdr_size) || ((size_t)(end - rec) - hdr_size < len))
+        return false;
+
+    return hdr->reserved == journal_message_crc(hdr, hdr_size, rec + hdr_size, len);
+}
+
+/* Check the crc32c of the message at off of the data file, the payload is read
+ * in chunks. */
+static bool journal_file_message_valid(journal_ctx_t *ctx,
+                                       const journal_message_header_compressed_t *hdr,
+                                       size_t hdr_size, off_t off)
+{
+    size_t len = IS_COMPRESS_MAGIC(ctx) ? hdr->compressed_len : hdr->mlen;
+    uint32_t crc = journal_message_crc(hdr, hdr_size, NULL, 0);
+    char buffer[16384];
+
+    off += hdr_size;
+    while (len > 0) {
+        size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (!journal_file_pread(ctx->data, buffer, n, off))
+            return false;
+        crc = crc32c_update(crc, (unsigned char *)buffer, n);
+        off += n;
+        len -= n;
+    }
+
+    return hdr->reserved == crc;
+}
+
 /* path is assumed to be MAXPATHLEN */
 static char *compute_checkpoint_filename(journal_t *j, const char *subscriber, char *name)
 {
@@ -992,7 +1074,13 @@ restart:
     }
 
     data_off = 0;
-    if ((data_len = journal_file_size(ctx->data)) == -1)
+    /* The writer holds the data lock while appending, so every message before
+     * data_len is complete. */
+    if (!journal_file_lock(ctx->data))
+        SYS_FAIL(JOURNAL_ERR_LOCK);
+    data_len = journal_file_size(ctx->data);
+    journal_file_unlock(ctx->data);
+    if (data_len == -1)
         SYS_FAIL(JOURNAL_ERR_FILE_SEEK);
 
     if (data_len == 0 && log < ctx->meta->storage_log) {
@@ -1048,12 +1136,16 @@ restart:
         off_t next_off = data_off;
         if (!journal_file_pread(ctx->data, &logmhdr, hdr_size, data_off))
             SYS_FAIL(JOURNAL_ERR_FILE_READ);
-        if (logmhdr.reserved != ctx->meta->hdr_magic) {
+        if (!IS_CHECKSUM_MAGIC(ctx) && (logmhdr.reserved != ctx->meta->hdr_magic)) {
             DEBUG("logmhdr.reserved == %"PRIu32".", logmhdr.reserved);
             SYS_FAIL(JOURNAL_ERR_FILE_CORRUPT);
         }
         if ((next_off += hdr_size + *message_disk_len) > data_len)
             break;
+        if (IS_CHECKSUM_MAGIC(ctx) && !journal_file_message_valid(ctx, &logmhdr, hdr_size, data_off)) {
+            DEBUG("checksum mismatch at %lu.", data_off);
+            SYS_FAIL(JOURNAL_ERR_FILE_CORRUPT);
+        }
 
         /* Write our new index offset */
         indices[i++] = data_off;
@@ -1196,15 +1288,13 @@ static int journal_repair_datafile(journal_ctx_t *ctx, uint32_t log)
         }
         if (next + hdr_size > mmap_end)
             goto error;
-        memcpy(&hdr, next, hdr_size);
-        if (hdr.reserved != ctx->meta->hdr_magic)
+        if (!journal_mapped_message_valid(ctx, &hdr, hdr_size, next, mmap_end))
             goto error;
         this = next;
         continue;
     error:
         for (next = this + hdr_size; next + hdr_size <= mmap_end; next++) {
-            memcpy(&hdr, next, hdr_size);
-            if (hdr.reserved == ctx->meta->hdr_magic) {
+            if (journal_mapped_message_valid(ctx, &hdr, hdr_size, next, mmap_end)) {
                 afternext = next + hdr_size + *message_disk_len;
                 if (afternext <= (char *)ctx->mmap_base)
                     continue;
@@ -1212,8 +1302,7 @@ static int journal_repair_datafile(journal_ctx_t *ctx, uint32_t log)
                     break;
                 if (afternext + hdr_size > mmap_end)
                     continue;
-                memcpy(&hdr, afternext, hdr_size);
-                if (hdr.reserved == ctx->meta->hdr_magic)
+                if (journal_mapped_message_valid(ctx, &hdr, hdr_size, afternext, mmap_end))
                     break;
             }
         }
@@ -1406,7 +1495,8 @@ static int new_checkpoint(char *ag, int fd, journal_id_t point)
 static int validate_metastore(const journal_meta_info_t *info, journal_meta_info_t *out)
 {
     int valid = 1;
-    if ((info->hdr_magic == DEFAULT_HDR_MAGIC) || (IS_COMPRESS_MAGIC_HDR(info->hdr_magic))) {
+    uint32_t magic = info->hdr_magic & ~JOURNAL_HDR_CHECKSUM;
+    if ((magic == DEFAULT_HDR_MAGIC) || (IS_COMPRESS_MAGIC_HDR(magic))) {
         if (out)
             out->hdr_magic = info->hdr_magic;
     } else {
@@ -1627,10 +1717,9 @@ static int journal_inspect_datafile(journal_ctx_t *ctx, uint32_t log)
     this = ctx->mmap_base;
     i = 0;
     while (this + hdr_size <= mmap_end) {
-        memcpy(&hdr, this, hdr_size);
         i++;
-        if (hdr.reserved != ctx->meta->hdr_magic) {
-            ERROR("Message %d at [%ld] has invalid reserved value %u.",
+        if (!journal_mapped_message_valid(ctx, &hdr, hdr_size, this, mmap_end)) {
+            ERROR("Message %d at [%ld] has invalid reserved value or checksum %u.",
                   i, (long int)(this - (char *)ctx->mmap_base), hdr.reserved);
             return 1;
         }
@@ -1917,15 +2006,103 @@ finish:
     return ctx->data;
 }
 
-int journal_ctx_write_message(journal_ctx_t *ctx, journal_message_t *mess, struct timeval *when)
+/* Size at which the writer starts a new segment, the configured segment size
+ * takes precedence over the unit limit stored in the metastore. */
+static off_t journal_segment_limit(journal_ctx_t *ctx)
 {
-    struct timeval now;
-    journal_message_header_compressed_t hdr;
-    off_t current_offset = 0;
-    size_t hdr_size = sizeof(journal_message_header_t);
+    if (ctx->journal->segment_size > 0)
+        return ctx->journal->segment_size;
+    return ctx->meta->unit_limit;
+}
 
-    if (IS_COMPRESS_MAGIC(ctx))
-        hdr_size = sizeof(journal_message_header_compressed_t);
+static void journal_reclaim_notify(journal_t *j)
+{
+    pthread_mutex_lock(&j->reclaim_lock);
+    if (j->reclaim_ctx != NULL) {
+        j->reclaim_pending = true;
+        pthread_cond_signal(&j->reclaim_cond);
+    }
+    pthread_mutex_unlock(&j->reclaim_lock);
+}
+
+/* Append num messages, each one described by a header and a payload iovec, with as
+ * few pwritev calls as possible. A new segment is started as soon as the current one
+ * reaches the segment limit. Must be called with write_lock held.
+ */
+static int journal_ctx_writev(journal_ctx_t *ctx, struct iovec *v, size_t num)
+{
+    off_t limit = journal_segment_limit(ctx);
+    size_t done = 0;
+
+    while (done < num) {
+        journal_open_writer(ctx);
+        if (!ctx->data) {
+            ctx->last_error = JOURNAL_ERR_FILE_OPEN;
+            ctx->last_errno = errno;
+            return -1;
+        }
+
+        if (!journal_file_lock(ctx->data)) {
+            ctx->last_error = JOURNAL_ERR_LOCK;
+            ctx->last_errno = errno;
+            return -1;
+        }
+
+        off_t current_offset = journal_file_size(ctx->data);
+        if (current_offset == -1) {
+            ctx->last_error = JOURNAL_ERR_FILE_SEEK;
+            ctx->last_errno = errno;
+            journal_file_unlock(ctx->data);
+            return -1;
+        }
+
+        if (current_offset == 0)
+            journal_file_preallocate(ctx->data, limit);
+
+        size_t n = 0;
+        size_t total_size = 0;
+        while ((done + n) < num) {
+            total_size += v[2*(done + n)].iov_len + v[2*(done + n) + 1].iov_len;
+            n++;
+            if (limit <= (current_offset + (off_t)total_size))
+                break;
+        }
+
+        if (!journal_file_pwritev_verify_return_value(ctx->data, v + 2*done, 2*n,
+                                                      current_offset, total_size)) {
+            ERROR("journal_file_pwritev failed in journal_ctx_writev");
+            ctx->last_error = JOURNAL_ERR_FILE_WRITE;
+            ctx->last_errno = errno;
+            journal_file_unlock(ctx->data);
+            return -1;
+        }
+        current_offset += total_size;
+        done += n;
+
+        journal_file_unlock(ctx->data);
+
+        if (limit <= current_offset) {
+            journal_close_writer(ctx);
+            journal_metastore_atomic_increment(ctx);
+            journal_reclaim_notify(ctx->journal);
+        }
+    }
+
+    return 0;
+}
+
+int journal_ctx_write_messages(journal_ctx_t *ctx, journal_message_t *mess, size_t num,
+                               struct timeval *when)
+{
+    struct timeval now;
+    journal_message_header_compressed_t hdr[JOURNAL_WRITE_BATCH];
+    struct iovec v[2*JOURNAL_WRITE_BATCH];
+    /* create a stack space to compress into which is large enough for most batches to compress into */
+    char compress_space[16384];
+    bool compress = IS_COMPRESS_MAGIC(ctx);
+    bool checksum = IS_CHECKSUM_MAGIC(ctx);
+    size_t hdr_size = compress ? sizeof(journal_message_header_compressed_t)
+                               : sizeof(journal_message_header_t);
 
     ctx->last_error = JOURNAL_ERR_SUCCESS;
     if (ctx->context_mode != JOURNAL_APPEND) {
@@ -1934,97 +2111,238 @@ int journal_ctx_write_message(journal_ctx_t *ctx, journal_message_t *mess, struc
         return -1;
     }
 
-    /* build the data we want to write outside of any lock */
-    hdr.reserved = ctx->meta->hdr_magic;
-    if (when) {
-        hdr.tv_sec = when->tv_sec;
-        hdr.tv_usec = when->tv_usec;
-    } else {
+    if (when == NULL) {
         gettimeofday(&now, NULL);
-        hdr.tv_sec = now.tv_sec;
-        hdr.tv_usec = now.tv_usec;
+        when = &now;
+    }
+
+    for (size_t i = 0; i < num; i += JOURNAL_WRITE_BATCH) {
+        size_t n = (num - i) < JOURNAL_WRITE_BATCH ? (num - i) : JOURNAL_WRITE_BATCH;
+
+        /* build the data we want to write outside of any lock */
+        char *compress_buffer = compress_space;
+        size_t compress_size = sizeof(compress_space);
+        if (compress) {
+            size_t required = 0;
+            for (size_t k = 0; k < n; k++)
+                required += LZ4_compressBound(mess[i+k].mess_len);
+            if (required > compress_size) {
+                compress_buffer = malloc(required);
+                if (compress_buffer == NULL) {
+                    ERROR("malloc failed in journal_ctx_write_messages");
+                    ctx->last_error = JOURNAL_ERR_FILE_WRITE;
+                    ctx->last_errno = ENOMEM;
+                    return -1;
+                }
+                compress_size = required;
+            }
+        }
+
+        size_t compress_offset = 0;
+        for (size_t k = 0; k < n; k++) {
+            journal_message_t *m = &mess[i+k];
+
+            hdr[k].reserved = ctx->meta->hdr_magic;
+            hdr[k].tv_sec = when->tv_sec;
+            hdr[k].tv_usec = when->tv_usec;
+            /* we store the original message size in the header */
+            hdr[k].mlen = m->mess_len;
+            hdr[k].compressed_len = 0;
+
+            v[2*k].iov_base = (void *)&hdr[k];
+            v[2*k].iov_len = hdr_size;
+
+            if (compress) {
+                char *dest = compress_buffer + compress_offset;
+                size_t compressed_len = compress_size - compress_offset;
+                if (journal_compress(m->mess, m->mess_len, &dest, &compressed_len) != 0) {
+                    ERROR("journal_compress failed in journal_ctx_write_messages");
+                    ctx->last_error = JOURNAL_ERR_FILE_WRITE;
+                    ctx->last_errno = 0;
+                    if (compress_buffer != compress_space)
+                        free(compress_buffer);
+                    return -1;
+                }
+                hdr[k].compressed_len = compressed_len;
+                v[2*k+1].iov_base = dest;
+                v[2*k+1].iov_len = compressed_len;
+                compress_offset += compressed_len;
+            } else {
+                v[2*k+1].iov_base = m->mess;
+                v[2*k+1].iov_len = m->mess_len;
+            }
+
+            if (checksum)
+                hdr[k].reserved = journal_message_crc(&hdr[k], hdr_size, v[2*k+1].iov_base,
+                                                      v[2*k+1].iov_len);
+        }
+
+        /* now grab the file lock and write to file */
+        /**
+         * this needs to be synchronized as concurrent writers can
+         * overwrite the shared ctx->data pointer as they move through
+         * individual file segments.
+         *
+         * Thread A-> open, write to existing segment,
+         * Thread B-> check open (already open)
+         * Thread A-> close and null out ctx->data pointer
+         * Thread B-> wha?!?
+         */
+        pthread_mutex_lock(&ctx->write_lock);
+        int status = journal_ctx_writev(ctx, v, n);
+        pthread_mutex_unlock(&ctx->write_lock);
+
+        if (compress_buffer != compress_space)
+            free(compress_buffer);
+
+        if (status != 0)
+            return -1;
     }
 
-    /* we store the original message size in the header */
-    hdr.mlen = mess->mess_len;
+    return 0;
+}
+
+int journal_ctx_write_message(journal_ctx_t *ctx, journal_message_t *mess, struct timeval *when)
+{
+    return journal_ctx_write_messages(ctx, mess, 1, when);
+}
 
-    struct iovec v[2];
-    v[0].iov_base = (void *) &hdr;
-    v[0].iov_len = hdr_size;
+static int journal_stage_append(journal_stage_t *stage, const void *data, size_t len)
+{
+    if ((stage->len + len) > stage->size) {
+        size_t size = stage->size == 0 ? 65536 : stage->size;
+        while (size < (stage->len + len))
+            size *= 2;
+        char *tmp = realloc(stage->data, size);
+        if (tmp == NULL)
+            return ENOMEM;
+        stage->data = tmp;
+        stage->size = size;
+    }
 
-    /* create a stack space to compress into which is large enough for most messages to compress into */
-    char compress_space[16384] = {0};
-    v[1].iov_base = compress_space;
-    size_t compressed_len = sizeof(compress_space);
+    if (stage->num == stage->alloc) {
+        size_t alloc = stage->alloc == 0 ? 256 : stage->alloc * 2;
+        uint32_t *tmp = realloc(stage->mlen, alloc * sizeof(*stage->mlen));
+        if (tmp == NULL)
+            return ENOMEM;
+        stage->mlen = tmp;
+        stage->alloc = alloc;
+    }
 
-    if (IS_COMPRESS_MAGIC(ctx)) {
-        if (journal_compress(mess->mess, mess->mess_len,
-                             (char **)&v[1].iov_base, &compressed_len) != 0) {
-            ERROR("journal_compress failed in journal_ctx_write_message");
-            SYS_FAIL(JOURNAL_ERR_FILE_WRITE);
+    memcpy(stage->data + stage->len, data, len);
+    stage->len += len;
+    stage->mlen[stage->num++] = len;
+
+    return 0;
+}
+
+/* Returns the number of staged messages written, the messages left after a write
+ * error are accounted as dropped messages of the journal. */
+static size_t journal_stage_flush(journal_ctx_t *ctx, journal_stage_t *stage)
+{
+    journal_message_t msgs[JOURNAL_WRITE_BATCH];
+    struct timeval now;
+    size_t offset = 0;
+    size_t written = 0;
+    size_t written_len = 0;
+
+    gettimeofday(&now, NULL);
+
+    for (size_t i = 0; i < stage->num; i += JOURNAL_WRITE_BATCH) {
+        size_t n = (stage->num - i) < JOURNAL_WRITE_BATCH ? (stage->num - i) : JOURNAL_WRITE_BATCH;
+        for (size_t k = 0; k < n; k++) {
+            msgs[k].mess = stage->data + offset;
+            msgs[k].mess_len = stage->mlen[i+k];
+            offset += stage->mlen[i+k];
         }
-        hdr.compressed_len = compressed_len;
-        v[1].iov_len = hdr.compressed_len;
-    } else {
-        v[1].iov_base = mess->mess;
-        v[1].iov_len = mess->mess_len;
-    }
-
-    size_t total_size = v[0].iov_len + v[1].iov_len;
-
-    /* now grab the file lock and write to file */
-    /**
-     * this needs to be synchronized as concurrent writers can
-     * overwrite the shared ctx->data pointer as they move through
-     * individual file segments.
-     *
-     * Thread A-> open, write to existing segment,
-     * Thread B-> check open (already open)
-     * Thread A-> close and null out ctx->data pointer
-     * Thread B-> wha?!?
-     */
-    pthread_mutex_lock(&ctx->write_lock);
 
-    journal_open_writer(ctx);
-    if (!ctx->data) {
-        ctx->last_error = JOURNAL_ERR_FILE_OPEN;
-        ctx->last_errno = errno;
-        pthread_mutex_unlock(&ctx->write_lock);
-        return -1;
+        if (journal_ctx_write_messages(ctx, msgs, n, &now) != 0)
+            break;
+
+        written += n;
+        written_len = offset;
     }
 
-    if (!journal_file_lock(ctx->data)) {
-        ctx->last_error = JOURNAL_ERR_LOCK;
-        ctx->last_errno = errno;
-        pthread_mutex_unlock(&ctx->write_lock);
-        return -1;
+    if (written < stage->num) {
+        size_t dropped = stage->num - written;
+        ERROR("journal '%s': dropped %zu staged messages after a write error.",
+              ctx->path, dropped);
+        if (ctx->journal != NULL) {
+            pthread_mutex_lock(&ctx->journal->reclaim_lock);
+            ctx->journal->dropped_messages += dropped;
+            ctx->journal->dropped_bytes += stage->len - written_len;
+            pthread_mutex_unlock(&ctx->journal->reclaim_lock);
+        }
     }
 
-    if ((current_offset = journal_file_size(ctx->data)) == -1)
-        SYS_FAIL(JOURNAL_ERR_FILE_SEEK);
+    stage->len = 0;
+    stage->num = 0;
+
+    return written;
+}
 
-    if (!journal_file_pwritev_verify_return_value(ctx->data, v, 2, current_offset, total_size)) {
-        ERROR("journal_file_pwritev failed in journal_ctx_write_message");
-        SYS_FAIL(JOURNAL_ERR_FILE_WRITE);
+static void journal_stage_free(journal_stage_t *stage)
+{
+    free(stage->data);
+    free(stage->mlen);
+    *stage = (journal_stage_t){0};
+}
+
+/* Group commit: the message is copied to the staging buffer of the context. If no
+ * other thread is flushing the caller becomes the flusher and writes everything
+ * staged with batched pwritev calls until the buffer is empty, otherwise the
+ * current flusher will write the message. Returns the number of messages written
+ * by the caller, 0 if the message was left to another thread or -1 if it cannot
+ * be staged. The messages lost on a write error are counted as dropped.
+ */
+int journal_ctx_write_staged(journal_ctx_t *ctx, const void *data, size_t len)
+{
+    if (ctx->context_mode != JOURNAL_APPEND) {
+        ctx->last_error = JOURNAL_ERR_ILLEGAL_WRITE;
+        ctx->last_errno = EPERM;
+        return -1;
     }
-    current_offset += total_size;;
 
-    if (IS_COMPRESS_MAGIC(ctx) && v[1].iov_base != compress_space)
-        free(v[1].iov_base);
+    pthread_mutex_lock(&ctx->stage_lock);
 
-    if (ctx->meta->unit_limit <= current_offset) {
-        journal_file_unlock(ctx->data);
-        journal_close_writer(ctx);
-        journal_metastore_atomic_increment(ctx);
-        pthread_mutex_unlock(&ctx->write_lock);
+    /* Do not let the staging buffer grow without bound while a flush is in progress. */
+    while (ctx->stage_flushing && (ctx->stage.len >= JOURNAL_STAGE_SIZE_MAX))
+        pthread_cond_wait(&ctx->stage_cond, &ctx->stage_lock);
+
+    int status = journal_stage_append(&ctx->stage, data, len);
+    if (status != 0) {
+        pthread_mutex_unlock(&ctx->stage_lock);
+        ERROR("journal_stage_append failed in journal_ctx_write_staged");
+        ctx->last_error = JOURNAL_ERR_FILE_WRITE;
+        ctx->last_errno = status;
+        return -1;
+    }
+
+    if (ctx->stage_flushing) {
+        pthread_mutex_unlock(&ctx->stage_lock);
         return 0;
     }
 
-finish:
-    journal_file_unlock(ctx->data);
-    pthread_mutex_unlock(&ctx->write_lock);
-    if (ctx->last_error == JOURNAL_ERR_SUCCESS) return 0;
-    return -1;
+    ctx->stage_flushing = true;
+
+    size_t written = 0;
+    while (ctx->stage.num > 0) {
+        journal_stage_t stage = ctx->stage;
+        ctx->stage = ctx->stage_flush;
+        ctx->stage_flush = stage;
+        pthread_cond_broadcast(&ctx->stage_cond);
+        pthread_mutex_unlock(&ctx->stage_lock);
+
+        written += journal_stage_flush(ctx, &ctx->stage_flush);
+
+        pthread_mutex_lock(&ctx->stage_lock);
+    }
+
+    ctx->stage_flushing = false;
+    pthread_cond_broadcast(&ctx->stage_cond);
+    pthread_mutex_unlock(&ctx->stage_lock);
+
+    return written > INT_MAX ? INT_MAX : (int)written;
 }
 
 int journal_ctx_write(journal_ctx_t *ctx, void *data, size_t len)
@@ -2250,6 +2568,9 @@ int journal_init(journal_t *j)
     }
 
     chmod(j->path, dirmode);
+
+    if (j->checksum)
+        j->meta.hdr_magic |= JOURNAL_HDR_CHECKSUM;
     // fassertxsetpath(ctx->path);
     /* Setup our initial state and store our instance metadata */
     if (journal_init_metastore(j) != 0) {
@@ -2271,6 +2592,10 @@ int journal_ctx_close(journal_ctx_t *ctx)
     free(ctx->path);
     free(ctx->compressed_data_buffer);
     free(ctx->mess_data);
+    journal_stage_free(&ctx->stage);
+    journal_stage_free(&ctx->stage_flush);
+    pthread_mutex_destroy(&ctx->stage_lock);
+    pthread_cond_destroy(&ctx->stage_cond);
     free(ctx);
     return 0;
 }
@@ -2290,6 +2615,8 @@ static journal_ctx_t *journal_ctx_new(journal_t *j)
     ctx->context_mode = JOURNAL_NEW;
     ctx->path = strdup(j->path);
     pthread_mutex_init(&ctx->write_lock, NULL);
+    pthread_mutex_init(&ctx->stage_lock, NULL);
+    pthread_cond_init(&ctx->stage_cond, NULL);
     //  fassertxsetpath(path);
     ctx->journal = j;
 
@@ -2525,6 +2852,12 @@ int journal_ctx_read_message(journal_ctx_t *ctx, const journal_id_t *id, journal
             DEBUG("read idx off end: %"PRIu64" %zu.", data_off, ctx->mmap_len);
             SYS_FAIL(JOURNAL_ERR_IDX_CORRUPT);
         }
+        if (IS_CHECKSUM_MAGIC(ctx) &&
+            (m->aligned_header.reserved != journal_message_crc(&m->aligned_header, hdr_size,
+                                               ((char *)ctx->mmap_base) + data_off + hdr_size,
+                                               *message_disk_len))) {
+            SYS_FAIL(JOURNAL_ERR_CHECKSUM);
+        }
         m->header = &m->aligned_header;
         if (IS_COMPRESS_MAGIC(ctx)) {
             if (ctx->mess_data_size < m->aligned_header.mlen) {
@@ -2569,12 +2902,23 @@ int journal_ctx_read_message(journal_ctx_t *ctx, const journal_id_t *id, journal
                                     m->aligned_header.compressed_len, data_off + hdr_size)) {
                 SYS_FAIL(JOURNAL_ERR_IDX_READ);
             }
+            if (IS_CHECKSUM_MAGIC(ctx) &&
+                (m->aligned_header.reserved != journal_message_crc(&m->aligned_header, hdr_size,
+                                                   ctx->compressed_data_buffer,
+                                                   m->aligned_header.compressed_len))) {
+                SYS_FAIL(JOURNAL_ERR_CHECKSUM);
+            }
             journal_decompress((char *)ctx->compressed_data_buffer,
                                m->header->compressed_len, ctx->mess_data, ctx->mess_data_size);
         } else {
             if (!journal_file_pread(ctx->data, ctx->mess_data, m->aligned_header.mlen,
                                                data_off + hdr_size))
                 SYS_FAIL(JOURNAL_ERR_IDX_READ);
+            if (IS_CHECKSUM_MAGIC(ctx) &&
+                (m->aligned_header.reserved != journal_message_crc(&m->aligned_header, hdr_size,
+                                                   ctx->mess_data, m->aligned_header.mlen))) {
+                SYS_FAIL(JOURNAL_ERR_CHECKSUM);
+            }
         }
         m->mess_len = m->header->mlen;
         m->mess = ctx->mess_data;
@@ -2605,6 +2949,94 @@ finish:
     return -1;
 }
 
+/* Read up to num consecutive messages starting at id with a single index read.
+ * With the mmap read method and no compression the messages point straight into
+ * the mapped segment and stay valid until the next journal_ctx_read_interval call.
+ * Anything the batched path cannot handle (compression, pread, close tags,
+ * corruption) is left to journal_ctx_read_message, one message at a time.
+ * Returns the number of messages read or -1 on error.
+ */
+int journal_ctx_read_messages(journal_ctx_t *ctx, const journal_id_t *id,
+                              journal_message_t *m, int num)
+{
+    uint64_t data_off[JOURNAL_READ_BATCH];
+    size_t hdr_size = sizeof(journal_message_header_t);
+    off_t index_len;
+    int n = 0;
+
+    if ((num <= 1) || IS_COMPRESS_MAGIC(ctx) || (ctx->read_method != JOURNAL_READ_METHOD_MMAP))
+        goto single;
+    if ((ctx->context_mode != JOURNAL_READ) || (id->marker < 1))
+        goto single;
+
+    journal_open_reader(ctx, id->log);
+    if (!ctx->data)
+        goto single;
+    journal_open_indexer(ctx, id->log);
+    if (!ctx->index)
+        goto single;
+
+    if ((index_len = journal_file_size(ctx->index)) == -1)
+        goto single;
+    if (index_len % sizeof(uint64_t))
+        goto single;
+
+    off_t first = id->marker - 1;
+    off_t entries = index_len / (off_t)sizeof(uint64_t);
+    if (first >= entries)
+        goto single;
+    if (num > JOURNAL_READ_BATCH)
+        num = JOURNAL_READ_BATCH;
+    if ((off_t)num > (entries - first))
+        num = entries - first;
+
+    if (!journal_file_pread(ctx->index, data_off, num * sizeof(uint64_t),
+                                        first * sizeof(uint64_t)))
+        goto single;
+
+    if (journal_setup_reader(ctx, id->log, 0) != 0)
+        goto single;
+
+    for (n = 0; n < num; n++) {
+        if ((data_off[n] == 0) && ((id->marker + n) != 1))
+            break;
+        if ((data_off[n] + hdr_size) > ctx->mmap_len)
+            break;
+
+        memcpy(&m[n].aligned_header, ((u_int8_t *)ctx->mmap_base) + data_off[n], hdr_size);
+
+        if ((data_off[n] + hdr_size + m[n].aligned_header.mlen) > ctx->mmap_len)
+            break;
+        if (IS_CHECKSUM_MAGIC(ctx) &&
+            (m[n].aligned_header.reserved != journal_message_crc(&m[n].aligned_header, hdr_size,
+                                                 ((u_int8_t *)ctx->mmap_base) + data_off[n] + hdr_size,
+                                                 m[n].aligned_header.mlen)))
+            break;
+
+        m[n].header = &m[n].aligned_header;
+        m[n].mess_len = m[n].aligned_header.mlen;
+        m[n].mess = ((u_int8_t *)ctx->mmap_base) + data_off[n] + hdr_size;
+    }
+
+    if (n > 0) {
+        ctx->last_error = JOURNAL_ERR_SUCCESS;
+        return n;
+    }
+
+single:
+    if (journal_ctx_read_message(ctx, id, m) != 0)
+        return -1;
+
+    return 1;
+}
+
+/* Whether the messages read from this context point into the mapped segment,
+ * otherwise they are overwritten by the next read. */
+bool journal_ctx_read_mapped(journal_ctx_t *ctx)
+{
+    return !IS_COMPRESS_MAGIC(ctx) && (ctx->read_method == JOURNAL_READ_METHOD_MMAP);
+}
+
 int journal_ctx_first_log_id(journal_ctx_t *ctx, journal_id_t *id)
 {
     struct dirent *de;
@@ -2877,7 +3309,7 @@ int journal_ctx_list_subscribers(journal_ctx_t *ctx, char ***subs)
             if (js.used == js.allocd) {
                 js.allocd *= 2;
                 char **tmp = realloc(js.subs, js.allocd*sizeof(char *));
-                if (*tmp == NULL) {
+                if (tmp == NULL) {
                     for (int i = 0; i < js.used; i++)
                         free(js.subs[i]);
                     free(js.subs);
@@ -2924,6 +3356,445 @@ size_t journal_ctx_raw_size(journal_ctx_t *ctx)
     return totalsize;
 }
 
+int journal_ctx_storage_stats(journal_ctx_t *ctx, uint64_t *segments, uint64_t *size)
+{
+    DIR *dir = opendir(ctx->path);
+    if (dir == NULL)
+        return -1;
+
+    int len = strlen(ctx->path);
+    char filename[MAXPATHLEN] = {0};
+    memcpy(filename, ctx->path, len);
+    filename[len++] = IFS_CH;
+
+    *segments = 0;
+    *size = 0;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        int dlen = strlen(de->d_name);
+        if ((len + dlen + 1) > (int)sizeof(filename))
+            continue;
+        memcpy(filename+len, de->d_name, dlen + 1); /* include \0 */
+        struct stat sb;
+        int ferr;
+        while ((ferr = stat(filename, &sb)) == -1 && errno == EINTR);
+        if (ferr != 0 || !S_ISREG(sb.st_mode))
+            continue;
+        *size += sb.st_size;
+        if (is_datafile(de->d_name, NULL))
+            (*segments)++;
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+/* Count the complete messages stored in the first size bytes of the data file
+ * of log. The count is cached in the journal and the next call only scans the
+ * data appended since, so every message is read once whatever the number of
+ * subscribers.
+ */
+static int journal_segment_messages(journal_ctx_t *ctx, uint32_t log, off_t size,
+                                                        uint64_t *messages)
+{
+    journal_t *j = ctx->journal;
+    bool compress = IS_COMPRESS_MAGIC(ctx);
+    size_t hdr_size = compress ? sizeof(journal_message_header_compressed_t)
+                               : sizeof(journal_message_header_t);
+
+    pthread_mutex_lock(&j->segments_lock);
+
+    journal_segment_t *seg = NULL;
+    for (size_t i = 0; i < j->segments_num; i++) {
+        if (j->segments[i].log == log) {
+            seg = &j->segments[i];
+            break;
+        }
+    }
+
+    if (seg == NULL) {
+        journal_segment_t *tmp = realloc(j->segments, sizeof(*j->segments) * (j->segments_num + 1));
+        if (tmp == NULL) {
+            pthread_mutex_unlock(&j->segments_lock);
+            return -1;
+        }
+        j->segments = tmp;
+        seg = &j->segments[j->segments_num++];
+        *seg = (journal_segment_t){ .log = log };
+    }
+
+    if (seg->offset < size) {
+        char file[MAXPATHLEN] = {0};
+        journal_set_data_file(ctx, file, log);
+        journal_file_t *data = journal_file_open(j, file, 0, ctx->file_mode);
+        if (data == NULL) {
+            pthread_mutex_unlock(&j->segments_lock);
+            return -1;
+        }
+
+        char buffer[16384];
+        bool stop = false;
+        while (!stop && ((seg->offset + (off_t)hdr_size) <= size)) {
+            size_t len = sizeof(buffer);
+            if ((size - seg->offset) < (off_t)len)
+                len = size - seg->offset;
+            if (!journal_file_pread(data, buffer, len, seg->offset))
+                break;
+
+            size_t pos = 0;
+            while ((pos + hdr_size) <= len) {
+                journal_message_header_compressed_t hdr;
+                memcpy(&hdr, buffer + pos, hdr_size);
+                if (!IS_CHECKSUM_MAGIC(ctx) && (hdr.reserved != ctx->meta->hdr_magic)) {
+                    stop = true;
+                    break;
+                }
+                size_t rlen = hdr_size + (compress ? hdr.compressed_len : hdr.mlen);
+                if ((seg->offset + (off_t)(pos + rlen)) > size) {
+                    /* The last message is still being written. */
+                    stop = true;
+                    break;
+                }
+                pos += rlen;
+                seg->messages++;
+            }
+
+            seg->offset += pos;
+            if (pos == 0)
+                break;
+        }
+
+        journal_file_close(j, data);
+    }
+
+    *messages = seg->messages;
+
+    pthread_mutex_unlock(&j->segments_lock);
+
+    return 0;
+}
+
+static void journal_segment_prune(journal_t *j, uint32_t earliest)
+{
+    pthread_mutex_lock(&j->segments_lock);
+    size_t n = 0;
+    for (size_t i = 0; i < j->segments_num; i++) {
+        if (j->segments[i].log >= earliest)
+            j->segments[n++] = j->segments[i];
+    }
+    j->segments_num = n;
+    pthread_mutex_unlock(&j->segments_lock);
+}
+
+/* Offset in the data file of log just after the message marker. */
+static off_t journal_message_end(journal_ctx_t *ctx, uint32_t log, uint32_t marker)
+{
+    if (marker == 0)
+        return 0;
+
+    char file[MAXPATHLEN] = {0};
+    journal_set_data_file(ctx, file, log);
+    size_t len = strlen(file);
+    if ((len + sizeof(INDEX_EXT)) > sizeof(file))
+        return -1;
+    memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
+
+    journal_file_t *index = journal_file_open(ctx->journal, file, 0, ctx->file_mode);
+    if (index == NULL)
+        return -1;
+
+    uint64_t data_off = 0;
+    int ok = journal_file_pread(index, &data_off, sizeof(data_off),
+                                (marker - 1) * sizeof(uint64_t));
+    journal_file_close(ctx->journal, index);
+    if (!ok)
+        return -1;
+
+    journal_set_data_file(ctx, file, log);
+    journal_file_t *data = journal_file_open(ctx->journal, file, 0, ctx->file_mode);
+    if (data == NULL)
+        return -1;
+
+    bool compress = IS_COMPRESS_MAGIC(ctx);
+    size_t hdr_size = compress ? sizeof(journal_message_header_compressed_t)
+                               : sizeof(journal_message_header_t);
+    journal_message_header_compressed_t hdr;
+    ok = journal_file_pread(data, &hdr, hdr_size, data_off);
+    journal_file_close(ctx->journal, data);
+    if (!ok)
+        return -1;
+
+    return data_off + hdr_size + (compress ? hdr.compressed_len : hdr.mlen);
+}
+
+int journal_ctx_subscriber_lag(journal_ctx_t *ctx, const char *subscriber,
+                               uint64_t *messages, uint64_t *bytes)
+{
+    journal_id_t chkpt = {0};
+    if (journal_ctx_get_checkpoint(ctx, subscriber, &chkpt) != 0)
+        return -1;
+
+    unsigned int earliest = 0;
+    unsigned int latest = 0;
+    if (!journal_get_storage_bounds(ctx, &earliest, &latest))
+        return -1;
+
+    journal_segment_prune(ctx->journal, earliest);
+
+    *messages = 0;
+    *bytes = 0;
+
+    uint32_t log = chkpt.log > earliest ? chkpt.log : earliest;
+    for (; log <= latest; log++) {
+        char file[MAXPATHLEN] = {0};
+        journal_set_data_file(ctx, file, log);
+        struct stat sb;
+        int rv;
+        while ((rv = stat(file, &sb)) == -1 && errno == EINTR);
+        if (rv != 0)
+            continue;
+
+        uint64_t num = 0;
+        if (journal_segment_messages(ctx, log, sb.st_size, &num) != 0)
+            return -1;
+
+        if (log == chkpt.log) {
+            off_t end = journal_message_end(ctx, log, chkpt.marker);
+            if (end < 0)
+                end = 0;
+            *messages += num > chkpt.marker ? num - chkpt.marker : 0;
+            *bytes += sb.st_size > end ? sb.st_size - end : 0;
+        } else {
+            *messages += num;
+            *bytes += sb.st_size;
+        }
+
+        if (log == UINT32_MAX)
+            break;
+    }
+
+    return 0;
+}
+
+/* Drop the oldest segments while the journal is bigger than the retention size
+ * or the last write to the segment is older than the retention time. The
+ * checkpoints of the subscribers that have not read a dropped segment yet are
+ * advanced to the next one. The segment being written is never dropped.
+ */
+static int journal_reclaim(journal_ctx_t *ctx)
+{
+    journal_t *j = ctx->journal;
+
+    if ((j->retention_size <= 0) && (j->retention_time == 0))
+        return 0;
+
+    unsigned int earliest = 0;
+    unsigned int latest = 0;
+    if (!journal_get_storage_bounds(ctx, &earliest, &latest))
+        return -1;
+
+    uint64_t segments = 0;
+    uint64_t total = 0;
+    if (journal_ctx_storage_stats(ctx, &segments, &total) != 0)
+        return -1;
+
+    cdtime_t expire = 0;
+    if (j->retention_time > 0) {
+        cdtime_t now = cdtime();
+        if (now > j->retention_time)
+            expire = now - j->retention_time;
+    }
+
+    char **subs = NULL;
+    int subs_num = -1;
+    uint64_t dropped_segments = 0;
+    uint64_t dropped_messages = 0;
+    uint64_t dropped_bytes = 0;
+
+    uint32_t log = earliest;
+    for (; (log < latest) && (log < ctx->meta->storage_log); log++) {
+        char file[MAXPATHLEN] = {0};
+        journal_set_data_file(ctx, file, log);
+        struct stat sb;
+        int rv;
+        while ((rv = stat(file, &sb)) == -1 && errno == EINTR);
+        if (rv != 0)
+            continue;
+
+        bool oversize = (j->retention_size > 0) && (total > (uint64_t)j->retention_size);
+        bool expired = (expire > 0) && (TIME_T_TO_CDTIME_T(sb.st_mtime) < expire);
+        if (!oversize && !expired)
+            break;
+
+        off_t data_size = sb.st_size;
+        uint64_t size = sb.st_size;
+        size_t len = strlen(file);
+        if ((len + sizeof(INDEX_EXT)) <= sizeof(file)) {
+            memcpy(file + len, INDEX_EXT, sizeof(INDEX_EXT));
+            while ((rv = stat(file, &sb)) == -1 && errno == EINTR);
+            if (rv == 0)
+                size += sb.st_size;
+        }
+
+        uint64_t messages = 0;
+        if (journal_segment_messages(ctx, log, data_size, &messages) != 0)
+            messages = 0;
+
+        if (subs_num < 0) {
+            subs_num = journal_ctx_list_subscribers(ctx, &subs);
+            if (subs_num < 0)
+                break;
+        }
+
+        /* Messages of the segment read by the slowest subscriber. */
+        uint64_t consumed = messages;
+        journal_id_t next = { .log = log + 1, .marker = 0 };
+        for (int i = 0; i < subs_num; i++) {
+            journal_id_t id = {0};
+            if (journal_ctx_get_checkpoint(ctx, subs[i], &id) != 0)
+                continue;
+            if (id.log > log)
+                continue;
+            uint64_t marker = id.log == log ? id.marker : 0;
+            if (marker < consumed)
+                consumed = marker;
+            journal_set_checkpoint(ctx, subs[i], &next);
+        }
+
+        journal_unlink_datafile(ctx, log);
+
+        total = total > size ? total - size : 0;
+        dropped_segments++;
+        dropped_messages += messages - consumed;
+        dropped_bytes += size;
+    }
+
+    if (subs != NULL)
+        journal_ctx_list_subscribers_dispose(ctx, subs);
+
+    if (dropped_segments == 0)
+        return 0;
+
+    journal_segment_prune(j, log);
+
+    WARNING("journal '%s': dropped %" PRIu64 " segments with %" PRIu64
+            " unread messages to honour the retention.",
+            j->path, dropped_segments, dropped_messages);
+
+    pthread_mutex_lock(&j->reclaim_lock);
+    j->dropped_segments += dropped_segments;
+    j->dropped_messages += dropped_messages;
+    j->dropped_bytes += dropped_bytes;
+    pthread_mutex_unlock(&j->reclaim_lock);
+
+    return 0;
+}
+
+static void *journal_reclaim_thread(void *arg)
+{
+    journal_ctx_t *ctx = arg;
+    journal_t *j = ctx->journal;
+
+    pthread_mutex_lock(&j->reclaim_lock);
+    while (j->reclaim_loop) {
+        j->reclaim_pending = false;
+        pthread_mutex_unlock(&j->reclaim_lock);
+
+        journal_reclaim(ctx);
+
+        pthread_mutex_lock(&j->reclaim_lock);
+        if (j->reclaim_loop && !j->reclaim_pending)
+            pthread_cond_timedwait(&j->reclaim_cond, &j->reclaim_lock,
+                                   &CDTIME_T_TO_TIMESPEC(cdtime() + JOURNAL_RECLAIM_INTERVAL));
+    }
+    pthread_mutex_unlock(&j->reclaim_lock);
+
+    return NULL;
+}
+
+int journal_reclaim_start(journal_t *j)
+{
+    if ((j->retention_size <= 0) && (j->retention_time == 0))
+        return 0;
+
+    if (j->reclaim_ctx != NULL)
+        return 0;
+
+    journal_ctx_t *ctx = journal_ctx_new(j);
+    if (ctx == NULL)
+        return -1;
+
+    ctx->context_mode = JOURNAL_READ;
+
+    if (journal_open_metastore(ctx, false) != 0) {
+        ERROR("journal_reclaim_start call to journal_open_metastore failed");
+        journal_ctx_close(ctx);
+        return -1;
+    }
+
+    if (journal_restore_metastore(ctx, 0, 1) != 0) {
+        ERROR("journal_reclaim_start call to journal_restore_metastore failed");
+        journal_ctx_close(ctx);
+        return -1;
+    }
+
+    j->reclaim_ctx = ctx;
+    j->reclaim_loop = true;
+
+    char thread_name[THREAD_NAME_MAX];
+    ssnprintf(thread_name, sizeof(thread_name), "journal-reclaim");
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    set_thread_setaffinity(&attr, thread_name);
+
+    int status = pthread_create(&j->reclaim_thread, &attr, journal_reclaim_thread, ctx);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        ERROR("pthread_create failed with status %i: %s.", status, STRERROR(status));
+        j->reclaim_ctx = NULL;
+        j->reclaim_loop = false;
+        journal_ctx_close(ctx);
+        return -1;
+    }
+
+    set_thread_name(j->reclaim_thread, thread_name);
+
+    return 0;
+}
+
+void journal_reclaim_stop(journal_t *j)
+{
+    pthread_mutex_lock(&j->reclaim_lock);
+    journal_ctx_t *ctx = j->reclaim_ctx;
+    if (ctx == NULL) {
+        pthread_mutex_unlock(&j->reclaim_lock);
+        return;
+    }
+    j->reclaim_loop = false;
+    pthread_cond_broadcast(&j->reclaim_cond);
+    pthread_mutex_unlock(&j->reclaim_lock);
+
+    pthread_join(j->reclaim_thread, NULL);
+
+    pthread_mutex_lock(&j->reclaim_lock);
+    j->reclaim_ctx = NULL;
+    pthread_mutex_unlock(&j->reclaim_lock);
+
+    journal_ctx_close(ctx);
+}
+
+void journal_reclaim_stats(journal_t *j, uint64_t *segments, uint64_t *messages, uint64_t *bytes)
+{
+    pthread_mutex_lock(&j->reclaim_lock);
+    *segments = j->dropped_segments;
+    *messages = j->dropped_messages;
+    *bytes = j->dropped_bytes;
+    pthread_mutex_unlock(&j->reclaim_lock);
+}
+
 #if 0
 int journal_clean(const char *file)
 {
@@ -3048,12 +3919,20 @@ journal_t *journal_new(const char *path)
     j->meta.hdr_magic = DEFAULT_HDR_MAGIC;
 
     j->path = strdup(path);
+    pthread_mutex_init(&j->segments_lock, NULL);
+    pthread_mutex_init(&j->reclaim_lock, NULL);
+    pthread_cond_init(&j->reclaim_cond, NULL);
 
     return j;
 }
 
 void journal_close(journal_t *j)
 {
+    journal_reclaim_stop(j);
+    pthread_cond_destroy(&j->reclaim_cond);
+    pthread_mutex_destroy(&j->reclaim_lock);
+    pthread_mutex_destroy(&j->segments_lock);
+    free(j->segments);
     free(j->path);
     free(j);
 }
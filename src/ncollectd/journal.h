@@ -56,7 +56,8 @@ typedef enum {
     JOURNAL_ERR_SUBSCRIBER_EXISTS,
     JOURNAL_ERR_CHECKPOINT,
     JOURNAL_ERR_NOT_SUPPORTED,
-    JOURNAL_ERR_CLOSE_LOGID
+    JOURNAL_ERR_CLOSE_LOGID,
+    JOURNAL_ERR_CHECKSUM
 } journal_err_t;
 
 typedef enum {
@@ -92,6 +93,12 @@ typedef struct {
 struct journal_thread_s;
 typedef struct journal_thread_s journal_thread_t;
 
+typedef struct {
+    uint32_t log;
+    off_t offset;
+    uint64_t messages;
+} journal_segment_t;
+
 typedef struct {
     const char *kind;
 
@@ -118,8 +125,33 @@ typedef struct {
     pthread_cond_t cond;
     journal_thread_t *threads;
 
+    /* Message count of the data files, see journal_ctx_subscriber_lag. */
+    pthread_mutex_t segments_lock;
+    journal_segment_t *segments;
+    size_t segments_num;
+
+    /* Background enforcement of the retention, see journal_reclaim_start. */
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_cond;
+    pthread_t reclaim_thread;
+    void *reclaim_ctx;
+    bool reclaim_loop;
+    bool reclaim_pending;
+    /* Dropped by the retention or lost on a write error, under reclaim_lock. */
+    uint64_t dropped_segments;
+    uint64_t dropped_messages;
+    uint64_t dropped_bytes;
 } journal_t;
 
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    uint32_t *mlen;
+    size_t num;
+    size_t alloc;
+} journal_stage_t;
+
 typedef struct {
     journal_t *journal;
 
@@ -156,6 +188,13 @@ typedef struct {
      */
     size_t    mess_data_size;
     char      *mess_data;
+
+    /* Staging buffers for group commit, see journal_ctx_write_staged. */
+    pthread_mutex_t stage_lock;
+    pthread_cond_t stage_cond;
+    bool stage_flushing;
+    journal_stage_t stage;
+    journal_stage_t stage_flush;
 } journal_ctx_t;
 
 struct journal_thread_s {
@@ -206,6 +245,10 @@ int journal_config_retention_size(journal_t *j, off_t retention_size);
 int journal_config_retention_time(journal_t *j, cdtime_t retention_time);
 int journal_config_segment_size(journal_t *j, off_t segment_size);
 
+int journal_reclaim_start(journal_t *j);
+void journal_reclaim_stop(journal_t *j);
+void journal_reclaim_stats(journal_t *j, uint64_t *segments, uint64_t *messages, uint64_t *bytes);
+
 journal_ctx_t *journal_get_writer(journal_t *j);
 journal_ctx_t *journal_get_reader(journal_t *j, const char *subscriber);
 
@@ -225,6 +268,9 @@ int journal_ctx_set_subscriber_checkpoint(journal_ctx_t *ctx, const char *subscr
 const char *journal_err_string(int);
 
 size_t journal_ctx_raw_size(journal_ctx_t *ctx);
+int journal_ctx_storage_stats(journal_ctx_t *ctx, uint64_t *segments, uint64_t *size);
+int journal_ctx_subscriber_lag(journal_ctx_t *ctx, const char *subscriber,
+                               uint64_t *messages, uint64_t *bytes);
 int journal_ctx_get_checkpoint(journal_ctx_t *ctx, const char *s, journal_id_t *id);
 int journal_ctx_list_subscribers_dispose(journal_ctx_t *ctx, char **subs);
 int journal_ctx_list_subscribers(journal_ctx_t *ctx, char ***subs);
@@ -246,8 +292,13 @@ int journal_ctx_set_use_compression(journal_ctx_t *ctx, bool use);
 
 int journal_ctx_write(journal_ctx_t *ctx, void *message, size_t mess_len);
 int journal_ctx_write_message(journal_ctx_t *ctx, journal_message_t *msg, struct timeval *when);
+int journal_ctx_write_messages(journal_ctx_t *ctx, journal_message_t *msgs, size_t num,
+                               struct timeval *when);
+int journal_ctx_write_staged(journal_ctx_t *ctx, const void *data, size_t len);
 int journal_ctx_read_interval(journal_ctx_t *ctx, journal_id_t *first_mess, journal_id_t *last_mess);
 int journal_ctx_read_message(journal_ctx_t *ctx, const journal_id_t *, journal_message_t *);
+int journal_ctx_read_messages(journal_ctx_t *ctx, const journal_id_t *, journal_message_t *, int num);
+bool journal_ctx_read_mapped(journal_ctx_t *ctx);
 int journal_ctx_read_checkpoint(journal_ctx_t *ctx, const journal_id_t *checkpoint);
 
 int journal_snprint_logid(char *buff, int n, const journal_id_t *checkpoint);
@@ -39,7 +39,6 @@ static c_avl_tree_t *plugins_loaded;
 
 static llist_t *list_init;
 static llist_t *list_shutdown;
-static llist_t *list_log;
 
 static char *plugindir;
 
@@ -65,6 +64,26 @@ static metric_family_t internal_fams[FAM_NCOLLECTD_MAX] = {
         .name = "ncollectd_write_queue_dropped",
         .type = METRIC_TYPE_COUNTER,
     },
+    [FAM_NCOLLECTD_WRITE_JOURNAL_SEGMENTS] = {
+        .name = "ncollectd_write_journal_segments",
+        .type = METRIC_TYPE_GAUGE,
+    },
+    [FAM_NCOLLECTD_WRITE_JOURNAL_SIZE_BYTES] = {
+        .name = "ncollectd_write_journal_size_bytes",
+        .type = METRIC_TYPE_GAUGE,
+    },
+    [FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_SEGMENTS] = {
+        .name = "ncollectd_write_journal_dropped_segments",
+        .type = METRIC_TYPE_COUNTER,
+    },
+    [FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_MESSAGES] = {
+        .name = "ncollectd_write_journal_dropped_messages",
+        .type = METRIC_TYPE_COUNTER,
+    },
+    [FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_BYTES] = {
+        .name = "ncollectd_write_journal_dropped_bytes",
+        .type = METRIC_TYPE_COUNTER,
+    },
     [FAM_NCOLLECTD_PLUGIN_WRITE_TIME_SECONDS] = {
         .name = "ncollectd_plugin_write_time_seconds",
         .type = METRIC_TYPE_COUNTER,
@@ -85,6 +104,22 @@ static metric_family_t internal_fams[FAM_NCOLLECTD_MAX] = {
         .name = "ncollectd_plugin_write_cpu_system_seconds",
         .type = METRIC_TYPE_COUNTER,
     },
+    [FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_MESSAGES] = {
+        .name = "ncollectd_plugin_write_journal_lag_messages",
+        .type = METRIC_TYPE_GAUGE,
+    },
+    [FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_BYTES] = {
+        .name = "ncollectd_plugin_write_journal_lag_bytes",
+        .type = METRIC_TYPE_GAUGE,
+    },
+    [FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_MESSAGES] = {
+        .name = "ncollectd_plugin_write_journal_replayed_messages",
+        .type = METRIC_TYPE_COUNTER,
+    },
+    [FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_BYTES] = {
+        .name = "ncollectd_plugin_write_journal_replayed_bytes",
+        .type = METRIC_TYPE_COUNTER,
+    },
     [FAM_NCOLLECTD_NOTIFICATIONS_DISPACHED] = {
         .name = "ncollectd_notifications_dispached",
         .type = METRIC_TYPE_COUNTER,
@@ -137,6 +172,18 @@ static metric_family_t internal_fams[FAM_NCOLLECTD_MAX] = {
         .name = "ncollectd_plugin_read_cpu_system_seconds",
         .type = METRIC_TYPE_COUNTER,
     },
+    [FAM_NCOLLECTD_LOG_QUEUE_LENGTH] = {
+        .name = "ncollectd_log_queue_length",
+        .type = METRIC_TYPE_GAUGE,
+    },
+    [FAM_NCOLLECTD_LOG_DROPPED] = {
+        .name = "ncollectd_log_dropped",
+        .type = METRIC_TYPE_COUNTER,
+    },
+    [FAM_NCOLLECTD_LOG_SUPPRESSED] = {
+        .name = "ncollectd_log_suppressed",
+        .type = METRIC_TYPE_COUNTER,
+    },
     [FAM_NCOLLECTD_CACHE_SIZE] = {
         .name = "ncollectd_cache_size",
         .type = METRIC_TYPE_GAUGE,
@@ -164,6 +211,7 @@ static int plugin_update_internal_statistics(void)
     plugin_write_stats(internal_fams);
     plugin_notify_stats(internal_fams);
     plugin_read_stats(internal_fams);
+    plugin_log_stats(internal_fams);
 
 //  TODO cache metrics
 
@@ -191,7 +239,7 @@ static void destroy_callback(callback_func_t *cf)
     free(cf);
 }
 
-static void destroy_all_callbacks(llist_t **list)
+void destroy_all_callbacks(llist_t **list)
 {
     if (*list == NULL)
         return;
@@ -331,11 +379,11 @@ static int plugin_load_file(char const *file, bool global, void **dlh)
                          "object.",
                          file, dlerror());
 
-        /* This error is printed to STDERR unconditionally. If list_log is NULL,
+        /* This error is printed to STDERR unconditionally. If no logger is registered,
          * plugin_log() will also print to STDERR. We avoid duplicate output by
-         * checking that the list of log handlers, list_log, is not NULL. */
+         * checking that there are log handlers registered. */
         fprintf(stderr, "ERROR: %s\n", errbuf);
-        if (list_log != NULL) {
+        if (plugin_has_loggers()) {
             ERROR("%s", errbuf);
         }
 
@@ -568,31 +616,6 @@ int plugin_register_shutdown(const char *name, plugin_shutdown_cb callback)
     return create_register_callback(&list_shutdown, name, &cf);
 }
 
-int plugin_register_log(const char *group, const char *name,
-                        plugin_log_cb callback, user_data_t const *ud)
-{
-    if (group == NULL) {
-        ERROR("group name is NULL.");
-        return EINVAL;
-    }
-
-    char *full_name = plugin_full_name(group, name);
-    if (full_name == NULL)
-        return -1;
-
-    callback_func_t cf = {0};
-    cf.cf_log = callback;
-    if (ud == NULL) {
-        cf.cf_udata = (user_data_t){ .data = NULL, .free_func = NULL };
-    } else {
-        cf.cf_udata = *ud;
-    }
-
-    int status = create_register_callback(&list_log, full_name, &cf);
-    free(full_name);
-    return status;
-}
-
 int plugin_unregister_config(const char *name)
 {
     cf_unregister(name);
@@ -604,31 +627,36 @@ int plugin_unregister_init(const char *name)
     return plugin_unregister(list_init, name);
 }
 
-strlist_t *plugin_get_loggers(void)
-{
-    return list_callbacks(&list_log);
-}
-
 int plugin_unregister_shutdown(const char *name)
 {
     return plugin_unregister(list_shutdown, name);
 }
 
-int plugin_unregister_log(const char *name)
+static int plugin_sync_mdb(__attribute__((unused)) user_data_t *ud)
 {
-    return plugin_unregister(list_log, name);
+    return plugin_write_sync_mdb();
 }
 
 int plugin_init_all(void)
 {
     int ret = 0;
 
+    if (plugin_init_log() != 0)
+        WARNING("Failed to start the log thread, logging from the calling threads.");
+
     mdb = mdb_alloc();
     if (mdb == NULL) {
         ERROR("Failed to alloc mdb structures.");
         return -1;
     }
 
+    const char *mdb_path = global_option_get("mdb-path");
+    mdb_config_t config = {
+        .path = mdb_path,
+        .retention = global_option_get_time("mdb-retention", MDB_DEFAULT_RETENTION)
+    };
+    mdb_config(mdb, &config);
+
     /* Init the value cache */
     int status = mdb_init(mdb);
     if (status != 0) {
@@ -637,6 +665,12 @@ int plugin_init_all(void)
         return -1;
     }
 
+    status = mdb_load_index(mdb);
+    if (status == 0)
+        status = mdb_load_data(mdb);
+    if (status != 0)
+        WARNING("Failed to load the mdb from '%s'.", mdb_path);
+
     status = plugin_init_notify();
     if (status != 0)
         return -1;
@@ -648,6 +682,10 @@ int plugin_init_all(void)
     if (IS_TRUE(global_option_get("collect-internal-stats")))
         plugin_register_read("ncollectd", plugin_update_internal_statistics);
 
+    if ((mdb_path != NULL) && (mdb_path[0] != '\0'))
+        plugin_register_complex_read(NULL, "mdb", plugin_sync_mdb,
+                                     global_option_get_time("mdb-sync-interval", 0), NULL);
+
     /* Calling all init callbacks before checking if read callbacks
      * are available allows the init callbacks to register the read
      * callback. */
@@ -688,11 +726,17 @@ int plugin_shutdown_all(void)
 
     stop_read_threads();
 
+    /* Save the mdb while the journal is open, the snapshot moves its checkpoint. */
+    plugin_write_sync_mdb();
+
     /* ask all plugins to write out the state they kept. */
     /* blocks until all write threads have shut down. */
     plugin_shutdown_write();
     plugin_shutdown_notify();
 
+    /* Deliver the queued log records before the loggers are shut down. */
+    plugin_shutdown_log();
+
     llentry_t *le = NULL;
     if (list_shutdown != NULL)
         le = llist_head(list_shutdown);
@@ -716,7 +760,7 @@ int plugin_shutdown_all(void)
     }
 
     destroy_all_callbacks(&list_shutdown);
-    destroy_all_callbacks(&list_log);
+    plugin_free_log();
 
     plugin_free_loaded();
     plugin_free_register_match();
@@ -732,95 +776,6 @@ int plugin_shutdown_all(void)
     return ret;
 }
 
-static int plugin_dispatch_log(const log_msg_t *msg)
-{
-    if (msg == NULL)
-        return EINVAL;
-
-    if (list_log == NULL) {
-        if (msg->plugin != NULL)
-            fprintf(stderr, "plugin %s %s(%s:%d): %s\n",
-                            msg->plugin, msg->func, msg->file, msg->line, msg->msg);
-        else
-            fprintf(stderr, "%s(%s:%d): %s\n",
-                            msg->func, msg->file, msg->line, msg->msg);
-        return 0;
-    }
-
-    llentry_t *le = llist_head(list_log);
-    while (le != NULL) {
-        callback_func_t *cf = le->value;
-        plugin_log_cb callback = cf->cf_log;
-
-        /* do not switch plugin context; rather keep the context
-         * (interval) information of the calling plugin */
-
-        (*callback)(msg, &cf->cf_udata);
-
-        le = le->next;
-    }
-
-    return 0;
-}
-
-void plugin_log(int level, const char *file, int line, const char *func, const char *format, ...)
-{
-#ifndef NCOLLECTD_DEBUG
-    if (level >= LOG_DEBUG)
-        return;
-#endif
-
-    char const *name = plugin_get_ctx().name;
-    if (name == NULL)
-        name = "UNKNOWN";
-
-    va_list ap;
-    va_start(ap, format);
-    char msg[1024];
-    vsnprintf(msg, sizeof(msg), format, ap);
-    msg[sizeof(msg) - 1] = '\0';
-    va_end(ap);
-
-    log_msg_t log = {
-        .severity = level,
-        .time = cdtime(),
-        .plugin = name,
-        .file = file,
-        .line = line,
-        .func = func,
-        .msg = msg,
-    };
-
-    plugin_dispatch_log(&log);
-}
-
-void daemon_log(int level, const char *file, int line, const char *func, const char *format, ...)
-{
-#ifndef NCOLLECTD_DEBUG
-    if (level >= LOG_DEBUG)
-        return;
-#endif
-
-    va_list ap;
-    va_start(ap, format);
-    char msg[1024];
-    vsnprintf(msg, sizeof(msg), format, ap);
-    msg[sizeof(msg) - 1] = '\0';
-    va_end(ap);
-
-    log_msg_t log = {
-        .severity = level,
-        .time = cdtime(),
-        .plugin = NULL,
-        .file = file,
-        .line = line,
-        .func = func,
-        .msg = msg,
-    };
-
-    plugin_dispatch_log(&log);
-}
-
 int parse_log_severity(const char *severity)
 {
     int log_level = -1;
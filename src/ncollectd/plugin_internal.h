@@ -41,11 +41,20 @@ enum {
     FAM_NCOLLECTD_METRICS_DISPACHED,
     FAM_NCOLLECTD_WRITE_QUEUE_LENGTH,
     FAM_NCOLLECTD_WRITE_QUEUE_DROPPED,
+    FAM_NCOLLECTD_WRITE_JOURNAL_SEGMENTS,
+    FAM_NCOLLECTD_WRITE_JOURNAL_SIZE_BYTES,
+    FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_SEGMENTS,
+    FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_MESSAGES,
+    FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_BYTES,
     FAM_NCOLLECTD_PLUGIN_WRITE_TIME_SECONDS,
     FAM_NCOLLECTD_PLUGIN_WRITE_CALLS,
     FAM_NCOLLECTD_PLUGIN_WRITE_FAILURES,
     FAM_NCOLLECTD_PLUGIN_WRITE_CPU_USER,
     FAM_NCOLLECTD_PLUGIN_WRITE_CPU_SYSTEM,
+    FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_MESSAGES,
+    FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_BYTES,
+    FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_MESSAGES,
+    FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_BYTES,
     FAM_NCOLLECTD_NOTIFICATIONS_DISPACHED,
     FAM_NCOLLECTD_NOTIFY_QUEUE_LENGTH,
     FAM_NCOLLECTD_NOTIFY_QUEUE_DROPPED,
@@ -59,6 +68,9 @@ enum {
     FAM_NCOLLECTD_PLUGIN_READ_FAILURES,
     FAM_NCOLLECTD_PLUGIN_READ_CPU_USER,
     FAM_NCOLLECTD_PLUGIN_READ_CPU_SYSTEM,
+    FAM_NCOLLECTD_LOG_QUEUE_LENGTH,
+    FAM_NCOLLECTD_LOG_DROPPED,
+    FAM_NCOLLECTD_LOG_SUPPRESSED,
     FAM_NCOLLECTD_CACHE_SIZE,
     FAM_NCOLLECTD_MAX,
 };
@@ -87,6 +99,7 @@ typedef struct {
 typedef int (*plugin_init_cb)(void);
 typedef int (*plugin_read_cb)(user_data_t *);
 typedef int (*plugin_write_cb)(metric_family_t const *, user_data_t *);
+typedef int (*plugin_write_batch_cb)(metric_family_list_t const *, user_data_t *);
 typedef int (*plugin_flush_cb)(cdtime_t timeout, user_data_t *);
 typedef void (*plugin_log_cb)(const log_msg_t *msg, user_data_t *);
 typedef int (*plugin_shutdown_cb)(void);
@@ -125,6 +138,8 @@ strlist_t *list_callbacks(llist_t **list);
 
 int create_register_callback(llist_t **list, const char *name, callback_func_t *icf);
 
+void destroy_all_callbacks(llist_t **list);
+
 int plugin_unregister(llist_t *list, const char *name);
 
 int plugin_register_read(const char *name, int (*callback)(void));
@@ -140,6 +155,7 @@ int plugin_init_read(void);
 int plugin_init_write(void);
 int plugin_config_write(void);
 void plugin_shutdown_write(void);
+int plugin_write_sync_mdb(void);
 void plugin_write_stats(metric_family_t *fams);
 void plugin_write_test_mode(bool mode);
 
@@ -148,6 +164,12 @@ int plugin_config_notify(void);
 void plugin_shutdown_notify(void);
 void plugin_notify_stats(metric_family_t *fams);
 
+int plugin_init_log(void);
+void plugin_shutdown_log(void);
+void plugin_free_log(void);
+bool plugin_has_loggers(void);
+void plugin_log_stats(metric_family_t *fams);
+
 void plugin_set_dir(const char *dir);
 int plugin_load(const char *name, bool global);
 bool plugin_is_loaded(char const *name);
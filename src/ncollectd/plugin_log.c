@@ -0,0 +1,493 @@
+// SPDX-License-Identifier: GPL-2.0-only OR MIT
+// SPDX-FileCopyrightText: Copyright (C) 2005-2014 Florian octo Forster
+// SPDX-FileCopyrightText: Copyright (C) 2022-2024 Manuel Sanmartín
+// SPDX-FileContributor: Florian octo Forster <octo at collectd.org>
+// SPDX-FileContributor: Sebastian Harl <sh at tokkee.org>
+// SPDX-FileContributor: Manuel Sanmartín <manuel.luis at gmail.com>
+
+#define _GNU_SOURCE
+
+#include "ncollectd.h"
+#include "globals.h"
+#include "configfile.h"
+#include "plugin_internal.h"
+#include "libutils/common.h"
+#include "libutils/time.h"
+
+#include <stdatomic.h>
+#include <sched.h>
+
+#define LOG_QUEUE_MIN_SIZE 64
+#define LOG_LIMIT_SLOTS 256
+#define LOG_PLUGIN_MAX 128
+#define LOG_MSG_MAX 1024
+
+/* Records are formatted by the calling thread directly into a cell of a bounded
+ * multi-producer, single-consumer ring and handed to the loggers by one log
+ * thread, so a logger blocked on I/O does not stall the read and write threads. */
+typedef struct {
+    atomic_size_t seq;
+    int severity;
+    cdtime_t time;
+    bool has_plugin;
+    const char *file;
+    int line;
+    const char *func;
+    /* The plugin name or the name of the context of the caller. */
+    char plugin[LOG_PLUGIN_MAX];
+    /* Plugin context of the caller, its name points to plugin. */
+    plugin_ctx_t ctx;
+    char msg[LOG_MSG_MAX];
+} log_cell_t;
+
+/* Rate limit of a call site, identified by the file and line of the log macro. */
+typedef struct {
+    _Atomic(const char *) file;
+    atomic_int line;
+    atomic_llong window;
+    atomic_uint count;
+    atomic_uint suppressed;
+} log_limit_t;
+
+static llist_t *list_log;
+
+static log_cell_t *log_cells;
+static size_t log_mask;
+static atomic_size_t log_enqueue_pos;
+static atomic_size_t log_dequeue_pos;
+
+static pthread_t log_thread;
+static atomic_bool log_thread_running;
+static atomic_bool log_loop;
+static atomic_bool log_sleeping;
+static pthread_mutex_t log_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static log_limit_t log_limits[LOG_LIMIT_SLOTS];
+static unsigned int log_rate_limit;
+
+static atomic_ullong log_dropped;
+static atomic_ullong log_suppressed;
+
+int plugin_register_log(const char *group, const char *name,
+                        plugin_log_cb callback, user_data_t const *ud)
+{
+    if (group == NULL) {
+        ERROR("group name is NULL.");
+        return EINVAL;
+    }
+
+    char *full_name = plugin_full_name(group, name);
+    if (full_name == NULL)
+        return -1;
+
+    callback_func_t cf = {0};
+    cf.cf_log = callback;
+    if (ud == NULL) {
+        cf.cf_udata = (user_data_t){ .data = NULL, .free_func = NULL };
+    } else {
+        cf.cf_udata = *ud;
+    }
+
+    int status = create_register_callback(&list_log, full_name, &cf);
+    free(full_name);
+    return status;
+}
+
+int plugin_unregister_log(const char *name)
+{
+    return plugin_unregister(list_log, name);
+}
+
+strlist_t *plugin_get_loggers(void)
+{
+    return list_callbacks(&list_log);
+}
+
+bool plugin_has_loggers(void)
+{
+    return list_log != NULL;
+}
+
+static void plugin_dispatch_log(const log_msg_t *msg)
+{
+    if (list_log == NULL) {
+        if (msg->plugin != NULL)
+            fprintf(stderr, "plugin %s %s(%s:%d): %s\n",
+                            msg->plugin, msg->func, msg->file, msg->line, msg->msg);
+        else
+            fprintf(stderr, "%s(%s:%d): %s\n",
+                            msg->func, msg->file, msg->line, msg->msg);
+        return;
+    }
+
+    llentry_t *le = llist_head(list_log);
+    while (le != NULL) {
+        callback_func_t *cf = le->value;
+        plugin_log_cb callback = cf->cf_log;
+
+        /* The loggers run with the plugin context of the caller, restored by
+         * plugin_dispatch_log_cell in the log thread. */
+        (*callback)(msg, &cf->cf_udata);
+
+        le = le->next;
+    }
+}
+
+static void plugin_dispatch_log_cell(log_cell_t *cell)
+{
+    log_msg_t msg = {
+        .severity = cell->severity,
+        .time = cell->time,
+        .plugin = cell->has_plugin ? cell->plugin : NULL,
+        .file = cell->file,
+        .line = cell->line,
+        .func = cell->func,
+        .msg = cell->msg,
+    };
+
+    plugin_ctx_t old_ctx = plugin_set_ctx(cell->ctx);
+    plugin_dispatch_log(&msg);
+    plugin_set_ctx(old_ctx);
+}
+
+/* Returns false when the call site already logged log_rate_limit messages in the
+ * current second.  The first message of a new second gets the number of
+ * messages suppressed in the previous one. */
+static bool plugin_log_limit(const char *file, int line, cdtime_t now, unsigned int *suppressed)
+{
+    uintptr_t hash = ((uintptr_t)file >> 3) * 31 + (uintptr_t)line;
+    log_limit_t *limit = &log_limits[hash % LOG_LIMIT_SLOTS];
+    long long window = (long long)CDTIME_T_TO_TIME_T(now);
+
+    if ((atomic_load(&limit->file) != file) || (atomic_load(&limit->line) != line)) {
+        /* Another call site used this slot, take it over. */
+        atomic_store(&limit->file, file);
+        atomic_store(&limit->line, line);
+        atomic_store(&limit->window, window);
+        atomic_store(&limit->count, 1);
+        atomic_store(&limit->suppressed, 0);
+        return true;
+    }
+
+    long long old_window = atomic_load(&limit->window);
+    if ((old_window != window) &&
+        atomic_compare_exchange_strong(&limit->window, &old_window, window)) {
+        atomic_store(&limit->count, 1);
+        *suppressed = atomic_exchange(&limit->suppressed, 0);
+        return true;
+    }
+
+    if (atomic_fetch_add(&limit->count, 1) < log_rate_limit)
+        return true;
+
+    atomic_fetch_add(&limit->suppressed, 1);
+    atomic_fetch_add(&log_suppressed, 1);
+    return false;
+}
+
+/* Claims the next free cell of the ring, returns NULL when the ring is full. */
+static log_cell_t *plugin_log_claim(size_t *rpos)
+{
+    size_t pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+
+    while (true) {
+        log_cell_t *cell = &log_cells[pos & log_mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *rpos = pos;
+                return cell;
+            }
+        } else if (diff < 0) {
+            /* The log thread has not released this cell yet: the ring is full. */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    return NULL;
+}
+
+static void plugin_log_publish(log_cell_t *cell, size_t pos)
+{
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    if (atomic_load(&log_sleeping)) {
+        pthread_mutex_lock(&log_wait_lock);
+        pthread_cond_signal(&log_wait_cond);
+        pthread_mutex_unlock(&log_wait_lock);
+    }
+}
+
+/* Dispatches the oldest published record, returns false if there is none. */
+static bool plugin_log_consume(void)
+{
+    size_t pos = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+    log_cell_t *cell = &log_cells[pos & log_mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq != (pos + 1))
+        return false;
+
+    plugin_dispatch_log_cell(cell);
+
+    atomic_store_explicit(&cell->seq, pos + log_mask + 1, memory_order_release);
+    atomic_store_explicit(&log_dequeue_pos, pos + 1, memory_order_release);
+
+    return true;
+}
+
+static size_t plugin_log_length(void)
+{
+    size_t dequeue_pos = atomic_load_explicit(&log_dequeue_pos, memory_order_acquire);
+    size_t enqueue_pos = atomic_load_explicit(&log_enqueue_pos, memory_order_acquire);
+
+    if (enqueue_pos < dequeue_pos)
+        return 0;
+
+    return enqueue_pos - dequeue_pos;
+}
+
+static void *plugin_log_thread(__attribute__((unused)) void *arg)
+{
+    while (true) {
+        if (plugin_log_consume())
+            continue;
+
+        if (plugin_log_length() > 0) {
+            /* A producer claimed a cell and is still formatting the message. */
+            sched_yield();
+            continue;
+        }
+
+        if (!atomic_load(&log_loop))
+            break;
+
+        pthread_mutex_lock(&log_wait_lock);
+        /* Producers check the sleeping flag after publishing a record, so
+         * looking at the ring again after setting it can not miss a wake up. */
+        atomic_store(&log_sleeping, true);
+        if ((plugin_log_length() == 0) && atomic_load(&log_loop)) {
+            cdtime_t abstime = cdtime() + TIME_T_TO_CDTIME_T_STATIC(1);
+            /* coverity[BAD_CHECK_OF_WAIT_COND] */
+            pthread_cond_timedwait(&log_wait_cond, &log_wait_lock,
+                                   &CDTIME_T_TO_TIMESPEC(abstime));
+        }
+        atomic_store(&log_sleeping, false);
+        pthread_mutex_unlock(&log_wait_lock);
+    }
+
+    return NULL;
+}
+
+static void plugin_vlog(int level, const char *plugin, const char *file, int line,
+                        const char *func, const char *format, va_list ap)
+{
+    cdtime_t now = cdtime();
+
+    if (!atomic_load(&log_thread_running)) {
+        char msg[LOG_MSG_MAX];
+        vsnprintf(msg, sizeof(msg), format, ap);
+        msg[sizeof(msg) - 1] = '\0';
+
+        log_msg_t log = {
+            .severity = level,
+            .time = now,
+            .plugin = plugin,
+            .file = file,
+            .line = line,
+            .func = func,
+            .msg = msg,
+        };
+
+        plugin_dispatch_log(&log);
+        return;
+    }
+
+    /* Errors are never rate limited nor dropped. */
+    unsigned int suppressed = 0;
+    if ((level > LOG_ERR) && (log_rate_limit > 0) &&
+        !plugin_log_limit(file, line, now, &suppressed))
+        return;
+
+    size_t pos = 0;
+    log_cell_t *cell = plugin_log_claim(&pos);
+    if (cell == NULL) {
+        /* With the ring full an error is delivered from the calling thread,
+         * unless the caller is a logger running in the log thread. */
+        if ((level <= LOG_ERR) && !pthread_equal(pthread_self(), log_thread)) {
+            char msg[LOG_MSG_MAX];
+            vsnprintf(msg, sizeof(msg), format, ap);
+            msg[sizeof(msg) - 1] = '\0';
+
+            log_msg_t log = {
+                .severity = level,
+                .time = now,
+                .plugin = plugin,
+                .file = file,
+                .line = line,
+                .func = func,
+                .msg = msg,
+            };
+
+            plugin_dispatch_log(&log);
+            return;
+        }
+
+        atomic_fetch_add(&log_dropped, 1);
+        return;
+    }
+
+    cell->severity = level;
+    cell->time = now;
+    cell->file = file;
+    cell->line = line;
+    cell->func = func;
+    cell->has_plugin = plugin != NULL;
+
+    /* The name of the context is copied, the plugin can be unregistered before
+     * the record is dispatched. */
+    plugin_ctx_t ctx = plugin_get_ctx();
+    const char *name = plugin != NULL ? plugin : ctx.name;
+    cell->plugin[0] = '\0';
+    if (name != NULL)
+        sstrncpy(cell->plugin, name, sizeof(cell->plugin));
+    cell->ctx = ctx;
+    cell->ctx.name = ctx.name != NULL ? cell->plugin : NULL;
+
+    int len = vsnprintf(cell->msg, sizeof(cell->msg), format, ap);
+    cell->msg[sizeof(cell->msg) - 1] = '\0';
+    if ((suppressed > 0) && (len >= 0) && ((size_t)len < (sizeof(cell->msg) - 1)))
+        snprintf(cell->msg + len, sizeof(cell->msg) - len,
+                 " (%u similar messages suppressed)", suppressed);
+
+    plugin_log_publish(cell, pos);
+}
+
+void plugin_log(int level, const char *file, int line, const char *func, const char *format, ...)
+{
+#ifndef NCOLLECTD_DEBUG
+    if (level >= LOG_DEBUG)
+        return;
+#endif
+
+    char const *name = plugin_get_ctx().name;
+    if (name == NULL)
+        name = "UNKNOWN";
+
+    va_list ap;
+    va_start(ap, format);
+    plugin_vlog(level, name, file, line, func, format, ap);
+    va_end(ap);
+}
+
+void daemon_log(int level, const char *file, int line, const char *func, const char *format, ...)
+{
+#ifndef NCOLLECTD_DEBUG
+    if (level >= LOG_DEBUG)
+        return;
+#endif
+
+    va_list ap;
+    va_start(ap, format);
+    plugin_vlog(level, NULL, file, line, func, format, ap);
+    va_end(ap);
+}
+
+int plugin_init_log(void)
+{
+    /* Without loggers the messages go to stderr, there is nothing to wait for. */
+    if ((list_log == NULL) || atomic_load(&log_thread_running))
+        return 0;
+
+    long size = global_option_get_long("log-queue-size", 1024);
+    if (size <= 0)
+        return 0;
+
+    if (size < LOG_QUEUE_MIN_SIZE)
+        size = LOG_QUEUE_MIN_SIZE;
+
+    size_t cells = 1;
+    while (cells < (size_t)size)
+        cells <<= 1;
+
+    long rate_limit = global_option_get_long("log-rate-limit", 10);
+    log_rate_limit = rate_limit > 0 ? (unsigned int)rate_limit : 0;
+
+    log_cells = calloc(cells, sizeof(*log_cells));
+    if (log_cells == NULL) {
+        ERROR("calloc failed.");
+        return -1;
+    }
+
+    log_mask = cells - 1;
+    for (size_t i = 0; i < cells; i++)
+        atomic_init(&log_cells[i].seq, i);
+    atomic_store(&log_enqueue_pos, 0);
+    atomic_store(&log_dequeue_pos, 0);
+    atomic_store(&log_loop, true);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    set_thread_setaffinity(&attr, "log");
+
+    int status = pthread_create(&log_thread, &attr, plugin_log_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        ERROR("pthread_create failed with status %i (%s).", status, STRERROR(status));
+        free(log_cells);
+        log_cells = NULL;
+        return -1;
+    }
+
+    set_thread_name(log_thread, "log");
+
+    atomic_store(&log_thread_running, true);
+
+    return 0;
+}
+
+/* Delivers every queued record and goes back to logging from the calling thread. */
+void plugin_shutdown_log(void)
+{
+    if (!atomic_load(&log_thread_running))
+        return;
+
+    atomic_store(&log_thread_running, false);
+
+    pthread_mutex_lock(&log_wait_lock);
+    atomic_store(&log_loop, false);
+    pthread_cond_signal(&log_wait_cond);
+    pthread_mutex_unlock(&log_wait_lock);
+
+    pthread_join(log_thread, NULL);
+
+    /* Records claimed by threads that saw the log thread running at the last moment. */
+    while (plugin_log_length() > 0) {
+        if (!plugin_log_consume())
+            sched_yield();
+    }
+}
+
+void plugin_free_log(void)
+{
+    destroy_all_callbacks(&list_log);
+
+    free(log_cells);
+    log_cells = NULL;
+}
+
+void plugin_log_stats(metric_family_t *fams)
+{
+    metric_family_append(&fams[FAM_NCOLLECTD_LOG_QUEUE_LENGTH],
+                         VALUE_GAUGE(atomic_load(&log_thread_running) ? plugin_log_length() : 0),
+                         NULL, NULL);
+    metric_family_append(&fams[FAM_NCOLLECTD_LOG_DROPPED],
+                         VALUE_COUNTER(atomic_load(&log_dropped)), NULL, NULL);
+    metric_family_append(&fams[FAM_NCOLLECTD_LOG_SUPPRESSED],
+                         VALUE_COUNTER(atomic_load(&log_suppressed)), NULL, NULL);
+}
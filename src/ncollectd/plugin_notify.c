@@ -589,6 +589,9 @@ int plugin_config_notify(void)
             return -1;
         }
 
+        if (journal_reclaim_start(notify_journal) != 0)
+            WARNING("cannot start the retention of journal '%s'.", notification_queue->journal.path);
+
         buf_t buf = BUF_CREATE;
         buf_resize(&buf, 4096);
         int status = plugin_notify_pack(&buf, NULL, NULL);
@@ -17,8 +17,10 @@
 #include "libutils/common.h"
 #include "libutils/time.h"
 #include "libutils/complain.h"
+#include "libutils/strlist.h"
 #include "libmdb/mdb.h"
 #include "queue.h"
+#include "ring.h"
 #include "journal.h"
 
 #include <stdatomic.h>
@@ -33,12 +35,36 @@ struct write_stats_s {
     atomic_ullong write_calls_failures;
     atomic_ullong write_cpu_user;
     atomic_ullong write_cpu_sys;
+    atomic_ullong journal_messages;
+    atomic_ullong journal_bytes;
     write_stats_t *next;
 };
 
 static pthread_mutex_t write_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static write_stats_t *write_stats;
 
+#define WRITE_BATCH_SIZE_DEFAULT 1024
+#define WRITE_JOURNAL_READ_BATCH 128
+/* The checkpoint of this subscriber is the last message saved in the mdb snapshot. */
+#define WRITE_JOURNAL_MDB "mdb"
+#define WRITE_JOURNAL_MDB_REPLAY "mdb-replay"
+
+typedef struct {
+    plugin_write_batch_cb write_cb;
+    size_t size;
+    cdtime_t timeout;
+    metric_family_list_t faml;
+    size_t elems_num;
+    void **elems;
+} write_batch_t;
+
+typedef struct {
+#ifdef HAVE_RUSAGE_THREAD
+    struct rusage usage;
+#endif
+    cdtime_t time;
+} write_account_t;
+
 typedef struct {
     queue_elem_t super;
     metric_family_t *fam;
@@ -48,6 +74,7 @@ typedef struct {
     queue_thread_t super;
     write_stats_t *stats;
     plugin_write_cb write_cb;
+    write_batch_t batch;
     plugin_flush_cb flush_cb;
     cdtime_t flush_interval;
     cdtime_t flush_timeout;
@@ -57,23 +84,40 @@ typedef struct {
 static queue_t *write_queue;
 
 typedef struct {
-    char *plugin;
+    ring_elem_t super;
     metric_family_t *fam;
-} write_journal_elem_t;
+} write_ring_elem_t;
+
+typedef struct {
+    ring_thread_t super;
+    write_stats_t *stats;
+    plugin_write_cb write_cb;
+    write_batch_t batch;
+    plugin_flush_cb flush_cb;
+    cdtime_t flush_interval;
+    cdtime_t flush_timeout;
+    user_data_t ud;
+} write_ring_thread_t;
+
+static ring_t *write_ring;
 
 typedef struct {
     journal_thread_t super;
     write_stats_t *stats;
     plugin_write_cb write_cb;
+    write_batch_t batch;
     plugin_flush_cb flush_cb;
     cdtime_t flush_interval;
     cdtime_t flush_timeout;
     journal_ctx_t *journal;
+    metric_family_view_t *views;
+    size_t views_num;
     user_data_t ud;
 } write_journal_thread_t;
 
 static journal_t *write_journal;
 static journal_ctx_t *write_journal_writer;
+static journal_ctx_t *write_journal_mdb;
 
 static atomic_ullong metrics_dispatched;
 
@@ -104,7 +148,10 @@ static int plugin_write_pack(buf_t *buf, metric_family_t *fam, const char *plugi
     return status;
 }
 
-static int plugin_write_unpack(rbuf_t *rbuf, write_journal_elem_t *elem)
+/* Unpack a journal message into a read-only view, the plugin name and the family
+ * point into the message. */
+static int plugin_write_unpack(rbuf_t *rbuf, char **plugin, metric_family_view_t *view,
+                               bool *has_fam)
 {
     rbuf_t srbuf = {0};
     int status = unpack_block(rbuf, &srbuf);
@@ -112,6 +159,9 @@ static int plugin_write_unpack(rbuf_t *rbuf, write_journal_elem_t *elem)
         return -1;
     }
 
+    *plugin = NULL;
+    *has_fam = false;
+
     while (true) {
         uint8_t id = 0;
 
@@ -119,10 +169,10 @@ static int plugin_write_unpack(rbuf_t *rbuf, write_journal_elem_t *elem)
 
         switch (id & 0xf0) {
         case WRITE_METRIC_FAMILY_NAME_ID:
-            elem->fam = metric_family_unpack(&srbuf);
+            *has_fam = metric_family_view_unpack(&srbuf, view) == 0;
             break;
         case WRITE_PLUGIN_NAME_ID:
-            status |= unpack_string(&srbuf, id, &elem->plugin);
+            status |= unpack_refstring(&srbuf, id, plugin);
             break;
         }
 
@@ -134,16 +184,77 @@ static int plugin_write_unpack(rbuf_t *rbuf, write_journal_elem_t *elem)
     }
 
     if (status != 0) {
-        free(elem->plugin);
-        metric_family_free(elem->fam);
+        metric_family_view_reset(view);
+        *has_fam = false;
         return -1;
     }
 
-    unpack_avance_block(rbuf, &srbuf);
+    return 0;
+}
+
+static void write_stats_remove(write_stats_t *writer_stats)
+{
+    if (writer_stats == NULL)
+        return;
+
+    pthread_mutex_lock(&write_stats_lock);
+    write_stats_t *prev = NULL;
+    write_stats_t *stats = write_stats;
+    while (stats != NULL) {
+        if (writer_stats == stats) {
+            write_stats_t *next = stats->next;
+            free(stats);
+            if (prev == NULL)
+                write_stats = next;
+            else
+                prev->next = next;
+            break;
+        }
+        prev = stats;
+        stats = stats->next;
+    }
+    pthread_mutex_unlock(&write_stats_lock);
+}
+
+static int write_batch_init(write_batch_t *batch, plugin_write_batch_cb write_cb,
+                            size_t size, cdtime_t timeout)
+{
+    *batch = (write_batch_t){0};
+
+    if (write_cb == NULL)
+        return 0;
+
+    batch->write_cb = write_cb;
+    batch->size = size == 0 ? WRITE_BATCH_SIZE_DEFAULT : size;
+    batch->timeout = timeout;
+
+    batch->faml.ptr = calloc(batch->size, sizeof(*batch->faml.ptr));
+    if (batch->faml.ptr == NULL) {
+        ERROR("calloc failed.");
+        return ENOMEM;
+    }
+    batch->faml.size = batch->size;
+    batch->faml.fixed = true;
+
+    batch->elems = calloc(batch->size, sizeof(*batch->elems));
+    if (batch->elems == NULL) {
+        ERROR("calloc failed.");
+        free(batch->faml.ptr);
+        batch->faml.ptr = NULL;
+        return ENOMEM;
+    }
 
     return 0;
 }
 
+static void write_batch_destroy(write_batch_t *batch)
+{
+    free(batch->faml.ptr);
+    batch->faml.ptr = NULL;
+    free(batch->elems);
+    batch->elems = NULL;
+}
+
 static void write_queue_elem_free(void *arg)
 {
     write_queue_elem_t *elem = arg;
@@ -162,56 +273,64 @@ static void write_queue_thread_free(void *arg)
     if (writer == NULL)
         return;
 
-    pthread_mutex_lock(&write_stats_lock);
-    if (writer->stats != NULL) {
-        write_stats_t *prev = NULL;
-        write_stats_t *stats = write_stats;
-        while (stats != NULL) {
-            if (writer->stats == stats) {
-                write_stats_t *next = stats->next;
-                free(stats);
-                writer->stats = NULL;
-                if (prev == NULL)
-                    write_stats = next;
-                else
-                    prev->next = next;
-                break;
-            }
-            prev = stats;
-            stats = stats->next;
-        }
-    }
-    pthread_mutex_unlock(&write_stats_lock);
+    write_stats_remove(writer->stats);
+    writer->stats = NULL;
+
+    write_batch_destroy(&writer->batch);
+
+    free(writer);
+}
+
+static void write_ring_elem_free(void *arg)
+{
+    write_ring_elem_t *elem = arg;
+
+    if (elem == NULL)
+        return;
+
+    metric_family_free(elem->fam);
+
+    free(elem);
+}
+
+static void write_ring_thread_free(void *arg)
+{
+    write_ring_thread_t *writer = arg;
+    if (writer == NULL)
+        return;
+
+    write_stats_remove(writer->stats);
+    writer->stats = NULL;
+
+    write_batch_destroy(&writer->batch);
 
     free(writer);
 }
 
+static void write_journal_views_free(write_journal_thread_t *writer)
+{
+    if (writer->views == NULL)
+        return;
+
+    for (size_t i = 0; i < writer->views_num; i++) {
+        metric_family_view_destroy(&writer->views[i]);
+    }
+    free(writer->views);
+    writer->views = NULL;
+    writer->views_num = 0;
+}
+
 static void write_journal_thread_free(void *arg)
 {
     write_journal_thread_t *writer = arg;
     if (writer == NULL)
         return;
 
-    pthread_mutex_lock(&write_stats_lock);
-    if (writer->stats != NULL) {
-        write_stats_t *prev = NULL;
-        write_stats_t *stats = write_stats;
-        while (stats != NULL) {
-            if (writer->stats == stats) {
-                write_stats_t *next = stats->next;
-                free(stats);
-                writer->stats = NULL;
-                if (prev == NULL)
-                    write_stats = next;
-                else
-                    prev->next = next;
-                break;
-            }
-            prev = stats;
-            stats = stats->next;
-        }
-    }
-    pthread_mutex_unlock(&write_stats_lock);
+    write_stats_remove(writer->stats);
+    writer->stats = NULL;
+
+    write_batch_destroy(&writer->batch);
+    write_journal_views_free(writer);
 
     if (writer->journal != NULL)
         journal_ctx_close(writer->journal);
@@ -220,30 +339,25 @@ static void write_journal_thread_free(void *arg)
 }
 
 
-static int plugin_write_fam(write_stats_t *stats, plugin_write_cb write_cb, user_data_t *ud,
-                            metric_family_t *fam)
+static void plugin_write_account_begin(write_account_t *account)
 {
-    if (fam == NULL)
-        return 0;
-
 #ifdef HAVE_RUSAGE_THREAD
-    struct rusage usage_start = {0};
-    getrusage(RUSAGE_THREAD, &usage_start);
+    getrusage(RUSAGE_THREAD, &account->usage);
 #endif
+    account->time = cdtime();
+}
 
-    cdtime_t start = cdtime();
-    int status = write_cb(fam, ud);
-    cdtime_t end = cdtime();
-
-    cdtime_t diff = end - start;
+static void plugin_write_account_end(write_stats_t *stats, write_account_t *account, int status)
+{
+    cdtime_t diff = cdtime() - account->time;
 
 #ifdef HAVE_RUSAGE_THREAD
-struct rusage usage_finish = {0};
+    struct rusage usage_finish = {0};
     getrusage(RUSAGE_THREAD, &usage_finish);
     cdtime_t cpu_user_time = TIMEVAL_TO_CDTIME_T(&usage_finish.ru_utime) -
-                             TIMEVAL_TO_CDTIME_T(&usage_start.ru_utime);
+                             TIMEVAL_TO_CDTIME_T(&account->usage.ru_utime);
     cdtime_t cpu_sys_time = TIMEVAL_TO_CDTIME_T(&usage_finish.ru_stime) -
-                            TIMEVAL_TO_CDTIME_T(&usage_start.ru_stime);
+                            TIMEVAL_TO_CDTIME_T(&account->usage.ru_stime);
 
     atomic_fetch_add(&stats->write_cpu_user, cpu_user_time);
     atomic_fetch_add(&stats->write_cpu_sys, cpu_sys_time);
@@ -253,10 +367,55 @@ struct rusage usage_finish = {0};
 
     if (status != 0)
         atomic_fetch_add(&stats->write_calls_failures, 1);
+}
+
+static int plugin_write_fam(write_stats_t *stats, plugin_write_cb write_cb, user_data_t *ud,
+                            metric_family_t *fam)
+{
+    if (fam == NULL)
+        return 0;
+
+    write_account_t account = {0};
+    plugin_write_account_begin(&account);
+
+    int status = write_cb(fam, ud);
+
+    plugin_write_account_end(stats, &account, status);
+
+    return status;
+}
+
+/* Deliver all the families collected in the batch with a single callback,
+ * the accounting is done once per batch instead of once per family. */
+static int plugin_write_batch(write_stats_t *stats, write_batch_t *batch, user_data_t *ud)
+{
+    if (batch->faml.pos == 0)
+        return 0;
+
+    write_account_t account = {0};
+    plugin_write_account_begin(&account);
+
+    int status = batch->write_cb(&batch->faml, ud);
+
+    plugin_write_account_end(stats, &account, status);
 
     return status;
 }
 
+static void plugin_write_journal_batch(write_journal_thread_t *writer)
+{
+    plugin_write_batch(writer->stats, &writer->batch, &writer->ud);
+
+    for (size_t i = 0; i < writer->batch.faml.pos; i++) {
+        if (writer->batch.faml.ptr[i] == &writer->views[i].fam)
+            metric_family_view_reset(&writer->views[i]);
+        else
+            metric_family_free(writer->batch.faml.ptr[i]);
+        writer->batch.faml.ptr[i] = NULL;
+    }
+    writer->batch.faml.pos = 0;
+}
+
 static size_t plugin_write_journal_read(write_journal_thread_t *writer)
 {
 
@@ -267,27 +426,68 @@ static size_t plugin_write_journal_read(write_journal_thread_t *writer)
 
     int count = journal_ctx_read_interval(writer->journal, &begin, &end);
     if (count > 0) {
-        for (int i = 0; i < count; i++, JOURNAL_ID_ADVANCE(&begin)) {
+        /* Mapped messages stay valid until the next read interval, so the views
+         * can be batched without copying the families. */
+        bool mapped = journal_ctx_read_mapped(writer->journal);
+        for (int i = 0; i < count; ) {
+            journal_message_t msgs[WRITE_JOURNAL_READ_BATCH];
+            int num = count - i;
+            if (num > WRITE_JOURNAL_READ_BATCH)
+                num = WRITE_JOURNAL_READ_BATCH;
+
             end = begin;
-            journal_message_t m;
-            if (journal_ctx_read_message(writer->journal, &begin, &m) == 0) {
-                write_journal_elem_t elem = {0};
+            num = journal_ctx_read_messages(writer->journal, &begin, msgs, num);
+            if (num <= 0) {
+                /* Skip the unreadable message. */
+                JOURNAL_ID_ADVANCE(&begin);
+                i++;
+                continue;
+            }
+
+            for (int j = 0; j < num; j++) {
+                size_t slot = writer->batch.write_cb != NULL ? writer->batch.faml.pos : 0;
+                metric_family_view_t *view = &writer->views[slot];
+                char *plugin = NULL;
+                bool has_fam = false;
                 rbuf_t rbuf = {0};
-                rbuf_init(&rbuf, m.mess, m.mess_len);
-                int status = plugin_write_unpack(&rbuf, &elem);
-                if (status == 0) {
-                    if ((elem.plugin == NULL) ||
-                        (strcasecmp(elem.plugin, writer->super.name) == 0))
-                    plugin_write_fam(writer->stats, writer->write_cb, &writer->ud, elem.fam);
-
-                    free(elem.plugin);
-                    metric_family_free(elem.fam);
+                rbuf_init(&rbuf, msgs[j].mess, msgs[j].mess_len);
+                int status = plugin_write_unpack(&rbuf, &plugin, view, &has_fam);
+                if ((status == 0) && has_fam) {
+                    bool write = (plugin == NULL) ||
+                                 (strcasecmp(plugin, writer->super.name) == 0);
+                    if (write && (writer->batch.write_cb != NULL)) {
+                        metric_family_t *fam = &view->fam;
+                        if (!mapped) {
+                            /* The message is overwritten by the next read, keep a copy. */
+                            fam = metric_family_clone(&view->fam);
+                            metric_family_view_reset(view);
+                        }
+                        if (fam != NULL) {
+                            metric_family_list_append(&writer->batch.faml, fam);
+                            if (writer->batch.faml.pos >= writer->batch.size)
+                                plugin_write_journal_batch(writer);
+                        }
+                    } else {
+                        if (write)
+                            plugin_write_fam(writer->stats, writer->write_cb, &writer->ud,
+                                             &view->fam);
+                        metric_family_view_reset(view);
+                    }
                 }
                 reads++;
+                atomic_fetch_add(&writer->stats->journal_bytes, msgs[j].mess_len);
             }
 
+            atomic_fetch_add(&writer->stats->journal_messages, (unsigned long long)num);
+
+            end.marker += num - 1;
+            begin.marker += num;
+            i += num;
         }
 
+        if (writer->batch.write_cb != NULL)
+            plugin_write_journal_batch(writer);
+
         journal_ctx_read_checkpoint(writer->journal, &end);
     }
 
@@ -348,6 +548,73 @@ static void *plugin_write_journal_thread(void *args)
     return NULL;
 }
 
+static void plugin_write_queue_elem(write_queue_thread_t *writer, write_queue_elem_t *elem)
+{
+    if (elem == NULL)
+        return;
+
+    DEBUG("%s: de-queue %p (remaining queue length: %ld)",
+          writer->super.name, (void *)elem, writer->super.queue_length);
+
+    /* Should elem be written to all plugins or this plugin in particular? */
+    if ((elem->super.plugin == NULL) ||
+        (strcasecmp(elem->super.plugin, writer->super.name) == 0)) {
+
+        plugin_ctx_t ctx = elem->super.ctx;
+        ctx.name = (char *)writer->super.name;
+        plugin_set_ctx(ctx);
+
+        plugin_write_fam(writer->stats, writer->write_cb, &writer->ud, elem->fam);
+    }
+
+    /* Free the element if it is not referenced by another queue or thread. */
+    queue_ref_single(write_queue, (queue_elem_t *)elem, -1);
+}
+
+/* Drain up to batch size elements, waiting at most batch timeout after the
+ * first one for more to arrive, and deliver them with one callback. */
+static void plugin_write_queue_batch(write_queue_thread_t *writer, cdtime_t abstime)
+{
+    write_batch_t *batch = &writer->batch;
+    cdtime_t deadline = abstime;
+
+    while (writer->super.loop && (batch->elems_num < batch->size)) {
+        write_queue_elem_t *elem = (write_queue_elem_t *)queue_dequeue(write_queue,
+                                                                       (queue_thread_t*)writer,
+                                                                       deadline);
+        if (elem == NULL) {
+            if ((batch->elems_num == 0) || (cdtime() >= deadline))
+                break;
+            continue;
+        }
+
+        if (batch->elems_num == 0) {
+            plugin_ctx_t ctx = elem->super.ctx;
+            ctx.name = (char *)writer->super.name;
+            plugin_set_ctx(ctx);
+
+            deadline = cdtime() + batch->timeout;
+            if ((abstime > 0) && (abstime < deadline))
+                deadline = abstime;
+        }
+
+        batch->elems[batch->elems_num++] = elem;
+
+        if ((elem->super.plugin == NULL) ||
+            (strcasecmp(elem->super.plugin, writer->super.name) == 0))
+            metric_family_list_append(&batch->faml, elem->fam);
+    }
+
+    plugin_write_batch(writer->stats, batch, &writer->ud);
+
+    for (size_t i = 0; i < batch->elems_num; i++) {
+        queue_ref_single(write_queue, batch->elems[i], -1);
+        batch->elems[i] = NULL;
+    }
+    batch->elems_num = 0;
+    batch->faml.pos = 0;
+}
+
 static void *plugin_write_queue_thread(void *args)
 {
     write_queue_thread_t *writer = args;
@@ -359,26 +626,112 @@ static void *plugin_write_queue_thread(void *args)
         if (writer->flush_cb != NULL)
             next_flush = cdtime() + writer->flush_interval;
 
-        write_queue_elem_t *elem = (write_queue_elem_t *)queue_dequeue(write_queue,
-                                                                       (queue_thread_t*)writer,
-                                                                       next_flush);
-        if (elem != NULL) {
-            DEBUG("%s: de-queue %p (remaining queue length: %ld)",
-                  writer->super.name, (void *)elem, writer->super.queue_length);
+        if (writer->batch.write_cb != NULL) {
+            plugin_write_queue_batch(writer, next_flush);
+        } else {
+            write_queue_elem_t *elem = (write_queue_elem_t *)queue_dequeue(write_queue,
+                                                                           (queue_thread_t*)writer,
+                                                                           next_flush);
+            plugin_write_queue_elem(writer, elem);
+        }
+
+        if (writer->flush_cb != NULL) {
+            cdtime_t now = cdtime();
+            if (now >= next_flush) {
+                writer->flush_cb(writer->flush_timeout, &writer->ud);
+                next_flush = now + writer->flush_interval;
+            }
+        }
+    }
 
-            /* Should elem be written to all plugins or this plugin in particular? */
-            if ((elem->super.plugin == NULL) ||
-                (strcasecmp(elem->super.plugin, writer->super.name) == 0)) {
+    DEBUG("%s: teardown", writer->super.name);
 
-                plugin_ctx_t ctx = elem->super.ctx;
-                ctx.name = (char *)writer->super.name;
-                plugin_set_ctx(ctx);
+    /* Cleanup before leaving */
+    free_userdata(&writer->ud);
+    writer->ud.data = NULL;
+    writer->ud.free_func = NULL;
 
-                plugin_write_fam(writer->stats, writer->write_cb, &writer->ud, elem->fam);
-            }
+    pthread_exit(NULL);
+
+    return NULL;
+}
 
-            /* Free the element if it is not referenced by another queue or thread. */
-            queue_ref_single(write_queue, (queue_elem_t *)elem, -1);
+static void plugin_write_ring_elem(write_ring_thread_t *writer, write_ring_elem_t *elem)
+{
+    if (elem == NULL)
+        return;
+
+    DEBUG("%s: de-queue %p (remaining ring length: %ld)",
+          writer->super.name, (void *)elem, ring_thread_length(&writer->super));
+
+    /* Elements for other plugins are never pushed into this ring. */
+    plugin_ctx_t ctx = elem->super.ctx;
+    ctx.name = (char *)writer->super.name;
+    plugin_set_ctx(ctx);
+
+    plugin_write_fam(writer->stats, writer->write_cb, &writer->ud, elem->fam);
+
+    /* Free the element if it is not referenced by another ring. */
+    ring_ref_single(write_ring, (ring_elem_t *)elem, -1);
+}
+
+static void plugin_write_ring_batch(write_ring_thread_t *writer, cdtime_t abstime)
+{
+    write_batch_t *batch = &writer->batch;
+    cdtime_t deadline = abstime;
+
+    while (atomic_load(&writer->super.loop) && (batch->elems_num < batch->size)) {
+        write_ring_elem_t *elem = (write_ring_elem_t *)ring_dequeue(write_ring,
+                                                                    (ring_thread_t *)writer,
+                                                                    deadline);
+        if (elem == NULL) {
+            if ((batch->elems_num == 0) || (cdtime() >= deadline))
+                break;
+            continue;
+        }
+
+        if (batch->elems_num == 0) {
+            plugin_ctx_t ctx = elem->super.ctx;
+            ctx.name = (char *)writer->super.name;
+            plugin_set_ctx(ctx);
+
+            deadline = cdtime() + batch->timeout;
+            if ((abstime > 0) && (abstime < deadline))
+                deadline = abstime;
+        }
+
+        batch->elems[batch->elems_num++] = elem;
+        metric_family_list_append(&batch->faml, elem->fam);
+    }
+
+    plugin_write_batch(writer->stats, batch, &writer->ud);
+
+    for (size_t i = 0; i < batch->elems_num; i++) {
+        ring_ref_single(write_ring, batch->elems[i], -1);
+        batch->elems[i] = NULL;
+    }
+    batch->elems_num = 0;
+    batch->faml.pos = 0;
+}
+
+static void *plugin_write_ring_thread(void *args)
+{
+    write_ring_thread_t *writer = args;
+
+    DEBUG("start '%s'", writer->super.name);
+    cdtime_t next_flush = 0;
+
+    while (atomic_load(&writer->super.loop)) {
+        if (writer->flush_cb != NULL)
+            next_flush = cdtime() + writer->flush_interval;
+
+        if (writer->batch.write_cb != NULL) {
+            plugin_write_ring_batch(writer, next_flush);
+        } else {
+            write_ring_elem_t *elem = (write_ring_elem_t *)ring_dequeue(write_ring,
+                                                                        (ring_thread_t *)writer,
+                                                                        next_flush);
+            plugin_write_ring_elem(writer, elem);
         }
 
         if (writer->flush_cb != NULL) {
@@ -562,7 +915,8 @@ int plugin_dispatch_metric_family_array_filtered(metric_family_t *fams, size_t s
 }
 
 int plugin_register_write_journal(char *full_name, write_stats_t *writer_stats,
-                                  plugin_write_cb write_cb, plugin_flush_cb flush_cb,
+                                  plugin_write_cb write_cb, plugin_write_batch_cb write_batch_cb,
+                                  size_t batch_size, cdtime_t batch_timeout, plugin_flush_cb flush_cb,
                                   cdtime_t flush_interval, cdtime_t flush_timeout,
                                   user_data_t const *ud)
 {
@@ -576,6 +930,10 @@ int plugin_register_write_journal(char *full_name, write_stats_t *writer_stats,
     writer->stats = writer_stats;
 
     writer->write_cb = write_cb;
+    if (write_batch_init(&writer->batch, write_batch_cb, batch_size, batch_timeout) != 0) {
+        free(writer);
+        return -1;
+    }
     writer->flush_cb = flush_cb;
     if (flush_interval == 0)
         writer->flush_interval = plugin_get_interval();
@@ -591,9 +949,20 @@ int plugin_register_write_journal(char *full_name, write_stats_t *writer_stats,
 
     journal_ctx_add_subscriber(write_journal_writer, full_name, JOURNAL_END);
 
+    writer->views_num = writer->batch.write_cb != NULL ? writer->batch.size : 1;
+    writer->views = calloc(writer->views_num, sizeof(*writer->views));
+    if (writer->views == NULL) {
+        ERROR("calloc failed.");
+        write_batch_destroy(&writer->batch);
+        free(writer);
+        return -1;
+    }
+
     writer->journal = journal_get_reader(write_journal, full_name);
     if (writer->journal == NULL) {
         ERROR("cannot create new journal context.");
+        write_batch_destroy(&writer->batch);
+        write_journal_views_free(writer);
         free(writer);
         return -1;
     }
@@ -602,6 +971,8 @@ int plugin_register_write_journal(char *full_name, write_stats_t *writer_stats,
                                       full_name, plugin_write_journal_thread, (void *)writer);
     if (status != 0) {
         journal_ctx_close(writer->journal);
+        write_batch_destroy(&writer->batch);
+        write_journal_views_free(writer);
         free(writer);
         return -1;
     }
@@ -610,7 +981,8 @@ int plugin_register_write_journal(char *full_name, write_stats_t *writer_stats,
 }
 
 int plugin_register_write_queue(char *full_name, write_stats_t *writer_stats,
-                                plugin_write_cb write_cb, plugin_flush_cb flush_cb,
+                                plugin_write_cb write_cb, plugin_write_batch_cb write_batch_cb,
+                                size_t batch_size, cdtime_t batch_timeout, plugin_flush_cb flush_cb,
                                 cdtime_t flush_interval, cdtime_t flush_timeout,
                                 user_data_t const *ud)
 {
@@ -624,6 +996,10 @@ int plugin_register_write_queue(char *full_name, write_stats_t *writer_stats,
     writer->stats = writer_stats;
 
     writer->write_cb = write_cb;
+    if (write_batch_init(&writer->batch, write_batch_cb, batch_size, batch_timeout) != 0) {
+        free(writer);
+        return -1;
+    }
     writer->flush_cb = flush_cb;
     if (flush_interval == 0)
         writer->flush_interval = plugin_get_interval();
@@ -640,6 +1016,7 @@ int plugin_register_write_queue(char *full_name, write_stats_t *writer_stats,
     int status = queue_thread_start(write_queue, (queue_thread_t *)writer,
                                     full_name, plugin_write_queue_thread, (void *)writer);
     if (status != 0) {
+        write_batch_destroy(&writer->batch);
         free(writer);
         return -1;
     }
@@ -647,9 +1024,56 @@ int plugin_register_write_queue(char *full_name, write_stats_t *writer_stats,
     return 0;
 }
 
-int plugin_register_write(const char *group, const char *name, plugin_write_cb write_cb,
-                          plugin_flush_cb flush_cb, cdtime_t flush_interval, cdtime_t flush_timeout,
-                          user_data_t const *ud)
+int plugin_register_write_ring(char *full_name, write_stats_t *writer_stats,
+                               plugin_write_cb write_cb, plugin_write_batch_cb write_batch_cb,
+                               size_t batch_size, cdtime_t batch_timeout, plugin_flush_cb flush_cb,
+                               cdtime_t flush_interval, cdtime_t flush_timeout,
+                               user_data_t const *ud)
+{
+    write_ring_thread_t *writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        ERROR("calloc failed.");
+        return -1;
+    }
+
+    writer_stats->plugin = full_name;
+    writer->stats = writer_stats;
+
+    writer->write_cb = write_cb;
+    if (write_batch_init(&writer->batch, write_batch_cb, batch_size, batch_timeout) != 0) {
+        free(writer);
+        return -1;
+    }
+    writer->flush_cb = flush_cb;
+    if (flush_interval == 0)
+        writer->flush_interval = plugin_get_interval();
+    else
+        writer->flush_interval = flush_interval;
+    writer->flush_timeout = flush_timeout;
+
+    if (ud == NULL) {
+        writer->ud = (user_data_t){ .data = NULL, .free_func = NULL };
+    } else {
+        writer->ud = *ud;
+    }
+
+    int status = ring_thread_start(write_ring, (ring_thread_t *)writer,
+                                   full_name, plugin_write_ring_thread, (void *)writer);
+    if (status != 0) {
+        write_batch_destroy(&writer->batch);
+        free(writer);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int plugin_register_write_internal(const char *group, const char *name,
+                                          plugin_write_cb write_cb,
+                                          plugin_write_batch_cb write_batch_cb,
+                                          size_t batch_size, cdtime_t batch_timeout,
+                                          plugin_flush_cb flush_cb, cdtime_t flush_interval,
+                                          cdtime_t flush_timeout, user_data_t const *ud)
 {
     if (group == NULL) {
         ERROR("group name is NULL.");
@@ -674,10 +1098,16 @@ int plugin_register_write(const char *group, const char *name, plugin_write_cb w
     int status = 0;
 
     if (write_queue != NULL) {
-        status = plugin_register_write_queue(full_name, writer_stats, write_cb, flush_cb,
+        status = plugin_register_write_queue(full_name, writer_stats, write_cb, write_batch_cb,
+                                             batch_size, batch_timeout, flush_cb,
                                              flush_interval, flush_timeout, ud);
+    } else if (write_ring != NULL) {
+        status = plugin_register_write_ring(full_name, writer_stats, write_cb, write_batch_cb,
+                                            batch_size, batch_timeout, flush_cb,
+                                            flush_interval, flush_timeout, ud);
     } else if (write_journal != NULL) {
-        status = plugin_register_write_journal(full_name, writer_stats, write_cb, flush_cb,
+        status = plugin_register_write_journal(full_name, writer_stats, write_cb, write_batch_cb,
+                                               batch_size, batch_timeout, flush_cb,
                                                flush_interval, flush_timeout, ud);
     }
 
@@ -696,10 +1126,37 @@ int plugin_register_write(const char *group, const char *name, plugin_write_cb w
     return 0;
 }
 
+int plugin_register_write(const char *group, const char *name, plugin_write_cb write_cb,
+                          plugin_flush_cb flush_cb, cdtime_t flush_interval, cdtime_t flush_timeout,
+                          user_data_t const *ud)
+{
+    return plugin_register_write_internal(group, name, write_cb, NULL, 0, 0,
+                                          flush_cb, flush_interval, flush_timeout, ud);
+}
+
+int plugin_register_write_batch(const char *group, const char *name,
+                                plugin_write_batch_cb write_batch_cb,
+                                plugin_flush_cb flush_cb, cdtime_t flush_interval,
+                                cdtime_t flush_timeout, size_t batch_size, cdtime_t batch_timeout,
+                                user_data_t const *ud)
+{
+    if (write_batch_cb == NULL) {
+        ERROR("write batch callback is NULL.");
+        free_userdata(ud);
+        return EINVAL;
+    }
+
+    return plugin_register_write_internal(group, name, NULL, write_batch_cb,
+                                          batch_size, batch_timeout,
+                                          flush_cb, flush_interval, flush_timeout, ud);
+}
+
 strlist_t *plugin_get_writers(void)
 {
     if (write_queue != NULL)
         return queue_get_threads(write_queue);
+    if (write_ring != NULL)
+        return ring_get_threads(write_ring);
     if (write_journal != NULL)
         return journal_get_threads(write_journal);
     return NULL;
@@ -709,6 +1166,8 @@ int plugin_unregister_write(const char *name)
 {
     if (write_queue != NULL)
         return queue_thread_stop(write_queue, name);
+    if (write_ring != NULL)
+        return ring_thread_stop(write_ring, name);
     if (write_journal != NULL)
         return journal_thread_stop(write_journal, name);
     return 0;
@@ -741,6 +1200,28 @@ int plugin_write(const char *plugin, metric_family_t *fam, bool clone)
         atomic_fetch_add(&metrics_dispatched, (unsigned long long)fam_copy->metric.num);
 
         return queue_enqueue(write_queue, plugin, (queue_elem_t *)elem);
+    } else if (write_ring != NULL) {
+        metric_family_t *fam_copy = fam;
+        if (clone) {
+            fam_copy = metric_family_clone(fam);
+            if (fam_copy == NULL) {
+              int status = errno;
+              ERROR("metric_family_clone failed: %s", STRERROR(status));
+              return status;
+            }
+        }
+
+        write_ring_elem_t *elem = calloc(1, sizeof(*elem));
+        if (elem == NULL) {
+            metric_family_free(fam_copy);
+            return ENOMEM;
+        }
+
+        elem->fam = fam_copy;
+
+        atomic_fetch_add(&metrics_dispatched, (unsigned long long)fam_copy->metric.num);
+
+        return ring_enqueue(write_ring, plugin, (ring_elem_t *)elem);
     } else if (write_journal != NULL) {
         if (write_journal_writer != NULL) {
             buf_t buf = BUF_CREATE;
@@ -752,12 +1233,16 @@ int plugin_write(const char *plugin, metric_family_t *fam, bool clone)
                 return status;
             }
 
-            if(journal_ctx_write(write_journal_writer, buf.ptr, buf_len(&buf)) != 0)
+            int written = journal_ctx_write_staged(write_journal_writer, buf.ptr, buf_len(&buf));
+            if (written >= 0)
                 atomic_fetch_add(&metrics_dispatched, (unsigned long long)fam->metric.num);
 
-            pthread_mutex_lock(&write_journal->lock);
-            pthread_cond_broadcast(&write_journal->cond);
-            pthread_mutex_unlock(&write_journal->lock);
+            /* Only the thread that flushed the staged messages wakes up the readers. */
+            if (written > 0) {
+                pthread_mutex_lock(&write_journal->lock);
+                pthread_cond_broadcast(&write_journal->cond);
+                pthread_mutex_unlock(&write_journal->lock);
+            }
 
             buf_destroy(&buf);
 
@@ -779,7 +1264,17 @@ int plugin_config_write(void)
 
     cf_queue_t *metric_queue = global_option_get_metric_queue();
 
-    if (metric_queue->type == CF_QUEUE_MEMORY) {
+    if ((metric_queue->type == CF_QUEUE_MEMORY) &&
+        (metric_queue->memory.mode == CF_QUEUE_MEMORY_RING)) {
+        write_ring = ring_new("metrics", metric_queue->memory.limit_high,
+                                         metric_queue->memory.limit_low);
+        if (write_ring == NULL) {
+            ERROR("cannot alloc ring queue");
+            return -1;
+        }
+        write_ring->free_elem_cb = write_ring_elem_free;
+        write_ring->free_thread_cb = write_ring_thread_free;
+    } else if (metric_queue->type == CF_QUEUE_MEMORY) {
         write_queue = queue_new("metrics");
         if (write_queue == NULL) {
             ERROR("cannot alloc queue");
@@ -813,6 +1308,9 @@ int plugin_config_write(void)
                 return -1;
             }
 
+            if (journal_reclaim_start(write_journal) != 0)
+                WARNING("cannot start the retention of journal '%s'.", metric_queue->journal.path);
+
             buf_t buf = BUF_CREATE;
             buf_resize(&buf, 4096);
             int status = plugin_write_pack(&buf, NULL, NULL);
@@ -831,8 +1329,115 @@ int plugin_config_write(void)
     return 0;
 }
 
+/* Insert in the mdb the messages written in the journal after the last mdb
+ * snapshot, the samples already in the snapshot are rejected by the mdb. */
+static int plugin_write_replay_mdb(void)
+{
+    journal_id_t checkpoint = {0};
+    if (journal_ctx_get_checkpoint(write_journal_writer, WRITE_JOURNAL_MDB, &checkpoint) != 0)
+        return 0;
+
+    journal_remove_subscriber(write_journal, WRITE_JOURNAL_MDB_REPLAY);
+    if (journal_ctx_set_subscriber_checkpoint(write_journal_writer, WRITE_JOURNAL_MDB_REPLAY,
+                                              &checkpoint) != 0) {
+        ERROR("cannot add journal subscriber '%s': %s.", WRITE_JOURNAL_MDB_REPLAY,
+              journal_ctx_err_string(write_journal_writer));
+        return -1;
+    }
+
+    journal_ctx_t *reader = journal_get_reader(write_journal, WRITE_JOURNAL_MDB_REPLAY);
+    if (reader == NULL) {
+        ERROR("cannot create new journal context.");
+        journal_remove_subscriber(write_journal, WRITE_JOURNAL_MDB_REPLAY);
+        return -1;
+    }
+
+    cdtime_t start = cdtime();
+    uint64_t messages = 0;
+
+    while (true) {
+        journal_id_t begin = {0};
+        journal_id_t end = {0};
+
+        int count = journal_ctx_read_interval(reader, &begin, &end);
+        if (count <= 0)
+            break;
+
+        for (int i = 0; i < count; i++) {
+            journal_message_t msg = {0};
+            if (journal_ctx_read_message(reader, &begin, &msg) == 0) {
+                metric_family_view_t view = {0};
+                char *plugin = NULL;
+                bool has_fam = false;
+                rbuf_t rbuf = {0};
+                rbuf_init(&rbuf, msg.mess, msg.mess_len);
+                int status = plugin_write_unpack(&rbuf, &plugin, &view, &has_fam);
+                if ((status == 0) && has_fam) {
+                    mdb_insert_metric_family(mdb, &view.fam);
+                    metric_family_view_reset(&view);
+                }
+                messages++;
+            }
+            end = begin;
+            JOURNAL_ID_ADVANCE(&begin);
+        }
+
+        journal_ctx_read_checkpoint(reader, &end);
+    }
+
+    journal_ctx_close(reader);
+    journal_remove_subscriber(write_journal, WRITE_JOURNAL_MDB_REPLAY);
+
+    if (messages > 0)
+        INFO("Replayed %" PRIu64 " journal messages in the mdb in %.3f seconds.",
+             messages, CDTIME_T_TO_DOUBLE(cdtime() - start));
+
+    return 0;
+}
+
+int plugin_write_sync_mdb(void)
+{
+    journal_id_t id = {0};
+    bool checkpoint = false;
+    /* The id is taken before the snapshot: the messages written meanwhile are
+     * replayed again. */
+    if (write_journal_mdb != NULL)
+        checkpoint = journal_ctx_last_log_id(write_journal_mdb, &id) == 0;
+
+    int status = mdb_sync(mdb);
+    if (status != 0)
+        return status;
+
+    if (checkpoint && (journal_ctx_read_checkpoint(write_journal_mdb, &id) != 0)) {
+        ERROR("cannot set the journal checkpoint of '%s': %s.", WRITE_JOURNAL_MDB,
+              journal_ctx_err_string(write_journal_mdb));
+        return -1;
+    }
+
+    return 0;
+}
+
 int plugin_init_write(void)
 {
+    if (write_journal == NULL)
+        return 0;
+
+    const char *mdb_path = global_option_get("mdb-path");
+    if ((mdb_path == NULL) || (mdb_path[0] == '\0'))
+        return 0;
+
+    int status = plugin_write_replay_mdb();
+    if (status != 0)
+        return status;
+
+    journal_ctx_add_subscriber(write_journal_writer, WRITE_JOURNAL_MDB, JOURNAL_END);
+
+    write_journal_mdb = journal_get_reader(write_journal, WRITE_JOURNAL_MDB);
+    if (write_journal_mdb == NULL) {
+        ERROR("cannot create new journal context.");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -845,7 +1450,17 @@ void plugin_shutdown_write(void)
 
     plugin_unregister_write(NULL);
 
+    if (write_ring != NULL) {
+        ring_free(write_ring);
+        write_ring = NULL;
+    }
+
     if (write_journal != NULL ){
+        if (write_journal_mdb != NULL) {
+            journal_ctx_close(write_journal_mdb);
+            write_journal_mdb = NULL;
+        }
+
         if (write_journal_writer != NULL) {
             journal_ctx_close(write_journal_writer);
             write_journal_writer = NULL;
@@ -865,12 +1480,42 @@ void plugin_write_stats(metric_family_t *fams)
         uint64_t dropped = queue_dropped(write_queue);
         metric_family_append(&fams[FAM_NCOLLECTD_WRITE_QUEUE_DROPPED],
                              VALUE_COUNTER(dropped), NULL, NULL);
+    } else if (write_ring != NULL) {
+        long length = ring_length(write_ring);
+        metric_family_append(&fams[FAM_NCOLLECTD_WRITE_QUEUE_LENGTH],
+                             VALUE_GAUGE(length), NULL, NULL);
+        uint64_t dropped = ring_dropped(write_ring);
+        metric_family_append(&fams[FAM_NCOLLECTD_WRITE_QUEUE_DROPPED],
+                             VALUE_COUNTER(dropped), NULL, NULL);
+    } else if ((write_journal != NULL) && (write_journal_writer != NULL)) {
+        uint64_t segments = 0;
+        uint64_t size = 0;
+        if (journal_ctx_storage_stats(write_journal_writer, &segments, &size) == 0) {
+            metric_family_append(&fams[FAM_NCOLLECTD_WRITE_JOURNAL_SEGMENTS],
+                                 VALUE_GAUGE(segments), NULL, NULL);
+            metric_family_append(&fams[FAM_NCOLLECTD_WRITE_JOURNAL_SIZE_BYTES],
+                                 VALUE_GAUGE(size), NULL, NULL);
+        }
+
+        uint64_t dropped_segments = 0;
+        uint64_t dropped_messages = 0;
+        uint64_t dropped_bytes = 0;
+        journal_reclaim_stats(write_journal, &dropped_segments, &dropped_messages, &dropped_bytes);
+        metric_family_append(&fams[FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_SEGMENTS],
+                             VALUE_COUNTER(dropped_segments), NULL, NULL);
+        metric_family_append(&fams[FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_MESSAGES],
+                             VALUE_COUNTER(dropped_messages), NULL, NULL);
+        metric_family_append(&fams[FAM_NCOLLECTD_WRITE_JOURNAL_DROPPED_BYTES],
+                             VALUE_COUNTER(dropped_bytes), NULL, NULL);
     }
 
     unsigned long long dispatched = atomic_load(&metrics_dispatched);
     metric_family_append(&fams[FAM_NCOLLECTD_METRICS_DISPACHED],
                          VALUE_COUNTER(dispatched), NULL, NULL);
 
+    bool journal = (write_journal != NULL) && (write_journal_writer != NULL);
+    strlist_t plugins = {0};
+
     pthread_mutex_lock(&write_stats_lock);
 
     write_stats_t *stats = write_stats;
@@ -897,10 +1542,48 @@ void plugin_write_stats(metric_family_t *fams)
                              VALUE_COUNTER_FLOAT64(CDTIME_T_TO_DOUBLE(write_cpu_sys)), NULL,
                              &LABEL_PAIR_CONST("plugin", stats->plugin), NULL);
 
+        if (journal) {
+            unsigned long long journal_messages = atomic_load(&stats->journal_messages);
+            unsigned long long journal_bytes = atomic_load(&stats->journal_bytes);
+
+            metric_family_append(&fams[FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_MESSAGES],
+                                 VALUE_COUNTER(journal_messages), NULL,
+                                 &LABEL_PAIR_CONST("plugin", stats->plugin), NULL);
+            metric_family_append(&fams[FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_REPLAYED_BYTES],
+                                 VALUE_COUNTER(journal_bytes), NULL,
+                                 &LABEL_PAIR_CONST("plugin", stats->plugin), NULL);
+
+            strlist_append(&plugins, stats->plugin);
+        }
+
         stats = stats->next;
     }
 
     pthread_mutex_unlock(&write_stats_lock);
+
+    /* The lag reads the checkpoints and the segments from disk, it is computed
+     * outside the lock with a reader of its own so a slow disk does not stall
+     * the writers or share the context of the journal writer. */
+    for (size_t i = 0; i < strlist_size(&plugins); i++) {
+        journal_ctx_t *reader = journal_get_reader(write_journal, plugins.ptr[i]);
+        if (reader == NULL)
+            continue;
+
+        uint64_t lag_messages = 0;
+        uint64_t lag_bytes = 0;
+        if (journal_ctx_subscriber_lag(reader, plugins.ptr[i], &lag_messages, &lag_bytes) == 0) {
+            metric_family_append(&fams[FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_MESSAGES],
+                                 VALUE_GAUGE(lag_messages), NULL,
+                                 &LABEL_PAIR_CONST("plugin", plugins.ptr[i]), NULL);
+            metric_family_append(&fams[FAM_NCOLLECTD_PLUGIN_WRITE_JOURNAL_LAG_BYTES],
+                                 VALUE_GAUGE(lag_bytes), NULL,
+                                 &LABEL_PAIR_CONST("plugin", plugins.ptr[i]), NULL);
+        }
+
+        journal_ctx_close(reader);
+    }
+
+    strlist_destroy(&plugins);
 }
 
 void plugin_write_test_mode(bool mode)
@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: GPL-2.0-only OR MIT
+
+#include "ncollectd.h"
+#include "plugin_internal.h"
+#include "libutils/common.h"
+#include "libutils/random.h"
+#include "libutils/time.h"
+#include "libutils/complain.h"
+
+#include <sched.h>
+
+#include "ring.h"
+
+#define RING_DEFAULT_SIZE 65536
+#define RING_MIN_SIZE 64
+
+static bool ring_push(ring_thread_t *thread, ring_elem_t *elem)
+{
+    size_t pos = atomic_load_explicit(&thread->enqueue_pos, memory_order_relaxed);
+
+    while (true) {
+        ring_cell_t *cell = &thread->cells[pos & thread->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&thread->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->elem = elem;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* The consumer has not released this cell yet: the ring is full. */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&thread->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    return false;
+}
+
+static ring_elem_t *ring_pop(ring_thread_t *thread)
+{
+    size_t pos = atomic_load_explicit(&thread->dequeue_pos, memory_order_relaxed);
+    ring_cell_t *cell = &thread->cells[pos & thread->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq != (pos + 1))
+        return NULL;
+
+    ring_elem_t *elem = cell->elem;
+    cell->elem = NULL;
+    atomic_store_explicit(&cell->seq, pos + thread->mask + 1, memory_order_release);
+    atomic_store_explicit(&thread->dequeue_pos, pos + 1, memory_order_release);
+
+    return elem;
+}
+
+long ring_thread_length(ring_thread_t *thread)
+{
+    size_t dequeue_pos = atomic_load_explicit(&thread->dequeue_pos, memory_order_acquire);
+    size_t enqueue_pos = atomic_load_explicit(&thread->enqueue_pos, memory_order_acquire);
+
+    if (enqueue_pos < dequeue_pos)
+        return 0;
+
+    return (long)(enqueue_pos - dequeue_pos);
+}
+
+int ring_ref_single(ring_t *ring, ring_elem_t *elem, long dir)
+{
+    long ref_count = atomic_fetch_add(&elem->ref_count, dir) + dir;
+
+    assert(ref_count >= 0);
+
+    if (ref_count == 0) {
+        free(elem->plugin);
+
+        if (ring->free_elem_cb != NULL)
+            ring->free_elem_cb(elem);
+        else
+            free(elem);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool ring_drop(ring_t *ring, long length)
+{
+    if (ring->limit_high == 0)
+        return false;
+
+    if (length >= ring->limit_high)
+        return true;
+
+    if (length < ring->limit_low)
+        return false;
+
+    /* Between limit_low and limit_high the probability to drop the element
+     * increases linearly with the length of this thread's ring. */
+    long range = ring->limit_high - ring->limit_low;
+    return (long)(cdrand_u() % range) < (length - ring->limit_low);
+}
+
+int ring_enqueue(ring_t *ring, const char *plugin, ring_elem_t *elem)
+{
+    if (elem == NULL)
+        return EINVAL;
+
+    char *dup_plugin = NULL;
+    if (plugin != NULL) {
+        dup_plugin = strdup(plugin);
+        if (dup_plugin == NULL) {
+            PLUGIN_ERROR("strdup failed");
+            return ENOMEM;
+        }
+    }
+
+    elem->ctx = plugin_get_ctx();
+    elem->plugin = dup_plugin;
+    /* Hold a reference while the element is being published, so a consumer
+     * can not free it before it has been pushed into every ring. */
+    atomic_init(&elem->ref_count, 1);
+
+    ring_threads_t *threads = atomic_load_explicit(&ring->threads, memory_order_acquire);
+    if ((threads == NULL) || (threads->num == 0)) {
+        c_complain_once(LOG_WARNING, &ring->complaint,
+                        "No %s callback has been registered. "
+                        "Please load at least one output plugin, "
+                        "if you want the collected data to be stored.", ring->kind);
+        ring_ref_single(ring, elem, -1);
+        return ENOENT;
+    }
+
+    for (size_t i = 0; i < threads->num; i++) {
+        ring_thread_t *thread = threads->ptr[i];
+
+        /* Elements for a particular plugin are only pushed into its own ring. */
+        if ((plugin != NULL) && (strcasecmp(plugin, thread->name) != 0))
+            continue;
+
+        atomic_fetch_add(&thread->producers, 1);
+        if (atomic_load(&thread->closed)) {
+            atomic_fetch_sub(&thread->producers, 1);
+            continue;
+        }
+
+        bool pushed = false;
+        if (!ring_drop(ring, ring_thread_length(thread))) {
+            atomic_fetch_add(&elem->ref_count, 1);
+            pushed = ring_push(thread, elem);
+            if (!pushed)
+                atomic_fetch_sub(&elem->ref_count, 1);
+        }
+
+        if (!pushed)
+            atomic_fetch_add(&ring->dropped, 1);
+
+        atomic_fetch_sub(&thread->producers, 1);
+
+        if (pushed && atomic_load(&thread->sleeping)) {
+            pthread_mutex_lock(&thread->wait_lock);
+            pthread_cond_signal(&thread->wait_cond);
+            pthread_mutex_unlock(&thread->wait_lock);
+        }
+    }
+
+    ring_ref_single(ring, elem, -1);
+
+    return 0;
+}
+
+ring_elem_t *ring_dequeue(__attribute__((unused)) ring_t *ring, ring_thread_t *reader,
+                          cdtime_t abstime)
+{
+    ring_elem_t *elem = ring_pop(reader);
+    if (elem != NULL)
+        return elem;
+
+    pthread_mutex_lock(&reader->wait_lock);
+    /* Producers check the sleeping flag after publishing an element, so
+     * looking at the ring again after setting it can not miss a wake up. */
+    atomic_store(&reader->sleeping, true);
+    if ((ring_thread_length(reader) == 0) && atomic_load(&reader->loop)) {
+        if (abstime > 0) {
+            /* coverity[BAD_CHECK_OF_WAIT_COND] */
+            pthread_cond_timedwait(&reader->wait_cond, &reader->wait_lock,
+                                   &CDTIME_T_TO_TIMESPEC(abstime));
+        } else {
+            /* coverity[BAD_CHECK_OF_WAIT_COND] */
+            pthread_cond_wait(&reader->wait_cond, &reader->wait_lock);
+        }
+    }
+    atomic_store(&reader->sleeping, false);
+    pthread_mutex_unlock(&reader->wait_lock);
+
+    return NULL;
+}
+
+long ring_length(ring_t *ring)
+{
+    long length = 0;
+
+    ring_threads_t *threads = atomic_load_explicit(&ring->threads, memory_order_acquire);
+    if (threads == NULL)
+        return 0;
+
+    for (size_t i = 0; i < threads->num; i++) {
+        long thread_length = ring_thread_length(threads->ptr[i]);
+        if (thread_length > length)
+            length = thread_length;
+    }
+
+    return length;
+}
+
+uint64_t ring_dropped(ring_t *ring)
+{
+    return atomic_load(&ring->dropped);
+}
+
+strlist_t *ring_get_threads(ring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+
+    ring_threads_t *threads = atomic_load(&ring->threads);
+    if ((threads == NULL) || (threads->num == 0)) {
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+    }
+
+    strlist_t *sl = strlist_alloc(threads->num);
+    if (sl == NULL) {
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < threads->num; i++) {
+        strlist_append(sl, threads->ptr[i]->name);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return sl;
+}
+
+static int ring_retire(ring_t *ring, ring_threads_t *threads, ring_thread_t *thread)
+{
+    ring_retired_t *retired = calloc(1, sizeof(*retired));
+    if (retired == NULL) {
+        ERROR("calloc failed.");
+        return ENOMEM;
+    }
+
+    retired->threads = threads;
+    retired->thread = thread;
+    retired->next = ring->retired;
+    ring->retired = retired;
+
+    return 0;
+}
+
+/* Publish a new snapshot of the thread list, must be called with the lock held.
+ * Producers may still be walking the old snapshot, so it is retired and released
+ * in ring_free. */
+static int ring_threads_publish(ring_t *ring, ring_threads_t *threads)
+{
+    ring_threads_t *old_threads = atomic_exchange(&ring->threads, threads);
+    if (old_threads == NULL)
+        return 0;
+
+    return ring_retire(ring, old_threads, NULL);
+}
+
+int ring_thread_start(ring_t *ring, ring_thread_t *thread, char *name,
+                                    void *(*start_routine)(void *), void *arg)
+{
+    thread->name = name;
+    atomic_init(&thread->loop, true);
+    thread->mask = ring->size - 1;
+    atomic_init(&thread->enqueue_pos, 0);
+    atomic_init(&thread->dequeue_pos, 0);
+    atomic_init(&thread->closed, false);
+    atomic_init(&thread->producers, 0);
+    atomic_init(&thread->sleeping, false);
+    thread->next = NULL;
+
+    thread->cells = calloc(ring->size, sizeof(*thread->cells));
+    if (thread->cells == NULL) {
+        ERROR("calloc failed.");
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < ring->size; i++) {
+        atomic_init(&thread->cells[i].seq, i);
+    }
+
+    pthread_mutex_init(&thread->wait_lock, NULL);
+    pthread_cond_init(&thread->wait_cond, NULL);
+
+    pthread_mutex_lock(&ring->lock);
+
+    ring_threads_t *old_threads = atomic_load(&ring->threads);
+    size_t num = old_threads == NULL ? 0 : old_threads->num;
+
+    ring_threads_t *threads = calloc(1, sizeof(*threads) + (num + 1) * sizeof(ring_thread_t *));
+    if (threads == NULL) {
+        ERROR("calloc failed.");
+        pthread_mutex_unlock(&ring->lock);
+        goto error;
+    }
+
+    char thread_name[THREAD_NAME_MAX];
+    ssnprintf(thread_name, sizeof(thread_name), "%s", name);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    set_thread_setaffinity(&attr, thread_name);
+
+    int status = pthread_create(&thread->thread, &attr, start_routine, arg);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        ERROR("pthread_create failed with status %i: %s.", status, STRERROR(status));
+        free(threads);
+        pthread_mutex_unlock(&ring->lock);
+        goto error;
+    }
+
+    set_thread_name(thread->thread, thread_name);
+
+    for (size_t i = 0; i < num; i++) {
+        threads->ptr[i] = old_threads->ptr[i];
+    }
+    threads->ptr[num] = thread;
+    threads->num = num + 1;
+
+    ring_threads_publish(ring, threads);
+
+    pthread_mutex_unlock(&ring->lock);
+
+    return 0;
+
+error:
+    pthread_cond_destroy(&thread->wait_cond);
+    pthread_mutex_destroy(&thread->wait_lock);
+    free(thread->cells);
+    thread->cells = NULL;
+    return -1;
+}
+
+int ring_thread_stop(ring_t *ring, const char *name)
+{
+    pthread_mutex_lock(&ring->lock);
+
+    ring_threads_t *old_threads = atomic_load(&ring->threads);
+    if ((old_threads == NULL) || (old_threads->num == 0)) {
+        pthread_mutex_unlock(&ring->lock);
+        return name == NULL ? 0 : ENOENT;
+    }
+
+    ring_threads_t *threads = calloc(1, sizeof(*threads) +
+                                        old_threads->num * sizeof(ring_thread_t *));
+    if (threads == NULL) {
+        ERROR("calloc failed.");
+        pthread_mutex_unlock(&ring->lock);
+        return ENOMEM;
+    }
+
+    ring_thread_t *to_stop = NULL;
+    for (size_t i = 0; i < old_threads->num; i++) {
+        ring_thread_t *thread = old_threads->ptr[i];
+        if ((name == NULL) || (strcasecmp(name, thread->name) == 0)) {
+            atomic_store(&thread->loop, false);
+            atomic_store(&thread->closed, true);
+            thread->next = to_stop;
+            to_stop = thread;
+        } else {
+            threads->ptr[threads->num++] = thread;
+        }
+    }
+
+    if (to_stop == NULL) {
+        free(threads);
+        pthread_mutex_unlock(&ring->lock);
+        return ENOENT;
+    }
+
+    ring_threads_publish(ring, threads);
+
+    pthread_mutex_unlock(&ring->lock);
+
+    int status = 0;
+
+    while (to_stop != NULL) {
+        ring_thread_t *next = to_stop->next;
+
+        pthread_mutex_lock(&to_stop->wait_lock);
+        pthread_cond_broadcast(&to_stop->wait_cond);
+        pthread_mutex_unlock(&to_stop->wait_lock);
+
+        int ret = pthread_join(to_stop->thread, NULL);
+        if (ret != 0) {
+            ERROR("pthread_join failed for %s.", to_stop->name);
+            status = ret;
+        }
+
+        /* Wait for the producers that saw the ring before it was closed. */
+        while (atomic_load(&to_stop->producers) > 0)
+            sched_yield();
+
+        /* Drop references to all remaining ring elements */
+        ring_elem_t *elem;
+        while ((elem = ring_pop(to_stop)) != NULL)
+            ring_ref_single(ring, elem, -1);
+
+        free(to_stop->cells);
+        to_stop->cells = NULL;
+        pthread_cond_destroy(&to_stop->wait_cond);
+        pthread_mutex_destroy(&to_stop->wait_lock);
+
+        /* The thread may still be referenced from an old snapshot. */
+        pthread_mutex_lock(&ring->lock);
+        ring_retire(ring, NULL, to_stop);
+        pthread_mutex_unlock(&ring->lock);
+
+        to_stop = next;
+    }
+
+    return status;
+}
+
+ring_t *ring_new(char *kind, long limit_high, long limit_low)
+{
+    ring_t *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        ERROR("calloc failed.");
+        return NULL;
+    }
+
+    ring->kind = strdup(kind);
+    if (ring->kind == NULL) {
+        free(ring);
+        ERROR("strdup failed.");
+        return NULL;
+    }
+
+    ring->limit_high = limit_high;
+    ring->limit_low = limit_low;
+
+    size_t size = RING_DEFAULT_SIZE;
+    if (limit_high > 0) {
+        size = RING_MIN_SIZE;
+        while (size <= (size_t)limit_high)
+            size <<= 1;
+    }
+    ring->size = size;
+
+    C_COMPLAIN_INIT(&(ring->complaint));
+    pthread_mutex_init(&ring->lock, NULL);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->threads, NULL);
+    ring->retired = NULL;
+
+    return ring;
+}
+
+void ring_free(ring_t *ring)
+{
+    if (ring == NULL)
+        return;
+
+    ring_thread_stop(ring, NULL);
+
+    ring_retired_t *retired = ring->retired;
+    while (retired != NULL) {
+        ring_retired_t *next = retired->next;
+
+        free(retired->threads);
+
+        if (retired->thread != NULL) {
+            char *name = retired->thread->name;
+            if (ring->free_thread_cb)
+                ring->free_thread_cb(retired->thread);
+            else
+                free(retired->thread);
+            free(name);
+        }
+
+        free(retired);
+        retired = next;
+    }
+
+    free(atomic_load(&ring->threads));
+
+    free(ring->kind);
+    pthread_mutex_destroy(&ring->lock);
+
+    free(ring);
+}
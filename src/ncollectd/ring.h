@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR MIT */
+
+#pragma once
+
+#include <stdatomic.h>
+
+/* Memory queue where every consumer thread owns a bounded multi-producer,
+ * single-consumer ring of element pointers. Producers only touch the rings
+ * and the element reference counts, the queue lock is taken just to start
+ * or stop consumer threads. */
+
+typedef struct {
+    char *plugin;
+    plugin_ctx_t ctx;
+    atomic_long ref_count;
+} ring_elem_t;
+
+typedef struct {
+    atomic_size_t seq;
+    ring_elem_t *elem;
+} ring_cell_t;
+
+struct ring_thread_s;
+typedef struct ring_thread_s ring_thread_t;
+struct ring_thread_s {
+    char *name;
+    atomic_bool loop;
+    pthread_t thread;
+    size_t mask;
+    ring_cell_t *cells;
+    atomic_size_t enqueue_pos;
+    atomic_size_t dequeue_pos;
+    atomic_bool closed;
+    atomic_long producers;
+    atomic_bool sleeping;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    ring_thread_t *next;
+};
+
+typedef struct {
+    size_t num;
+    ring_thread_t *ptr[];
+} ring_threads_t;
+
+typedef struct ring_retired_s ring_retired_t;
+struct ring_retired_s {
+    ring_threads_t *threads;
+    ring_thread_t *thread;
+    ring_retired_t *next;
+};
+
+typedef struct {
+    char *kind;
+    long limit_high;
+    long limit_low;
+    size_t size;
+    atomic_ullong dropped;
+    void (*free_elem_cb)(void *);
+    void (*free_thread_cb)(void *);
+    c_complain_t complaint;
+    pthread_mutex_t lock;
+    _Atomic(ring_threads_t *) threads;
+    ring_retired_t *retired;
+} ring_t;
+
+ring_t *ring_new(char *kind, long limit_high, long limit_low);
+
+void ring_free(ring_t *ring);
+
+int ring_ref_single(ring_t *ring, ring_elem_t *elem, long dir);
+
+int ring_enqueue(ring_t *ring, const char *plugin, ring_elem_t *elem);
+
+ring_elem_t *ring_dequeue(ring_t *ring, ring_thread_t *reader, cdtime_t abstime);
+
+long ring_length(ring_t *ring);
+
+long ring_thread_length(ring_thread_t *thread);
+
+uint64_t ring_dropped(ring_t *ring);
+
+strlist_t *ring_get_threads(ring_t *ring);
+
+int ring_thread_start(ring_t *ring, ring_thread_t *thread, char *name,
+                                    void *(*start_routine)(void *), void *arg);
+
+int ring_thread_stop(ring_t *ring, const char *name);
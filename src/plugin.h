@@ -65,6 +65,7 @@ typedef struct {
 typedef int (*plugin_init_cb)(void);
 typedef int (*plugin_read_cb)(user_data_t *);
 typedef int (*plugin_write_cb)(metric_family_t const *, user_data_t *);
+typedef int (*plugin_write_batch_cb)(metric_family_list_t const *, user_data_t *);
 typedef int (*plugin_flush_cb)(cdtime_t timeout, user_data_t *);
 typedef void (*plugin_log_cb)(const log_msg_t *msg, user_data_t *);
 typedef int (*plugin_shutdown_cb)(void);
@@ -90,6 +91,16 @@ int plugin_register_write(const char *group, const char *name, plugin_write_cb w
                           plugin_flush_cb flush_cb, cdtime_t flush_interval, cdtime_t flush_timeout,
                           user_data_t const *user_data);
 
+/* Like "plugin_register_write" but the callback receives up to "batch_size"
+ * metric families at once. After the first family is dequeued the writer
+ * waits at most "batch_timeout" for the batch to fill up. A "batch_size" of
+ * zero selects the default size. */
+int plugin_register_write_batch(const char *group, const char *name,
+                                plugin_write_batch_cb write_batch_cb,
+                                plugin_flush_cb flush_cb, cdtime_t flush_interval,
+                                cdtime_t flush_timeout, size_t batch_size, cdtime_t batch_timeout,
+                                user_data_t const *user_data);
+
 int plugin_register_shutdown(const char *name, plugin_shutdown_cb callback);
 
 int plugin_register_log(const char *group, const char *name,
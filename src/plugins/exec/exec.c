@@ -20,12 +20,15 @@
 #include "libutils/exec.h"
 #include "libmetric/parser.h"
 
-#include <poll.h>
+#include <fcntl.h>
 
 #ifdef HAVE_SYS_CAPABILITY_H
 #include <sys/capability.h>
 #endif
 
+/* Intervals a persistent program can take to answer before it is restarted. */
+#define EXEC_PERSISTENT_MAX_SKIPPED 3
+
 typedef struct {
     char *instance;
     cexec_t exec;
@@ -34,202 +37,238 @@ typedef struct {
     label_set_t labels;
     plugin_filter_t *filter;
     metric_parser_t *mp;
-    int status;
+    plugin_ctx_t ctx;
+    cdtime_t last_dispatch;
+    cdtime_t last_read;
+    bool persistent;
+    int fd_in;
+    bool pending;
+    int skipped;
+    /* Last signal sent to a persistent program that did not answer. */
+    int signal_sent;
     pid_t pid;
     bool running;
     pthread_mutex_t lock;
+    pthread_cond_t cond;
 } program_t;
 
-static void *exec_read_one(void *arg)
+static exec_reaper_t *exec_reaper;
+static pthread_t exec_reaper_thread;
+
+static void exec_dispatch_pending(program_t *pm, cdtime_t now)
+{
+    if (metric_parser_size(pm->mp) == 0)
+        return;
+
+    PLUGIN_WARNING("There are metrics pending to be dispatched. Missing '#EOF'?");
+    metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered, pm->filter, 0);
+    metric_parser_reset(pm->mp);
+    pm->last_dispatch = now;
+}
+
+static void exec_read_line(char *line, void *arg)
 {
-    program_t *pm = (program_t *)arg;
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
 
-    char buffer[4096];
-    char buffer_err[4096];
-    char *pbuffer = buffer;
-    char *pbuffer_err = buffer_err;
+    cdtime_t now = cdtime();
+    if (((now - pm->last_dispatch) > pm->interval) && ((now - pm->last_read) > pm->interval/2))
+        exec_dispatch_pending(pm, now);
+    pm->last_read = now;
 
-    int fd, fd_err;
-    int status = exec_fork_child(&pm->exec, false, NULL, &fd, &fd_err);
+    int status = metric_parse_line(pm->mp, line);
     if (status < 0) {
-        /* Reset the "running" flag */
+        PLUGIN_WARNING("Cannot parse line: '%s'.", line);
+    } else if (status == 1) { // #EOF FIXME
+        metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered, pm->filter, 0);
+        metric_parser_reset(pm->mp);
+        pm->last_dispatch = now;
+
         pthread_mutex_lock(&pm->lock);
-        pm->running = false;
+        pm->pending = false;
+        pm->skipped = 0;
         pthread_mutex_unlock(&pm->lock);
-        pthread_exit((void *)1);
     }
-    pm->pid = status;
 
-    assert(pm->pid != 0);
+    plugin_set_ctx(old_ctx);
+}
 
-    struct pollfd fds[2] = {{0}};
-    fds[0].fd = fd;
-    fds[0].events = POLLIN;
-    fds[1].fd = fd_err;
-    fds[1].events = POLLIN;
+static void exec_read_error(char *line, void *arg)
+{
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
+    PLUGIN_ERROR("Program '%s' error: %s", pm->exec.exec, line);
+    plugin_set_ctx(old_ctx);
+}
 
-    cdtime_t last_dispatch = cdtime();
-    cdtime_t last_read = cdtime();
-    cdtime_t timeout = pm->interval/2;
+static void exec_read_idle(cdtime_t now, void *arg)
+{
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
+    if ((now - pm->last_dispatch) > pm->interval)
+        exec_dispatch_pending(pm, now);
+    plugin_set_ctx(old_ctx);
+}
 
-    while (true) {
-        status = poll(fds, STATIC_ARRAY_SIZE(fds), CDTIME_T_TO_MS(timeout));
-        if (status < 0) {
-            if ((errno == EINTR) || (errno == EAGAIN))
-                continue;
-            break;
-        }
+static void exec_read_exit(int status, void *arg)
+{
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
 
-        cdtime_t now = cdtime();
-
-        if (status == 0) { /* timeout */
-            if ((now - last_dispatch) > pm->interval) {
-                if (metric_parser_size(pm->mp) > 0) {
-                    PLUGIN_WARNING("There are metrics pending to be dispatched. Missing '#EOF'?");
-                    metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered,
-                                                   pm->filter, 0);
-                    metric_parser_reset(pm->mp);
-                    last_dispatch = now;
-                }
-            }
-            continue;
-        }
+    metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered, pm->filter, 0);
+    metric_parser_reset(pm->mp);
 
-        if (((now - last_dispatch) > pm->interval) && ((now - last_read) > pm->interval/2)) {
-            if (metric_parser_size(pm->mp) > 0) {
-                PLUGIN_WARNING("There are metrics pending to be dispatched. Missing '#EOF'?");
-                metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered,
-                                               pm->filter, 0);
-                metric_parser_reset(pm->mp);
-                last_dispatch = now;
-            }
-        }
+    if (pm->persistent) {
+        if ((status != -1) && WIFSIGNALED(status))
+            PLUGIN_WARNING("Program '%s' was killed by signal %i, it will be restarted.",
+                           pm->exec.exec, WTERMSIG(status));
+        else
+            PLUGIN_WARNING("Program '%s' exited with status %i, it will be restarted.",
+                           pm->exec.exec, status == -1 ? -1 : WEXITSTATUS(status));
+    } else {
+        PLUGIN_DEBUG("Child %i exited with status %i.", (int)pm->pid, status);
+    }
 
-        if (fds[0].revents & (POLLIN | POLLHUP)) {
-            int len = read(fd, pbuffer, sizeof(buffer) - 1 - (pbuffer - buffer));
-            if (len < 0) {
-                if (errno == EAGAIN || errno == EINTR)
-                    continue;
-                break;
-            } else if (len == 0) {
-                break; /* We've reached EOF */
-            }
-
-            last_read = now;
-
-            pbuffer[len] = '\0';
-
-            len += pbuffer - buffer;
-            pbuffer = buffer;
-
-            char *pnl;
-            while ((pnl = strchr(pbuffer, '\n'))) {
-                *pnl = '\0';
-                if (*(pnl - 1) == '\r')
-                    *(pnl - 1) = '\0';
-
-                status = metric_parse_line(pm->mp, pbuffer);
-                if (status < 0) {
-                    PLUGIN_WARNING("Cannot parse line: '%s'.", pbuffer);
-                } else if (status == 1) { // #EOF FIXME
-                    metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered,
-                                                   pm->filter, 0);
-                    metric_parser_reset(pm->mp);
-                    last_dispatch = now;
-                }
-
-                pbuffer = ++pnl;
-            }
-
-            /* not completely read ? */
-            if (pbuffer - buffer < len) {
-                len -= pbuffer - buffer;
-                memmove(buffer, pbuffer, len);
-                pbuffer = buffer + len;
-            } else {
-                pbuffer = buffer;
-            }
-        } else if (fds[0].revents & (POLLERR | POLLNVAL)) {
-            PLUGIN_ERROR("Failed to read pipe from '%s'.", pm->exec.exec);
-            break;
-        } else if (fds[1].revents & (POLLIN | POLLHUP)) {
-            int len = read(fd_err, pbuffer_err,
-                                   sizeof(buffer_err) - 1 - (pbuffer_err - buffer_err));
-
-            if (len < 0) {
-                if (errno == EAGAIN || errno == EINTR)
-                    continue;
-                break;
-            } else if (len == 0) {
-                /* We've reached EOF */
-                PLUGIN_DEBUG("Program '%s' has closed STDERR.", pm->exec.exec);
-
-                /* Clean up file descriptor */
-                if (fd_err > 0)
-                    close(fd_err);
-                fd_err = -1;
-                fds[1].fd = -1;
-                fds[1].events = 0;
-                continue;
-            }
-
-            pbuffer_err[len] = '\0';
-
-            len += pbuffer_err - buffer_err;
-            pbuffer_err = buffer_err;
-
-            char *pnl;
-            while ((pnl = strchr(pbuffer_err, '\n'))) {
-                *pnl = '\0';
-                if (*(pnl - 1) == '\r')
-                    *(pnl - 1) = '\0';
-
-                PLUGIN_ERROR("exec_read_one: error = %s", pbuffer_err);
-
-                pbuffer_err = ++pnl;
-            }
-            /* not completely read ? */
-            if (pbuffer_err - buffer_err < len) {
-                len -= pbuffer_err - buffer_err;
-                memmove(buffer_err, pbuffer_err, len);
-                pbuffer_err = buffer_err + len;
-            } else {
-                pbuffer_err = buffer_err;
-            }
-        } else if (fds[1].revents & (POLLERR | POLLNVAL)) {
-            PLUGIN_WARNING("Ignoring STDERR for program '%s'.", pm->exec.exec);
-            /* Clean up file descriptor */
-            if ((fds[1].revents & POLLNVAL) == 0) {
-                if (fd_err > 0)
-                    close(fd_err);
-                fd_err = -1;
-            }
-            fds[1].fd = -1;
-            fds[1].events = 0;
-        }
+    plugin_set_ctx(old_ctx);
+
+    pthread_mutex_lock(&pm->lock);
+    if (pm->fd_in >= 0)
+        close(pm->fd_in);
+    pm->fd_in = -1;
+    pm->pending = false;
+    pm->skipped = 0;
+    pm->signal_sent = 0;
+    pm->pid = 0;
+    pm->running = false;
+    pthread_cond_broadcast(&pm->cond);
+    pthread_mutex_unlock(&pm->lock);
+}
+
+/* Starts the program and hands its output over to the reaper, a persistent
+ * program also gets a pipe to its stdin. */
+static int exec_start(program_t *pm)
+{
+    pthread_mutex_lock(&pm->lock);
+
+    if (pm->running || (exec_reaper == NULL)) {
+        pthread_mutex_unlock(&pm->lock);
+        return -1;
     }
 
-    metric_parser_dispatch(pm->mp, plugin_dispatch_metric_family_filtered, pm->filter, 0);
-    metric_parser_reset(pm->mp);
+    pm->running = true;
+    pthread_mutex_unlock(&pm->lock);
 
-    PLUGIN_DEBUG("exec_read_one: Waiting for '%s' to exit.", pm->exec.exec);
-    if (waitpid(pm->pid, &status, 0) < 0) {
-        PLUGIN_DEBUG("waitpid failed: %s", STRERRNO);
+    int fd_in = -1;
+    int fd = -1;
+    int fd_err = -1;
+    int pid = exec_fork_child(&pm->exec, false, pm->persistent ? &fd_in : NULL, &fd, &fd_err);
+    if (pid < 0) {
+        /* Reset the "running" flag */
+        pthread_mutex_lock(&pm->lock);
+        pm->running = false;
+        pthread_mutex_unlock(&pm->lock);
+        return -1;
     }
-    PLUGIN_DEBUG("Child %i exited with status %i.", (int)pm->pid, status);
 
-    pm->pid = 0;
+    assert(pid != 0);
+
+    /* A program that does not read its stdin must not block the read thread. */
+    if (fd_in >= 0) {
+        int flags = fcntl(fd_in, F_GETFL);
+        fcntl(fd_in, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    pm->ctx = plugin_get_ctx();
+    pm->last_dispatch = cdtime();
+    pm->last_read = pm->last_dispatch;
 
     pthread_mutex_lock(&pm->lock);
-    pm->running = false;
+    pm->pid = pid;
+    pm->fd_in = fd_in;
+    pm->pending = false;
+    pm->skipped = 0;
+    pm->signal_sent = 0;
     pthread_mutex_unlock(&pm->lock);
 
-    close(fd);
-    if (fd_err >= 0)
-        close(fd_err);
+    exec_watch_t watch = {
+        .out_cb = exec_read_line,
+        .err_cb = exec_read_error,
+        .idle_cb = exec_read_idle,
+        .idle_timeout = pm->interval/2,
+        .exit_cb = exec_read_exit,
+        .arg = pm,
+    };
+
+    int status = exec_reaper_watch(exec_reaper, pid, fd, fd_err, &watch);
+    if (status != 0) {
+        pthread_mutex_lock(&pm->lock);
+        if (pm->fd_in >= 0)
+            close(pm->fd_in);
+        pm->fd_in = -1;
+        pm->pid = 0;
+        pm->running = false;
+        pthread_mutex_unlock(&pm->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Asks the persistent program for the metrics, the answer ends with '# EOF'. */
+static void exec_collect(program_t *pm)
+{
+    pthread_mutex_lock(&pm->lock);
+
+    if (!pm->running) {
+        pthread_mutex_unlock(&pm->lock);
+        return;
+    }
+
+    /* Still running one interval after the SIGTERM. */
+    if (pm->signal_sent == SIGTERM) {
+        PLUGIN_WARNING("Program '%s' did not exit after SIGTERM, sending SIGKILL.",
+                       pm->exec.exec);
+        kill(pm->pid, SIGKILL);
+        pm->signal_sent = SIGKILL;
+        pthread_mutex_unlock(&pm->lock);
+        return;
+    }
+
+    if (pm->fd_in < 0) {
+        pthread_mutex_unlock(&pm->lock);
+        return;
+    }
+
+    if (pm->pending) {
+        pm->skipped++;
+        if (pm->skipped >= EXEC_PERSISTENT_MAX_SKIPPED) {
+            PLUGIN_WARNING("Program '%s' did not answer in %d intervals, restarting it.",
+                           pm->exec.exec, pm->skipped);
+            /* Closing its stdin first lets the program see EOF. */
+            close(pm->fd_in);
+            pm->fd_in = -1;
+            kill(pm->pid, SIGTERM);
+            pm->signal_sent = SIGTERM;
+        } else {
+            PLUGIN_WARNING("Program '%s' has not answered the previous collect, skipping.",
+                           pm->exec.exec);
+        }
+        pthread_mutex_unlock(&pm->lock);
+        return;
+    }
+
+    static const char trigger[] = "collect\n";
+    ssize_t len = write(pm->fd_in, trigger, sizeof(trigger) - 1);
+    if (len == (ssize_t)(sizeof(trigger) - 1)) {
+        pm->pending = true;
+    } else if ((len < 0) && (errno == EAGAIN)) {
+        PLUGIN_WARNING("Program '%s' is not reading its stdin, skipping.", pm->exec.exec);
+    } else if (len < 0) {
+        /* With EPIPE the program has exited, the reaper restarts it. */
+        PLUGIN_ERROR("Failed to write to program '%s': %s", pm->exec.exec, STRERRNO);
+    }
 
-    pthread_exit((void *)0);
-    return NULL;
+    pthread_mutex_unlock(&pm->lock);
 }
 
 static int exec_read(user_data_t *user_data)
@@ -237,22 +276,14 @@ static int exec_read(user_data_t *user_data)
     program_t *pm = user_data->data;
 
     pthread_mutex_lock(&pm->lock);
+    bool running = pm->running;
+    pthread_mutex_unlock(&pm->lock);
 
-    if (pm->running) {
-        pthread_mutex_unlock(&pm->lock);
+    if (!running && (exec_start(pm) != 0))
         return 0;
-    }
-
-    pm->running = true;
-    pthread_mutex_unlock(&pm->lock);
 
-    pthread_t t;
-    int status = plugin_thread_create(&t, exec_read_one, (void *)pm, "exec read");
-    if (status == 0) {
-        pthread_detach(t);
-    } else {
-        PLUGIN_ERROR("plugin_thread_create failed.");
-    }
+    if (pm->persistent)
+        exec_collect(pm);
 
     return 0;
 }
@@ -264,12 +295,18 @@ static void exec_free(void *arg)
     if (pm == NULL)
         return;
 
+    pthread_mutex_lock(&pm->lock);
     if (pm->pid > 0) {
         kill(pm->pid, SIGTERM);
         PLUGIN_INFO("Sent SIGTERM to %d", (int)pm->pid);
-
-        waitpid(pm->pid, NULL, 0);
     }
+    /* The reaper reads the output until the child exits. */
+    while (pm->running)
+        pthread_cond_wait(&pm->cond, &pm->lock);
+    pthread_mutex_unlock(&pm->lock);
+
+    pthread_mutex_destroy(&pm->lock);
+    pthread_cond_destroy(&pm->cond);
 
     free(pm->instance);
 
@@ -298,6 +335,9 @@ static int exec_config_exec(config_item_t *ci)
         return -1;
     }
     pm->interval = plugin_get_interval();
+    pm->fd_in = -1;
+    pthread_mutex_init(&pm->lock, NULL);
+    pthread_cond_init(&pm->cond, NULL);
 
     int status = cf_util_get_string(ci, &pm->instance);
     if (status != 0) {
@@ -323,6 +363,8 @@ static int exec_config_exec(config_item_t *ci)
             status = cf_util_get_label(child, &pm->labels);
         } else if (strcasecmp("metric-prefix", child->key) == 0) {
             status = cf_util_get_string(child, &pm->metric_prefix);
+        } else if (strcasecmp("persistent", child->key) == 0) {
+            status = cf_util_get_boolean(child, &pm->persistent);
         } else if (strcasecmp("filter", child->key) == 0) {
             status = plugin_filter_configure(child, &pm->filter);
         } else {
@@ -347,8 +389,6 @@ static int exec_config_exec(config_item_t *ci)
         return -1;
     }
 
-    pthread_mutex_init(&pm->lock, NULL);
-
     char interval[DTOA_MAX];
     dtoa(CDTIME_T_TO_DOUBLE(pm->interval), interval, DTOA_MAX);
     cexec_append_env(&pm->exec, "NCOLLECTD_INTERVAL", interval);
@@ -394,6 +434,36 @@ static int exec_init(void)
                            "ncollectd binary.");
     }
 #endif
+
+    if (exec_reaper != NULL)
+        return 0;
+
+    exec_reaper = exec_reaper_alloc();
+    if (exec_reaper == NULL)
+        return -1;
+
+    int status = plugin_thread_create(&exec_reaper_thread, exec_reaper_run, exec_reaper,
+                                      "exec reaper");
+    if (status != 0) {
+        PLUGIN_ERROR("plugin_thread_create failed.");
+        exec_reaper_free(exec_reaper);
+        exec_reaper = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int exec_shutdown(void)
+{
+    if (exec_reaper == NULL)
+        return 0;
+
+    exec_reaper_stop(exec_reaper);
+    pthread_join(exec_reaper_thread, NULL);
+    exec_reaper_free(exec_reaper);
+    exec_reaper = NULL;
+
     return 0;
 }
 
@@ -401,4 +471,5 @@ void module_register(void)
 {
     plugin_register_config("exec", exec_config);
     plugin_register_init("exec", exec_init);
+    plugin_register_shutdown("exec", exec_shutdown);
 }
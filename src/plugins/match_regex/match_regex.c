@@ -10,6 +10,7 @@
 #include "libutils/common.h"
 #include "libutils/llist.h"
 #include "libutils/time.h"
+#include "libutils/multimatch.h"
 
 #include <regex.h>
 
@@ -38,6 +39,8 @@ struct match_regex_metric_s {
 
     regex_t cregex;
     regex_t cexcluderegex;
+    int regex_id;
+    int excluderegex_id;
 
     struct match_regex_metric_s *next;
 };
@@ -48,6 +51,9 @@ typedef struct {
     char *metric_prefix;
     label_set_t labels;
     match_regex_metric_t *metrics;
+    /* Prefilter of all the regexes, only the candidates for a line are run. */
+    multimatch_t *mm;
+    bool *candidates;
 } match_regex_t;
 
 static cdtime_t match_regex_parse_time(char const *tbuf)
@@ -120,6 +126,9 @@ static void match_regex_destroy(void *user_data)
     free(regex->metric_prefix);
     label_set_reset(&regex->labels);
 
+    multimatch_free(regex->mm);
+    free(regex->candidates);
+
     free(regex);
 }
 
@@ -129,11 +138,17 @@ static int match_regex_match(match_metric_family_set_t *set, char *buffer, void
     if (user_data == NULL)
         return -1;
 
+    multimatch_candidates(regex->mm, buffer, regex->candidates);
+
     match_regex_metric_t *regex_metric = regex->metrics;
-    while (regex_metric != NULL) {
+    for (; regex_metric != NULL; regex_metric = regex_metric->next) {
         regmatch_t re_match[32];
 
-        if (regex_metric->excluderegex != NULL) {
+        if (!regex->candidates[regex_metric->regex_id])
+            continue;
+
+        if ((regex_metric->excluderegex != NULL) &&
+            regex->candidates[regex_metric->excluderegex_id]) {
             int status = regexec(&regex_metric->cexcluderegex,
                                  buffer, STATIC_ARRAY_SIZE(re_match), re_match, 0);
             if (status == 0)
@@ -223,8 +238,6 @@ static int match_regex_match(match_metric_family_set_t *set, char *buffer, void
 
         label_set_reset(&mlabel);
         strbuf_destroy(&buf);
-
-        regex_metric = regex_metric->next;
     }
 
     return 0;
@@ -365,6 +378,13 @@ static int match_regex_config_metric(const config_item_t *ci, match_regex_t *reg
         return -1;
     }
 
+    regex_metric->regex_id = multimatch_add(regex->mm, regex_metric->regex,
+                                            REG_EXTENDED | REG_NEWLINE);
+    if (regex_metric->regex_id < 0) {
+        PLUGIN_ERROR("Adding the regular expression '%s' failed.", regex_metric->regex);
+        return -1;
+    }
+
     if (regex_metric->excluderegex != NULL) {
         status = regcomp(&regex_metric->cexcluderegex, regex_metric->excluderegex, REG_EXTENDED);
         if (status != 0) {
@@ -372,6 +392,14 @@ static int match_regex_config_metric(const config_item_t *ci, match_regex_t *reg
                          regex_metric->excluderegex);
             return -1;
         }
+
+        regex_metric->excluderegex_id = multimatch_add(regex->mm, regex_metric->excluderegex,
+                                                       REG_EXTENDED);
+        if (regex_metric->excluderegex_id < 0) {
+            PLUGIN_ERROR("Adding the excluding regular expression '%s' failed.",
+                         regex_metric->excluderegex);
+            return -1;
+        }
     }
 
     return 0;
@@ -387,6 +415,13 @@ static int match_regex_config(const config_item_t *ci, void **user_data)
         return -1;
     }
 
+    regex->mm = multimatch_create();
+    if (regex->mm == NULL) {
+        PLUGIN_ERROR("multimatch_create failed.");
+        match_regex_destroy(regex);
+        return -1;
+    }
+
     int status = 0;
     for (int i = 0; i < ci->children_num; ++i) {
         config_item_t *option = ci->children + i;
@@ -412,6 +447,20 @@ static int match_regex_config(const config_item_t *ci, void **user_data)
         return -1;
     }
 
+    status = multimatch_compile(regex->mm);
+    if (status != 0) {
+        PLUGIN_ERROR("multimatch_compile failed.");
+        match_regex_destroy(regex);
+        return -1;
+    }
+
+    regex->candidates = calloc(multimatch_size(regex->mm) + 1, sizeof(*regex->candidates));
+    if (regex->candidates == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        match_regex_destroy(regex);
+        return -1;
+    }
+
     *user_data = regex;
 
     return 0;
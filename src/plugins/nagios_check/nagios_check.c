@@ -19,8 +19,6 @@
 #include "libutils/dtoa.h"
 #include "libutils/exec.h"
 
-#include <poll.h>
-
 #ifdef HAVE_SYS_CAPABILITY_H
 #include <sys/capability.h>
 #endif
@@ -47,12 +45,18 @@ typedef struct {
     bool persist;
     bool persist_ok;
 
+    plugin_ctx_t ctx;
+    strbuf_t buf;
     int status;
     pid_t pid;
     bool running;
     pthread_mutex_t lock;
+    pthread_cond_t cond;
 } program_t;
 
+static exec_reaper_t *nagios_check_reaper;
+static pthread_t nagios_check_reaper_thread;
+
 static const size_t MAX_CHECK_SIZE = 4096;
 
 static void nagios_check_dispatch_notification(program_t *pm, char *output)
@@ -144,161 +148,57 @@ static void nagios_check_dispatch_notification(program_t *pm, char *output)
     plugin_dispatch_notification(&n);
 }
 
-static void *nagios_check_read_one(void *arg)
+static void nagios_check_read_line(char *line, void *arg)
 {
-    program_t *pm = (program_t *)arg;
+    program_t *pm = arg;
 
-    char buffer[4096];
-    char buffer_err[4096];
-    char *pbuffer = buffer;
-    char *pbuffer_err = buffer_err;
+    if (strbuf_len(&pm->buf) >= MAX_CHECK_SIZE)
+        return;
+
+    size_t avail = MAX_CHECK_SIZE - strbuf_len(&pm->buf);
+    size_t len = strlen(line);
+    if (len > avail)
+        len = avail;
 
-    int fd, fd_err;
-    int status = exec_fork_child(&pm->exec, false, NULL, &fd, &fd_err);
+    int status = strbuf_putstrn(&pm->buf, line, len);
+    status |= strbuf_putchar(&pm->buf, '\n');
     if (status < 0) {
-        /* Reset the "running" flag */
-        pthread_mutex_lock(&pm->lock);
-        pm->running = false;
-        pthread_mutex_unlock(&pm->lock);
-        pthread_exit((void *)1);
+        plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
+        PLUGIN_WARNING("Failed to fill check response buffer.");
+        plugin_set_ctx(old_ctx);
     }
-    pm->pid = status;
-
-    assert(pm->pid != 0);
-
-    struct pollfd fds[2] = {{0}};
-    fds[0].fd = fd;
-    fds[0].events = POLLIN;
-    fds[1].fd = fd_err;
-    fds[1].events = POLLIN;
-
-    strbuf_t buf = STRBUF_CREATE;
-
-    while (true) {
-        status = poll(fds, STATIC_ARRAY_SIZE(fds), -1);
-        if (status < 0) {
-            if (errno == EINTR)
-                continue;
-            break;
-        }
-
-        if (fds[0].revents & (POLLIN | POLLHUP)) {
-            int len = read(fd, pbuffer, sizeof(buffer) - 1 - (pbuffer - buffer));
-            if (len < 0) {
-                if (errno == EAGAIN || errno == EINTR)
-                    continue;
-                break;
-            } else if (len == 0) {
-                break; /* We've reached EOF */
-            }
-
-            pbuffer[len] = '\0';
-
-            len += pbuffer - buffer;
-            pbuffer = buffer;
-
-            if (strbuf_len(&buf) < MAX_CHECK_SIZE) {
-                size_t avail = MAX_CHECK_SIZE - strbuf_len(&buf);
-                size_t pbuffer_len = len;
-                if (pbuffer_len > avail)
-                    pbuffer_len = avail;
-                status = strbuf_putstrn(&buf, pbuffer, pbuffer_len);
-                status |= strbuf_putchar(&buf, '\n');
-                if (status < 0)
-                    PLUGIN_WARNING("Failed to fill check response buffer.");
-            }
-            pbuffer += len;
-
-            /* not completely read ? */
-            if (pbuffer - buffer < len) {
-                len -= pbuffer - buffer;
-                memmove(buffer, pbuffer, len);
-                pbuffer = buffer + len;
-            } else {
-                pbuffer = buffer;
-            }
-        } else if (fds[0].revents & (POLLERR | POLLNVAL)) {
-            PLUGIN_ERROR("Failed to read pipe from '%s'.", pm->exec.exec);
-            break;
-        } else if (fds[1].revents & (POLLIN | POLLHUP)) {
-            int len = read(fd_err, pbuffer_err,
-                                   sizeof(buffer_err) - 1 - (pbuffer_err - buffer_err));
-
-            if (len < 0) {
-                if (errno == EAGAIN || errno == EINTR)
-                    continue;
-                break;
-            } else if (len == 0) {
-                /* We've reached EOF */
-                PLUGIN_DEBUG("Program '%s' has closed STDERR.", pm->exec.exec);
-
-                /* Clean up file descriptor */
-                if (fd_err > 0)
-                    close(fd_err);
-                fd_err = -1;
-                fds[1].fd = -1;
-                fds[1].events = 0;
-                continue;
-            }
-
-            pbuffer_err[len] = '\0';
-
-            len += pbuffer_err - buffer_err;
-            pbuffer_err = buffer_err;
-
-            char *pnl;
-            while ((pnl = strchr(pbuffer_err, '\n'))) {
-                *pnl = '\0';
-                if (*(pnl - 1) == '\r')
-                    *(pnl - 1) = '\0';
+}
 
-                PLUGIN_ERROR("exec_read_one: error = %s", pbuffer_err);
+static void nagios_check_read_error(char *line, void *arg)
+{
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
+    PLUGIN_ERROR("Program '%s' error: %s", pm->exec.exec, line);
+    plugin_set_ctx(old_ctx);
+}
 
-                pbuffer_err = ++pnl;
-            }
-            /* not completely read ? */
-            if (pbuffer_err - buffer_err < len) {
-                len -= pbuffer_err - buffer_err;
-                memmove(buffer_err, pbuffer_err, len);
-                pbuffer_err = buffer_err + len;
-            } else {
-                pbuffer_err = buffer_err;
-            }
-        } else if (fds[1].revents & (POLLERR | POLLNVAL)) {
-            PLUGIN_WARNING("Ignoring STDERR for program '%s'.", pm->exec.exec);
-            /* Clean up file descriptor */
-            if ((fds[1].revents & POLLNVAL) == 0) {
-                if (fd_err > 0)
-                    close(fd_err);
-                fd_err = -1;
-            }
-            fds[1].fd = -1;
-            fds[1].events = 0;
-        }
-    }
+static void nagios_check_read_exit(int status, void *arg)
+{
+    program_t *pm = arg;
+    plugin_ctx_t old_ctx = plugin_set_ctx(pm->ctx);
 
-    PLUGIN_DEBUG("Waiting for '%s' to exit.", pm->exec.exec);
-    if (waitpid(pm->pid, &pm->status, 0) < 0) {
-        PLUGIN_ERROR("waitpid failed: %s", STRERRNO);
+    if (status == -1) {
+        PLUGIN_ERROR("Failed to get the exit status of '%s'.", pm->exec.exec);
     } else {
-        PLUGIN_DEBUG("Child %i exited with status %i.", (int)pm->pid, pm->status);
-        nagios_check_dispatch_notification(pm, buf.ptr);
+        PLUGIN_DEBUG("Child %i exited with status %i.", (int)pm->pid, status);
+        pm->status = status;
+        nagios_check_dispatch_notification(pm, pm->buf.ptr);
     }
 
-    strbuf_destroy(&buf);
+    strbuf_reset(&pm->buf);
 
-    pm->pid = 0;
+    plugin_set_ctx(old_ctx);
 
     pthread_mutex_lock(&pm->lock);
+    pm->pid = 0;
     pm->running = false;
+    pthread_cond_broadcast(&pm->cond);
     pthread_mutex_unlock(&pm->lock);
-
-    close(fd);
-    if (fd_err >= 0)
-        close(fd_err);
-
-    pthread_exit((void *)0);
-    return NULL;
 }
 
 static int nagios_check_read(user_data_t *user_data)
@@ -307,7 +207,7 @@ static int nagios_check_read(user_data_t *user_data)
 
     pthread_mutex_lock(&pm->lock);
 
-    if (pm->running) {
+    if (pm->running || (nagios_check_reaper == NULL)) {
         pthread_mutex_unlock(&pm->lock);
         return 0;
     }
@@ -315,12 +215,39 @@ static int nagios_check_read(user_data_t *user_data)
     pm->running = true;
     pthread_mutex_unlock(&pm->lock);
 
-    pthread_t t = (pthread_t){0};
-    int status = plugin_thread_create(&t, nagios_check_read_one, (void *)pm, "exec read");
-    if (status == 0) {
-        pthread_detach(t);
-    } else {
-        PLUGIN_ERROR("plugin_thread_create failed.");
+    int fd = -1;
+    int fd_err = -1;
+    int pid = exec_fork_child(&pm->exec, false, NULL, &fd, &fd_err);
+    if (pid < 0) {
+        /* Reset the "running" flag */
+        pthread_mutex_lock(&pm->lock);
+        pm->running = false;
+        pthread_mutex_unlock(&pm->lock);
+        return 0;
+    }
+
+    assert(pid != 0);
+
+    pm->ctx = plugin_get_ctx();
+    strbuf_reset(&pm->buf);
+
+    pthread_mutex_lock(&pm->lock);
+    pm->pid = pid;
+    pthread_mutex_unlock(&pm->lock);
+
+    exec_watch_t watch = {
+        .out_cb = nagios_check_read_line,
+        .err_cb = nagios_check_read_error,
+        .exit_cb = nagios_check_read_exit,
+        .arg = pm,
+    };
+
+    int status = exec_reaper_watch(nagios_check_reaper, pid, fd, fd_err, &watch);
+    if (status != 0) {
+        pthread_mutex_lock(&pm->lock);
+        pm->pid = 0;
+        pm->running = false;
+        pthread_mutex_unlock(&pm->lock);
     }
 
     return 0;
@@ -333,12 +260,18 @@ static void nagios_check_free(void *arg)
     if (pm == NULL)
         return;
 
+    pthread_mutex_lock(&pm->lock);
     if (pm->pid > 0) {
         kill(pm->pid, SIGTERM);
-        PLUGIN_INFO("Sent SIGTERM to %hu", (unsigned short int)pm->pid);
-
-        waitpid(pm->pid, NULL, 0);
+        PLUGIN_INFO("Sent SIGTERM to %d", (int)pm->pid);
     }
+    /* The reaper reads the output until the child exits. */
+    while (pm->running)
+        pthread_cond_wait(&pm->cond, &pm->lock);
+    pthread_mutex_unlock(&pm->lock);
+
+    pthread_mutex_destroy(&pm->lock);
+    pthread_cond_destroy(&pm->cond);
 
     free(pm->instance);
 
@@ -348,6 +281,7 @@ static void nagios_check_free(void *arg)
     label_set_reset(&pm->labels);
     label_set_reset(&pm->annotations);
 
+    strbuf_destroy(&pm->buf);
 
     free(pm);
 }
@@ -367,6 +301,9 @@ static int nagios_check_config_instance(config_item_t *ci)
     pm->interval = plugin_get_interval();
     pm->persist = false;
     pm->persist_ok = false;
+    pm->buf = STRBUF_CREATE;
+    pthread_mutex_init(&pm->lock, NULL);
+    pthread_cond_init(&pm->cond, NULL);
 
     int status = cf_util_get_string(ci, &pm->instance);
     if (status != 0) {
@@ -415,8 +352,6 @@ static int nagios_check_config_instance(config_item_t *ci)
         return -1;
     }
 
-    pthread_mutex_init(&pm->lock, NULL);
-
     return plugin_register_complex_read("nagios_check", pm->instance, nagios_check_read, pm->interval,
                                         &(user_data_t){.data = pm, .free_func = nagios_check_free});
 }
@@ -458,6 +393,36 @@ static int nagios_check_init(void)
                            "ncollectd binary.");
     }
 #endif
+
+    if (nagios_check_reaper != NULL)
+        return 0;
+
+    nagios_check_reaper = exec_reaper_alloc();
+    if (nagios_check_reaper == NULL)
+        return -1;
+
+    int status = plugin_thread_create(&nagios_check_reaper_thread, exec_reaper_run,
+                                      nagios_check_reaper, "nagios reaper");
+    if (status != 0) {
+        PLUGIN_ERROR("plugin_thread_create failed.");
+        exec_reaper_free(nagios_check_reaper);
+        nagios_check_reaper = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int nagios_check_shutdown(void)
+{
+    if (nagios_check_reaper == NULL)
+        return 0;
+
+    exec_reaper_stop(nagios_check_reaper);
+    pthread_join(nagios_check_reaper_thread, NULL);
+    exec_reaper_free(nagios_check_reaper);
+    nagios_check_reaper = NULL;
+
     return 0;
 }
 
@@ -465,4 +430,5 @@ void module_register(void)
 {
     plugin_register_config("nagios_check", nagios_check_config);
     plugin_register_init("nagios_check", nagios_check_init);
+    plugin_register_shutdown("nagios_check", nagios_check_shutdown);
 }
@@ -22,8 +22,6 @@
 #include "libmetric/metric_match.h"
 #include "libformat/format.h"
 
-#include <poll.h>
-
 #ifdef HAVE_SYS_CAPABILITY_H
 #include <sys/capability.h>
 #endif
@@ -44,16 +42,15 @@ struct program_list {
     char **envp;
     cexec_t exec;
     pid_t pid;
+    pthread_mutex_t lock;
     program_list_t *next;
 };
 
-typedef struct {
-    program_list_t *pl;
-    notification_t *n;
-} program_list_and_notification_t;
-
 static program_list_t *pl_head;
 
+static exec_reaper_t *notify_exec_reaper;
+static pthread_t notify_exec_reaper_thread;
+
 static void notify_exec_free_envp(char **envp)
 {
     if (envp == NULL)
@@ -67,7 +64,7 @@ static void notify_exec_free_envp(char **envp)
     free(envp);
 }
 
-static char **notify_exec_notification2env(notification_t *n, char **default_envp)
+static char **notify_exec_notification2env(const notification_t *n, char **default_envp)
 {
     char buffer[4096];
     strbuf_t buf = STRBUF_CREATE_FIXED(buffer, sizeof(buffer));
@@ -185,11 +182,19 @@ static char **notify_exec_notification2env(notification_t *n, char **default_env
     return envp;
 }
 
-static void *notify_exec_notification_one(void *arg)
+static void notify_exec_notification_exit(__attribute__((unused)) int status, void *arg)
 {
-    program_list_t *pl = ((program_list_and_notification_t *)arg)->pl;
-    notification_t *n = ((program_list_and_notification_t *)arg)->n;
+    program_list_t *pl = arg;
+
+    PLUGIN_DEBUG("Child %i exited with status %i.", (int)pl->pid, status);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->pid = 0;
+    pthread_mutex_unlock(&pl->lock);
+}
 
+static void notify_exec_notification_one(program_list_t *pl, const notification_t *n)
+{
     strbuf_t buf = STRBUF_CREATE;
     char **envp = NULL;
     switch (pl->format) {
@@ -207,86 +212,69 @@ static void *notify_exec_notification_one(void *arg)
         break;
     }
 
+    /* The environment is only needed until the program is executed. */
     pl->exec.envp = envp == NULL ? pl->envp : envp;
 
-    int fd = 0;
-    int pid = exec_fork_child(&pl->exec, false, &fd, NULL, NULL);
+    int fd = -1;
+    int fd_out = -1;
+    int fd_err = -1;
+    int pid = exec_fork_child(&pl->exec, false, &fd, &fd_out, &fd_err);
+    pl->exec.envp = NULL;
+    notify_exec_free_envp(envp);
     if (pid < 0) {
-        notification_free(n);
-        free(arg);
         strbuf_destroy(&buf);
-        notify_exec_free_envp(envp);
-        pthread_exit((void *)1);
+        return;
     }
+
+    pthread_mutex_lock(&pl->lock);
     pl->pid = pid;
+    pthread_mutex_unlock(&pl->lock);
 
-    if (pl->format != PROGRAM_FORMAT_NOTIFICATION_ENV) {
-        if (strbuf_len(&buf) > 0) {
-            ssize_t status = swrite(fd, buf.ptr, strbuf_len(&buf));
-            if (status != 0) {
-                PLUGIN_ERROR("write(%i) failed: %s", fd, STRERRNO);
-                kill(pid, SIGTERM);
-                close(fd);
-                notification_free(n);
-                free(arg);
-                strbuf_destroy(&buf);
-                notify_exec_free_envp(envp);
-                pthread_exit((void *)1);
-                return NULL;
-            }
+    exec_watch_t watch = {
+        .exit_cb = notify_exec_notification_exit,
+        .arg = pl,
+    };
+
+    int status = exec_reaper_watch(notify_exec_reaper, pid, fd_out, fd_err, &watch);
+    if (status != 0) {
+        pthread_mutex_lock(&pl->lock);
+        pl->pid = 0;
+        pthread_mutex_unlock(&pl->lock);
+        close(fd);
+        strbuf_destroy(&buf);
+        return;
+    }
+
+    if ((pl->format != PROGRAM_FORMAT_NOTIFICATION_ENV) && (strbuf_len(&buf) > 0)) {
+        ssize_t wstatus = swrite(fd, buf.ptr, strbuf_len(&buf));
+        if (wstatus != 0) {
+            PLUGIN_ERROR("write(%i) failed: %s", fd, STRERRNO);
+            kill(pid, SIGTERM);
         }
     }
 
     close(fd);
-
-    int status;
-    waitpid(pid, &status, 0);
-    PLUGIN_DEBUG("Child %i exited with status %i.", pid, status);
-
-    pl->pid = 0;
-
-    notification_free(n);
-    free(arg);
     strbuf_destroy(&buf);
-    notify_exec_free_envp(envp);
-
-    pthread_exit((void *)0);
-    return NULL;
 }
 
 static int notify_exec_notification(const notification_t *n,
                                     user_data_t __attribute__((unused)) * user_data)
 {
+    if (notify_exec_reaper == NULL)
+        return 0;
+
     for (program_list_t *pm = pl_head; pm != NULL; pm = pm->next) {
         if (metric_match_cmp(&pm->match, n->name, &n->label) == false)
             continue;
 
         /* Skip if a child is already running. */
-        if (pm->pid != 0)
-            continue;
-
-        program_list_and_notification_t *pln = calloc(1, sizeof(*pln));
-        if (pln == NULL) {
-            PLUGIN_ERROR("calloc failed.");
-            continue;
-        }
-
-        pln->pl = pm;
-        pln->n = notification_clone(n);
-        if (pln->n == NULL) {
-            PLUGIN_ERROR("notification_clone failed.");
-            free(pln);
+        pthread_mutex_lock(&pm->lock);
+        bool running = pm->pid != 0;
+        pthread_mutex_unlock(&pm->lock);
+        if (running)
             continue;
-        }
 
-        pthread_t t = (pthread_t){0};
-        int status = plugin_thread_create(&t, notify_exec_notification_one, (void *)pln,
-                                              "notify exec");
-        if (status == 0) {
-            pthread_detach(t);
-        } else {
-            PLUGIN_ERROR("plugin_thread_create failed.");
-        }
+        notify_exec_notification_one(pm, n);
     }
 
     return 0;
@@ -299,13 +287,6 @@ static void notify_exec_free(void *arg)
     if (pm == NULL)
         return;
 
-    if (pm->pid > 0) {
-        kill(pm->pid, SIGTERM);
-        PLUGIN_INFO("Sent SIGTERM to %hu", (unsigned short int)pm->pid);
-
-        waitpid(pm->pid, NULL, 0);
-    }
-
     exec_reset(&pm->exec);
     notify_exec_free_envp(pm->envp);
 
@@ -314,6 +295,8 @@ static void notify_exec_free(void *arg)
     if (pm->match.labels != NULL)
         metric_match_set_free(pm->match.labels);
 
+    pthread_mutex_destroy(&pm->lock);
+
     free(pm);
 }
 
@@ -377,6 +360,7 @@ static int notify_exec_config_match(config_item_t *ci, program_format_notificati
     }
 
     pm->format = format;
+    pthread_mutex_init(&pm->lock, NULL);
 
     int status = notify_exec_config_get_match(ci, pm);
     if (status != 0) {
@@ -449,6 +433,14 @@ static int notify_exec_config(config_item_t *ci)
 
 static int notify_exec_shutdown(void)
 {
+    /* The children still running are terminated before the programs are freed. */
+    if (notify_exec_reaper != NULL) {
+        exec_reaper_stop(notify_exec_reaper);
+        pthread_join(notify_exec_reaper_thread, NULL);
+        exec_reaper_free(notify_exec_reaper);
+        notify_exec_reaper = NULL;
+    }
+
     program_list_t *pm = pl_head;
     while (pm != NULL) {
         program_list_t *next = pm->next;
@@ -474,6 +466,23 @@ static int notify_exec_init(void)
                            "ncollectd binary.");
     }
 #endif
+
+    if (notify_exec_reaper != NULL)
+        return 0;
+
+    notify_exec_reaper = exec_reaper_alloc();
+    if (notify_exec_reaper == NULL)
+        return -1;
+
+    int status = plugin_thread_create(&notify_exec_reaper_thread, exec_reaper_run,
+                                      notify_exec_reaper, "notify reaper");
+    if (status != 0) {
+        PLUGIN_ERROR("plugin_thread_create failed.");
+        exec_reaper_free(notify_exec_reaper);
+        notify_exec_reaper = NULL;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -967,50 +967,41 @@ static int postfix_read_journal(postfix_ctx_t *ctx)
 }
 #endif
 
-static int postfix_read_log(postfix_ctx_t *ctx)
+static int postfix_read_log_line(void *data, char *buf, size_t len)
 {
-    while (true) {
-        char buf[8192];
-        int status = tail_readline(&ctx->tail, buf, sizeof(buf));
-        if (status != 0) {
-            PLUGIN_ERROR("File '%s': tail_readline failed with status %i.",
-                         ctx->tail.file, status);
-            return -1;
-        }
+    postfix_ctx_t *ctx = data;
 
-        /* check for EOF */
-        if (buf[0] == 0)
-          break;
+    if (len == 0)
+        return 0;
 
-        size_t len = strlen(buf);
-        while (len > 0) {
-            if (buf[len - 1] != '\n')
-                break;
-            buf[len - 1] = '\0';
-            len--;
-        }
+    regmatch_t match[6] = {0};
+    size_t match_size = STATIC_ARRAY_SIZE(match);
 
-        if (len == 0)
-            continue;
+    int status = regexec(&ctx->preg[POSTFIX_REGEX_LOG], buf, match_size, match, 0);
+    if (status != 0)
+        return 0;
 
-        regmatch_t match[6] = {0};
-        size_t match_size = STATIC_ARRAY_SIZE(match);
+    char *subprocess = postfix_regmatch(&match[2], buf, len);
+    if (subprocess == NULL)
+        return -1;
 
-        status = regexec(&ctx->preg[POSTFIX_REGEX_LOG], buf, match_size, match, 0);
-        if (status != 0)
-            return 0;
+    char *message = postfix_regmatch(&match[5], buf, len);
+    if (message == NULL)
+        return -1;
 
-        char *subprocess = postfix_regmatch(&match[2], buf, len);
-        if (subprocess == NULL)
-            return -1;
+    size_t message_len = strlen(message);
 
-        char *message = postfix_regmatch(&match[5], buf, len);
-        if (message == NULL)
-            return -1;
+    postfix_parse_log_line(ctx, subprocess, message, message_len);
 
-        size_t message_len = strlen(message);
+    return 0;
+}
 
-        postfix_parse_log_line(ctx, subprocess, message, message_len);
+static int postfix_read_log(postfix_ctx_t *ctx)
+{
+    int status = tail_read(&ctx->tail, postfix_read_log_line, ctx);
+    if (status != 0) {
+        PLUGIN_ERROR("File '%s': tail_read failed with status %i.", ctx->tail.file, status);
+        return -1;
     }
 
     return 0;
@@ -1136,7 +1127,9 @@ static void postfix_ctx_free(void *arg)
     free(ctx->showq_path);
     free(ctx->unit);
 
-    tail_close(&ctx->tail);
+    /* The file of the tail is the log_path. */
+    ctx->tail.file = NULL;
+    tail_reset(&ctx->tail);
 #ifdef HAVE_SD_JOURNAL
     if (ctx->journal != NULL)
         sd_journal_close(ctx->journal);
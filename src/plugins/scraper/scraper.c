@@ -41,8 +41,24 @@ typedef struct {
     CURL *curl;
     char curl_errbuf[CURL_ERROR_SIZE];
     metric_parser_t *mp;
+    bool scraping;
+    cdtime_t next_scrape;
 } scraper_instance_t;
 
+/* All the url instances scraped from a single read callback with the curl
+ * multi interface. */
+typedef struct {
+    cdtime_t interval;
+    unsigned int max_concurrent;
+    CURLM *curl_multi;
+    size_t targets_num;
+    scraper_instance_t **targets;
+} scraper_multi_t;
+
+#define SCRAPER_MULTI_MAX_CONCURRENT 64
+
+static scraper_multi_t *scraper_multi;
+
 static size_t scraper_curl_callback(void *buf, size_t size, size_t nmemb, void *user_data)
 {
     scraper_instance_t *target = user_data;
@@ -96,6 +112,13 @@ static int scraper_curl_init(scraper_instance_t *target)
         return -1;
     }
 
+    rcode = curl_easy_setopt(target->curl, CURLOPT_PRIVATE, target);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_PRIVATE failed: %s",
+                     curl_easy_strerror(rcode));
+        return -1;
+    }
+
     rcode = curl_easy_setopt(target->curl, CURLOPT_USERAGENT, NCOLLECTD_USERAGENT);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_USERAGENT failed: %s",
@@ -277,20 +300,14 @@ static void scaper_curl_cleanup(scraper_instance_t *target)
     }
 }
 
-static int scaper_read_url(scraper_instance_t *target)
+static void scraper_url_finish(scraper_instance_t *target, CURLcode status)
 {
-    if (scraper_curl_init(target) != 0) {
-        scaper_curl_cleanup(target);
-        return 0;
-    }
-
-    int status = curl_easy_perform(target->curl);
     if (status != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_perform failed with status %i: %s (%s)",
-                     status, target->curl_errbuf, target->url);
+                     (int)status, target->curl_errbuf, target->url);
         metric_parser_reset(target->mp);
         scaper_curl_cleanup(target);
-        return 0;
+        return;
     }
 
     label_set_t lstats = {0};
@@ -314,11 +331,23 @@ static int scaper_read_url(scraper_instance_t *target)
         PLUGIN_ERROR("curl_easy_perform failed with response code %ld (%s)", rc, url);
         metric_parser_reset(target->mp);
         scaper_curl_cleanup(target);
-        return 0;
+        return;
     }
 
+    metric_parse_buffer(target->mp, NULL, 0);
     metric_parser_dispatch(target->mp, plugin_dispatch_metric_family_filtered, target->filter, 0);
     metric_parser_reset(target->mp);
+}
+
+static int scaper_read_url(scraper_instance_t *target)
+{
+    if (scraper_curl_init(target) != 0) {
+        scaper_curl_cleanup(target);
+        return 0;
+    }
+
+    CURLcode status = curl_easy_perform(target->curl);
+    scraper_url_finish(target, status);
 
     return 0;
 }
@@ -402,6 +431,110 @@ static int scaper_read(user_data_t *ud)
     return 0;
 }
 
+static int scraper_multi_read(user_data_t *ud)
+{
+    if ((ud == NULL) || (ud->data == NULL)) {
+        PLUGIN_ERROR("Invalid user data.");
+        return -1;
+    }
+
+    scraper_multi_t *multi = ud->data;
+
+    /* The multi handle is kept between reads to reuse the connections. */
+    if (multi->curl_multi == NULL) {
+        multi->curl_multi = curl_multi_init();
+        if (multi->curl_multi == NULL) {
+            PLUGIN_ERROR("curl_multi_init failed.");
+            return -1;
+        }
+        curl_multi_setopt(multi->curl_multi, CURLMOPT_MAXCONNECTS, (long)multi->max_concurrent);
+    }
+
+    cdtime_t now = cdtime();
+    /* Targets with a longer interval are scraped in the first read after they
+     * are due, allow half the read interval of jitter. */
+    cdtime_t slack = plugin_get_interval() / 2;
+    size_t next = 0;
+    size_t running = 0;
+
+    while (true) {
+        while ((running < multi->max_concurrent) && (next < multi->targets_num)) {
+            scraper_instance_t *target = multi->targets[next];
+            next++;
+
+            if ((target->interval > 0) && (target->next_scrape > (now + slack)))
+                continue;
+            target->next_scrape = now + target->interval;
+
+            if (scraper_curl_init(target) != 0) {
+                scaper_curl_cleanup(target);
+                continue;
+            }
+
+            CURLMcode mc = curl_multi_add_handle(multi->curl_multi, target->curl);
+            if (mc != CURLM_OK) {
+                PLUGIN_ERROR("curl_multi_add_handle failed for '%s': %s",
+                             target->url, curl_multi_strerror(mc));
+                continue;
+            }
+            target->scraping = true;
+            running++;
+        }
+
+        if (running == 0)
+            break;
+
+        int still_running = 0;
+        CURLMcode mc = curl_multi_perform(multi->curl_multi, &still_running);
+        if (mc != CURLM_OK) {
+            PLUGIN_ERROR("curl_multi_perform failed: %s", curl_multi_strerror(mc));
+            break;
+        }
+
+        struct CURLMsg *m = NULL;
+        int msgq = 0;
+        while ((m = curl_multi_info_read(multi->curl_multi, &msgq)) != NULL) {
+            if (m->msg != CURLMSG_DONE)
+                continue;
+
+            CURL *curl = m->easy_handle;
+            CURLcode result = m->data.result;
+
+            scraper_instance_t *target = NULL;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &target);
+            curl_multi_remove_handle(multi->curl_multi, curl);
+            running--;
+
+            if (target != NULL) {
+                target->scraping = false;
+                scraper_url_finish(target, result);
+            }
+        }
+
+        if ((running == 0) || (still_running == 0))
+            continue;
+
+        int numfds = 0;
+        mc = curl_multi_poll(multi->curl_multi, NULL, 0, 1000, &numfds);
+        if (mc != CURLM_OK) {
+            PLUGIN_ERROR("curl_multi_poll failed: %s", curl_multi_strerror(mc));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < multi->targets_num; i++) {
+        scraper_instance_t *target = multi->targets[i];
+        if (target->scraping) {
+            curl_multi_remove_handle(multi->curl_multi, target->curl);
+            target->scraping = false;
+            metric_parser_reset(target->mp);
+            scaper_curl_cleanup(target);
+        }
+    }
+
+    return 0;
+}
+
 static void scraper_instance_free(void *arg)
 {
     scraper_instance_t *target = (scraper_instance_t *)arg;
@@ -433,6 +566,23 @@ static void scraper_instance_free(void *arg)
     free(target);
 }
 
+static void scraper_multi_free(void *arg)
+{
+    scraper_multi_t *multi = arg;
+    if (multi == NULL)
+        return;
+
+    for (size_t i = 0; i < multi->targets_num; i++) {
+        scraper_instance_free(multi->targets[i]);
+    }
+    free(multi->targets);
+
+    if (multi->curl_multi != NULL)
+        curl_multi_cleanup(multi->curl_multi);
+
+    free(multi);
+}
+
 static int scraper_config_append_string(const char *name, struct curl_slist **dest,
                                         config_item_t *ci)
 {
@@ -615,19 +765,93 @@ static int scraper_config_target(config_item_t *ci)
         return -1;
     }
 
+    if ((scraper_multi != NULL) && (target->url != NULL)) {
+        scraper_instance_t **tmp = realloc(scraper_multi->targets,
+                                           sizeof(*tmp) * (scraper_multi->targets_num + 1));
+        if (tmp == NULL) {
+            PLUGIN_ERROR("realloc failed.");
+            scraper_instance_free(target);
+            return -1;
+        }
+        scraper_multi->targets = tmp;
+        scraper_multi->targets[scraper_multi->targets_num] = target;
+        scraper_multi->targets_num++;
+        return 0;
+    }
+
     return plugin_register_complex_read("scraper", target->instance, scaper_read, target->interval,
                                  &(user_data_t){.data = target,.free_func = scraper_instance_free});
 }
 
+static int scraper_config_multi(config_item_t *ci)
+{
+    if (ci->values_num != 0) {
+        PLUGIN_WARNING("The 'multi' block does not take arguments.");
+        return -1;
+    }
+
+    if (scraper_multi != NULL) {
+        PLUGIN_ERROR("The 'multi' block can appear only once.");
+        return -1;
+    }
+
+    scraper_multi = calloc(1, sizeof(*scraper_multi));
+    if (scraper_multi == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        return -1;
+    }
+
+    scraper_multi->max_concurrent = SCRAPER_MULTI_MAX_CONCURRENT;
+
+    int status = 0;
+    for (int i = 0; i < ci->children_num; i++) {
+        config_item_t *child = ci->children + i;
+
+        if (strcasecmp("max-concurrent", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &scraper_multi->max_concurrent);
+            if ((status == 0) && (scraper_multi->max_concurrent == 0)) {
+                PLUGIN_ERROR("'max-concurrent' must be greater than zero.");
+                status = -1;
+            }
+        } else if (strcasecmp("interval", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &scraper_multi->interval);
+        } else {
+            PLUGIN_WARNING("Option `%s' not allowed here.", child->key);
+            status = -1;
+        }
+
+        if (status != 0)
+            break;
+    }
+
+    return status;
+}
+
 static int scraper_config(config_item_t *ci)
 {
     int status = 0;
 
+    /* The 'multi' block applies to all the instances, wherever it appears. */
+    for (int i = 0; i < ci->children_num; i++) {
+        config_item_t *child = ci->children + i;
+
+        if (strcasecmp("multi", child->key) == 0) {
+            status = scraper_config_multi(child);
+            if (status != 0) {
+                scraper_multi_free(scraper_multi);
+                scraper_multi = NULL;
+                return -1;
+            }
+        }
+    }
+
     for (int i = 0; i < ci->children_num; i++) {
         config_item_t *child = ci->children + i;
 
         if (strcasecmp("instance", child->key) == 0) {
             status = scraper_config_target(child);
+        } else if (strcasecmp("multi", child->key) == 0) {
+            continue;
         } else {
             PLUGIN_ERROR("The configuration option '%s' in %s:%d is not allowed here.",
                          child->key, cf_get_file(child), cf_get_lineno(child));
@@ -635,10 +859,24 @@ static int scraper_config(config_item_t *ci)
         }
 
         if (status != 0)
-            return -1;
+            break;
     }
 
-    return 0;
+    if (scraper_multi != NULL) {
+        scraper_multi_t *multi = scraper_multi;
+        scraper_multi = NULL;
+
+        if ((status != 0) || (multi->targets_num == 0)) {
+            scraper_multi_free(multi);
+        } else {
+            status = plugin_register_complex_read("scraper", "multi", scraper_multi_read,
+                                                  multi->interval,
+                                                  &(user_data_t){.data = multi,
+                                                                 .free_func = scraper_multi_free});
+        }
+    }
+
+    return status != 0 ? -1 : 0;
 }
 
 static int scraper_init(void)
@@ -20,37 +20,28 @@ typedef struct {
     plugin_match_t *matches;
 } ctail_t;
 
-static int ctail_read(user_data_t *ud)
+static int ctail_read_line(void *data, char *line, size_t len)
 {
-    ctail_t *ctail = ud->data;
+    ctail_t *ctail = data;
 
-    while (true) {
-        char buf[8192];
-        int status = tail_readline(&ctail->tail, buf, sizeof(buf));
-        if (status != 0) {
-            PLUGIN_ERROR("File '%s': tail_readline failed with status %i.",
-                         ctail->tail.file, status);
-            return -1;
-        }
+    if (len == 0)
+        return 0;
 
-        /* check for EOF */
-        if (buf[0] == 0)
-          break;
+    int status = plugin_match(ctail->matches, line);
+    if (status != 0)
+        PLUGIN_WARNING("plugin_match failed.");
 
-        size_t len = strlen(buf);
-        while (len > 0) {
-            if (buf[len - 1] != '\n')
-                break;
-            buf[len - 1] = '\0';
-            len--;
-        }
+    return status;
+}
 
-        if (len == 0)
-            continue;
+static int ctail_read(user_data_t *ud)
+{
+    ctail_t *ctail = ud->data;
 
-        status = plugin_match(ctail->matches, buf);
-        if (status != 0)
-            PLUGIN_WARNING("plugin_match failed.");
+    int status = tail_read(&ctail->tail, ctail_read_line, ctail);
+    if (status != 0) {
+        PLUGIN_ERROR("File '%s': tail_read failed with status %i.", ctail->tail.file, status);
+        return -1;
     }
 
     if (ctail->whole)
@@ -13,6 +13,7 @@
 #include "libformat/format.h"
 #include "libcompress/compress.h"
 
+#include <pthread.h>
 #include <curl/curl.h>
 
 #include "curl_stats.h"
@@ -21,6 +22,51 @@
 #define WRITE_HTTP_RESPONSE_BUFFER_SIZE 1024
 #endif
 
+#define WRITE_HTTP_ASYNC_MAX_IN_FLIGHT 4
+#define WRITE_HTTP_ASYNC_QUEUE_LIMIT (16 * 1024 * 1024)
+#define WRITE_HTTP_ASYNC_RETRIES 3
+#define WRITE_HTTP_ASYNC_BACKOFF_MAX 5
+
+typedef struct {
+    char buffer[WRITE_HTTP_RESPONSE_BUFFER_SIZE];
+    unsigned int pos;
+} wh_response_t;
+
+/* A formatted and compressed payload waiting to be posted. */
+typedef struct wh_batch_s wh_batch_t;
+struct wh_batch_s {
+    wh_batch_t *next;
+    char *data;
+    size_t size;
+    unsigned int retries;
+    cdtime_t retry_time;
+};
+
+typedef struct {
+    CURL *curl;
+    wh_batch_t *batch;
+    char curl_errbuf[CURL_ERROR_SIZE];
+    wh_response_t response;
+} wh_request_t;
+
+/* The writer thread formats and compresses the batches and queues them, a
+ * sender thread posts them with up to max_in_flight requests over the curl
+ * multi interface. */
+typedef struct {
+    unsigned int max_in_flight;
+    size_t queue_limit;
+    unsigned int retries;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool thread_running;
+    bool loop;
+    CURLM *curl_multi;
+    wh_batch_t *head;
+    wh_batch_t *tail;
+    size_t queue_size;
+    wh_request_t *requests;
+} wh_async_t;
+
 struct wh_callback_s {
     char *name;
     char *location;
@@ -51,11 +97,13 @@ struct wh_callback_s {
     uint64_t curl_stats_flags;
     struct curl_slist *headers;
     char curl_errbuf[CURL_ERROR_SIZE];
+    unsigned int batch_size;
+    cdtime_t batch_timeout;
     unsigned int send_buffer_max;
     strbuf_t send_buffer;
     cdtime_t send_buffer_init_time;
-    char response_buffer[WRITE_HTTP_RESPONSE_BUFFER_SIZE];
-    unsigned int response_buffer_pos;
+    wh_response_t response;
+    wh_async_t *async;
 };
 typedef struct wh_callback_s wh_callback_t;
 
@@ -64,37 +112,57 @@ typedef struct wh_callback_s wh_callback_t;
 static size_t wh_curl_write_callback(char *ptr, __attribute__((unused)) size_t size,
                                      size_t nmemb, void *userdata)
 {
-    wh_callback_t *cb = (wh_callback_t *)userdata;
+    wh_response_t *response = userdata;
     unsigned int len = 0;
 
-    if ((cb->response_buffer_pos + nmemb) > sizeof(cb->response_buffer))
-        len = sizeof(cb->response_buffer) - cb->response_buffer_pos;
+    if ((response->pos + nmemb) > sizeof(response->buffer))
+        len = sizeof(response->buffer) - response->pos;
     else
         len = nmemb;
 
     PLUGIN_DEBUG("curl callback nmemb=%zu buffer_pos=%u write_len=%u ",
-                 nmemb, cb->response_buffer_pos, len);
+                 nmemb, response->pos, len);
 
-    memcpy(cb->response_buffer + cb->response_buffer_pos, ptr, len);
-    cb->response_buffer_pos += len;
-    cb->response_buffer[sizeof(cb->response_buffer) - 1] = '\0';
+    memcpy(response->buffer + response->pos, ptr, len);
+    response->pos += len;
+    response->buffer[sizeof(response->buffer) - 1] = '\0';
 
     /* Always return nmemb even if we write less so libcurl won't throw an error */
     return nmemb;
 }
 
-static void wh_log_http_error(wh_callback_t *cb)
+static void wh_response_reset(wh_response_t *response)
+{
+    response->pos = 0;
+    response->buffer[0] = '\0';
+}
+
+static void wh_log_http_error(wh_callback_t *cb, CURL *curl)
 {
     if (!cb->log_http_error)
         return;
 
     long http_code = 0;
-    curl_easy_getinfo(cb->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 
     if (http_code != 200)
         PLUGIN_INFO("HTTP Error code: %ld", http_code);
 }
 
+static void wh_curl_stats_dispatch(wh_callback_t *cb, CURL *curl)
+{
+    if (cb->curl_stats_flags == 0)
+        return;
+
+    label_set_t labels = {
+        .ptr = (label_pair_t[]) {{.name = "instance", .value = cb->name }},
+        .num = 1,
+    };
+    int rc = curl_stats_dispatch(curl, cb->curl_stats_flags, "write_http", &labels);
+    if (rc != 0)
+        PLUGIN_ERROR("curl_stats_dispatch failed with status %d", rc);
+}
+
 static int wh_post(wh_callback_t *cb, char *data, size_t data_len)
 {
     if ((data == NULL) || (data_len == 0))
@@ -107,11 +175,7 @@ static int wh_post(wh_callback_t *cb, char *data, size_t data_len)
 
     CURLcode rcode = 0;
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_URL, cb->location);
-    if (rcode != CURLE_OK) {
-        PLUGIN_ERROR("curl_easy_setopt CURLOPT_URL failed: %s", curl_easy_strerror(rcode));
-        return -1;
-    }
+    wh_response_reset(&cb->response);
 
     curl_off_t curl_post_data_len = post_data_len;
     rcode = curl_easy_setopt(cb->curl, CURLOPT_POSTFIELDSIZE_LARGE, curl_post_data_len);
@@ -128,40 +192,17 @@ static int wh_post(wh_callback_t *cb, char *data, size_t data_len)
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_WRITEFUNCTION, wh_curl_write_callback);
-    if (rcode != CURLE_OK) {
-        PLUGIN_ERROR("curl_easy_setopt CURLOPT_WRITEFUNCTION failed: %s",
-                     curl_easy_strerror(rcode));
-        return -1;
-    }
-
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_WRITEDATA, (void *)cb);
-    if (rcode != CURLE_OK) {
-        PLUGIN_ERROR("curl_easy_setopt CURLOPT_WRITEDATA failed: %s",
-                     curl_easy_strerror(rcode));
-        return -1;
-    }
-
     int status = curl_easy_perform(cb->curl);
 
-    wh_log_http_error(cb);
-
-    if (cb->curl_stats_flags != 0) {
-        label_set_t labels = {
-            .ptr = (label_pair_t[]) {{.name = "instance", .value = cb->name }},
-            .num = 1,
-        };
-        int rc = curl_stats_dispatch(cb->curl, cb->curl_stats_flags, "write_http", &labels);
-        if (rc != 0)
-            PLUGIN_ERROR("curl_stats_dispatch failed with status %d", rc);
-    }
+    wh_log_http_error(cb, cb->curl);
+    wh_curl_stats_dispatch(cb, cb->curl);
 
     if (status != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_perform failed with status %d: %s", status, cb->curl_errbuf);
-        if (strlen(cb->response_buffer) > 0)
-            PLUGIN_ERROR("curl_response: %s", cb->response_buffer);
+        if (strlen(cb->response.buffer) > 0)
+            PLUGIN_ERROR("curl_response: %s", cb->response.buffer);
     } else {
-        PLUGIN_DEBUG("curl_response: %s", cb->response_buffer);
+        PLUGIN_DEBUG("curl_response: %s", cb->response.buffer);
     }
 
     compress_free(cb->compress, post_data);
@@ -169,28 +210,39 @@ static int wh_post(wh_callback_t *cb, char *data, size_t data_len)
     return status;
 }
 
-static int wh_callback_init(wh_callback_t *cb)
+static int wh_curl_setopt(wh_callback_t *cb, CURL *curl, char *errbuf, wh_response_t *response)
 {
-    if (cb->curl != NULL)
-        return 0;
+    CURLcode rcode = 0;
 
-    cb->curl = curl_easy_init();
-    if (cb->curl == NULL) {
-        PLUGIN_ERROR("curl_easy_init failed.");
+    rcode = curl_easy_setopt(curl, CURLOPT_URL, cb->location);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_URL failed: %s", curl_easy_strerror(rcode));
         return -1;
     }
 
-    CURLcode rcode = 0;
+    rcode = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, wh_curl_write_callback);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_WRITEFUNCTION failed: %s",
+                     curl_easy_strerror(rcode));
+        return -1;
+    }
+
+    rcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)response);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_WRITEDATA failed: %s",
+                     curl_easy_strerror(rcode));
+        return -1;
+    }
 
     if (cb->low_speed_limit > 0 && cb->low_speed_time > 0) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_LOW_SPEED_LIMIT,
+        rcode = curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
                                    (long)(cb->low_speed_limit * cb->low_speed_time));
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_LOW_SPEED_LIMIT failed: %s",
                          curl_easy_strerror(rcode));
             return -1;
         }
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_LOW_SPEED_TIME, (long)cb->low_speed_time);
+        rcode = curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)cb->low_speed_time);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_LOW_SPEED_TIME failed: %s",
                          curl_easy_strerror(rcode));
@@ -200,7 +252,7 @@ static int wh_callback_init(wh_callback_t *cb)
 
 #ifdef HAVE_CURLOPT_TIMEOUT_MS
     if (cb->timeout > 0) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_TIMEOUT_MS, (long)cb->timeout);
+        rcode = curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)cb->timeout);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_TIMEOUT_MS failed: %s",
                          curl_easy_strerror(rcode));
@@ -209,58 +261,42 @@ static int wh_callback_init(wh_callback_t *cb)
     }
 #endif
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_NOSIGNAL, 1L);
+    rcode = curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_NOSIGNAL failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_USERAGENT, NCOLLECTD_USERAGENT);
+    rcode = curl_easy_setopt(curl, CURLOPT_USERAGENT, NCOLLECTD_USERAGENT);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_USERAGENT failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    cb->headers = curl_slist_append(cb->headers, "Accept:  */*");
-
-    if (cb->content_type != NULL) {
-        char buffer[256];
-        ssnprintf(buffer, sizeof(buffer), "Content-Type: %s", cb->content_type);
-        cb->headers = curl_slist_append(cb->headers, buffer);
-    }
-
-    const char *encoding = compress_get_encoding(cb->compress);
-    if (encoding != NULL) {
-        char buffer[256];
-        ssnprintf(buffer, sizeof(buffer), "Content-Encoding: %s", encoding);
-        cb->headers = curl_slist_append(cb->headers, buffer);
-    }
-
-    cb->headers = curl_slist_append(cb->headers, "Expect:");
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_HTTPHEADER, cb->headers);
+    rcode = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, cb->headers);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_HTTPHEADER failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_ERRORBUFFER, cb->curl_errbuf);
+    rcode = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_ERRORBUFFER failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    rcode = curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_FOLLOWLOCATION failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_MAXREDIRS, 50L);
+    rcode = curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_MAXREDIRS failed: %s",
                      curl_easy_strerror(rcode));
@@ -269,13 +305,13 @@ static int wh_callback_init(wh_callback_t *cb)
 
     if (cb->user != NULL) {
 #ifdef HAVE_CURLOPT_USERNAME
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_USERNAME, cb->user);
+        rcode = curl_easy_setopt(curl, CURLOPT_USERNAME, cb->user);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_USERNAME failed: %s",
                          curl_easy_strerror(rcode));
             return -1;
         }
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_PASSWORD, (cb->pass == NULL) ? "" : cb->pass);
+        rcode = curl_easy_setopt(curl, CURLOPT_PASSWORD, (cb->pass == NULL) ? "" : cb->pass);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_PASSWORD failed: %s",
                          curl_easy_strerror(rcode));
@@ -296,14 +332,14 @@ static int wh_callback_init(wh_callback_t *cb)
 
         snprintf(cb->credentials, credentials_size, "%s:%s", cb->user,
                          (cb->pass == NULL) ? "" : cb->pass);
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_USERPWD, cb->credentials);
+        rcode = curl_easy_setopt(curl, CURLOPT_USERPWD, cb->credentials);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_USERPWD failed: %s",
                          curl_easy_strerror(rcode));
             return -1;
         }
 #endif
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+        rcode = curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_HTTPAUTH failed: %s",
                          curl_easy_strerror(rcode));
@@ -311,21 +347,21 @@ static int wh_callback_init(wh_callback_t *cb)
         }
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_SSL_VERIFYPEER, (long)cb->verify_peer);
+    rcode = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, (long)cb->verify_peer);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSL_VERIFYPEER failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_SSL_VERIFYHOST, cb->verify_host ? 2L : 0L);
+    rcode = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, cb->verify_host ? 2L : 0L);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSL_VERIFYHOST failed: %s",
                      curl_easy_strerror(rcode));
         return -1;
     }
 
-    rcode = curl_easy_setopt(cb->curl, CURLOPT_SSLVERSION, cb->sslversion);
+    rcode = curl_easy_setopt(curl, CURLOPT_SSLVERSION, cb->sslversion);
     if (rcode != CURLE_OK) {
         PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSLVERSION failed: %s",
                      curl_easy_strerror(rcode));
@@ -333,7 +369,7 @@ static int wh_callback_init(wh_callback_t *cb)
     }
 
     if (cb->cacert != NULL) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_CAINFO, cb->cacert);
+        rcode = curl_easy_setopt(curl, CURLOPT_CAINFO, cb->cacert);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_CAINFO failed: %s",
                          curl_easy_strerror(rcode));
@@ -341,7 +377,7 @@ static int wh_callback_init(wh_callback_t *cb)
         }
     }
     if (cb->capath != NULL) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_CAPATH, cb->capath);
+        rcode = curl_easy_setopt(curl, CURLOPT_CAPATH, cb->capath);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_CAPATH failed: %s",
                          curl_easy_strerror(rcode));
@@ -350,13 +386,13 @@ static int wh_callback_init(wh_callback_t *cb)
     }
 
     if (cb->clientkey != NULL && cb->clientcert != NULL) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_SSLKEY, cb->clientkey);
+        rcode = curl_easy_setopt(curl, CURLOPT_SSLKEY, cb->clientkey);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSLKEY failed: %s",
                          curl_easy_strerror(rcode));
             return -1;
         }
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_SSLCERT, cb->clientcert);
+        rcode = curl_easy_setopt(curl, CURLOPT_SSLCERT, cb->clientcert);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSLCERT failed: %s",
                          curl_easy_strerror(rcode));
@@ -364,7 +400,7 @@ static int wh_callback_init(wh_callback_t *cb)
         }
 
         if (cb->clientkeypass != NULL) {
-            rcode = curl_easy_setopt(cb->curl, CURLOPT_SSLKEYPASSWD, cb->clientkeypass);
+            rcode = curl_easy_setopt(curl, CURLOPT_SSLKEYPASSWD, cb->clientkeypass);
             if (rcode != CURLE_OK) {
                 PLUGIN_ERROR("curl_easy_setopt CURLOPT_SSLKEYPASSWD failed: %s",
                              curl_easy_strerror(rcode));
@@ -374,14 +410,14 @@ static int wh_callback_init(wh_callback_t *cb)
     }
 
     if (cb->proxy != NULL) {
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_PROXY, cb->proxy);
+        rcode = curl_easy_setopt(curl, CURLOPT_PROXY, cb->proxy);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_PROXY failed: %s",
                          curl_easy_strerror(rcode));
             return -1;
         }
 
-        rcode = curl_easy_setopt(cb->curl, CURLOPT_HTTPPROXYTUNNEL, cb->proxy_tunnel ? 1L : 0L);
+        rcode = curl_easy_setopt(curl, CURLOPT_HTTPPROXYTUNNEL, cb->proxy_tunnel ? 1L : 0L);
         if (rcode != CURLE_OK) {
             PLUGIN_ERROR("curl_easy_setopt CURLOPT_HTTPPROXYTUNNEL failed: %s",
                          curl_easy_strerror(rcode));
@@ -392,6 +428,34 @@ static int wh_callback_init(wh_callback_t *cb)
     return 0;
 }
 
+static CURL *wh_curl_create(wh_callback_t *cb, char *errbuf, wh_response_t *response)
+{
+    CURL *curl = curl_easy_init();
+    if (curl == NULL) {
+        PLUGIN_ERROR("curl_easy_init failed.");
+        return NULL;
+    }
+
+    if (wh_curl_setopt(cb, curl, errbuf, response) != 0) {
+        curl_easy_cleanup(curl);
+        return NULL;
+    }
+
+    return curl;
+}
+
+static int wh_callback_init(wh_callback_t *cb)
+{
+    if (cb->curl != NULL)
+        return 0;
+
+    cb->curl = wh_curl_create(cb, cb->curl_errbuf, &cb->response);
+    if (cb->curl == NULL)
+        return -1;
+
+    return 0;
+}
+
 static void wh_callback_cleanup(wh_callback_t *cb)
 {
     if (cb->curl != NULL) {
@@ -401,9 +465,353 @@ static void wh_callback_cleanup(wh_callback_t *cb)
     }
 }
 
+static void wh_batch_free(wh_callback_t *cb, wh_batch_t *batch)
+{
+    if (batch == NULL)
+        return;
+
+    if (cb->compress == COMPRESS_FORMAT_NONE)
+        free(batch->data);
+    else
+        compress_free(cb->compress, batch->data);
+
+    free(batch);
+}
+
+static int wh_async_request_start(wh_callback_t *cb, wh_request_t *request)
+{
+    if (request->curl == NULL) {
+        request->curl = wh_curl_create(cb, request->curl_errbuf, &request->response);
+        if (request->curl == NULL)
+            return -1;
+
+        CURLcode rcode = curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
+        if (rcode != CURLE_OK) {
+            PLUGIN_ERROR("curl_easy_setopt CURLOPT_PRIVATE failed: %s",
+                         curl_easy_strerror(rcode));
+            curl_easy_cleanup(request->curl);
+            request->curl = NULL;
+            return -1;
+        }
+    }
+
+    wh_response_reset(&request->response);
+    request->curl_errbuf[0] = '\0';
+
+    curl_off_t curl_post_data_len = request->batch->size;
+    CURLcode rcode = curl_easy_setopt(request->curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                                                     curl_post_data_len);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_POSTFIELDSIZE_LARGE failed: %s",
+                     curl_easy_strerror(rcode));
+        return -1;
+    }
+
+    rcode = curl_easy_setopt(request->curl, CURLOPT_POSTFIELDS, request->batch->data);
+    if (rcode != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_setopt CURLOPT_POSTFIELDS failed: %s",
+                     curl_easy_strerror(rcode));
+        return -1;
+    }
+
+    CURLMcode mc = curl_multi_add_handle(cb->async->curl_multi, request->curl);
+    if (mc != CURLM_OK) {
+        PLUGIN_ERROR("curl_multi_add_handle failed: %s", curl_multi_strerror(mc));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Transport errors and server side errors are retried with an exponential
+ * backoff, the batch goes back to the head of the queue to keep the order. */
+static void wh_async_request_done(wh_callback_t *cb, wh_request_t *request, CURLcode result)
+{
+    wh_async_t *async = cb->async;
+    wh_batch_t *batch = request->batch;
+    request->batch = NULL;
+
+    wh_log_http_error(cb, request->curl);
+    wh_curl_stats_dispatch(cb, request->curl);
+
+    long http_code = 0;
+    curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    if (result != CURLE_OK) {
+        PLUGIN_ERROR("curl_easy_perform failed with status %d: %s",
+                     (int)result, request->curl_errbuf);
+        if (strlen(request->response.buffer) > 0)
+            PLUGIN_ERROR("curl_response: %s", request->response.buffer);
+    } else if ((http_code >= 500) || (http_code == 429)) {
+        PLUGIN_ERROR("HTTP request failed with response code %ld.", http_code);
+    } else {
+        PLUGIN_DEBUG("curl_response: %s", request->response.buffer);
+        wh_batch_free(cb, batch);
+        return;
+    }
+
+    batch->retries++;
+
+    pthread_mutex_lock(&async->lock);
+    if (async->loop && (batch->retries <= async->retries)) {
+        unsigned int shift = batch->retries - 1;
+        if (shift > WRITE_HTTP_ASYNC_BACKOFF_MAX)
+            shift = WRITE_HTTP_ASYNC_BACKOFF_MAX;
+        batch->retry_time = cdtime() + (TIME_T_TO_CDTIME_T(1) << shift);
+        batch->next = async->head;
+        async->head = batch;
+        if (async->tail == NULL)
+            async->tail = batch;
+        async->queue_size += batch->size;
+        batch = NULL;
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    if (batch != NULL) {
+        PLUGIN_ERROR("Dropping a batch of %zu bytes after %u attempts.",
+                     batch->size, batch->retries);
+        wh_batch_free(cb, batch);
+    }
+}
+
+static void *wh_async_thread(void *arg)
+{
+    wh_callback_t *cb = arg;
+    wh_async_t *async = cb->async;
+    unsigned int in_flight = 0;
+
+    while (true) {
+        cdtime_t now = cdtime();
+
+        pthread_mutex_lock(&async->lock);
+        bool loop = async->loop;
+        for (unsigned int i = 0; (i < async->max_in_flight) && (async->head != NULL); i++) {
+            wh_request_t *request = &async->requests[i];
+            if (request->batch != NULL)
+                continue;
+            /* When stopping the pending retries are sent without waiting. */
+            if (loop && (async->head->retry_time > now))
+                break;
+
+            wh_batch_t *batch = async->head;
+            async->head = batch->next;
+            if (async->head == NULL)
+                async->tail = NULL;
+            async->queue_size -= batch->size;
+            batch->next = NULL;
+
+            request->batch = batch;
+            if (wh_async_request_start(cb, request) != 0) {
+                PLUGIN_ERROR("Dropping a batch of %zu bytes.", batch->size);
+                request->batch = NULL;
+                wh_batch_free(cb, batch);
+                continue;
+            }
+            in_flight++;
+        }
+        bool idle = async->head == NULL;
+        pthread_mutex_unlock(&async->lock);
+
+        if (!loop && idle && (in_flight == 0))
+            break;
+
+        int still_running = 0;
+        CURLMcode mc = curl_multi_perform(async->curl_multi, &still_running);
+        if (mc != CURLM_OK) {
+            PLUGIN_ERROR("curl_multi_perform failed: %s", curl_multi_strerror(mc));
+            break;
+        }
+
+        struct CURLMsg *m = NULL;
+        int msgq = 0;
+        while ((m = curl_multi_info_read(async->curl_multi, &msgq)) != NULL) {
+            if (m->msg != CURLMSG_DONE)
+                continue;
+
+            CURL *curl = m->easy_handle;
+            CURLcode result = m->data.result;
+
+            wh_request_t *request = NULL;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+            curl_multi_remove_handle(async->curl_multi, curl);
+            in_flight--;
+
+            if (request != NULL)
+                wh_async_request_done(cb, request, result);
+        }
+
+        int numfds = 0;
+        mc = curl_multi_poll(async->curl_multi, NULL, 0, 1000, &numfds);
+        if (mc != CURLM_OK) {
+            PLUGIN_ERROR("curl_multi_poll failed: %s", curl_multi_strerror(mc));
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < async->max_in_flight; i++) {
+        wh_request_t *request = &async->requests[i];
+        if (request->batch != NULL) {
+            curl_multi_remove_handle(async->curl_multi, request->curl);
+            wh_batch_free(cb, request->batch);
+            request->batch = NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static int wh_async_start(wh_callback_t *cb)
+{
+    wh_async_t *async = cb->async;
+
+    if (async->thread_running)
+        return 0;
+
+    if (async->curl_multi == NULL) {
+        async->curl_multi = curl_multi_init();
+        if (async->curl_multi == NULL) {
+            PLUGIN_ERROR("curl_multi_init failed.");
+            return -1;
+        }
+        curl_multi_setopt(async->curl_multi, CURLMOPT_MAXCONNECTS, (long)async->max_in_flight);
+    }
+
+    async->loop = true;
+
+    int status = plugin_thread_create(&async->thread, wh_async_thread, cb, "write_http");
+    if (status != 0) {
+        PLUGIN_ERROR("Failed to start sender thread: %s", STRERROR(status));
+        return -1;
+    }
+
+    async->thread_running = true;
+
+    return 0;
+}
+
+static void wh_async_stop(wh_callback_t *cb)
+{
+    wh_async_t *async = cb->async;
+
+    if (!async->thread_running)
+        return;
+
+    pthread_mutex_lock(&async->lock);
+    async->loop = false;
+    pthread_mutex_unlock(&async->lock);
+
+    curl_multi_wakeup(async->curl_multi);
+    pthread_join(async->thread, NULL);
+    async->thread_running = false;
+}
+
+static void wh_async_free(wh_callback_t *cb)
+{
+    wh_async_t *async = cb->async;
+    if (async == NULL)
+        return;
+
+    wh_async_stop(cb);
+
+    while (async->head != NULL) {
+        wh_batch_t *next = async->head->next;
+        wh_batch_free(cb, async->head);
+        async->head = next;
+    }
+
+    if (async->requests != NULL) {
+        for (unsigned int i = 0; i < async->max_in_flight; i++) {
+            if (async->requests[i].curl != NULL)
+                curl_easy_cleanup(async->requests[i].curl);
+        }
+        free(async->requests);
+    }
+
+    if (async->curl_multi != NULL)
+        curl_multi_cleanup(async->curl_multi);
+
+    pthread_mutex_destroy(&async->lock);
+
+    free(async);
+    cb->async = NULL;
+}
+
+/* Compress the data and queue it for the sender thread, the oldest batches are
+ * dropped when the queue would exceed its limit. */
+static int wh_async_enqueue(wh_callback_t *cb, char *data, size_t data_len)
+{
+    wh_async_t *async = cb->async;
+
+    if ((data == NULL) || (data_len == 0))
+        return 0;
+
+    if (wh_async_start(cb) != 0)
+        return -1;
+
+    wh_batch_t *batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        return -1;
+    }
+
+    if (cb->compress == COMPRESS_FORMAT_NONE) {
+        batch->data = malloc(data_len);
+        if (batch->data == NULL) {
+            PLUGIN_ERROR("malloc failed.");
+            free(batch);
+            return -1;
+        }
+        memcpy(batch->data, data, data_len);
+        batch->size = data_len;
+    } else {
+        batch->data = compress(cb->compress, data, data_len, &batch->size);
+        if (batch->data == NULL) {
+            free(batch);
+            return -1;
+        }
+    }
+
+    wh_batch_t *dropped = NULL;
+    size_t dropped_num = 0;
+
+    pthread_mutex_lock(&async->lock);
+    while ((async->head != NULL) && ((async->queue_size + batch->size) > async->queue_limit)) {
+        wh_batch_t *old = async->head;
+        async->head = old->next;
+        if (async->head == NULL)
+            async->tail = NULL;
+        async->queue_size -= old->size;
+        old->next = dropped;
+        dropped = old;
+        dropped_num++;
+    }
+
+    if (async->tail == NULL)
+        async->head = batch;
+    else
+        async->tail->next = batch;
+    async->tail = batch;
+    async->queue_size += batch->size;
+    pthread_mutex_unlock(&async->lock);
+
+    curl_multi_wakeup(async->curl_multi);
+
+    if (dropped_num > 0) {
+        PLUGIN_WARNING("Queue limit of %zu bytes reached, dropped %zu batches.",
+                       async->queue_limit, dropped_num);
+        while (dropped != NULL) {
+            wh_batch_t *next = dropped->next;
+            wh_batch_free(cb, dropped);
+            dropped = next;
+        }
+    }
+
+    return 0;
+}
+
 static int wh_flush_internal(wh_callback_t *cb, cdtime_t timeout)
 {
-    if (wh_callback_init(cb) != 0) {
+    if ((cb->async == NULL) && (wh_callback_init(cb) != 0)) {
         wh_callback_cleanup(cb);
         return -1;
     }
@@ -417,7 +825,11 @@ static int wh_flush_internal(wh_callback_t *cb, cdtime_t timeout)
             return 0;
     }
 
-    int status = wh_post(cb, cb->send_buffer.ptr, strbuf_len(&cb->send_buffer));
+    int status = 0;
+    if (cb->async != NULL)
+        status = wh_async_enqueue(cb, cb->send_buffer.ptr, strbuf_len(&cb->send_buffer));
+    else
+        status = wh_post(cb, cb->send_buffer.ptr, strbuf_len(&cb->send_buffer));
 
     strbuf_reset(&cb->send_buffer);
 
@@ -443,6 +855,8 @@ static void wh_callback_free(void *data)
 
     wh_flush_internal(cb, 0);
 
+    wh_async_free(cb);
+
     if (cb->curl != NULL) {
         curl_easy_cleanup(cb->curl);
         cb->curl = NULL;
@@ -470,34 +884,37 @@ static void wh_callback_free(void *data)
     free(cb);
 }
 
-static int wh_write(metric_family_t const *fam, user_data_t *user_data)
+static int wh_write(metric_family_list_t const *faml, user_data_t *user_data)
 {
-    if ((fam == NULL) || (user_data == NULL))
+    if ((faml == NULL) || (user_data == NULL))
         return EINVAL;
 
     wh_callback_t *cb = user_data->data;
 
-    if (strbuf_len(&cb->send_buffer) >= cb->send_buffer_max) {
-        int status = wh_flush_internal(cb, 0);
-        if (status != 0)
-            return -1;
-    }
+    for (size_t i = 0; i < faml->pos; i++) {
+        if (strbuf_len(&cb->send_buffer) >= cb->send_buffer_max) {
+            int status = wh_flush_internal(cb, 0);
+            if (status != 0)
+                return -1;
+        }
 
-    if (strbuf_len(&cb->send_buffer) == 0)
-        cb->send_buffer_init_time = cdtime();
+        if (strbuf_len(&cb->send_buffer) == 0)
+            cb->send_buffer_init_time = cdtime();
 
-    format_stream_metric_ctx_t ctx = {0};
+        format_stream_metric_ctx_t ctx = {0};
 
-    int status = format_stream_metric_begin(&ctx, cb->format_metric, &cb->send_buffer);
-    status |= format_stream_metric_family(&ctx, fam);
-    status |= format_stream_metric_end(&ctx);
+        int status = format_stream_metric_begin(&ctx, cb->format_metric, &cb->send_buffer);
+        status |= format_stream_metric_family(&ctx, faml->ptr[i]);
+        status |= format_stream_metric_end(&ctx);
 
-    if (status != 0) {
-        strbuf_reset(&cb->send_buffer);
-        PLUGIN_ERROR("Failed to format message.");
-        return -1;
+        if (status != 0) {
+            strbuf_reset(&cb->send_buffer);
+            PLUGIN_ERROR("Failed to format message.");
+            return -1;
+        }
     }
 
+    /* The whole batch is formatted before the buffer is considered for posting. */
     return wh_flush_internal(cb, cb->flush_timeout);
 }
 
@@ -589,6 +1006,68 @@ static int wh_config_ssl_version(config_item_t *ci, long *sslversion)
     return 0;
 }
 
+static int wh_config_async(config_item_t *ci, wh_callback_t *cb)
+{
+    if (ci->values_num != 0) {
+        PLUGIN_ERROR("The '%s' block in %s:%d does not take arguments.",
+                     ci->key, cf_get_file(ci), cf_get_lineno(ci));
+        return -1;
+    }
+
+    if (cb->async != NULL) {
+        PLUGIN_ERROR("The '%s' block in %s:%d can appear only once.",
+                     ci->key, cf_get_file(ci), cf_get_lineno(ci));
+        return -1;
+    }
+
+    cb->async = calloc(1, sizeof(*cb->async));
+    if (cb->async == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        return -1;
+    }
+
+    wh_async_t *async = cb->async;
+    pthread_mutex_init(&async->lock, NULL);
+    async->max_in_flight = WRITE_HTTP_ASYNC_MAX_IN_FLIGHT;
+    async->queue_limit = WRITE_HTTP_ASYNC_QUEUE_LIMIT;
+    async->retries = WRITE_HTTP_ASYNC_RETRIES;
+
+    int status = 0;
+    for (int i = 0; i < ci->children_num; i++) {
+        config_item_t *child = ci->children + i;
+
+        if (strcasecmp("max-in-flight", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &async->max_in_flight);
+            if ((status == 0) && (async->max_in_flight == 0)) {
+                PLUGIN_ERROR("'max-in-flight' in %s:%d must be greater than zero.",
+                             cf_get_file(child), cf_get_lineno(child));
+                status = -1;
+            }
+        } else if (strcasecmp("queue-limit", child->key) == 0) {
+            unsigned int queue_limit = 0;
+            status = cf_util_get_unsigned_int(child, &queue_limit);
+            if (status == 0)
+                async->queue_limit = queue_limit;
+        } else if (strcasecmp("retries", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &async->retries);
+        } else {
+            PLUGIN_ERROR("Invalid configuration option: %s.", child->key);
+            status = EINVAL;
+        }
+
+        if (status != 0)
+            return status;
+    }
+
+    async->requests = calloc(async->max_in_flight, sizeof(*async->requests));
+    if (async->requests == NULL) {
+        PLUGIN_ERROR("calloc failed.");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int wh_config_instance(config_item_t *ci)
 {
     wh_callback_t *cb = calloc(1, sizeof(*cb));
@@ -660,6 +1139,10 @@ static int wh_config_instance(config_item_t *ci)
             status = cf_util_get_boolean(child, &cb->store_rates);
         } else if (strcasecmp("buffer-size", child->key) == 0) {
             status = cf_util_get_unsigned_int(child, &cb->send_buffer_max);
+        } else if (strcasecmp("batch-size", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &cb->batch_size);
+        } else if (strcasecmp("batch-timeout", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &cb->batch_timeout);
         } else if (strcasecmp("low-speed-limit", child->key) == 0) {
             status = cf_util_get_int(child, &cb->low_speed_limit);
         } else if (strcasecmp("timeout", child->key) == 0) {
@@ -678,6 +1161,8 @@ static int wh_config_instance(config_item_t *ci)
             status = cf_util_get_cdtime(child, &cb->flush_timeout);
         } else if (strcasecmp("write", child->key) == 0) {
             status = cf_uti_get_send(child, &send);
+        } else if (strcasecmp("async", child->key) == 0) {
+            status = wh_config_async(child, cb);
         } else {
             PLUGIN_ERROR("Invalid configuration option: %s.", child->key);
             status = EINVAL;
@@ -706,6 +1191,27 @@ static int wh_config_instance(config_item_t *ci)
     if (cb->low_speed_limit > 0)
         cb->low_speed_time = CDTIME_T_TO_TIME_T(plugin_get_interval());
 
+    cb->headers = curl_slist_append(cb->headers, "Accept:  */*");
+
+    if (cb->content_type != NULL) {
+        char buffer[256];
+        ssnprintf(buffer, sizeof(buffer), "Content-Type: %s", cb->content_type);
+        cb->headers = curl_slist_append(cb->headers, buffer);
+    }
+
+    const char *encoding = compress_get_encoding(cb->compress);
+    if (encoding != NULL) {
+        char buffer[256];
+        ssnprintf(buffer, sizeof(buffer), "Content-Encoding: %s", encoding);
+        cb->headers = curl_slist_append(cb->headers, buffer);
+    }
+
+    cb->headers = curl_slist_append(cb->headers, "Expect:");
+
+    /* Notifications are posted from the notification callback as they come. */
+    if ((send == SEND_NOTIFICATIONS) && (cb->async != NULL))
+        wh_async_free(cb);
+
     cb->send_buffer = STRBUF_CREATE;
 
     PLUGIN_DEBUG("Registering write callback 'write_http/%s' with URL '%s'",
@@ -716,8 +1222,9 @@ static int wh_config_instance(config_item_t *ci)
     if (send == SEND_NOTIFICATIONS)
         return plugin_register_notification("write_http", cb->name, wh_notify, &user_data);
 
-    return plugin_register_write("write_http", cb->name, wh_write,
-                                  wh_flush, flush_interval, cb->flush_timeout, &user_data);
+    return plugin_register_write_batch("write_http", cb->name, wh_write,
+                                       wh_flush, flush_interval, cb->flush_timeout,
+                                       cb->batch_size, cb->batch_timeout, &user_data);
 }
 
 static int wh_config(config_item_t *ci)
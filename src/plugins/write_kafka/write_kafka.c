@@ -18,6 +18,8 @@ typedef struct {
     format_stream_metric_t format_metric;
     format_notification_t format_notification;
     strbuf_t buf;
+    unsigned int batch_size;
+    cdtime_t batch_timeout;
     rd_kafka_t *kafka;
     rd_kafka_conf_t *kafka_conf;
     rd_kafka_topic_conf_t *conf;
@@ -162,9 +164,9 @@ static int kafka_notif(notification_t const *n, user_data_t *user_data)
     return 0;
 }
 
-static int kafka_write(metric_family_t const *fam, user_data_t *user_data)
+static int kafka_write(metric_family_list_t const *faml, user_data_t *user_data)
 {
-    if ((fam == NULL) || (user_data == NULL))
+    if ((faml == NULL) || (user_data == NULL))
         return EINVAL;
 
     kafka_topic_context_t *ctx = user_data->data;
@@ -176,10 +178,13 @@ static int kafka_write(metric_family_t const *fam, user_data_t *user_data)
     void *key = (ctx->key != NULL) ? ctx->key : kafka_random_key(KAFKA_RANDOM_KEY_BUFFER);
     size_t keylen = strlen(key);
 
+    /* Produce one message with all the metric families of the batch. */
     strbuf_reset(&ctx->buf);
     format_stream_metric_ctx_t fctx = {0};
     status = format_stream_metric_begin(&fctx, ctx->format_metric, &ctx->buf);
-    status |= format_stream_metric_family(&fctx, fam);
+    for (size_t i = 0; i < faml->pos; i++) {
+        status |= format_stream_metric_family(&fctx, faml->ptr[i]);
+    }
     status |= format_stream_metric_end(&fctx);
     if (status != 0) {
         PLUGIN_ERROR("Failed to format metric.");
@@ -187,6 +192,9 @@ static int kafka_write(metric_family_t const *fam, user_data_t *user_data)
     }
 
     size_t size = strbuf_len(&ctx->buf);
+    if (size == 0)
+        return 0;
+
     rd_kafka_produce(ctx->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
                                  ctx->buf.ptr, size, key, keylen, NULL);
 
@@ -308,6 +316,10 @@ static int kafka_config_instance(config_item_t *ci)
             status = cf_uti_get_send(child, &send);
         } else if (strcasecmp("format-metric", child->key) == 0) {
             status = config_format_stream_metric(child, &tctx->format_metric);
+        } else if (strcasecmp("batch-size", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &tctx->batch_size);
+        } else if (strcasecmp("batch-timeout", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &tctx->batch_timeout);
         } else if (strcasecmp("format-notification", child->key) == 0) {
             status = config_format_notification(child, &tctx->format_notification);
         } else {
@@ -332,8 +344,8 @@ static int kafka_config_instance(config_item_t *ci)
         return plugin_register_notification("write_kafka", tctx->topic_name, kafka_notif,
                                                            &user_data);
 
-    return plugin_register_write("write_kafka", tctx->topic_name, kafka_write, NULL, 0, 0,
-                                                &user_data);
+    return plugin_register_write_batch("write_kafka", tctx->topic_name, kafka_write, NULL, 0, 0,
+                                       tctx->batch_size, tctx->batch_timeout, &user_data);
 }
 
 static int kafka_config(config_item_t *ci)
@@ -24,6 +24,8 @@
 #include "libformat/format.h"
 
 #include <netdb.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #ifndef DEFAULT_NODE
 #define DEFAULT_NODE "localhost"
@@ -37,18 +39,37 @@
 #define SEND_BUF_SIZE 65536
 #endif
 
+#ifndef SEND_QUEUE_LIMIT
+#define SEND_QUEUE_LIMIT (16 * 1024 * 1024)
+#endif
+
+#define RECONNECT_INTERVAL_MIN TIME_T_TO_CDTIME_T(1)
+#define RECONNECT_INTERVAL_MAX TIME_T_TO_CDTIME_T(60)
+
 typedef struct {
     char *instance;
 
     struct addrinfo *ai;
+    struct addrinfo *ai_next;
     cdtime_t ai_last_update;
     int sock_fd;
+    bool connecting;
+    cdtime_t reconnect_time;
+    cdtime_t reconnect_interval;
+    cdtime_t reconnect_interval_max;
 
     char *node;
     char *service;
 
     format_stream_metric_t format;
     strbuf_t buf;
+    /* Formatted data not written yet to the socket, starting at send_offset. */
+    strbuf_t send_buf;
+    size_t send_offset;
+    cdtime_t send_buf_init_time;
+    unsigned int send_buf_size;
+    unsigned int send_queue_limit;
+    cdtime_t flush_timeout;
 
     bool connect_failed_log_enabled;
     int connect_dns_failed_attempts_remaining;
@@ -56,6 +77,9 @@ typedef struct {
 
     cdtime_t resolve_interval;
     cdtime_t resolve_jitter;
+
+    unsigned int batch_size;
+    cdtime_t batch_timeout;
 } write_tcp_callback_t;
 
 static cdtime_t new_random_ttl(write_tcp_callback_t *cb)
@@ -100,18 +124,60 @@ static void set_sock_opts(int sockfd)
   }
 }
 
-static int write_tcp_callback_init(write_tcp_callback_t *cb)
+static void write_tcp_reconnect_later(write_tcp_callback_t *cb)
 {
-    int status;
-    cdtime_t now;
+    if (cb->reconnect_interval == 0)
+        cb->reconnect_interval = RECONNECT_INTERVAL_MIN;
+    else
+        cb->reconnect_interval *= 2;
+
+    if (cb->reconnect_interval > cb->reconnect_interval_max)
+        cb->reconnect_interval = cb->reconnect_interval_max;
+
+    cb->reconnect_time = cdtime() + cb->reconnect_interval;
+}
+
+static void write_tcp_disconnect(write_tcp_callback_t *cb)
+{
+    if (cb->sock_fd >= 0)
+        close(cb->sock_fd);
+    cb->sock_fd = -1;
+    cb->connecting = false;
+
+    /* Do not send the rest of a partially written line over a new connection. */
+    if ((cb->send_offset > 0) && (cb->send_offset < strbuf_len(&cb->send_buf)) &&
+        (cb->send_buf.ptr[cb->send_offset - 1] != '\n')) {
+        char *end = memchr(cb->send_buf.ptr + cb->send_offset, '\n',
+                           strbuf_len(&cb->send_buf) - cb->send_offset);
+        if (end == NULL)
+            cb->send_offset = strbuf_len(&cb->send_buf);
+        else
+            cb->send_offset = end - cb->send_buf.ptr + 1;
+    }
+}
 
+static void write_tcp_connected(write_tcp_callback_t *cb)
+{
     const char *node = cb->node ? cb->node : DEFAULT_NODE;
     const char *service = cb->service ? cb->service : DEFAULT_SERVICE;
 
-    if (cb->sock_fd > 0)
-        return 0;
+    cb->connecting = false;
+    cb->ai_next = NULL;
+    cb->reconnect_interval = 0;
 
-    now = cdtime();
+    if (cb->connect_failed_log_enabled == 0) {
+        PLUGIN_WARNING("Connecting to %s:%s succeeded.", node, service);
+        cb->connect_failed_log_enabled = 1;
+    }
+    cb->connect_dns_failed_attempts_remaining = 1;
+}
+
+static int write_tcp_resolve(write_tcp_callback_t *cb)
+{
+    const char *node = cb->node ? cb->node : DEFAULT_NODE;
+    const char *service = cb->service ? cb->service : DEFAULT_SERVICE;
+
+    cdtime_t now = cdtime();
     if (cb->ai) {
         /* When we are here, we still have the IP in cache.
          * If we have remaining attempts without calling the DNS, we update the
@@ -145,7 +211,7 @@ static int write_tcp_callback_init(write_tcp_callback_t *cb)
                 .ai_socktype = SOCK_STREAM,
         };
 
-        status = getaddrinfo(node, service, &ai_hints, &cb->ai);
+        int status = getaddrinfo(node, service, &ai_hints, &cb->ai);
         if (status != 0) {
             if (cb->ai) {
                 freeaddrinfo(cb->ai);
@@ -159,36 +225,226 @@ static int write_tcp_callback_init(write_tcp_callback_t *cb)
         }
     }
 
+    return 0;
+}
+
+/* Start a non-blocking connect, the addresses are tried in order and a
+ * connection in progress is checked in write_tcp_ready.  After all the
+ * addresses fail the next attempt waits an exponential backoff. */
+static int write_tcp_callback_init(write_tcp_callback_t *cb)
+{
+    const char *node = cb->node ? cb->node : DEFAULT_NODE;
+    const char *service = cb->service ? cb->service : DEFAULT_SERVICE;
+
+    if (cb->sock_fd >= 0)
+        return 0;
+
+    if (cdtime() < cb->reconnect_time)
+        return -1;
+
+    if (cb->ai_next == NULL) {
+        if (write_tcp_resolve(cb) != 0) {
+            write_tcp_reconnect_later(cb);
+            return -1;
+        }
+        cb->ai_next = cb->ai;
+    }
+
     assert(cb->ai != NULL);
-    for (struct addrinfo *ai = cb->ai; ai != NULL; ai = ai->ai_next) {
-        cb->sock_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (cb->sock_fd < 0)
+    int error = 0;
+    for (struct addrinfo *ai = cb->ai_next; ai != NULL; ai = ai->ai_next) {
+        cb->ai_next = ai->ai_next;
+
+        cb->sock_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                             ai->ai_protocol);
+        if (cb->sock_fd < 0) {
+            error = errno;
             continue;
+        }
 
         set_sock_opts(cb->sock_fd);
 
-        status = connect(cb->sock_fd, ai->ai_addr, ai->ai_addrlen);
-        if (status != 0) {
-            close(cb->sock_fd);
-            cb->sock_fd = -1;
-            continue;
+        int status = connect(cb->sock_fd, ai->ai_addr, ai->ai_addrlen);
+        if (status == 0) {
+            write_tcp_connected(cb);
+            return 0;
+        }
+
+        if (errno == EINPROGRESS) {
+            cb->connecting = true;
+            return 0;
         }
 
-        break;
+        error = errno;
+        close(cb->sock_fd);
+        cb->sock_fd = -1;
+    }
+
+    cb->ai_next = NULL;
+    if (cb->connect_failed_log_enabled) {
+        PLUGIN_ERROR("Connecting to %s:%s failed. The last error was: %s",
+                     node, service, STRERROR(error));
+        cb->connect_failed_log_enabled = 0;
     }
+    write_tcp_reconnect_later(cb);
+
+    return -1;
+}
 
-    if (cb->sock_fd < 0) {
-        PLUGIN_ERROR("Connecting to %s:%s failed. The last error was: %s", node, service, STRERRNO);
+/* Returns true when the socket is connected and can be written. */
+static bool write_tcp_ready(write_tcp_callback_t *cb)
+{
+    if ((cb->sock_fd < 0) && (write_tcp_callback_init(cb) != 0))
+        return false;
+
+    if (!cb->connecting)
+        return true;
+
+    struct pollfd pfd = { .fd = cb->sock_fd, .events = POLLOUT };
+    int status = poll(&pfd, 1, 0);
+    if (status == 0)
+        return false;
+
+    int error = 0;
+    if (status < 0) {
+        error = errno;
+    } else {
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(cb->sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0)
+            error = errno;
+    }
+
+    if (error != 0) {
+        const char *node = cb->node ? cb->node : DEFAULT_NODE;
+        const char *service = cb->service ? cb->service : DEFAULT_SERVICE;
+        if (cb->connect_failed_log_enabled) {
+            PLUGIN_ERROR("Connecting to %s:%s failed: %s", node, service, STRERROR(error));
+            if (cb->ai_next == NULL)
+                cb->connect_failed_log_enabled = 0;
+        }
+        write_tcp_disconnect(cb);
+        if (cb->ai_next == NULL)
+            write_tcp_reconnect_later(cb);
+        return false;
+    }
+
+    write_tcp_connected(cb);
+    return true;
+}
+
+/* Keep data in the send buffer, dropping it if the buffer would exceed the
+ * queue limit. */
+static int write_tcp_queue(write_tcp_callback_t *cb, const char *data, size_t len, bool force)
+{
+    if (len == 0)
+        return 0;
+
+    size_t pending = strbuf_len(&cb->send_buf) - cb->send_offset;
+    if (!force && ((pending + len) > cb->send_queue_limit)) {
+        PLUGIN_WARNING("Send queue limit of %u bytes reached, dropping %zu bytes.",
+                       cb->send_queue_limit, len);
         return -1;
     }
 
-    if (cb->connect_failed_log_enabled == 0) {
-        PLUGIN_WARNING("Connecting to %s:%s succeeded.", node, service);
-        cb->connect_failed_log_enabled = 1;
+    if (pending == 0) {
+        strbuf_reset(&cb->send_buf);
+        cb->send_offset = 0;
+        cb->send_buf_init_time = cdtime();
+    } else if (cb->send_offset >= (strbuf_len(&cb->send_buf) / 2)) {
+        memmove(cb->send_buf.ptr, cb->send_buf.ptr + cb->send_offset, pending);
+        cb->send_buf.pos = pending;
+        cb->send_buf.ptr[pending] = '\0';
+        cb->send_offset = 0;
     }
-    cb->connect_dns_failed_attempts_remaining = 1;
 
-    return 0;
+    return strbuf_putstrn(&cb->send_buf, data, len);
+}
+
+/* Write the pending send buffer followed by data with a single non-blocking
+ * writev, whatever can not be written now is kept in the send buffer. */
+static int write_tcp_send(write_tcp_callback_t *cb, const char *data, size_t len)
+{
+    if (!write_tcp_ready(cb))
+        return write_tcp_queue(cb, data, len, false);
+
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    size_t pending = strbuf_len(&cb->send_buf) - cb->send_offset;
+    if (pending > 0) {
+        iov[iovcnt].iov_base = cb->send_buf.ptr + cb->send_offset;
+        iov[iovcnt].iov_len = pending;
+        iovcnt++;
+    }
+    if (len > 0) {
+        iov[iovcnt].iov_base = (void *)(uintptr_t)data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+
+    if (iovcnt == 0)
+        return 0;
+
+    size_t written = 0;
+    while ((pending + len) > written) {
+        ssize_t ret = writev(cb->sock_fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            PLUGIN_ERROR("send failed: %s", STRERRNO);
+            cb->send_offset += written < pending ? written : pending;
+            write_tcp_disconnect(cb);
+            write_tcp_reconnect_later(cb);
+            size_t data_written = written > pending ? written - pending : 0;
+            /* A partially written batch is dropped with the connection. */
+            if (data_written > 0)
+                return -1;
+            return write_tcp_queue(cb, data, len, false);
+        }
+
+        written += ret;
+
+        size_t n = ret;
+        while ((iovcnt > 0) && (n >= iov[0].iov_len)) {
+            n -= iov[0].iov_len;
+            iov[0] = iov[1];
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+
+    if (written >= pending) {
+        strbuf_reset(&cb->send_buf);
+        cb->send_offset = 0;
+        size_t data_written = written - pending;
+        /* The rest of a partially written batch must follow it. */
+        return write_tcp_queue(cb, data + data_written, len - data_written, data_written > 0);
+    }
+
+    cb->send_offset += written;
+    return write_tcp_queue(cb, data, len, false);
+}
+
+static int write_tcp_flush(cdtime_t timeout, user_data_t *user_data)
+{
+    if (user_data == NULL)
+        return -EINVAL;
+
+    write_tcp_callback_t *cb = user_data->data;
+
+    if (strbuf_len(&cb->send_buf) == cb->send_offset)
+        return 0;
+
+    /* timeout == 0  => flush unconditionally */
+    if ((timeout > 0) && ((cb->send_buf_init_time + timeout) > cdtime()))
+        return 0;
+
+    return write_tcp_send(cb, NULL, 0);
 }
 
 static void write_tcp_callback_free(void *data)
@@ -200,10 +456,18 @@ static void write_tcp_callback_free(void *data)
 
     cb = data;
 
-    close(cb->sock_fd);
+    if ((cb->sock_fd >= 0) && (strbuf_len(&cb->send_buf) > cb->send_offset))
+        write_tcp_send(cb, NULL, 0);
+
+    if (cb->sock_fd >= 0)
+        close(cb->sock_fd);
     cb->sock_fd = -1;
 
+    if (cb->ai != NULL)
+        freeaddrinfo(cb->ai);
+
     strbuf_destroy(&cb->buf);
+    strbuf_destroy(&cb->send_buf);
 
     free(cb->instance);
     free(cb->node);
@@ -212,9 +476,9 @@ static void write_tcp_callback_free(void *data)
     free(cb);
 }
 
-static int write_tcp_write(metric_family_t const *fam, user_data_t *user_data)
+static int write_tcp_write(metric_family_list_t const *faml, user_data_t *user_data)
 {
-    if ((fam == NULL) || (user_data == NULL))
+    if ((faml == NULL) || (user_data == NULL))
         return EINVAL;
 
     write_tcp_callback_t *cb = user_data->data;
@@ -223,30 +487,26 @@ static int write_tcp_write(metric_family_t const *fam, user_data_t *user_data)
 
     strbuf_reset(&cb->buf);
 
+    /* Format the whole batch into one buffer so it is sent with a single write. */
     int status = format_stream_metric_begin(&ctx, cb->format, &cb->buf);
-    status |= format_stream_metric_family(&ctx, fam);
+    for (size_t i = 0; i < faml->pos; i++) {
+        status |= format_stream_metric_family(&ctx, faml->ptr[i]);
+    }
     status |= format_stream_metric_end(&ctx);
 
     if (status != 0)
         return 0;
 
-    if (cb->sock_fd < 0) {
-        status = write_tcp_callback_init(cb);
-        if (status != 0) {
-            PLUGIN_ERROR("write_tcp_callback_init failed.");
-            return -1;
-        }
-    }
+    size_t len = strbuf_len(&cb->buf);
+    if (len == 0)
+        return 0;
 
-    ssize_t ret = swrite(cb->sock_fd, cb->buf.ptr, strbuf_len(&cb->buf));
-    if (ret != 0) {
-        PLUGIN_ERROR("send failed with status %zi (%s)", ret , STRERRNO);
-        close(cb->sock_fd);
-        cb->sock_fd = -1;
-        return -1;
-    }
+    /* Small batches are coalesced until the buffer is full or flushed. */
+    size_t pending = strbuf_len(&cb->send_buf) - cb->send_offset;
+    if ((pending + len) < cb->send_buf_size)
+        return write_tcp_queue(cb, cb->buf.ptr, len, false);
 
-    return 0;
+    return write_tcp_send(cb, cb->buf.ptr, len);
 }
 
 static int write_tcp_config_instance(config_item_t *ci)
@@ -267,6 +527,12 @@ static int write_tcp_config_instance(config_item_t *ci)
     cb->connect_failed_log_enabled = 1;
     cb->next_random_ttl = new_random_ttl(cb);
     cb->format = FORMAT_STREAM_METRIC_OPENMETRICS_TEXT;
+    cb->send_buf_size = SEND_BUF_SIZE;
+    cb->send_queue_limit = SEND_QUEUE_LIMIT;
+    cb->reconnect_interval_max = RECONNECT_INTERVAL_MAX;
+    cb->flush_timeout = plugin_get_interval() / 2;
+
+    cdtime_t flush_interval = plugin_get_interval();
 
     for (int i = 0; i < ci->children_num; i++) {
         config_item_t *child = ci->children + i;
@@ -281,6 +547,20 @@ static int write_tcp_config_instance(config_item_t *ci)
             status = cf_util_get_cdtime(child, &cb->resolve_jitter);
         } else if (strcasecmp("format", child->key) == 0) {
             status = config_format_stream_metric(child, &cb->format);
+        } else if (strcasecmp("batch-size", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &cb->batch_size);
+        } else if (strcasecmp("batch-timeout", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &cb->batch_timeout);
+        } else if (strcasecmp("buffer-size", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &cb->send_buf_size);
+        } else if (strcasecmp("queue-limit", child->key) == 0) {
+            status = cf_util_get_unsigned_int(child, &cb->send_queue_limit);
+        } else if (strcasecmp("flush-interval", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &flush_interval);
+        } else if (strcasecmp("flush-timeout", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &cb->flush_timeout);
+        } else if (strcasecmp("reconnect-interval-max", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &cb->reconnect_interval_max);
         } else {
             PLUGIN_ERROR("Invalid configuration option: %s.", child->key);
             status = -1;
@@ -302,8 +582,13 @@ static int write_tcp_config_instance(config_item_t *ci)
         return -1;
     }
 
-    plugin_register_write("write_tcp", cb->instance, write_tcp_write, NULL, 0, 0,
-                          &(user_data_t){.data = cb, .free_func = write_tcp_callback_free});
+    if (cb->send_queue_limit < cb->send_buf_size)
+        cb->send_queue_limit = cb->send_buf_size;
+
+    plugin_register_write_batch("write_tcp", cb->instance, write_tcp_write,
+                                write_tcp_flush, flush_interval, cb->flush_timeout,
+                                cb->batch_size, cb->batch_timeout,
+                                &(user_data_t){.data = cb, .free_func = write_tcp_callback_free});
     return 0;
 }
 
@@ -11,6 +11,8 @@
 // SPDX-FileContributor: Pierre-Yves Ritschard <pyr at spootnik.org>
 // Based on the write_http plugin.
 
+#define _GNU_SOURCE
+
 #include "plugin.h"
 #include "libutils/common.h"
 #include "libformat/format.h"
@@ -21,6 +23,9 @@
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
 
 #ifndef DEFAULT_NODE
 #define DEFAULT_NODE "localhost"
@@ -35,44 +40,133 @@
 #define SEND_BUF_SIZE 1428
 #endif
 
+#ifndef SEND_PACKETS
+#define SEND_PACKETS 32
+#endif
+
+enum {
+    FAM_WRITE_UDP_PACKETS,
+    FAM_WRITE_UDP_BYTES,
+    FAM_WRITE_UDP_SEND_CALLS,
+    FAM_WRITE_UDP_SEND_ERRORS,
+    FAM_WRITE_UDP_MAX,
+};
+
+static metric_family_t fams[FAM_WRITE_UDP_MAX] = {
+    [FAM_WRITE_UDP_PACKETS] = {
+        .name = "ncollectd_write_udp_packets",
+        .type = METRIC_TYPE_COUNTER,
+        .help = "Number of datagrams sent",
+    },
+    [FAM_WRITE_UDP_BYTES] = {
+        .name = "ncollectd_write_udp_bytes",
+        .type = METRIC_TYPE_COUNTER,
+        .help = "Number of bytes sent",
+    },
+    [FAM_WRITE_UDP_SEND_CALLS] = {
+        .name = "ncollectd_write_udp_send_calls",
+        .type = METRIC_TYPE_COUNTER,
+        .help = "Number of system calls used to send the datagrams",
+    },
+    [FAM_WRITE_UDP_SEND_ERRORS] = {
+        .name = "ncollectd_write_udp_send_errors",
+        .type = METRIC_TYPE_COUNTER,
+        .help = "Number of failed system calls",
+    },
+};
+
 typedef struct {
+    atomic_uint refs;
     char *name;
     int sock_fd;
     char *host;
     char *service;
     int ttl;
     int packet_size;
+    int packets;
     format_dgram_metric_t format;
     cdtime_t flush_timeout;
     strbuf_t buf;
+    /* The send buffer holds up to "packets" datagrams of "packet_size" bytes,
+     * they are sent together with a single sendmmsg call. */
     char *send_buf;
+    struct iovec *send_iov;
     size_t send_buf_size;
     size_t send_buf_free;
     size_t send_buf_fill;
+    size_t send_packet;
     cdtime_t send_buf_init_time;
+    atomic_uint_fast64_t stats_packets;
+    atomic_uint_fast64_t stats_bytes;
+    atomic_uint_fast64_t stats_send_calls;
+    atomic_uint_fast64_t stats_send_errors;
+    metric_family_t fams[FAM_WRITE_UDP_MAX];
 } write_udp_callback_t;
 
 static void write_udp_reset_buffer(write_udp_callback_t *cb)
 {
     cb->send_buf_free = cb->send_buf_size;
     cb->send_buf_fill = 0;
+    cb->send_packet = 0;
+    cb->send_iov[0].iov_base = cb->send_buf;
+    cb->send_iov[0].iov_len = 0;
     cb->send_buf_init_time = cdtime();
 }
 
+static int write_udp_send_error(write_udp_callback_t *cb)
+{
+    atomic_fetch_add(&cb->stats_send_errors, 1);
+    PLUGIN_ERROR("send to %s:%s failed: %s", cb->host, cb->service, STRERRNO);
+    close(cb->sock_fd);
+    cb->sock_fd = -1;
+    return -1;
+}
+
 static int write_udp_send_buffer(write_udp_callback_t *cb)
 {
     if (cb->sock_fd < 0)
         return -1;
 
-    ssize_t status = swrite(cb->sock_fd, cb->send_buf, cb->send_buf_fill);
-    if (status != 0) {
-        PLUGIN_ERROR("send to %s:%s failed with status %zi (%s)",
-                     cb->host, cb->service, status, STRERRNO);
-        close(cb->sock_fd);
-        cb->sock_fd = -1;
-        return -1;
+    size_t num = cb->send_packet + 1;
+    if (cb->send_iov[cb->send_packet].iov_len == 0)
+        num--;
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < num; i++) {
+        bytes += cb->send_iov[i].iov_len;
+    }
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[num];
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < num; i++) {
+        msgs[i].msg_hdr.msg_iov = &cb->send_iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
+    size_t sent = 0;
+    while (sent < num) {
+        int status = sendmmsg(cb->sock_fd, msgs + sent, num - sent, 0);
+        atomic_fetch_add(&cb->stats_send_calls, 1);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            return write_udp_send_error(cb);
+        }
+        sent += status;
+    }
+#else
+    for (size_t i = 0; i < num; i++) {
+        ssize_t status = swrite(cb->sock_fd, cb->send_iov[i].iov_base, cb->send_iov[i].iov_len);
+        atomic_fetch_add(&cb->stats_send_calls, 1);
+        if (status != 0)
+            return write_udp_send_error(cb);
+    }
+#endif
+
+    atomic_fetch_add(&cb->stats_packets, num);
+    atomic_fetch_add(&cb->stats_bytes, bytes);
+
     return 0;
 }
 
@@ -89,7 +183,7 @@ static int write_udp_flush_internal(write_udp_callback_t *cb, cdtime_t timeout)
             return 0;
     }
 
-    if (cb->send_buf_fill == 0) {
+    if ((cb->send_packet == 0) && (cb->send_buf_fill == 0)) {
         cb->send_buf_init_time = cdtime();
         return 0;
     }
@@ -165,7 +259,12 @@ static void write_udp_callback_free(void *data)
 
     write_udp_callback_t *cb = data;
 
-    write_udp_flush_internal(cb, 0);
+    /* The callback is shared by the write and the stats read callbacks. */
+    if (atomic_fetch_sub(&cb->refs, 1) > 1)
+        return;
+
+    if (cb->send_iov != NULL)
+        write_udp_flush_internal(cb, 0);
 
     if (cb->sock_fd >= 0) {
         close(cb->sock_fd);
@@ -176,6 +275,7 @@ static void write_udp_callback_free(void *data)
     free(cb->host);
     free(cb->service);
     free(cb->send_buf);
+    free(cb->send_iov);
 
     strbuf_destroy(&cb->buf);
 
@@ -212,10 +312,25 @@ static int write_udp_send_message(write_udp_callback_t *cb, char const *message,
             return -1;
     }
 
+    if (message_len >= (size_t)cb->packet_size) {
+        PLUGIN_WARNING("Message of %zu bytes does not fit in a packet of %d bytes.",
+                       message_len, cb->packet_size);
+        return -1;
+    }
+
     if (message_len >= cb->send_buf_free) {
-        status = write_udp_flush_internal(cb, 0);
-        if (status != 0)
-            return status;
+        if (cb->send_packet + 1 < (size_t)cb->packets) {
+            cb->send_packet++;
+            cb->send_iov[cb->send_packet].iov_base = cb->send_buf +
+                                                     cb->send_packet * cb->packet_size;
+            cb->send_iov[cb->send_packet].iov_len = 0;
+            cb->send_buf_free = cb->send_buf_size;
+            cb->send_buf_fill = 0;
+        } else {
+            status = write_udp_flush_internal(cb, 0);
+            if (status != 0)
+                return status;
+        }
     }
 
     /* Assert that we have enough space for this message. */
@@ -223,7 +338,9 @@ static int write_udp_send_message(write_udp_callback_t *cb, char const *message,
 
     /* `message_len + 1' because `message_len' does not include the
      * trailing null byte. Neither does `send_buffer_fill'. */
-    memcpy(cb->send_buf + cb->send_buf_fill, message, message_len);
+    struct iovec *iov = &cb->send_iov[cb->send_packet];
+    memcpy((char *)iov->iov_base + iov->iov_len, message, message_len);
+    iov->iov_len += message_len;
     cb->send_buf_fill += message_len;
     cb->send_buf_free -= message_len;
 
@@ -254,6 +371,28 @@ static int write_udp_write(metric_family_t const *fam, user_data_t *user_data)
     return 0;
 }
 
+static int write_udp_stats_read(user_data_t *user_data)
+{
+    write_udp_callback_t *cb = user_data->data;
+
+    metric_family_append(&cb->fams[FAM_WRITE_UDP_PACKETS],
+                         VALUE_COUNTER(atomic_load(&cb->stats_packets)), NULL,
+                         &LABEL_PAIR_CONST("instance", cb->name), NULL);
+    metric_family_append(&cb->fams[FAM_WRITE_UDP_BYTES],
+                         VALUE_COUNTER(atomic_load(&cb->stats_bytes)), NULL,
+                         &LABEL_PAIR_CONST("instance", cb->name), NULL);
+    metric_family_append(&cb->fams[FAM_WRITE_UDP_SEND_CALLS],
+                         VALUE_COUNTER(atomic_load(&cb->stats_send_calls)), NULL,
+                         &LABEL_PAIR_CONST("instance", cb->name), NULL);
+    metric_family_append(&cb->fams[FAM_WRITE_UDP_SEND_ERRORS],
+                         VALUE_COUNTER(atomic_load(&cb->stats_send_errors)), NULL,
+                         &LABEL_PAIR_CONST("instance", cb->name), NULL);
+
+    plugin_dispatch_metric_family_array(cb->fams, FAM_WRITE_UDP_MAX, 0);
+
+    return 0;
+}
+
 static int write_udp_config_instance(config_item_t *ci)
 {
     write_udp_callback_t *cb = calloc(1, sizeof(*cb));
@@ -266,6 +405,9 @@ static int write_udp_config_instance(config_item_t *ci)
     cb->host = strdup(DEFAULT_NODE);
     cb->service = strdup(DEFAULT_SERVICE);
     cb->packet_size = SEND_BUF_SIZE;
+    cb->packets = SEND_PACKETS;
+    atomic_init(&cb->refs, 1);
+    memcpy(cb->fams, fams, sizeof(cb->fams[0])*FAM_WRITE_UDP_MAX);
 
     int status = cf_util_get_string(ci, &cb->name);
     if (status != 0) {
@@ -274,6 +416,8 @@ static int write_udp_config_instance(config_item_t *ci)
     }
 
     cdtime_t flush_interval = 0;
+    bool report_stats = false;
+    cdtime_t stats_interval = 0;
     for (int i = 0; i < ci->children_num; i++) {
         config_item_t *child = ci->children + i;
 
@@ -297,6 +441,18 @@ static int write_udp_config_instance(config_item_t *ci)
                     status = -1;
                 }
             }
+        } else if (strcasecmp("packets-per-send", child->key) == 0) {
+            status = cf_util_get_int(child, &cb->packets);
+            if (status == 0) {
+                if ((cb->packets < 1) || (cb->packets > 1024)) {
+                    PLUGIN_ERROR("'packets-per-send' must be between 1 and 1024.");
+                    status = -1;
+                }
+            }
+        } else if (strcasecmp("report-stats", child->key) == 0) {
+            status = cf_util_get_boolean(child, &report_stats);
+        } else if (strcasecmp("stats-interval", child->key) == 0) {
+            status = cf_util_get_cdtime(child, &stats_interval);
         } else if (strcasecmp("format-metric", child->key) == 0) {
             status = config_format_dgram_metric(child, &cb->format);
         } else if (strcasecmp("flush-interval", child->key) == 0) {
@@ -319,8 +475,9 @@ static int write_udp_config_instance(config_item_t *ci)
 
     cb->send_buf_size = cb->packet_size;
     cb->send_buf_free = cb->packet_size;
-    cb->send_buf = malloc(cb->packet_size);
-    if (cb->send_buf == NULL) {
+    cb->send_buf = malloc((size_t)cb->packet_size * cb->packets);
+    cb->send_iov = calloc(cb->packets, sizeof(*cb->send_iov));
+    if ((cb->send_buf == NULL) || (cb->send_iov == NULL)) {
         PLUGIN_ERROR("malloc failed.");
         write_udp_callback_free(cb);
         return -1;
@@ -333,8 +490,19 @@ static int write_udp_config_instance(config_item_t *ci)
         return -1;
     }
 
+    write_udp_reset_buffer(cb);
     write_udp_callback_init(cb);
 
+    if (report_stats) {
+        atomic_fetch_add(&cb->refs, 1);
+        status = plugin_register_complex_read("write_udp", cb->name, write_udp_stats_read,
+                                              stats_interval,
+                                              &(user_data_t){ .data = cb,
+                                                              .free_func = write_udp_callback_free });
+        if (status != 0)
+            atomic_fetch_sub(&cb->refs, 1);
+    }
+
     plugin_register_write("write_udp", cb->name, write_udp_write,
                           write_udp_flush, flush_interval, cb->flush_timeout,
                           &(user_data_t){ .data = cb, .free_func = write_udp_callback_free });